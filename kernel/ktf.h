@@ -14,11 +14,10 @@
 #include <linux/ptrace.h>
 #include "ktf_test.h"
 #include "ktf_override.h"
+#include "ktf_tgroup.h"
 #include "ktf_map.h"
 #include "ktf_unlproto.h"
 
-#define	KTF_MAX_LOG			2048
-
 /* Type for an optional configuration callback for contexts.
  * Implementations should copy and store data into their private
  * extensions of the context structure. The data pointer is
@@ -37,6 +36,7 @@ struct ktf_context {
 	ktf_context_cb cleanup;	   /* Optional callback upon context release */
 	int config_errno;	   /* If config_cb set: state of configuration */
 	struct ktf_context_type *type; /* Associated type, must be set */
+	struct mutex run_lock;	   /* Serializes runs and configuration of this context */
 };
 
 typedef struct ktf_context* (*ktf_context_alloc)(struct ktf_context_type *ct);
@@ -307,12 +307,13 @@ static inline int ktf_no_probe_support(void)
 
 #define	KTF_OVERRIDE(func, probehandler) \
 	static int probehandler(struct kprobe *, struct pt_regs *);\
-	static struct kprobe __ktf_override_##probehandler = { \
-		.symbol_name = #func, \
-		.pre_handler = probehandler, \
-		.post_handler = ktf_post_handler, \
-		.fault_handler = NULL, \
-		.flags = 0, \
+	static struct ktf_override __ktf_override_##probehandler = { \
+		.kp = { \
+			.symbol_name = #func, \
+			.pre_handler = probehandler, \
+			.post_handler = ktf_post_handler, \
+			.flags = 0, \
+		}, \
         }; \
         static int probehandler(struct kprobe *kp, struct pt_regs *regs)
 
@@ -325,14 +326,7 @@ static inline int ktf_no_probe_support(void)
 #endif
 
 #define	KTF_UNREGISTER_OVERRIDE(func, probehandler) \
-	do { \
-		unregister_kprobe(&__ktf_override_##probehandler); \
-		memset(&__ktf_override_##probehandler, 0, \
-		       sizeof(struct kprobe)); \
-		__ktf_override_##probehandler.symbol_name = #func; \
-		__ktf_override_##probehandler.pre_handler = probehandler; \
-		__ktf_override_##probehandler.post_handler = ktf_post_handler; \
-	} while (0)
+	ktf_unregister_override(&__ktf_override_##probehandler)
 
 
 #define	KTF_OVERRIDE_RETURN \
@@ -391,7 +385,38 @@ static inline int ktf_no_probe_support(void)
 #define	KTF_THREAD_WAIT_STARTED(t)	(wait_for_completion(&((t)->started)))
 #define	KTF_THREAD_WAIT_COMPLETED(t)	(wait_for_completion(&((t)->completed)))
 
-u32 ktf_get_assertion_count(void);
+/* Thread groups, see ktf_tgroup.h: Set up tg to run nr instances of the
+ * thread function threadname, defined with KTF_TGROUP_THREAD(), in the
+ * context of the current test. arg is available to the threads as
+ * _thread->tg->arg. Run the group with ktf_tgroup_run(tg, cpus) and free it
+ * with ktf_tgroup_cleanup(tg).
+ */
+#define	KTF_TGROUP_INIT(threadname, tg, nr, _arg) \
+	do { \
+		(tg)->func = threadname; \
+		(tg)->name = #threadname; \
+		(tg)->state.self = self; \
+		(tg)->state.ctx = ctx; \
+		(tg)->state.iter = _i; \
+		(tg)->state.value = _value; \
+		(tg)->arg = _arg; \
+		(tg)->nr_threads = nr; \
+		(tg)->threads = NULL; \
+	} while (0)
+
+/* The body of a thread group thread is timed from the release of the
+ * group, and counts the operations it performs in _thread->ops. Like with
+ * KTF_THREAD() the variables of a test case are available:
+ */
+#define	KTF_TGROUP_THREAD(name) \
+	static void name(struct ktf_tgroup_thread *_thread, struct ktf_test *self, \
+			 struct ktf_context *ctx, int _i, u32 _value)
+
+/* Number of passed assertions in the test not yet reported to user space.
+ * Assertions are counted per test since KTF 0.3, which is why the test is
+ * passed, and modules built for 0.2 are refused by the version check:
+ */
+u32 ktf_get_assertion_count(struct ktf_test *self);
 
 /**
  * ASSERT_TRUE() - fail and return if @C evaluates to false
@@ -31,6 +31,10 @@
 #define nla_put_u64_64bit(m, c, v, x) nla_put_u64(m, c, v)
 #endif
 
+#if (KERNEL_VERSION(4, 0, 0) > LINUX_VERSION_CODE)
+#define genl_has_listeners(family, net, group) true
+#endif
+
 #if (KERNEL_VERSION(4, 10, 0) > LINUX_VERSION_CODE)
 static inline void *nla_memdup(const struct nlattr *src, gfp_t gfp)
 {
@@ -51,6 +55,16 @@ static inline unsigned int stack_trace_save(unsigned long *store, unsigned int s
 	save_stack_trace(&trace);
 	return trace.nr_entries;
 }
+
+#if (KERNEL_VERSION(4, 12, 0) > LINUX_VERSION_CODE)
+#define genlmsg_parse_deprecated(nlh, family, tb, maxtype, policy, extack) \
+	genlmsg_parse(nlh, family, tb, maxtype, policy)
+#define nla_parse_nested_deprecated(tb, maxtype, nla, policy, extack) \
+	nla_parse_nested(tb, maxtype, nla, policy)
+#else
+#define genlmsg_parse_deprecated genlmsg_parse
+#define nla_parse_nested_deprecated nla_parse_nested
+#endif
 #endif
 #endif
 #endif
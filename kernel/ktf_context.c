@@ -55,6 +55,8 @@ static int __ktf_handle_add_ctx_type(struct ktf_handle *handle,
 	spin_lock_irqsave(&context_lock, flags);
 	ret = ktf_map_insert(&handle->ctx_type_map, &ct->elem);
 	spin_unlock_irqrestore(&context_lock, flags);
+	if (!ret)
+		ktf_registry_changed();
 	return ret;
 }
 
@@ -63,6 +65,7 @@ static int __ktf_context_add(struct ktf_handle *handle, struct ktf_context *ctx,
 			     struct ktf_context_type *ct)
 {
 	unsigned long flags;
+	bool new_id = false;
 	int ret;
 
 	ktf_map_elem_init(&ctx->elem, name);
@@ -71,6 +74,7 @@ static int __ktf_context_add(struct ktf_handle *handle, struct ktf_context *ctx,
 	ctx->config_errno = ENOENT; /* 0 here means configuration is ok */
 	ctx->type = ct;
 	ctx->cleanup = ct->cleanup;
+	mutex_init(&ctx->run_lock);
 
 	spin_lock_irqsave(&context_lock, flags);
 	ret = ktf_map_insert(&handle->ctx_map, &ctx->elem);
@@ -80,12 +84,18 @@ static int __ktf_context_add(struct ktf_handle *handle, struct ktf_context *ctx,
 			handle->id = ++ktf_context_maxid;
 			INIT_LIST_HEAD(&handle->handle_list);
 			list_add(&handle->handle_list, &context_handles);
+			new_id = true;
 		}
 	}
 	spin_unlock_irqrestore(&context_lock, flags);
-	if (!ret)
+	if (!ret) {
+		ktf_registry_changed();
+		ktf_nl_event_ctx(KTF_EV_CTX_ADD, ctx);
+		if (new_id)
+			ktf_registry_handle_changed(handle);
 		tlog(T_DEBUG, "added %scontext %s with type %s",
 		     (cfg_cb ? "configurable " : ""), name, ct->name);
+	}
 	return ret;
 }
 
@@ -141,8 +151,14 @@ int ktf_context_set_config(struct ktf_context *ctx, const void *data, size_t dat
 	int ret;
 
 	if (ctx->config_cb) {
+		/* Not while a test runs in the context */
+		mutex_lock(&ctx->run_lock);
 		ret = ctx->config_cb(ctx, data, data_sz);
+		if (ret != ctx->config_errno)
+			ktf_registry_changed();
 		ctx->config_errno = ret;
+		mutex_unlock(&ctx->run_lock);
+		ktf_nl_event_ctx(KTF_EV_CTX_CFG, ctx);
 	}
 	/* We don't use the map element refcounts for contexts, as
 	 * the context objects may be allocated statically by client modules,
@@ -170,13 +186,21 @@ void ktf_context_remove(struct ktf_context *ctx)
 	}
 	handle = ctx->handle;
 
+	/* Wait for runs and configuration in progress in this context. The
+	 * cleanup may free the context along with its lock, so it is only
+	 * called with the lock released, once the context can't be found:
+	 */
+	mutex_lock(&ctx->run_lock);
 	spin_lock_irqsave(&context_lock, flags);
 	ktf_map_remove(&handle->ctx_map, ctx->elem.key);
 	if (!ktf_has_contexts(handle))
 		list_del(&handle->handle_list);
 	spin_unlock_irqrestore(&context_lock, flags);
+	ktf_registry_changed();
+	ktf_nl_event_ctx(KTF_EV_CTX_DEL, ctx);
 
 	tlog(T_DEBUG, "removed context %s at %p", ctx->elem.key, ctx);
+	mutex_unlock(&ctx->run_lock);
 
 	if (ctx->cleanup)
 		ctx->cleanup(ctx);
@@ -339,11 +363,15 @@ static int __init ktf_init(void)
 		return -EINVAL;
 	}
 
+	ret = ktf_registry_init();
+	if (ret)
+		goto failure;
 	ktf_debugfs_init();
 	ret = ktf_nl_register();
 	if (ret) {
 		terr("Unable to register protocol with netlink");
 		ktf_debugfs_cleanup();
+		ktf_registry_cleanup();
 		goto failure;
 	}
 
@@ -7,8 +7,13 @@
  */
 #include <linux/kallsyms.h>
 #include <linux/debugfs.h>
+#include <linux/ftrace.h>
+#include <linux/hash.h>
+#include <linux/hashtable.h>
+#include <linux/jhash.h>
 #include <linux/mm.h>
 #include <linux/module.h>
+#include <linux/percpu.h>
 #include <linux/slab.h>
 #include <linux/stacktrace.h>
 #ifdef CONFIG_SLUB
@@ -18,11 +23,13 @@
 #include <linux/slab_def.h>
 #endif
 #include <linux/string.h>
+#include <linux/vmalloc.h>
 #include <linux/kprobes.h>
 #include <linux/ptrace.h>
 #include "ktf.h"
 #include "ktf_map.h"
 #include "ktf_cov.h"
+#include "ktf_nl.h"
 #include "ktf_compat.h"
 
 /* It may seem odd that we use a refcnt field in ktf_cov_entry structures
@@ -36,11 +43,12 @@
  */
 static void ktf_cov_entry_free(struct ktf_map_elem *elem)
 {
-	struct ktf_cov_entry *entry = container_of(elem, struct ktf_cov_entry,
-						   kmap);
+	struct ktf_cov_entry *entry = ktf_map_elem_entry(elem, struct ktf_cov_entry,
+							 kmap);
 	if (entry->refcnt > 0)
 		unregister_kprobe(&entry->kprobe);
-	kfree(entry);
+	free_percpu(entry->count);
+	kfree_rcu(entry, kmap.rcu);
 }
 
 /* Comparison function is subtle.  We want to be able to compare key1
@@ -73,19 +81,32 @@ static int ktf_cov_obj_compare(const char *key1, const char *key2)
 
 void ktf_cov_entry_get(struct ktf_cov_entry *entry)
 {
-	ktf_map_elem_get(&entry->kmap);
+	ktf_map_elem_get(ktf_map_fixed_elem(&entry->kmap));
 }
 
 void ktf_cov_entry_put(struct ktf_cov_entry *entry)
 {
-	ktf_map_elem_put(&entry->kmap);
+	ktf_map_elem_put(ktf_map_fixed_elem(&entry->kmap));
+}
+
+/* Hits are counted per cpu to keep the probe handler free of shared
+ * writes, sum them up on demand.
+ */
+unsigned long ktf_cov_entry_count(struct ktf_cov_entry *entry)
+{
+	unsigned long count = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		count += *per_cpu_ptr(entry->count, cpu);
+	return count;
 }
 
 /* Global map for address-> symbol/module mapping.  Sort via symbol address
  * and size combination, see ktf_cov_obj_compare() above for comparison
  * logic.
  */
-static DEFINE_KTF_MAP(cov_entry_map, ktf_cov_obj_compare, ktf_cov_entry_free);
+static DEFINE_KTF_MAP_FIXED_RCU(cov_entry_map, ktf_cov_obj_compare, ktf_cov_entry_free);
 
 struct ktf_cov_entry *ktf_cov_entry_find(unsigned long addr, unsigned long size)
 {
@@ -98,11 +119,170 @@ struct ktf_cov_entry *ktf_cov_entry_find(unsigned long addr, unsigned long size)
 				  struct ktf_cov_entry, kmap);
 }
 
+struct ktf_cov_entry *ktf_cov_entry_find_after(unsigned long addr)
+{
+	struct ktf_cov_obj_key k;
+	struct ktf_map_elem *elem;
+
+	k.address = addr;
+	k.size = 0;
+
+	elem = ktf_map_find_after(&cov_entry_map, (char *)&k);
+	return elem ? ktf_map_elem_entry(elem, struct ktf_cov_entry, kmap) : NULL;
+}
+
+/* The counters are per cpu, so taking a snapshot is cheap compared to
+ * the test itself, and does not disturb concurrent calls.  Entries added
+ * after the size of the map is sampled are not part of the snapshot.
+ */
+struct ktf_cov_snapshot *ktf_cov_snapshot_take(void)
+{
+	struct ktf_cov_snapshot *snap;
+	struct ktf_cov_entry *entry;
+	size_t max = ktf_map_size(&cov_entry_map);
+
+	snap = vzalloc(sizeof(*snap) + max * sizeof(snap->entries[0]));
+	if (!snap)
+		return NULL;
+
+	ktf_map_for_each_entry(entry, &cov_entry_map, kmap) {
+		if (snap->nr_entries == max) {
+			ktf_cov_entry_put(entry);
+			break;
+		}
+		if (!entry->cov)
+			continue;
+		ktf_cov_entry_get(entry);
+		snap->entries[snap->nr_entries].entry = entry;
+		snap->entries[snap->nr_entries].count = ktf_cov_entry_count(entry);
+		snap->nr_entries++;
+	}
+	return snap;
+}
+
+void ktf_cov_snapshot_delta(struct ktf_cov_snapshot *snap)
+{
+	unsigned int i;
+
+	for (i = 0; i < snap->nr_entries; i++)
+		snap->entries[i].count = ktf_cov_entry_count(snap->entries[i].entry) -
+			snap->entries[i].count;
+}
+
+void ktf_cov_snapshot_free(struct ktf_cov_snapshot *snap)
+{
+	unsigned int i;
+
+	if (!snap)
+		return;
+	for (i = 0; i < snap->nr_entries; i++)
+		ktf_cov_entry_put(snap->entries[i].entry);
+	vfree(snap);
+}
+
+/* Lockless check for whether addr is within a function we cover */
+static bool ktf_cov_entry_covers(unsigned long addr)
+{
+	struct ktf_cov_obj_key k;
+	bool found;
+
+	k.address = addr;
+	k.size = 0;
+
+	rcu_read_lock();
+	found = ktf_map_find_rcu(&cov_entry_map, (char *)&k) != NULL;
+	rcu_read_unlock();
+	return found;
+}
+
+/* Sorted, immutable copy of the address ranges of all coverage entries,
+ * replaced as a whole whenever entries are added or change address.  This
+ * lets the allocation handlers attribute stack frames with a lockless
+ * binary search over a compact array, instead of a tree walk per frame.
+ */
+struct ktf_cov_ranges {
+	struct rcu_head rcu;
+	unsigned int nr_ranges;
+	struct ktf_cov_obj_key ranges[];
+};
+
+static struct ktf_cov_ranges __rcu *cov_ranges;
+static DEFINE_MUTEX(cov_ranges_lock);
+
+static void ktf_cov_ranges_free(struct rcu_head *rcu)
+{
+	vfree(container_of(rcu, struct ktf_cov_ranges, rcu));
+}
+
+/* Must be called with cov_ranges_lock held */
+static void ktf_cov_ranges_replace(struct ktf_cov_ranges *cr)
+{
+	struct ktf_cov_ranges *old;
+
+	old = rcu_dereference_protected(cov_ranges,
+					lockdep_is_held(&cov_ranges_lock));
+	rcu_assign_pointer(cov_ranges, cr);
+	if (old)
+		call_rcu(&old->rcu, ktf_cov_ranges_free);
+}
+
+/* Rebuild the range array from the entry map.  Concurrent rebuilds are
+ * serialized, so the last one to complete sees all entry map updates.
+ */
+static void ktf_cov_ranges_update(void)
+{
+	struct ktf_cov_entry *entry;
+	struct ktf_cov_ranges *cr;
+	size_t max;
+
+	mutex_lock(&cov_ranges_lock);
+	max = ktf_map_size(&cov_entry_map);
+	cr = vzalloc(sizeof(*cr) + max * sizeof(cr->ranges[0]));
+	if (!cr) {
+		mutex_unlock(&cov_ranges_lock);
+		terr("No memory for %zu coverage ranges, keeping old ones", max);
+		return;
+	}
+
+	/* The map is sorted by address, and so is the copy */
+	ktf_map_for_each_entry(entry, &cov_entry_map, kmap) {
+		if (cr->nr_ranges == max) {
+			ktf_cov_entry_put(entry);
+			break;
+		}
+		cr->ranges[cr->nr_ranges++] = entry->key;
+	}
+	ktf_cov_ranges_replace(cr);
+	mutex_unlock(&cov_ranges_lock);
+}
+
+/* Must be called under rcu_read_lock() */
+static bool ktf_cov_ranges_cover(struct ktf_cov_ranges *cr, unsigned long addr)
+{
+	unsigned int lo = 0, hi = cr->nr_ranges;
+
+	while (lo < hi) {
+		unsigned int mid = lo + (hi - lo) / 2;
+		const struct ktf_cov_obj_key *r = &cr->ranges[mid];
+
+		if (addr < r->address)
+			hi = mid;
+		else if (addr >= r->address + r->size)
+			lo = mid + 1;
+		else
+			return true;
+	}
+	return false;
+}
+
+static void ktf_cov_ftrace_destroy(struct ktf_cov_ftrace *cf);
+
 static void ktf_cov_free(struct ktf_map_elem *elem)
 {
 	struct ktf_cov *cov = container_of(elem, struct ktf_cov, kmap);
 
-	kfree(cov);
+	ktf_cov_ftrace_destroy(cov->ftrace);
+	kfree_rcu(cov, kmap.rcu);
 }
 
 void ktf_cov_put(struct ktf_cov *cov)
@@ -111,7 +291,7 @@ void ktf_cov_put(struct ktf_cov *cov)
 }
 
 /* Coverage object map. Just modules supported for now, sort by name. */
-static DEFINE_KTF_MAP(cov_map, NULL, ktf_cov_free);
+static DEFINE_KTF_MAP_RCU(cov_map, NULL, ktf_cov_free);
 
 struct ktf_cov *ktf_cov_find(const char *module)
 {
@@ -121,42 +301,212 @@ struct ktf_cov *ktf_cov_find(const char *module)
 /* cache for memory objects used to track allocations */
 static struct kmem_cache *cov_mem_cache;
 
-static void ktf_cov_mem_free(struct ktf_map_elem *elem)
+/* Stack depot: interned allocation stacks, hashed on their contents.
+ * Lookups are lockless, and stacks are only freed at cleanup time.
+ */
+#define KTF_COV_STACK_HASH_BITS	10
+
+static struct kmem_cache *cov_stack_cache;
+static DEFINE_HASHTABLE(cov_stack_hash, KTF_COV_STACK_HASH_BITS);
+static DEFINE_SPINLOCK(cov_stack_lock);
+
+static bool ktf_cov_stack_equal(struct ktf_cov_stack *st, u32 hash,
+				unsigned long *entries, unsigned int nr_entries)
+{
+	return st->hash == hash && st->nr_entries == nr_entries &&
+		!memcmp(st->entries, entries, nr_entries * sizeof(*entries));
+}
+
+static struct ktf_cov_stack *ktf_cov_stack_lookup(u32 hash,
+						  unsigned long *entries,
+						  unsigned int nr_entries)
+{
+	struct ktf_cov_stack *st;
+
+	hash_for_each_possible_rcu(cov_stack_hash, st, hnode, hash) {
+		if (ktf_cov_stack_equal(st, hash, entries, nr_entries))
+			return st;
+	}
+	return NULL;
+}
+
+/* Return the interned copy of a stack, adding it if needed.
+ * Called from probe context.
+ */
+static struct ktf_cov_stack *ktf_cov_stack_get(unsigned long *entries,
+					       unsigned int nr_entries)
+{
+	u32 hash = jhash(entries, nr_entries * sizeof(*entries), 0);
+	struct ktf_cov_stack *st, *new;
+	unsigned long flags;
+
+	rcu_read_lock();
+	st = ktf_cov_stack_lookup(hash, entries, nr_entries);
+	rcu_read_unlock();
+	if (st)
+		return st;
+
+	new = kmem_cache_alloc(cov_stack_cache, GFP_NOWAIT);
+	if (!new)
+		return NULL;
+	new->hash = hash;
+	new->nr_entries = nr_entries;
+	atomic_long_set(&new->count, 0);
+	atomic_long_set(&new->bytes, 0);
+	memcpy(new->entries, entries, nr_entries * sizeof(*entries));
+
+	spin_lock_irqsave(&cov_stack_lock, flags);
+	/* Someone may have added the same stack in the meantime */
+	st = ktf_cov_stack_lookup(hash, entries, nr_entries);
+	if (!st) {
+		hash_add_rcu(cov_stack_hash, &new->hnode, hash);
+		st = new;
+		new = NULL;
+	}
+	spin_unlock_irqrestore(&cov_stack_lock, flags);
+	if (new)
+		kmem_cache_free(cov_stack_cache, new);
+	return st;
+}
+
+struct ktf_cov_stack *ktf_cov_stack_next(struct ktf_cov_stack *st)
+{
+	struct hlist_node *node;
+	int bkt = 0;
+
+	if (st) {
+		node = rcu_dereference(hlist_next_rcu(&st->hnode));
+		if (node)
+			return hlist_entry(node, struct ktf_cov_stack, hnode);
+		bkt = hash_min(st->hash, HASH_BITS(cov_stack_hash)) + 1;
+	}
+	for (; bkt < HASH_SIZE(cov_stack_hash); bkt++) {
+		node = rcu_dereference(hlist_first_rcu(&cov_stack_hash[bkt]));
+		if (node)
+			return hlist_entry(node, struct ktf_cov_stack, hnode);
+	}
+	return NULL;
+}
+
+static void ktf_cov_stack_delete_all(void)
+{
+	struct ktf_cov_stack *st;
+	struct hlist_node *tmp;
+	int bkt;
+
+	hash_for_each_safe(cov_stack_hash, bkt, tmp, st, hnode) {
+		hash_del(&st->hnode);
+		kmem_cache_free(cov_stack_cache, st);
+	}
+}
+
+/* Allocations from our own caches are never tracked */
+static bool ktf_cov_own_cache(struct kmem_cache *cache)
 {
-	struct ktf_cov_mem *m = container_of(elem, struct ktf_cov_mem,
-					     kmap);
+	return cache == cov_mem_cache || cache == cov_stack_cache;
+}
+
+static void ktf_cov_mem_free_rcu(struct rcu_head *rcu)
+{
+	struct ktf_cov_mem *m = container_of(rcu, struct ktf_cov_mem, rcu);
 
 	kmem_cache_free(cov_mem_cache, m);
 }
 
-/* Global map for tracking memory allocations */
-DEFINE_KTF_MAP(cov_mem_map, ktf_cov_obj_compare, ktf_cov_mem_free);
-EXPORT_SYMBOL(cov_mem_map);
+/* Global hash table for tracking memory allocations.  Allocations are
+ * looked up by their exact address only (as passed to kfree()), so a
+ * hash on the address gives O(1) insert and remove, and the lock per
+ * bucket keeps allocations on different cpus from contending.
+ */
+struct hlist_head cov_mem_hash[KTF_COV_MEM_HASH_SIZE];
+EXPORT_SYMBOL(cov_mem_hash);
+
+static spinlock_t cov_mem_lock[KTF_COV_MEM_HASH_SIZE];
+static atomic_t cov_mem_cnt = ATOMIC_INIT(0);
 
-struct ktf_cov_mem *ktf_cov_mem_find(unsigned long addr, unsigned long size)
+static void ktf_cov_mem_hash_init(void)
 {
-	struct ktf_cov_obj_key k;
+	int i;
 
-	k.address = addr;
-	k.size = size;
+	for (i = 0; i < KTF_COV_MEM_HASH_SIZE; i++)
+		spin_lock_init(&cov_mem_lock[i]);
+}
 
-	return ktf_map_find_entry(&cov_mem_map, (char *)&k,
-				  struct ktf_cov_mem, kmap);
+static inline unsigned int ktf_cov_mem_hash(unsigned long addr)
+{
+	return hash_long(addr, KTF_COV_MEM_HASH_BITS);
 }
 
-void ktf_cov_mem_get(struct ktf_cov_mem *m)
+/* Running totals of the sizes of tracked allocations and frees */
+static atomic_long_t cov_mem_alloc_bytes = ATOMIC_LONG_INIT(0);
+static atomic_long_t cov_mem_free_bytes = ATOMIC_LONG_INIT(0);
+
+static void ktf_cov_mem_unlink(struct ktf_cov_mem *m)
 {
-	ktf_map_elem_get(&m->kmap);
+	hlist_del_rcu(&m->hnode);
+	atomic_dec(&cov_mem_cnt);
+	atomic_long_add(m->key.size, &cov_mem_free_bytes);
+	atomic_long_dec(&m->stack->count);
+	atomic_long_sub(m->key.size, &m->stack->bytes);
+	call_rcu(&m->rcu, ktf_cov_mem_free_rcu);
 }
 
-void ktf_cov_mem_put(struct ktf_cov_mem *m)
+/* Returns -EEXIST if the address is already tracked */
+static int ktf_cov_mem_insert(struct ktf_cov_mem *m)
 {
-	ktf_map_elem_put(&m->kmap);
+	unsigned int h = ktf_cov_mem_hash(m->key.address);
+	struct ktf_cov_mem *pos;
+	unsigned long flags;
+
+	spin_lock_irqsave(&cov_mem_lock[h], flags);
+	hlist_for_each_entry(pos, &cov_mem_hash[h], hnode) {
+		if (pos->key.address == m->key.address) {
+			spin_unlock_irqrestore(&cov_mem_lock[h], flags);
+			return -EEXIST;
+		}
+	}
+	hlist_add_head_rcu(&m->hnode, &cov_mem_hash[h]);
+	atomic_inc(&cov_mem_cnt);
+	atomic_long_add(m->key.size, &cov_mem_alloc_bytes);
+	atomic_long_inc(&m->stack->count);
+	atomic_long_add(m->key.size, &m->stack->bytes);
+	spin_unlock_irqrestore(&cov_mem_lock[h], flags);
+	return 0;
 }
 
-static void ktf_cov_mem_remove(struct ktf_cov_mem *m)
+/* Stop tracking the allocation at addr, if tracked */
+static void ktf_cov_mem_remove(unsigned long addr)
 {
-	ktf_map_remove_elem(&cov_mem_map, &m->kmap);
+	unsigned int h = ktf_cov_mem_hash(addr);
+	struct ktf_cov_mem *m;
+	unsigned long flags;
+
+	spin_lock_irqsave(&cov_mem_lock[h], flags);
+	hlist_for_each_entry(m, &cov_mem_hash[h], hnode) {
+		if (m->key.address == addr) {
+			ktf_cov_mem_unlink(m);
+			spin_unlock_irqrestore(&cov_mem_lock[h], flags);
+			tlog(T_DEBUG, "cov_mem: freeing allocation %p",
+			     (void *)addr);
+			return;
+		}
+	}
+	spin_unlock_irqrestore(&cov_mem_lock[h], flags);
+}
+
+static void ktf_cov_mem_delete_all(void)
+{
+	struct hlist_node *tmp;
+	struct ktf_cov_mem *m;
+	unsigned long flags;
+	int i;
+
+	for (i = 0; i < KTF_COV_MEM_HASH_SIZE; i++) {
+		spin_lock_irqsave(&cov_mem_lock[i], flags);
+		hlist_for_each_entry_safe(m, tmp, &cov_mem_hash[i], hnode)
+			ktf_cov_mem_unlink(m);
+		spin_unlock_irqrestore(&cov_mem_lock[i], flags);
+	}
 }
 
 /* Do not use ktf_cov_entry_find() here as we can get entry directly
@@ -171,80 +521,431 @@ static int ktf_cov_handler(struct kprobe *p, struct pt_regs *regs)
 	/* Make sure probe is ours... */
 	if (!entry || entry->magic != KTF_COV_ENTRY_MAGIC)
 		return 0;
-	entry->count++;
-	if (entry->count == 1 && entry->cov)
-		entry->cov->count++;
+	/* kprobe handlers run with preemption disabled */
+	__this_cpu_inc(*entry->count);
 	return 0;
 }
 
-static int ktf_cov_init_symbol(void *data, const char *name,
-			       struct module *mod, unsigned long addr)
+static void ktf_cov_entry_kprobe_init(struct ktf_cov_entry *entry)
 {
-	struct ktf_cov_entry *entry;
-	struct ktf_cov *cov = data;
-	char buf[256];
+	memset(&entry->kprobe, 0, sizeof(entry->kprobe));
+	entry->kprobe.pre_handler = ktf_cov_handler;
+	entry->kprobe.symbol_name = entry->name;
+}
 
-	if (!mod || !cov)
-		return 0;
+static void ktf_cov_entry_destroy(struct ktf_cov_entry *entry)
+{
+	free_percpu(entry->count);
+	kfree(entry);
+}
+
+static struct ktf_cov_entry *ktf_cov_entry_create(struct ktf_cov *cov,
+						  const char *name,
+						  unsigned long addr,
+						  unsigned long size)
+{
+	struct ktf_cov_entry *entry = kzalloc(sizeof(*entry), GFP_KERNEL);
 
-	if (!try_module_get(mod))
+	if (!entry)
+		return NULL;
+	entry->count = alloc_percpu(unsigned long);
+	if (!entry->count) {
+		kfree(entry);
+		return NULL;
+	}
+	(void)strlcpy(entry->name, name, sizeof(entry->name));
+	entry->magic = KTF_COV_ENTRY_MAGIC;
+	entry->cov = cov;
+	/* With ftrace, calls are counted by the ftrace_ops of the cov */
+	entry->refcnt = cov->ftrace ? 0 : 1;
+	entry->key.address = addr;
+	entry->key.size = size ? size : ktf_symbol_size(addr);
+	ktf_cov_entry_kprobe_init(entry);
+	return entry;
+}
+
+/* Register the kprobes of n coverage entries in one go.  register_kprobes()
+ * fails the whole batch if a single function can not be probed, so in
+ * that case fall back to registering them one by one.  The entries are
+ * reordered so that the ones successfully registered come first, and
+ * the number of those is returned.
+ */
+static int ktf_cov_register_entries(struct ktf_cov_entry **entries, int n)
+{
+	struct kprobe **kps;
+	int i, k = 0;
+
+	if (!n)
 		return 0;
 
-	/* module_mutex is grabbed by register_kprobe() */
+	kps = kcalloc(n, sizeof(*kps), GFP_KERNEL);
+	if (kps) {
+		for (i = 0; i < n; i++)
+			kps[i] = &entries[i]->kprobe;
+		k = register_kprobes(kps, n);
+		kfree(kps);
+		if (!k)
+			return n;
+	}
+
+	for (i = 0, k = 0; i < n; i++) {
+		/* reset kprobe state left behind by the failed attempt */
+		ktf_cov_entry_kprobe_init(entries[i]);
+		if (register_kprobe(&entries[i]->kprobe) == 0)
+			swap(entries[i], entries[k++]);
+	}
+	return k;
+}
+
+static void ktf_cov_unregister_entries(struct ktf_cov_entry **entries, int n)
+{
+	struct kprobe **kps;
+	int i;
+
+	if (!n)
+		return;
+
+	kps = kcalloc(n, sizeof(*kps), GFP_KERNEL);
+	if (!kps) {
+		for (i = 0; i < n; i++)
+			unregister_kprobe(&entries[i]->kprobe);
+		return;
+	}
+	for (i = 0; i < n; i++)
+		kps[i] = &entries[i]->kprobe;
+	unregister_kprobes(kps, n);
+	kfree(kps);
+}
+
+#ifdef CONFIG_DYNAMIC_FTRACE
+/* Alternative backend (KTF_COV_OPT_FTRACE): Rather than a kprobe per
+ * function, with a breakpoint trap per call, a single ftrace_ops filtered
+ * on the functions of the module counts the calls.  The handler finds the
+ * entry for the traced ip by a binary search in an array of the entries
+ * sorted by address, which is built while the ftrace_ops is unregistered.
+ */
+struct ktf_cov_ftrace {
+	struct ftrace_ops ops;
+	int enabled;			/* ops is registered iff > 0 */
+	unsigned int nr_entries;
+	struct ktf_cov_entry **entries;	/* sorted by address */
+};
+
+#if (KERNEL_VERSION(5, 11, 0) > LINUX_VERSION_CODE)
+#define ktf_ftrace_regs pt_regs
+#else
+#define ktf_ftrace_regs ftrace_regs
+#endif
+
+static void notrace ktf_cov_ftrace_handler(unsigned long ip,
+					   unsigned long parent_ip,
+					   struct ftrace_ops *ops,
+					   struct ktf_ftrace_regs *regs)
+{
+	struct ktf_cov_ftrace *cf = container_of(ops, struct ktf_cov_ftrace,
+						 ops);
+	unsigned int lo = 0, hi = cf->nr_entries;
+
+	while (lo < hi) {
+		unsigned int mid = lo + (hi - lo) / 2;
+		struct ktf_cov_entry *entry = cf->entries[mid];
+
+		if (ip < entry->key.address) {
+			hi = mid;
+		} else if (ip >= entry->key.address + entry->key.size) {
+			lo = mid + 1;
+		} else {
+			this_cpu_inc(*entry->count);
+			return;
+		}
+	}
+}
+
+static struct ktf_cov_ftrace *ktf_cov_ftrace_create(void)
+{
+	struct ktf_cov_ftrace *cf = kzalloc(sizeof(*cf), GFP_KERNEL);
+
+	if (!cf)
+		return ERR_PTR(-ENOMEM);
+	cf->ops.func = ktf_cov_ftrace_handler;
+#if (KERNEL_VERSION(5, 11, 0) > LINUX_VERSION_CODE)
+	/* The handler calls nothing that can be traced */
+	cf->ops.flags = FTRACE_OPS_FL_RECURSION_SAFE;
+#endif
+	return cf;
+}
+
+static void ktf_cov_ftrace_destroy(struct ktf_cov_ftrace *cf)
+{
+	if (!cf)
+		return;
+	/* Called from the cov_map free function, possibly in atomic context,
+	 * so the ops has been unregistered by ktf_cov_ftrace_stop() already:
+	 */
+	ftrace_free_filter(&cf->ops);
+	kfree(cf->entries);
+	kfree(cf);
+}
+
+/* Add the functions of n new entries to the filter of cf.  Like
+ * ktf_cov_register_entries(), the entries that can be traced are moved
+ * first and the number of those is returned.
+ */
+static int ktf_cov_ftrace_filter(struct ktf_cov_ftrace *cf,
+				 struct ktf_cov_entry **entries, int n)
+{
+	int i, k = 0;
+
+	for (i = 0; i < n; i++) {
+		if (ftrace_set_filter_ip(&cf->ops, entries[i]->key.address,
+					 0, 0) == 0)
+			swap(entries[i], entries[k++]);
+	}
+	return k;
+}
+
+static void ktf_cov_ftrace_unfilter(struct ktf_cov_ftrace *cf,
+				    struct ktf_cov_entry *entry)
+{
+	(void)ftrace_set_filter_ip(&cf->ops, entry->key.address, 1, 0);
+}
+
+static void ktf_cov_update_entries(const char *name, struct ktf_cov *cov);
+
+/* If the module was reloaded, its functions are at new addresses.  Without
+ * probes to find them, look them up by name, and move the entries to their
+ * new addresses as ktf_cov_update_entries() does for the kprobe backend.
+ * Returns whether any of the entries moved.
+ */
+static bool ktf_cov_ftrace_relocate(struct ktf_cov *cov)
+{
+	struct ktf_cov_entry *entry;
+	struct module *mod;
+	bool moved = false;
+	void *addr;
+
+	mutex_lock(&module_mutex);
+	mod = find_module(cov->kmap.key);
+	if (mod && (mod->state != MODULE_STATE_LIVE || !try_module_get(mod)))
+		mod = NULL;
 	mutex_unlock(&module_mutex);
+	if (!mod)
+		return false;
 
-	/* We only care about symbols for cov-specified module. */
-	if (strcmp(mod->name, cov->kmap.key))
-		goto out;
+	ktf_map_for_each_entry(entry, &cov_entry_map, kmap) {
+		if (entry->cov != cov)
+			continue;
+		addr = ktf_find_symbol(cov->kmap.key, entry->name);
+		entry->kprobe.addr = addr ? addr : (void *)entry->key.address;
+		if ((unsigned long)entry->kprobe.addr != entry->key.address)
+			moved = true;
+	}
+	if (moved) {
+		ktf_cov_update_entries(cov->kmap.key, cov);
+		ktf_cov_ranges_update();
+	}
+	module_put(mod);
+	return moved;
+}
+
+static int ktf_cov_ftrace_enable(struct ktf_cov *cov)
+{
+	struct ktf_cov_ftrace *cf = cov->ftrace;
+	bool moved = ktf_cov_ftrace_relocate(cov);
+	struct ktf_cov_entry *entry;
+	int ret, n = 0;
+
+	if (cf->enabled++) {
+		if (!moved)
+			return 0;
+		/* Waits for handlers in progress, so the array can be rebuilt */
+		unregister_ftrace_function(&cf->ops);
+		cf->nr_entries = 0;
+		kfree(cf->entries);
+	}
+
+	cf->entries = kcalloc(cov->total, sizeof(*cf->entries), GFP_KERNEL);
+	if (!cf->entries) {
+		cf->enabled = 0;
+		return -ENOMEM;
+	}
+	/* The filter still has the old addresses of entries that moved */
+	if (moved)
+		ftrace_free_filter(&cf->ops);
+	/* The entry map is sorted by address */
+	ktf_map_for_each_entry(entry, &cov_entry_map, kmap) {
+		if (entry->cov != cov || n == cov->total)
+			continue;
+		if (moved && ftrace_set_filter_ip(&cf->ops, entry->key.address, 0, 0))
+			continue;
+		cf->entries[n++] = entry;
+	}
+	cf->nr_entries = n;
+
+	ret = register_ftrace_function(&cf->ops);
+	if (ret) {
+		tlog(T_DEBUG, "%d: failed to register ftrace ops for %s",
+		     ret, cov->kmap.key);
+		cf->enabled = 0;
+		cf->nr_entries = 0;
+		kfree(cf->entries);
+		cf->entries = NULL;
+	}
+	return ret;
+}
+
+static void ktf_cov_ftrace_disable(struct ktf_cov *cov)
+{
+	struct ktf_cov_ftrace *cf = cov->ftrace;
+
+	if (!cf->enabled || --cf->enabled)
+		return;
+	/* Waits for handlers in progress, so the array can be freed */
+	unregister_ftrace_function(&cf->ops);
+	cf->nr_entries = 0;
+	kfree(cf->entries);
+	cf->entries = NULL;
+}
+
+/* Disable coverage however many times it was enabled, at cleanup */
+static void ktf_cov_ftrace_stop(struct ktf_cov *cov)
+{
+	struct ktf_cov_ftrace *cf = cov->ftrace;
+
+	if (!cf || !cf->enabled)
+		return;
+	cf->enabled = 1;
+	ktf_cov_ftrace_disable(cov);
+}
+#else
+static struct ktf_cov_ftrace *ktf_cov_ftrace_create(void)
+{
+	return ERR_PTR(-ENOTSUPP);
+}
+
+static void ktf_cov_ftrace_destroy(struct ktf_cov_ftrace *cf) {}
+
+static int ktf_cov_ftrace_filter(struct ktf_cov_ftrace *cf,
+				 struct ktf_cov_entry **entries, int n)
+{
+	return 0;
+}
+
+static void ktf_cov_ftrace_unfilter(struct ktf_cov_ftrace *cf,
+				    struct ktf_cov_entry *entry) {}
+
+static int ktf_cov_ftrace_enable(struct ktf_cov *cov)
+{
+	return -ENOTSUPP;
+}
+
+static void ktf_cov_ftrace_disable(struct ktf_cov *cov) {}
+
+static void ktf_cov_ftrace_stop(struct ktf_cov *cov) {}
+#endif /* CONFIG_DYNAMIC_FTRACE */
+
+#if (KERNEL_VERSION(4, 6, 0) > LINUX_VERSION_CODE)
+#define ktf_cov_mod_kallsyms(mod) (mod)
+#else
+#define ktf_cov_mod_kallsyms(mod) rcu_dereference_protected((mod)->kallsyms, true)
+#endif
+
+static bool ktf_cov_want_symbol(struct module *mod, const char *name,
+				unsigned long addr)
+{
+	bool text;
+
+	if (!*name || !addr)
+		return false;
 
 	/* We don't probe ourselves and functions called within probe ctxt. */
 	if (strncmp(name, "ktf_cov", strlen("ktf_cov")) == 0 ||
 	    strcmp(name, "ktf_map_find") == 0)
-		goto out;
+		return false;
+
+	/* Only functions are of interest */
+	preempt_disable();
+	text = __module_text_address(addr) == mod;
+	preempt_enable();
+	if (!text)
+		return false;
 
 	/* Check if we're already covered for this module/symbol. */
-	entry = ktf_cov_entry_find(addr, 0);
-	if (entry) {
-		tlog(T_DEBUG, "%s already present in coverage: %s",
-		     name, entry->name);
-		ktf_cov_entry_put(entry);
-		goto out;
-	}
-	entry = kzalloc(sizeof(*entry), GFP_KERNEL);
-	(void)strlcpy(entry->name, name, sizeof(entry->name));
-	entry->magic = KTF_COV_ENTRY_MAGIC;
-	entry->cov = cov;
-	entry->refcnt = 1;
+	return !ktf_cov_entry_covers(addr);
+}
 
-	entry->kprobe.pre_handler = ktf_cov_handler;
-	entry->kprobe.symbol_name = entry->name;
+/* Set up coverage entries for the functions of the module cov is for,
+ * by walking only that module's symbol table.
+ */
+static int ktf_cov_init_module(struct ktf_cov *cov)
+{
+	struct ktf_cov_entry *entry, **entries;
+	unsigned int i, nsyms, n = 0, k;
+	struct module *mod;
+	char buf[256];
+
+	mutex_lock(&module_mutex);
+	mod = find_module(cov->kmap.key);
+	if (mod && (mod->state != MODULE_STATE_LIVE || !try_module_get(mod)))
+		mod = NULL;
+	mutex_unlock(&module_mutex);
+	if (!mod) {
+		tlog(T_DEBUG, "cov: module %s not loaded", cov->kmap.key);
+		return -ENOENT;
+	}
 
-	/* Ugh - we try to register a kprobe as a means of determining
-	 * if the symbol is a function.
+	/* The symbol table of a live module stays unchanged for as long
+	 * as we hold a reference to the module.
 	 */
-	if (register_kprobe(&entry->kprobe) < 0) {
-		/* not a probe-able function */
-		kfree(entry);
-		goto out;
+	nsyms = ktf_cov_mod_kallsyms(mod)->num_symtab;
+	entries = kcalloc(nsyms, sizeof(*entries), GFP_KERNEL);
+	if (!entries) {
+		module_put(mod);
+		return -ENOMEM;
 	}
-	entry->key.address = addr;
-	entry->key.size = ktf_symbol_size(addr);
-	(void)sprint_symbol(buf, entry->key.address);
-	if (ktf_map_elem_init(&entry->kmap, (char *)&entry->key) < 0 ||
-	    ktf_map_insert(&cov_entry_map, &entry->kmap) < 0) {
-		unregister_kprobe(&entry->kprobe);
-		kfree(entry);
-		goto out;
+
+	for (i = 0; i < nsyms; i++) {
+		const Elf_Sym *sym = &ktf_cov_mod_kallsyms(mod)->symtab[i];
+		const char *name = ktf_cov_mod_kallsyms(mod)->strtab + sym->st_name;
+
+		if (!ktf_cov_want_symbol(mod, name, sym->st_value))
+			continue;
+		entry = ktf_cov_entry_create(cov, name, sym->st_value,
+					     sym->st_size);
+		if (entry)
+			entries[n++] = entry;
 	}
-	tlog(T_DEBUG, "Added %s/%s (%p, size %lu) to coverage: %s",
-	     mod->name, entry->name, (void *)entry->kprobe.addr,
-	     entry->key.size, buf);
 
-	cov->total++;
-	ktf_cov_entry_put(entry);
+	if (cov->ftrace)
+		k = ktf_cov_ftrace_filter(cov->ftrace, entries, n);
+	else
+		k = ktf_cov_register_entries(entries, n);
+	for (i = k; i < n; i++) {
+		/* not a probe-able function */
+		ktf_cov_entry_destroy(entries[i]);
+	}
 
-out:
-	mutex_lock(&module_mutex);
+	for (i = 0; i < k; i++) {
+		entry = entries[i];
+		(void)sprint_symbol(buf, entry->key.address);
+		if (ktf_map_elem_init_fixed(&entry->kmap, &entry->key,
+					    sizeof(entry->key)) < 0 ||
+		    ktf_map_insert(&cov_entry_map, ktf_map_fixed_elem(&entry->kmap)) < 0) {
+			if (cov->ftrace)
+				ktf_cov_ftrace_unfilter(cov->ftrace, entry);
+			else
+				unregister_kprobe(&entry->kprobe);
+			ktf_cov_entry_destroy(entry);
+			continue;
+		}
+		tlog(T_DEBUG, "Added %s/%s (%p, size %lu) to coverage: %s",
+		     mod->name, entry->name, (void *)entry->key.address,
+		     entry->key.size, buf);
+		cov->total++;
+		ktf_cov_entry_put(entry);
+	}
+
+	kfree(entries);
 	module_put(mod);
 	return 0;
 }
@@ -254,46 +955,101 @@ static int ktf_cov_kmem_cache_alloc_handler(struct kretprobe_instance *,
 
 static unsigned long register_kretprobe_size;
 
+/* Memory tracking hooks into every allocation in the system, so to keep
+ * the cost down on busy hosts it can be limited to allocations of at least
+ * cov_mem_min_size bytes, and to 1 in cov_mem_sample of those, per cpu.
+ */
+static unsigned int cov_mem_sample = 1;
+module_param(cov_mem_sample, uint, 0644);
+MODULE_PARM_DESC(cov_mem_sample, "Track only 1 in N allocations with memory coverage (default 1)");
+
+static unsigned long cov_mem_min_size;
+module_param(cov_mem_min_size, ulong, 0644);
+MODULE_PARM_DESC(cov_mem_min_size, "Track only allocations of at least this size with memory coverage");
+
+static DEFINE_PER_CPU(unsigned int, cov_mem_sample_cnt);
+
+/* Called from probe context, with preemption disabled. */
+static bool ktf_cov_mem_sample(void)
+{
+	unsigned int rate = READ_ONCE(cov_mem_sample);
+
+	if (rate <= 1)
+		return true;
+	if (__this_cpu_inc_return(cov_mem_sample_cnt) < rate)
+		return false;
+	__this_cpu_write(cov_mem_sample_cnt, 0);
+	return true;
+}
+
+/* Per probe instance state, from allocation entry to return */
+struct ktf_cov_mem_trace {
+	unsigned long size;
+	unsigned int nr_entries;	/* nonzero iff allocation is tracked */
+	unsigned long entries[KTF_COV_MAX_STACK_DEPTH];
+};
+
 /* Handler tracking allocations.  Determine if any functions we are
  * tracking coverage for (coverage entries) are on the stack; if so
  * we track the allocation.
  */
-static int ktf_cov_kmem_alloc_entry(struct ktf_cov_mem *m, unsigned long bytes)
+static int ktf_cov_kmem_alloc_entry(struct ktf_cov_mem_trace *m,
+				    unsigned long bytes)
 {
-	struct ktf_cov_entry *entry = NULL;
+	struct ktf_cov_ranges *cr;
+	unsigned long start, end;
+	bool covered = false;
 	int n;
 
-	/* We don't care about 0-length allocations. */
-	if (!bytes)
+	m->nr_entries = 0;
+
+	/* We don't care about 0-length allocations, and filter out as
+	 * much as we can before the expensive stack walk.
+	 */
+	if (!bytes || bytes < READ_ONCE(cov_mem_min_size) ||
+	    !ktf_cov_mem_sample())
 		return 0;
 
+	rcu_read_lock();
+	cr = rcu_dereference(cov_ranges);
+	if (!cr || !cr->nr_ranges) {
+		rcu_read_unlock();
+		return 0;
+	}
+	/* Frames outside the text of all covered functions need no search */
+	start = cr->ranges[0].address;
+	end = cr->ranges[cr->nr_ranges - 1].address +
+		cr->ranges[cr->nr_ranges - 1].size;
+
 	/* Find first cov entry on stack to allow us to attribute traced
 	 * allocation to first coverage entry we come across.
 	 */
-	m->nr_entries = stack_trace_save(m->stack_entries, KTF_COV_MAX_STACK_DEPTH, 1);
+	m->nr_entries = stack_trace_save(m->entries, KTF_COV_MAX_STACK_DEPTH, 1);
 	for (n = 0; n < m->nr_entries; n++) {
 		/* avoid recursive enter when allocating cov mem */
-		if (m->stack_entries[n] ==
+		if (m->entries[n] ==
 		    (unsigned long)ktf_cov_kmem_cache_alloc_handler)
 			break;
 		/* ignore allocs as a result of registering probes */
-		if (m->stack_entries[n] >
+		if (m->entries[n] >
 		    (unsigned long)register_kretprobe &&
-		    m->stack_entries[n] < ((unsigned long)register_kretprobe +
+		    m->entries[n] < ((unsigned long)register_kretprobe +
 		    register_kretprobe_size))
 			break;
-		entry = ktf_cov_entry_find(m->stack_entries[n], 0);
-		if (entry)
+		if (m->entries[n] < start || m->entries[n] >= end)
+			continue;
+		covered = ktf_cov_ranges_cover(cr, m->entries[n]);
+		if (covered)
 			break;
 	}
-	if (!entry) {
+	rcu_read_unlock();
+	if (!covered) {
 		m->nr_entries = 0;
 		return 0;
 	}
-	ktf_cov_entry_put(entry);
 
-	m->key.size = bytes;
-	/* Have to wait until alloc returns to get key.address */
+	m->size = bytes;
+	/* Have to wait until alloc returns to get the address */
 
 	return 0;
 }
@@ -302,7 +1058,7 @@ static int ktf_cov_kmem_alloc_entry(struct ktf_cov_mem *m, unsigned long bytes)
 static int ktf_cov_kmalloc_entry_handler(struct kretprobe_instance *ri,
 					 struct pt_regs *regs)
 {
-	struct ktf_cov_mem *m = (struct ktf_cov_mem *)ri->data;
+	struct ktf_cov_mem_trace *m = (struct ktf_cov_mem_trace *)ri->data;
 	unsigned long bytes = (unsigned long)KTF_ENTRY_PROBE_ARG0;
 
 	return ktf_cov_kmem_alloc_entry(m, bytes);
@@ -313,49 +1069,57 @@ static int ktf_cov_kmem_cache_alloc_entry_handler(struct kretprobe_instance *ri,
 {
 	struct kmem_cache *cache =
 		(struct kmem_cache *)KTF_ENTRY_PROBE_ARG0;
-	struct ktf_cov_mem *m = (struct ktf_cov_mem *)ri->data;
+	struct ktf_cov_mem_trace *m = (struct ktf_cov_mem_trace *)ri->data;
 	unsigned long bytes;
 
 	if (!cache)
 		return 0;
 
 	bytes = cache->object_size;
-	if (cache == cov_mem_cache)
+	if (ktf_cov_own_cache(cache))
 		return 0;
 	return ktf_cov_kmem_alloc_entry(m, bytes);
 }
 
-static int ktf_cov_kmem_alloc_return(struct ktf_cov_mem *m,
+static int ktf_cov_kmem_alloc_return(struct ktf_cov_mem_trace *m,
 				     unsigned long ret)
 {
+	unsigned int nr_entries = m->nr_entries;
 	struct ktf_cov_mem *mm;
 
-	m->key.address = ret;
+	m->nr_entries = 0;
+	if (!ret)
+		return 0;
 	mm = kmem_cache_alloc(cov_mem_cache, GFP_NOWAIT);
 	if (!mm)
 		return 0;
-	memcpy(mm, m, sizeof(*mm));
-	if (ktf_map_elem_init(&mm->kmap, (char *)&mm->key) < 0 ||
-	    ktf_map_insert(&cov_mem_map, &mm->kmap) < 0) {
+	mm->key.address = ret;
+	mm->key.size = m->size;
+	mm->stack = ktf_cov_stack_get(m->entries, nr_entries);
+	if (!mm->stack) {
+		kmem_cache_free(cov_mem_cache, mm);
+		return 0;
+	}
+	if (ktf_cov_mem_insert(mm) < 0) {
 		/* This can happen as inexplicably the same probe
 		 * can fire twice for _kmalloc; this results in
 		 * us attempting to add the same address twice, with
-		 * the result that we get -EEXIST from ktf_map_insert()
+		 * the result that we get -EEXIST from ktf_cov_mem_insert()
 		 * the second time.  Annoying but the end result is
 		 * we track the allocation once, which is what we want.
 		 */
 		terr("Failed to insert cov_mem %p", (void *)ret);
 		kmem_cache_free(cov_mem_cache, mm);
+	} else {
+		tlog(T_DEBUG, "cov_mem: tracking allocation %p", (void *)ret);
 	}
-	tlog(T_DEBUG, "cov_mem: tracking allocation %p", (void *)m->key.address);
-	m->nr_entries = 0;
 	return 0;
 }
 
 static int ktf_cov_kmalloc_handler(struct kretprobe_instance *ri,
 				   struct pt_regs *regs)
 {
-	struct ktf_cov_mem *m = (struct ktf_cov_mem *)ri->data;
+	struct ktf_cov_mem_trace *m = (struct ktf_cov_mem_trace *)ri->data;
 	unsigned long ret = regs_return_value(regs);
 
 	if (m->nr_entries)
@@ -368,10 +1132,10 @@ static int ktf_cov_kmem_cache_alloc_handler(struct kretprobe_instance *ri,
 {
 	struct kmem_cache *cache =
 		(struct kmem_cache *)KTF_ENTRY_PROBE_ARG0;
-	struct ktf_cov_mem *m = (struct ktf_cov_mem *)ri->data;
+	struct ktf_cov_mem_trace *m = (struct ktf_cov_mem_trace *)ri->data;
 	unsigned long ret = regs_return_value(regs);
 
-	if (cache == cov_mem_cache)
+	if (ktf_cov_own_cache(cache))
 		return 0;
 
 	if (m->nr_entries)
@@ -381,18 +1145,10 @@ static int ktf_cov_kmem_cache_alloc_handler(struct kretprobe_instance *ri,
 
 static int ktf_cov_kmem_free_entry(unsigned long tofree)
 {
-	struct ktf_cov_mem *m;
-
-	if (!tofree)
+	if (!tofree || !atomic_read(&cov_mem_cnt))
 		return 0;
 
-	m = ktf_cov_mem_find(tofree, 0);
-	if (m) {
-		tlog(T_DEBUG, "cov_mem: freeing allocation %p",
-		     (void *)m->key.address);
-		ktf_cov_mem_remove(m);
-		ktf_cov_mem_put(m);
-	}
+	ktf_cov_mem_remove(tofree);
 	return 0;
 }
 
@@ -414,7 +1170,7 @@ static int ktf_cov_kmem_cache_free_entry_handler(struct kretprobe_instance *ri,
 		(struct kmem_cache *)KTF_ENTRY_PROBE_ARG0;
 	unsigned long tofree = (unsigned long)KTF_ENTRY_PROBE_ARG1;
 
-	if (!tofree || cache == cov_mem_cache)
+	if (!tofree || ktf_cov_own_cache(cache))
 		return 0;
 
 	return ktf_cov_kmem_free_entry(tofree);
@@ -424,13 +1180,13 @@ static struct kretprobe cov_mem_probes[] = {
 	{	.kp = { .symbol_name = "__kmalloc" },
 		.handler = ktf_cov_kmalloc_handler,
 		.entry_handler = ktf_cov_kmalloc_entry_handler,
-		.data_size = sizeof(struct ktf_cov_mem),
+		.data_size = sizeof(struct ktf_cov_mem_trace),
 		.maxactive = 0, /* assumes default value */
 	},
 	{	.kp = { .symbol_name = "kmem_cache_alloc" },
 		.handler = ktf_cov_kmem_cache_alloc_handler,
 		.entry_handler = ktf_cov_kmem_cache_alloc_entry_handler,
-		.data_size = sizeof(struct ktf_cov_mem),
+		.data_size = sizeof(struct ktf_cov_mem_trace),
 		.maxactive = 0, /* assumes default value */
 	},
 	{	.kp = { .symbol_name = "kfree" },
@@ -449,12 +1205,22 @@ static struct kretprobe cov_mem_probes[] = {
 
 static int cov_opt_mem_cnt;
 
+bool ktf_cov_mem_bytes(unsigned long *alloc, unsigned long *freed)
+{
+	if (!READ_ONCE(cov_opt_mem_cnt))
+		return false;
+	*alloc = atomic_long_read(&cov_mem_alloc_bytes);
+	*freed = atomic_long_read(&cov_mem_free_bytes);
+	return true;
+}
+
 static int ktf_cov_init_opts(struct ktf_cov *cov)
 {
 	int i, ret = 0;
 
 	if (cov->opts & KTF_COV_OPT_MEM && ++cov_opt_mem_cnt == 1) {
 		if (!cov_mem_cache) {
+			ktf_cov_mem_hash_init();
 			cov_mem_cache =
 				kmem_cache_create("ktf_cov_mem_cache",
 						  sizeof(struct ktf_cov_mem), 0,
@@ -464,6 +1230,16 @@ static int ktf_cov_init_opts(struct ktf_cov *cov)
 			if (!cov_mem_cache)
 				return -ENOMEM;
 		}
+		if (!cov_stack_cache) {
+			cov_stack_cache =
+				kmem_cache_create("ktf_cov_stack_cache",
+						  sizeof(struct ktf_cov_stack), 0,
+						  SLAB_HWCACHE_ALIGN | SLAB_PANIC,
+						  NULL);
+
+			if (!cov_stack_cache)
+				return -ENOMEM;
+		}
 
 		for (i = 0; i < ARRAY_SIZE(cov_mem_probes); i++) {
 			/* reset in case we're re-registering */
@@ -527,31 +1303,66 @@ static void ktf_cov_update_entries(const char *name, struct ktf_cov *cov)
 		 * and re-add with new address/size as key (size may have
 		 * changed if module was re-compiled).
 		 */
-		ktf_map_remove_elem(&cov_entry_map, &entry->kmap);
+		ktf_map_remove_elem(&cov_entry_map, ktf_map_fixed_elem(&entry->kmap));
 		entry->key.address = (unsigned long)entry->kprobe.addr;
 		entry->key.size = ktf_symbol_size(entry->key.address);
-		if (ktf_map_elem_init(&entry->kmap, (char *)&entry->key) < 0 ||
-		    ktf_map_insert(&cov_entry_map, &entry->kmap) < 0) {
+		if (ktf_map_elem_init_fixed(&entry->kmap, &entry->key,
+					    sizeof(entry->key)) < 0 ||
+		    ktf_map_insert(&cov_entry_map, ktf_map_fixed_elem(&entry->kmap)) < 0) {
 			tlog(T_DEBUG, "Failed to add %s/%s", name, entry->name);
-			unregister_kprobe(&entry->kprobe);
-			entry->refcnt--;
+			if (!cov->ftrace) {
+				unregister_kprobe(&entry->kprobe);
+				entry->refcnt--;
+			}
 			entry = ktf_map_next_entry(entry, kmap);
 		} else {
 			tlog(T_DEBUG, "Added %s/%s (%p, size %lu) to coverage",
 			     name, entry->name, (void *)entry->key.address,
 			     entry->key.size);
-			/* Map has changed, reset to root. */
+				/* Map has changed, reset to root. */
 			entry = ktf_map_first_entry(&cov_entry_map,
 						    struct ktf_cov_entry, kmap);
 		}
 	}
 }
 
+/* Re-register the probes of the entries of cov that were disabled */
+static int ktf_cov_enable_entries(struct ktf_cov *cov)
+{
+	struct ktf_cov_entry *entry, **entries;
+	int i, n = 0, k;
+
+	/* No references are needed, as entries only leave the entry map
+	 * at cleanup time.
+	 */
+	entries = kcalloc(cov->total, sizeof(*entries), GFP_KERNEL);
+	if (!entries)
+		return -ENOMEM;
+
+	ktf_map_for_each_entry(entry, &cov_entry_map, kmap) {
+		if (entry->cov != cov)
+			continue;
+		if (++entry->refcnt == 1) {
+			/* reset kprobe as we're re-registering */
+			ktf_cov_entry_kprobe_init(entry);
+			entries[n++] = entry;
+		}
+	}
+
+	k = ktf_cov_register_entries(entries, n);
+	for (i = k; i < n; i++) {
+		tlog(T_DEBUG, "Failed to add %s/%s", cov->kmap.key,
+		     entries[i]->name);
+		entries[i]->refcnt--;
+	}
+	kfree(entries);
+	return 0;
+}
+
 int ktf_cov_enable(const char *name, unsigned int opts)
 {
 	struct ktf_cov *cov = ktf_cov_find(name);
-	struct ktf_cov_entry *entry;
-	int ret = 0;
+	int ret = 0, opt_ret;
 
 #ifndef KTF_PROBE_SUPPORT
 	return -ENOTSUPP;
@@ -563,53 +1374,62 @@ int ktf_cov_enable(const char *name, unsigned int opts)
 
 		cov->type = KTF_COV_TYPE_MODULE;
 		cov->opts = opts;
+		if (opts & KTF_COV_OPT_FTRACE) {
+			cov->ftrace = ktf_cov_ftrace_create();
+			if (IS_ERR(cov->ftrace)) {
+				ret = PTR_ERR(cov->ftrace);
+				kfree(cov);
+				return ret;
+			}
+		}
 		if (ktf_map_elem_init(&cov->kmap, name) < 0 ||
 		    ktf_map_insert(&cov_map, &cov->kmap) < 0) {
 			tlog(T_DEBUG, "cov %s already present", cov->kmap.key);
+			ktf_cov_ftrace_destroy(cov->ftrace);
 			kfree(cov);
 			return -EEXIST;
 		}
 		register_kretprobe_size =
 			ktf_symbol_size((unsigned long)register_kretprobe);
-		mutex_lock(&module_mutex);
-		kallsyms_on_each_symbol(ktf_cov_init_symbol, cov);
-		mutex_unlock(&module_mutex);
-	} else {
-		ktf_map_for_each_entry(entry, &cov_entry_map, kmap) {
-			if (entry->cov != cov)
-				continue;
-			if (++entry->refcnt == 1) {
-				/* reset kprobe as we're re-registering */
-				memset(&entry->kprobe, 0,
-				       sizeof(entry->kprobe));
-				entry->kprobe.pre_handler = ktf_cov_handler;
-				entry->kprobe.symbol_name = entry->name;
-				ret = register_kprobe(&entry->kprobe);
-				if (ret) {
-					tlog(T_DEBUG, "Failed to add %s/%s",
-					     name, entry->name);
-					entry->refcnt--;
-				}
-			}
+		ret = ktf_cov_init_module(cov);
+		if (ret) {
+			ktf_map_remove_elem(&cov_map, &cov->kmap);
+			ktf_cov_put(cov);
+			return ret;
 		}
+		ktf_cov_ranges_update();
+		if (cov->ftrace)
+			ret = ktf_cov_ftrace_enable(cov);
+	} else if (cov->ftrace) {
+		ret = ktf_cov_ftrace_enable(cov);
+	} else {
+		ret = ktf_cov_enable_entries(cov);
 		/* Probe addresses/function sizes for functions may have
 		 * changed if module was unloaded/reloaded - entry map
 		 * needs to be updated to use new address/size as key.
 		 */
-		ktf_cov_update_entries(name, cov);
+		if (!ret) {
+			ktf_cov_update_entries(name, cov);
+			ktf_cov_ranges_update();
+		}
 	}
 
-	ret = ktf_cov_init_opts(cov);
+	/* Options are set up regardless, to pair with ktf_cov_disable() */
+	opt_ret = ktf_cov_init_opts(cov);
 
 	ktf_cov_put(cov);
 
+	ret = ret ? ret : opt_ret;
+	if (!ret)
+		ktf_nl_event_cov(KTF_EV_COV_ON, name);
 	return ret;
 }
 
 void ktf_cov_disable(const char *module)
 {
 	struct ktf_cov *cov = ktf_cov_find(module);
-	struct ktf_cov_entry *entry;
+	struct ktf_cov_entry *entry, **entries;
+	int n = 0;
 
 #ifndef	KTF_PROBE_SUPPORT
 	return;
@@ -618,40 +1438,72 @@ void ktf_cov_disable(const char *module)
 	if (!cov)
 		return;
 
+	if (cov->ftrace) {
+		ktf_cov_ftrace_disable(cov);
+		goto out;
+	}
+
+	/* Collect probes to unregister them in one go if we can */
+	entries = kcalloc(cov->total, sizeof(*entries), GFP_KERNEL);
 	ktf_map_for_each_entry(entry, &cov_entry_map, kmap) {
 		if (entry->cov == cov) {
 			if (--entry->refcnt == 0) {
-				unregister_kprobe(&entry->kprobe);
+				if (entries)
+					entries[n++] = entry;
+				else
+					unregister_kprobe(&entry->kprobe);
 				tlog(T_DEBUG, "Removed coverage %s/%s",
 				     cov->kmap.key, entry->name);
 			}
 		}
 	}
+	ktf_cov_unregister_entries(entries, n);
+	kfree(entries);
+out:
 	ktf_cov_cleanup_opts(cov);
 	ktf_cov_put(cov);
+	ktf_nl_event_cov(KTF_EV_COV_OFF, module);
 }
 
+/* Outstanding allocations are reported grouped by allocation stack */
 static void ktf_cov_mem_seq_print(struct seq_file *seq)
 {
-	struct ktf_cov_mem *m;
+	struct ktf_cov_stack *st;
 	char buf[256];
-	int n;
+	int bkt, n;
 
 	seq_puts(seq, "\nMemory in use allocated by covered functions:\n\n");
-	seq_printf(seq, "%44s %16s %10s\n", "ALLOCATION STACK", "ADDRESS",
+	seq_printf(seq, "%44s %16s %10s\n", "ALLOCATION STACK", "ALLOCATIONS",
 		   "SIZE");
-	ktf_for_each_cov_mem(m) {
-		for (n = 0; n < m->nr_entries; n++) {
-			sprint_symbol(buf, m->stack_entries[n]);
+	rcu_read_lock();
+	hash_for_each_rcu(cov_stack_hash, bkt, st, hnode) {
+		long count = atomic_long_read(&st->count);
+
+		if (count <= 0)
+			continue;
+		for (n = 0; n < st->nr_entries; n++) {
+			sprint_symbol(buf, st->entries[n]);
 			seq_printf(seq, "%44s", buf);
 			if (n == 0)
-				seq_printf(seq, " %16p %10lu",
-					   (void *)m->key.address,
-					   m->key.size);
+				seq_printf(seq, " %16ld %10ld", count,
+					   atomic_long_read(&st->bytes));
 			seq_puts(seq, "\n");
 		}
 		seq_puts(seq, "\n");
 	}
+	rcu_read_unlock();
+}
+
+/* Number of unique functions called for cov */
+static int ktf_cov_called(struct ktf_cov *cov)
+{
+	struct ktf_cov_entry *entry;
+	int called = 0;
+
+	ktf_map_for_each_entry(entry, &cov_entry_map, kmap)
+		if (entry->cov == cov && ktf_cov_entry_count(entry))
+			called++;
+	return called;
 }
 
 void ktf_cov_seq_print(struct seq_file *seq)
@@ -663,13 +1515,13 @@ void ktf_cov_seq_print(struct seq_file *seq)
 		   "#CALLED");
 	ktf_map_for_each_entry(cov, &cov_map, kmap)
 		seq_printf(seq, "%10s %44d %10d\n",
-			   cov->kmap.key, cov->total, cov->count);
+			   cov->kmap.key, cov->total, ktf_cov_called(cov));
 
 	seq_printf(seq, "\n%10s %44s %10s\n", "MODULE", "FUNCTION", "COUNT");
 	ktf_map_for_each_entry(entry, &cov_entry_map, kmap)
-		seq_printf(seq, "%10s %44s %10d\n",
+		seq_printf(seq, "%10s %44s %10lu\n",
 			   entry->cov ? entry->cov->kmap.key : "-",
-			   entry->name, entry->count);
+			   entry->name, ktf_cov_entry_count(entry));
 
 	ktf_cov_mem_seq_print(seq);
 }
@@ -691,9 +1543,18 @@ void ktf_cov_cleanup(void)
 
 	ktf_map_for_each_entry(cov, &cov_map, kmap) {
 		ktf_cov_disable(ktf_map_elem_name(&cov->kmap, name));
+		/* Freeing cov can't sleep, so unregister its ftrace ops here */
+		ktf_cov_ftrace_stop(cov);
 	}
 	ktf_map_delete_all(&cov_map);
 	ktf_map_delete_all(&cov_entry_map);
-	ktf_map_delete_all(&cov_mem_map);
+	mutex_lock(&cov_ranges_lock);
+	ktf_cov_ranges_replace(NULL);
+	mutex_unlock(&cov_ranges_lock);
+	ktf_cov_mem_delete_all();
+	/* Wait for deferred frees of map elements and ranges */
+	rcu_barrier();
+	ktf_cov_stack_delete_all();
 	kmem_cache_destroy(cov_mem_cache);
+	kmem_cache_destroy(cov_stack_cache);
 }
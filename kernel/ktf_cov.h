@@ -20,12 +20,14 @@ enum ktf_cov_type {
 	KTF_COV_TYPE_MAX,
 };
 
+struct ktf_cov_ftrace;
+
 struct ktf_cov {
 	struct ktf_map_elem kmap;
 	enum ktf_cov_type type;		/* only modules supported for now. */
-	int count;			/* number of unique functions called */
 	int total;			/* total number of functions */
 	unsigned int opts;
+	struct ktf_cov_ftrace *ftrace;	/* set iff KTF_COV_OPT_FTRACE */
 };
 
 /* Key for coverage entries (functions) consists in function address _and_
@@ -41,23 +43,33 @@ struct ktf_cov_obj_key {
 struct ktf_cov_entry {
 	struct kprobe kprobe;
 	int magic;			/* magic number identifying entry */
-	struct ktf_map_elem kmap;
+	struct ktf_map_elem_fixed kmap;	/* keyed by a copy of key below */
 	char name[KTF_MAX_KEY];
 	struct ktf_cov_obj_key key;
 	struct ktf_cov *cov;
-	struct ktf_map cov_mem;
-	int refcnt;
-	int count;
+	int refcnt;			/* kprobe enable count, unused w/ftrace */
+	unsigned long __percpu *count;	/* per cpu hits, see ktf_cov_entry_count() */
 };
 
 #define KTF_COV_MAX_STACK_DEPTH		32
 
+/* Allocation stacks are interned, and shared by all tracked allocations
+ * with the same stack.  Stacks are kept until KTF is unloaded.
+ */
+struct ktf_cov_stack {
+	struct hlist_node hnode;	/* linkage for the stack depot */
+	u32 hash;
+	unsigned int nr_entries;
+	atomic_long_t count;		/* tracked allocations with this stack */
+	atomic_long_t bytes;		/* total size of those allocations */
+	unsigned long entries[KTF_COV_MAX_STACK_DEPTH];
+};
+
 struct ktf_cov_mem {
-	struct ktf_map_elem kmap;
+	struct hlist_node hnode;	/* linkage for cov_mem_hash */
+	struct rcu_head rcu;
 	struct ktf_cov_obj_key key;
-	unsigned long flags;
-	unsigned int nr_entries;
-	unsigned long stack_entries[KTF_COV_MAX_STACK_DEPTH];
+	struct ktf_cov_stack *stack;	/* stack at allocation time */
 };
 
 #define	KTF_COV_MEM_IGNORE	0x1	/* avoid recursive enter */
@@ -67,22 +79,57 @@ struct ktf_cov_mem_probe {
 	struct kretprobe kretprobe;
 };
 
-extern struct ktf_map cov_mem_map;
+/* Tracked allocations, hashed by address with a lock per bucket */
+#define KTF_COV_MEM_HASH_BITS	10
+#define KTF_COV_MEM_HASH_SIZE	(1 << KTF_COV_MEM_HASH_BITS)
+
+extern struct hlist_head cov_mem_hash[KTF_COV_MEM_HASH_SIZE];
 
-#define	ktf_for_each_cov_mem(pos)	\
-	ktf_map_for_each_entry(pos, &cov_mem_map, kmap)
+/* Iterate over tracked allocations - must be called under rcu_read_lock() */
+#define	ktf_for_each_cov_mem(bkt, pos)		for ((bkt) = 0, pos = NULL; pos == NULL && (bkt) < KTF_COV_MEM_HASH_SIZE; (bkt)++) 		hlist_for_each_entry_rcu(pos, &cov_mem_hash[bkt], hnode)
 
 struct ktf_cov_entry *ktf_cov_entry_find(unsigned long, unsigned long);
 void ktf_cov_entry_put(struct ktf_cov_entry *);
 void ktf_cov_entry_get(struct ktf_cov_entry *);
+unsigned long ktf_cov_entry_count(struct ktf_cov_entry *);
 
 struct ktf_cov *ktf_cov_find(const char *);
 void ktf_cov_put(struct ktf_cov *);
 void ktf_cov_get(struct ktf_cov *);
 
-struct ktf_cov_mem *ktf_cov_mem_find(unsigned long, unsigned long);
-void ktf_cov_mem_put(struct ktf_cov_mem *);
-void ktf_cov_mem_get(struct ktf_cov_mem *);
+/* Iteration for dumping coverage data: Returns, with a reference, the
+ * function entry with the lowest address above addr, if any.
+ */
+struct ktf_cov_entry *ktf_cov_entry_find_after(unsigned long addr);
+
+/* Returns the stack after st, or the first stack if st is NULL.  Must be
+ * called under rcu_read_lock(), but as stacks live until KTF is unloaded
+ * st may be kept between read side sections.
+ */
+struct ktf_cov_stack *ktf_cov_stack_next(struct ktf_cov_stack *st);
+
+/* Snapshot of the call counts of the covered functions, to find the
+ * functions called during a test run.  Holds a reference to each entry.
+ */
+struct ktf_cov_snapshot_entry {
+	struct ktf_cov_entry *entry;
+	unsigned long count;
+};
+
+struct ktf_cov_snapshot {
+	unsigned int nr_entries;
+	struct ktf_cov_snapshot_entry entries[];
+};
+
+struct ktf_cov_snapshot *ktf_cov_snapshot_take(void);
+/* Replace the counts in snap by the number of calls since it was taken */
+void ktf_cov_snapshot_delta(struct ktf_cov_snapshot *snap);
+void ktf_cov_snapshot_free(struct ktf_cov_snapshot *snap);
+
+/* Total bytes of tracked allocations made and freed so far, for all
+ * modules.  Returns false if memory tracking is not enabled.
+ */
+bool ktf_cov_mem_bytes(unsigned long *alloc, unsigned long *freed);
 
 void ktf_cov_seq_print(struct seq_file *);
 void ktf_cov_cleanup(void);
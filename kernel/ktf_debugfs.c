@@ -6,11 +6,14 @@
  */
 #include <asm/unistd.h>
 #include <linux/module.h>
+#include <linux/string.h>
 #include <linux/time.h>
+#include <linux/uaccess.h>
 #include "ktf_debugfs.h"
 #include "ktf.h"
 #include "ktf_test.h"
 #include "ktf_cov.h"
+#include "ktf_shm.h"
 
 /* Create a debugfs representation of test sets/tests.  Hierarchy looks like
  * this:
@@ -25,23 +28,61 @@
  *						Show results of last run for
  *						test
  *
+ * Writing the name of a test to /sys/kernel/debug/ktf/run/<testset> runs
+ * that test only.  With the parameter debugfs_tests=0 this is the way to
+ * run single tests, as the files for each test are then not created - for
+ * large test suites creating and removing them dominates the time it takes
+ * to load and unload the test module.
  */
 
+static bool debugfs_tests = true;
+module_param(debugfs_tests, bool, 0444);
+MODULE_PARM_DESC(debugfs_tests, "Create debugfs run and result files for each test (default on)");
+
 static struct dentry *ktf_debugfs_rootdir;
 static struct dentry *ktf_debugfs_rundir;
 static struct dentry *ktf_debugfs_resultsdir;
 static struct dentry *ktf_debugfs_cov_file;
+static struct dentry *ktf_debugfs_shm_file;
 
+/* Results are shown from a copy of the results of the last completed
+ * run, which does not wait for a run in progress:
+ */
 static void ktf_debugfs_print_result(struct seq_file *seq, struct ktf_test *t)
 {
-	struct timespec now;
+	struct ktf_test_result r;
 
-	if (t && strlen(t->log) > 0) {
-		getnstimeofday(&now);
-		seq_printf(seq, "[%s/%s, %ld seconds ago] %s\n",
-			   t->tclass, t->name,
-			   now.tv_sec - t->lastrun.tv_sec, t->log);
+	if (!t)
+		return;
+	ktf_test_last_result(t, &r);
+	ktf_test_show_errors(seq, t, &r);
+	if (r.lastrun.tv_sec) {
+		seq_printf(seq, "[%s/%s] took %llu ns on cpu %u%s, "
+			   "context switches: %llu voluntary, %llu involuntary",
+			   t->tclass, t->name, r.stats.duration_ns, r.stats.cpu,
+			   r.stats.flags & KTF_STATS_MIGRATED ? " (migrated)" : "",
+			   r.stats.nvcsw, r.stats.nivcsw);
+		if (r.stats.flags & KTF_STATS_MEM)
+			seq_printf(seq, ", %llu bytes allocated, %llu freed",
+				   r.stats.mem_alloc, r.stats.mem_freed);
+		seq_puts(seq, "\n");
 	}
+	if (r.bench.iterations)
+		seq_printf(seq, "[%s/%s] %llu iterations: "
+			   "min/median/p99/max %llu/%llu/%llu/%llu ns, "
+			   "%llu/%llu/%llu/%llu cycles\n",
+			   t->tclass, t->name, r.bench.iterations,
+			   r.bench.min_ns, r.bench.median_ns,
+			   r.bench.p99_ns, r.bench.max_ns,
+			   r.bench.min_cycles, r.bench.median_cycles,
+			   r.bench.p99_cycles, r.bench.max_cycles);
+	if (r.tgroup.threads)
+		seq_printf(seq, "[%s/%s] %u threads on %u cpus: %llu ops in %llu ns, "
+			   "%llu ops/s, per thread %llu-%llu ops, %llu-%llu ns\n",
+			   t->tclass, t->name, r.tgroup.threads, r.tgroup.cpus,
+			   r.tgroup.ops, r.tgroup.duration_ns, r.tgroup.ops_per_sec,
+			   r.tgroup.min_ops, r.tgroup.max_ops,
+			   r.tgroup.min_ns, r.tgroup.max_ns);
 }
 
 /* /sys/kernel/debug/ktf/results/<testset>-tests/<test> shows specific result */
@@ -78,7 +119,7 @@ static int ktf_debugfs_run(struct seq_file *seq, void *v)
 	if (!t)
 		return 0;
 
-	ktf_run_hook(NULL, NULL, t, 0, NULL, 0);
+	ktf_run_hook(NULL, NULL, t, 0, NULL, 0, NULL);
 	ktf_debugfs_print_result(seq, t);
 
 	return 0;
@@ -95,7 +136,7 @@ static int ktf_debugfs_run_all(struct seq_file *seq, void *v)
 
 	seq_printf(seq, "Running %s\n", ktf_case_name(testset));
 	ktf_testcase_for_each_test(t, testset) {
-		ktf_run_hook(NULL, NULL, t, 0, NULL, 0);
+		ktf_run_hook(NULL, NULL, t, 0, NULL, 0, NULL);
 		ktf_debugfs_print_result(seq, t);
 	}
 
@@ -141,6 +182,30 @@ static const struct file_operations ktf_results_test_fops = {
 	.release = ktf_debugfs_release,
 };
 
+/* Write of a test name to /sys/kernel/debug/ktf/run/<testset> runs it. */
+static ssize_t ktf_run_testset_write(struct file *file, const char __user *ubuf,
+				     size_t count, loff_t *ppos)
+{
+	struct seq_file *seq = file->private_data;
+	struct ktf_case *testset = (struct ktf_case *)seq->private;
+	size_t len = min(count, (size_t)KTF_MAX_NAME);
+	char name[KTF_MAX_KEY];
+	struct ktf_test *t;
+
+	if (!testset)
+		return -ENOENT;
+	if (copy_from_user(name, ubuf, len))
+		return -EFAULT;
+	name[len] = '\0';
+
+	t = ktf_map_find_entry(&testset->tests, strim(name), struct ktf_test, kmap);
+	if (!t)
+		return -ENOENT;
+	ktf_run_hook(NULL, NULL, t, 0, NULL, 0, NULL);
+	ktf_test_put(t);
+	return count;
+}
+
 static void _ktf_debugfs_destroy_test(struct ktf_test *t)
 {
 	if (!t)
@@ -156,11 +221,12 @@ void ktf_debugfs_create_test(struct ktf_test *t)
 {
 	struct ktf_case *testset = ktf_case_find(t->tclass);
 
-	if (!testset)
-		return;
-
 	memset(&t->debugfs, 0, sizeof(t->debugfs));
 
+	/* No <testset>-tests directories with debugfs_tests=0 */
+	if (!testset || !testset->debugfs.debugfs_run_test)
+		goto out;
+
 	t->debugfs.debugfs_results_test =
 		debugfs_create_file(t->name, S_IFREG | 0444,
 				    testset->debugfs.debugfs_results_test,
@@ -178,12 +244,17 @@ void ktf_debugfs_create_test(struct ktf_test *t)
 			ktf_test_get(t);
 		}
 	}
+out:
 	/* Drop reference to testset from ktf_case_find(). */
-	ktf_case_put(testset);
+	if (testset)
+		ktf_case_put(testset);
 }
 
 void ktf_debugfs_destroy_test(struct ktf_test *t)
 {
+	/* The reference is only there if the files are */
+	if (!t->debugfs.debugfs_run_test)
+		return;
 	_ktf_debugfs_destroy_test(t);
 	/* Release reference now debugfs files are gone. */
 	ktf_test_put(t);
@@ -219,6 +290,7 @@ static const struct file_operations ktf_run_testset_fops = {
 	.owner = THIS_MODULE,
 	.open = ktf_run_testset_open,
 	.read = seq_read,
+	.write = ktf_run_testset_write,
 	.llseek = seq_lseek,
 	.release = ktf_debugfs_release,
 };
@@ -247,12 +319,15 @@ void ktf_debugfs_create_testset(struct ktf_case *testset)
 		goto err;
 
 	testset->debugfs.debugfs_run_testset =
-		debugfs_create_file(name, S_IFREG | 0444,
+		debugfs_create_file(name, S_IFREG | 0644,
 				    ktf_debugfs_rundir,
 				    testset, &ktf_run_testset_fops);
 	if (!testset->debugfs.debugfs_run_testset)
 		goto err;
 
+	if (!debugfs_tests)
+		goto done;
+
 	/* Now add parent directories for individual test result/run tests
 	 * which live in
 	 * /sys/kernel/debug/ktf/[results|run]/<testset>-tests/<testname>
@@ -269,7 +344,7 @@ void ktf_debugfs_create_testset(struct ktf_case *testset)
 		debugfs_create_dir(tests_subdir, ktf_debugfs_rundir);
 	if (!testset->debugfs.debugfs_run_test)
 		goto err;
-
+done:
 	/* Take reference count for testset.  One will do as we will always
 	 * free testset debugfs resources together.
 	 */
@@ -277,10 +352,14 @@ void ktf_debugfs_create_testset(struct ktf_case *testset)
 	return;
 err:
 	_ktf_debugfs_destroy_testset(testset);
+	memset(&testset->debugfs, 0, sizeof(testset->debugfs));
 }
 
 void ktf_debugfs_destroy_testset(struct ktf_case *testset)
 {
+	/* No reference if creation failed */
+	if (!testset->debugfs.debugfs_run_testset)
+		return;
 	tlog(T_DEBUG, "Destroying debugfs testset %s", ktf_case_name(testset));
 	_ktf_debugfs_destroy_testset(testset);
 	/* Remove our debugfs reference cout to testset */
@@ -311,6 +390,7 @@ static const struct file_operations ktf_cov_fops = {
 void ktf_debugfs_cleanup(void)
 {
 	tlog(T_DEBUG, "Removing ktf debugfs dirs...");
+	debugfs_remove(ktf_debugfs_shm_file);
 	debugfs_remove(ktf_debugfs_cov_file);
 	debugfs_remove(ktf_debugfs_rundir);
 	debugfs_remove(ktf_debugfs_resultsdir);
@@ -336,7 +416,15 @@ void ktf_debugfs_init(void)
 						   ktf_debugfs_rootdir,
 						   NULL,
 						   &ktf_cov_fops);
-	if (ktf_debugfs_cov_file)
+	if (!ktf_debugfs_cov_file)
+		goto err;
+
+	ktf_debugfs_shm_file = debugfs_create_file(KTF_DEBUGFS_SHM,
+						   S_IFREG | 0600,
+						   ktf_debugfs_rootdir,
+						   NULL,
+						   &ktf_shm_fops);
+	if (ktf_debugfs_shm_file)
 		return;
 err:
 	terr("Could not init %s\n", KTF_DEBUGFS_ROOT);
@@ -15,6 +15,7 @@
 #define KTF_DEBUGFS_RUN                         "run"
 #define KTF_DEBUGFS_RESULTS                     "results"
 #define KTF_DEBUGFS_COV				"coverage"
+#define KTF_DEBUGFS_SHM				"shm"
 #define KTF_DEBUGFS_TESTS_SUFFIX                "-tests"
 
 #define KTF_DEBUGFS_NAMESZ                      256
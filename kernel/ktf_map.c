@@ -16,9 +16,19 @@ void ktf_map_init(struct ktf_map *map, ktf_map_elem_comparefn elem_comparefn,
 {
 	map->root = RB_ROOT;
 	map->size = 0;
+	map->rcu = false;
+	map->key_size = 0;
 	map->elem_comparefn = elem_comparefn;
 	map->elem_freefn = elem_freefn;
 	spin_lock_init(&map->lock);
+	seqcount_init(&map->seq);
+}
+
+void ktf_map_init_rcu(struct ktf_map *map, ktf_map_elem_comparefn elem_comparefn,
+		      ktf_map_elem_freefn elem_freefn)
+{
+	ktf_map_init(map, elem_comparefn, elem_freefn);
+	map->rcu = true;
 }
 
 int ktf_map_elem_init(struct ktf_map_elem *elem, const char *key)
@@ -28,6 +38,23 @@ int ktf_map_elem_init(struct ktf_map_elem *elem, const char *key)
 	 * KTF_MAX_NAME == KTF_MAX_KEY - 1 length:
 	 */
 	elem->key[KTF_MAX_NAME] = '\0';
+	elem->key_size = 0;
+	elem->map = NULL;
+	kref_init(&elem->refcount);
+	return 0;
+}
+
+int ktf_map_elem_init_fixed(struct ktf_map_elem_fixed *elem, const void *key, size_t len)
+{
+	BUILD_BUG_ON(offsetof(struct ktf_map_elem_fixed, key) !=
+		     offsetof(struct ktf_map_elem, key));
+
+	if (len > KTF_MAP_KEY_FIXED)
+		return -EINVAL;
+	/* key may be the element's own key when re-inserting it: */
+	memmove(elem->key, key, len);
+	memset(elem->key + len, 0, KTF_MAP_KEY_FIXED - len);
+	elem->key_size = KTF_MAP_KEY_FIXED;
 	elem->map = NULL;
 	kref_init(&elem->refcount);
 	return 0;
@@ -45,9 +72,19 @@ int ktf_uint_compare(const char *ac, const char *bc)
 }
 EXPORT_SYMBOL(ktf_uint_compare);
 
+int ktf_ulong_compare(const char *ac, const char *bc)
+{
+	unsigned long a = *((unsigned long *)ac);
+	unsigned long b = *((unsigned long *)bc);
+
+	return a > b ? 1 : (a < b ? -1 : 0);
+}
+EXPORT_SYMBOL(ktf_ulong_compare);
+
 /* Copy "elem"s key representation into "name".  For cases where no
  * compare function is defined - i.e. string keys - just copy string,
- * otherwise name is hexascii of first 8 bytes of key.
+ * otherwise name is hexascii of the first 8 bytes of key, or of all of
+ * a fixed size key.
  */
 char *
 ktf_map_elem_name(struct ktf_map_elem *elem, char *name)
@@ -57,6 +94,8 @@ ktf_map_elem_name(struct ktf_map_elem *elem, char *name)
 
 	if (!elem || !elem->map)
 		(void)strlcpy(name, "<none>", KTF_MAX_NAME);
+	else if (elem->key_size)
+		(void)snprintf(name, KTF_MAX_NAME, "'%*ph'", elem->key_size, elem->key);
 	else if (!elem->map->elem_comparefn)
 		(void)strlcpy(name, elem->key, KTF_MAX_NAME);
 	else
@@ -100,36 +139,166 @@ void ktf_map_elem_get(struct ktf_map_elem *elem)
 	kref_get(&elem->refcount);
 }
 
-struct ktf_map_elem *ktf_map_find(struct ktf_map *map, const char *key)
+static inline int ktf_map_compare(struct ktf_map *map, const char *a, const char *b)
 {
-	struct rb_node *node;
-	unsigned long flags;
+	if (map->elem_comparefn)
+		return map->elem_comparefn(a, b);
+	if (map->key_size)
+		return memcmp(a, b, map->key_size);
+	return strncmp(a, b, KTF_MAX_KEY);
+}
 
-	/* may be called in interrupt context */
-	spin_lock_irqsave(&map->lock, flags);
-	node = map->root.rb_node;
+/* Tree walk shared by the locked and the lockless lookups. Without the lock
+ * a lookup may miss an element while the tree is being rebalanced, but it
+ * will always terminate and never return an element with a different key:
+ */
+static struct ktf_map_elem *__ktf_map_find(struct ktf_map *map, const char *key)
+{
+	struct rb_node *node = rcu_dereference_raw(map->root.rb_node);
 
 	while (node) {
 		struct ktf_map_elem *elem = container_of(node, struct ktf_map_elem, node);
-		int result;
+		int result = ktf_map_compare(map, key, elem->key);
 
-		if (map->elem_comparefn)
-			result = map->elem_comparefn(key, elem->key);
+		if (result < 0)
+			node = rcu_dereference_raw(node->rb_left);
+		else if (result > 0)
+			node = rcu_dereference_raw(node->rb_right);
 		else
-			result = strncmp(key, elem->key, KTF_MAX_KEY);
+			return elem;
+	}
+	return NULL;
+}
 
-		if (result < 0) {
-			node = node->rb_left;
-		} else if (result > 0) {
-			node = node->rb_right;
+struct ktf_map_elem *ktf_map_find_rcu(struct ktf_map *map, const char *key)
+{
+	struct ktf_map_elem *elem;
+	unsigned int seq;
+
+	/* Retry a failed lookup if the map was modified while we looked: */
+	do {
+		seq = read_seqcount_begin(&map->seq);
+		elem = __ktf_map_find(map, key);
+	} while (!elem && read_seqcount_retry(&map->seq, seq));
+	return elem;
+}
+
+static struct ktf_map_elem *__ktf_map_find_after(struct ktf_map *map, const char *key)
+{
+	struct rb_node *node = rcu_dereference_raw(map->root.rb_node);
+	struct ktf_map_elem *after = NULL;
+
+	while (node) {
+		struct ktf_map_elem *elem = container_of(node, struct ktf_map_elem, node);
+
+		if (ktf_map_compare(map, key, elem->key) < 0) {
+			after = elem;
+			node = rcu_dereference_raw(node->rb_left);
 		} else {
-			ktf_map_elem_get(elem);
-			spin_unlock_irqrestore(&map->lock, flags);
-			return elem;
+			node = rcu_dereference_raw(node->rb_right);
 		}
 	}
+	return after;
+}
+
+static struct ktf_map_elem *__ktf_map_find_first(struct ktf_map *map)
+{
+	struct rb_node *node = rcu_dereference_raw(map->root.rb_node);
+	struct rb_node *left;
+
+	if (!node)
+		return NULL;
+	while ((left = rcu_dereference_raw(node->rb_left)))
+		node = left;
+	return container_of(node, struct ktf_map_elem, node);
+}
+
+/* The lockless walks below are retried if the map was modified while we
+ * looked, as for ktf_map_find_rcu(). Iterating goes from the key of the
+ * previous element, since that element may have been removed or moved by
+ * a rebalance meanwhile, and rb_next() can't be trusted to find the next:
+ */
+static struct ktf_map_elem *ktf_map_find_after_rcu(struct ktf_map *map,
+						   const char *key)
+{
+	struct ktf_map_elem *elem;
+	unsigned int seq;
+
+	do {
+		seq = read_seqcount_begin(&map->seq);
+		elem = __ktf_map_find_after(map, key);
+	} while (read_seqcount_retry(&map->seq, seq));
+	return elem;
+}
+
+struct ktf_map_elem *ktf_map_find_first_rcu(struct ktf_map *map)
+{
+	struct ktf_map_elem *elem;
+	unsigned int seq;
+
+	do {
+		seq = read_seqcount_begin(&map->seq);
+		elem = __ktf_map_find_first(map);
+	} while (read_seqcount_retry(&map->seq, seq));
+	return elem;
+}
+
+struct ktf_map_elem *ktf_map_find_next_rcu(struct ktf_map_elem *elem)
+{
+	return ktf_map_find_after_rcu(elem->map, elem->key);
+}
+
+/* Take a reference to an element found without holding the map lock.
+ * This fails if the element is already on its way to be freed:
+ */
+static inline bool ktf_map_elem_tryget(struct ktf_map_elem *elem)
+{
+	return elem && kref_get_unless_zero(&elem->refcount);
+}
+
+struct ktf_map_elem *ktf_map_find(struct ktf_map *map, const char *key)
+{
+	struct ktf_map_elem *elem;
+	unsigned long flags;
+
+	if (map->rcu) {
+		rcu_read_lock();
+		elem = ktf_map_find_rcu(map, key);
+		if (!ktf_map_elem_tryget(elem))
+			elem = NULL;
+		rcu_read_unlock();
+		return elem;
+	}
+
+	/* may be called in interrupt context */
+	spin_lock_irqsave(&map->lock, flags);
+	elem = __ktf_map_find(map, key);
+	if (elem)
+		ktf_map_elem_get(elem);
 	spin_unlock_irqrestore(&map->lock, flags);
-	return NULL;
+	return elem;
+}
+
+struct ktf_map_elem *ktf_map_find_after(struct ktf_map *map, const char *key)
+{
+	struct ktf_map_elem *elem;
+	unsigned long flags;
+
+	if (map->rcu) {
+		rcu_read_lock();
+		elem = ktf_map_find_after_rcu(map, key);
+		while (elem && !ktf_map_elem_tryget(elem))
+			elem = ktf_map_find_next_rcu(elem);
+		rcu_read_unlock();
+		return elem;
+	}
+
+	spin_lock_irqsave(&map->lock, flags);
+	elem = __ktf_map_find_after(map, key);
+	if (elem)
+		ktf_map_elem_get(elem);
+	spin_unlock_irqrestore(&map->lock, flags);
+	return elem;
 }
 
 /* Find the first map elem in 'map' */
@@ -139,6 +308,15 @@ struct ktf_map_elem *ktf_map_find_first(struct ktf_map *map)
 	struct rb_node *node;
 	unsigned long flags;
 
+	if (map->rcu) {
+		rcu_read_lock();
+		elem = ktf_map_find_first_rcu(map);
+		while (elem && !ktf_map_elem_tryget(elem))
+			elem = ktf_map_find_next_rcu(elem);
+		rcu_read_unlock();
+		return elem;
+	}
+
 	spin_lock_irqsave(&map->lock, flags);
 	node = rb_first(&map->root);
 	if (node) {
@@ -159,6 +337,18 @@ struct ktf_map_elem *ktf_map_find_next(struct ktf_map_elem *elem)
 
 	if (!elem->map)
 		return NULL;
+
+	if (map->rcu) {
+		rcu_read_lock();
+		next = ktf_map_find_next_rcu(elem);
+		while (next && !ktf_map_elem_tryget(next))
+			next = ktf_map_find_next_rcu(next);
+		rcu_read_unlock();
+		/* See assumption below */
+		ktf_map_elem_put(elem);
+		return next;
+	}
+
 	spin_lock_irqsave(&map->lock, flags);
 	node = rb_next(&elem->node);
 
@@ -187,16 +377,14 @@ int ktf_map_insert(struct ktf_map *map, struct ktf_map_elem *elem)
 	struct rb_node **newobj, *parent = NULL;
 	unsigned long flags;
 
+	if (elem->key_size != map->key_size)
+		return -EINVAL;
+
 	spin_lock_irqsave(&map->lock, flags);
 	newobj = &map->root.rb_node;
 	while (*newobj) {
 		struct ktf_map_elem *this = container_of(*newobj, struct ktf_map_elem, node);
-		int result;
-
-		if (map->elem_comparefn)
-			result = map->elem_comparefn(elem->key, this->key);
-		else
-			result = strncmp(elem->key, this->key, KTF_MAX_KEY);
+		int result = ktf_map_compare(map, elem->key, this->key);
 
 		parent = *newobj;
 		if (result < 0) {
@@ -209,22 +397,37 @@ int ktf_map_insert(struct ktf_map *map, struct ktf_map_elem *elem)
 		}
 	}
 
+	/* Bump reference count for map reference */
+	ktf_map_elem_get(elem);
+	elem->map = map;
+
 	/* Add newobj node and rebalance tree. */
-	rb_link_node(&elem->node, parent, newobj);
+	write_seqcount_begin(&map->seq);
+	rb_link_node_rcu(&elem->node, parent, newobj);
 	rb_insert_color(&elem->node, &map->root);
-	elem->map = map;
 	map->size++;
-	/* Bump reference count for map reference */
-	ktf_map_elem_get(elem);
+	write_seqcount_end(&map->seq);
 	spin_unlock_irqrestore(&map->lock, flags);
 	return 0;
 }
 
+/* Must be called with the map lock held */
+static void __ktf_map_remove_elem(struct ktf_map *map, struct ktf_map_elem *elem)
+{
+	write_seqcount_begin(&map->seq);
+	rb_erase(&elem->node, &map->root);
+	map->size--;
+	write_seqcount_end(&map->seq);
+}
+
 void ktf_map_remove_elem(struct ktf_map *map, struct ktf_map_elem *elem)
 {
+	unsigned long flags;
+
 	if (elem) {
-		rb_erase(&elem->node, &map->root);
-		map->size--;
+		spin_lock_irqsave(&map->lock, flags);
+		__ktf_map_remove_elem(map, elem);
+		spin_unlock_irqrestore(&map->lock, flags);
 		ktf_map_elem_put(elem);
 	}
 }
@@ -234,9 +437,11 @@ struct ktf_map_elem *ktf_map_remove(struct ktf_map *map, const char *key)
 	struct ktf_map_elem *elem;
 	unsigned long flags;
 
-	elem = ktf_map_find(map, key);
+	/* The map reference is handed over to the caller */
 	spin_lock_irqsave(&map->lock, flags);
-	ktf_map_remove_elem(map, elem);
+	elem = __ktf_map_find(map, key);
+	if (elem)
+		__ktf_map_remove_elem(map, elem);
 	spin_unlock_irqrestore(&map->lock, flags);
 	return elem;
 }
@@ -251,9 +456,8 @@ void ktf_map_delete_all(struct ktf_map *map)
 	do {
 		node = rb_first(&(map)->root);
 		if (node) {
-			rb_erase(node, &(map)->root);
-			map->size--;
 			elem = container_of(node, struct ktf_map_elem, node);
+			__ktf_map_remove_elem(map, elem);
 			ktf_map_elem_put(elem);
 		}
 	} while (node);
@@ -12,10 +12,15 @@
 #include <linux/kref.h>
 #include <linux/version.h>
 #include <linux/rbtree.h>
+#include <linux/rcupdate.h>
+#include <linux/seqlock.h>
 
 #define	KTF_MAX_KEY 64
 #define KTF_MAX_NAME (KTF_MAX_KEY - 1)
 
+/* Key size of the compact map elements below */
+#define KTF_MAP_KEY_FIXED 16
+
 struct ktf_map_elem;
 
 /* Compare function called to compare element keys - optional and if
@@ -29,6 +34,7 @@ typedef int (*ktf_map_elem_comparefn)(const char *, const char *);
  * to the string compare:
  */
 int ktf_uint_compare(const char *a, const char *b);
+int ktf_ulong_compare(const char *a, const char *b);
 
 /* Free function called when elem refcnt is 0 - optional and of course for
  * dynamically-allocated elems only.
@@ -38,37 +44,99 @@ typedef void (*ktf_map_elem_freefn)(struct ktf_map_elem *);
 struct ktf_map {
 	struct rb_root root; /* The rb tree holding the map */
 	size_t size;	     /* Current size (number of elements) of the map */
-	spinlock_t lock;     /* held for map lookup etc */
+	spinlock_t lock;     /* held for map updates (and lookups if !rcu) */
+	seqcount_t seq;	     /* Bumped by updates, for lockless lookups */
+	bool rcu;	     /* Lookups are lockless - see ktf_map_init_rcu() */
+	unsigned int key_size; /* Binary key size of elements, 0 for strings */
 	ktf_map_elem_comparefn elem_comparefn; /* Key comparison function */
 	ktf_map_elem_freefn elem_freefn; /* Free function */
 };
 
+/* Common head of the element types below, which only differ in key size.
+ * The key follows the head, so it is at the same offset in both types:
+ */
+#define __KTF_MAP_ELEM_HEAD \
+	struct rb_node node;	/* Linkage for the map */ \
+	struct ktf_map *map;	/* owning map */ \
+	struct kref refcount;	/* reference count for element */ \
+	unsigned int key_size;	/* Binary key size, 0 for string keys */ \
+	struct rcu_head rcu	/* For deferred free of elements in rcu maps */
+
 struct ktf_map_elem {
-	struct rb_node node;	      /* Linkage for the map */
+	__KTF_MAP_ELEM_HEAD;
 	char key[KTF_MAX_KEY+1] __aligned(8);
 		/* Key of the element - must be unique within the same map */
-	struct ktf_map *map;  /* owning map */
-	struct kref refcount; /* reference count for element */
 };
 
-#define __KTF_MAP_INITIALIZER(_mapname, _elem_comparefn, _elem_freefn) \
+/* A compact element with a binary key of KTF_MAP_KEY_FIXED bytes, for maps
+ * defined with DEFINE_KTF_MAP_FIXED_RCU(). It is passed to the map functions
+ * as a struct ktf_map_elem by means of ktf_map_fixed_elem():
+ */
+struct ktf_map_elem_fixed {
+	__KTF_MAP_ELEM_HEAD;
+	char key[KTF_MAP_KEY_FIXED] __aligned(8);
+};
+
+#define ktf_map_fixed_elem(_elem) ((struct ktf_map_elem *)(_elem))
+
+/* container_of() for an embedded element of either type */
+#define ktf_map_elem_entry(_elem, _type, _member) \
+	((_type *)((char *)(_elem) - offsetof(_type, _member)))
+
+#define __KTF_MAP_INITIALIZER_KEY(_mapname, _elem_comparefn, _elem_freefn, _rcu, _key_size) \
         { \
 		.root = RB_ROOT, \
 		.size = 0, \
 		.lock = __SPIN_LOCK_UNLOCKED(_mapname), \
+		.seq = SEQCNT_ZERO(_mapname.seq), \
+		.rcu = _rcu, \
+		.key_size = _key_size, \
 		.elem_comparefn = _elem_comparefn, \
 		.elem_freefn = _elem_freefn, \
 	}
 
+#define __KTF_MAP_INITIALIZER_RCU(_mapname, _elem_comparefn, _elem_freefn, _rcu) \
+	__KTF_MAP_INITIALIZER_KEY(_mapname, _elem_comparefn, _elem_freefn, _rcu, 0)
+
+#define __KTF_MAP_INITIALIZER(_mapname, _elem_comparefn, _elem_freefn) \
+	__KTF_MAP_INITIALIZER_RCU(_mapname, _elem_comparefn, _elem_freefn, false)
+
 #define DEFINE_KTF_MAP(_mapname, _elem_comparefn, _elem_freefn) \
 	struct ktf_map _mapname = __KTF_MAP_INITIALIZER(_mapname, _elem_comparefn, _elem_freefn)
 
+#define DEFINE_KTF_MAP_RCU(_mapname, _elem_comparefn, _elem_freefn) \
+	struct ktf_map _mapname = \
+		__KTF_MAP_INITIALIZER_RCU(_mapname, _elem_comparefn, _elem_freefn, true)
+
+/* An rcu map of struct ktf_map_elem_fixed elements. Without a compare
+ * function keys are compared with memcmp():
+ */
+#define DEFINE_KTF_MAP_FIXED_RCU(_mapname, _elem_comparefn, _elem_freefn) \
+	struct ktf_map _mapname = __KTF_MAP_INITIALIZER_KEY(_mapname, _elem_comparefn, \
+							    _elem_freefn, true, \
+							    KTF_MAP_KEY_FIXED)
+
 void ktf_map_init(struct ktf_map *map, ktf_map_elem_comparefn elem_comparefn,
 	ktf_map_elem_freefn elem_freefn);
 
+/* Initialize a map that supports lockless lookups: All lookups, including
+ * the refcounted ones below, are done under rcu_read_lock() without taking
+ * the map lock. In return, the free function of such a map must not
+ * release the memory of an element until an RCU grace period has passed,
+ * for instance by means of kfree_rcu(ptr, kmap.rcu) or call_rcu() on the
+ * rcu member of the element.
+ */
+void ktf_map_init_rcu(struct ktf_map *map, ktf_map_elem_comparefn elem_comparefn,
+	ktf_map_elem_freefn elem_freefn);
+
 /* returns 0 upon success or -errno upon error */
 int ktf_map_elem_init(struct ktf_map_elem *elem, const char *key);
 
+/* Initialize a compact element with the first len bytes of key, the rest of
+ * the key is zeroed. Returns 0 upon success or -EINVAL if len is too large.
+ */
+int ktf_map_elem_init_fixed(struct ktf_map_elem_fixed *elem, const void *key, size_t len);
+
 /* increase/reduce reference count to element.  If count reaches 0, the
  * free function associated with map (if any) is called.
  */
@@ -77,14 +145,31 @@ void ktf_map_elem_put(struct ktf_map_elem *elem);
 
 char *ktf_map_elem_name(struct ktf_map_elem *elem, char *name);
 
-/* Insert a new element in map - return 0 iff 'elem' was inserted or -1 if
- * the key already existed - duplicates are not insterted.
+/* Insert a new element in map - return 0 iff 'elem' was inserted,
+ * -EEXIST if the key already existed - duplicates are not insterted - or
+ * -EINVAL if the element type does not match the map.
  */
 int ktf_map_insert(struct ktf_map *map, struct ktf_map_elem *elem);
 
 /* Find and return the element with 'key' */
 struct ktf_map_elem *ktf_map_find(struct ktf_map *map, const char *key);
 
+/* Find the element with the smallest key greater than 'key', with reference
+ * count increased. Allows resuming an iteration from a key, even if the
+ * element with that key has been removed in the meantime.
+ */
+struct ktf_map_elem *ktf_map_find_after(struct ktf_map *map, const char *key);
+
+/* RCU read side interface for maps initialized with ktf_map_init_rcu():
+ * The caller must hold rcu_read_lock() for as long as the returned
+ * element is used, and no reference is taken. The element may be removed
+ * from the map concurrently, so only the key and fields that stay
+ * constant for the lifetime of the element should be accessed.
+ */
+struct ktf_map_elem *ktf_map_find_rcu(struct ktf_map *map, const char *key);
+struct ktf_map_elem *ktf_map_find_first_rcu(struct ktf_map *map);
+struct ktf_map_elem *ktf_map_find_next_rcu(struct ktf_map_elem *elem);
+
 /* Find the first map elem in 'map' with reference count increased. */
 struct ktf_map_elem *ktf_map_find_first(struct ktf_map *map);
 
@@ -100,7 +185,7 @@ struct ktf_map_elem *ktf_map_find_next(struct ktf_map_elem *elem);
 struct ktf_map_elem *ktf_map_remove(struct ktf_map *map, const char *key);
 
 /* Remove specific element elem from the map. Refcount is not increased
- * as caller must already have had a reference.
+ * as caller must already have had a reference. Takes the map lock.
  */
 void ktf_map_remove_elem(struct ktf_map *map, struct ktf_map_elem *elem);
 
@@ -117,14 +202,14 @@ static inline bool ktf_map_empty(struct ktf_map *map) {
 /* Gets first entry with refcount of entry increased for caller. */
 #define ktf_map_first_entry(_map, _type, _member) \
 	ktf_map_empty(_map) ? NULL : \
-	container_of(ktf_map_find_first(_map), _type, _member)
+	ktf_map_elem_entry(ktf_map_find_first(_map), _type, _member)
 
 /* Gets next elem after "pos", decreasing refcount for pos and increasing
  * it for returned entry.
  */
 #define ktf_map_next_entry(_pos, _member) ({ \
-	struct ktf_map_elem *_e = ktf_map_find_next(&(_pos)->_member); \
-        _e ? container_of(_e, typeof(*_pos), _member) : NULL; \
+	struct ktf_map_elem *_e = ktf_map_find_next((struct ktf_map_elem *)&(_pos)->_member); \
+        _e ? ktf_map_elem_entry(_e, typeof(*_pos), _member) : NULL; \
 })
 
 /* Iterates over map elements, incrementing refcount for current element and
@@ -147,7 +232,31 @@ static inline bool ktf_map_empty(struct ktf_map *map) {
 
 #define ktf_map_find_entry(_map, _key, _type, _member) ({	\
 	struct ktf_map_elem *_entry = ktf_map_find(_map, _key);	\
-        _entry ? container_of(_entry, _type, _member) : NULL; \
+        _entry ? ktf_map_elem_entry(_entry, _type, _member) : NULL; \
+})
+
+/* Iterate over the elements of an rcu map without taking references.
+ * Must be called under rcu_read_lock(), and it is safe to break out of
+ * the loop. Elements are visited in key order, each step looking up the
+ * element after the key of the previous one, so elements present during
+ * the whole iteration are visited once, while elements added or removed
+ * during the iteration may or may not be visited.
+ */
+#define ktf_map_for_each_rcu(pos, map)	\
+	for (pos = ktf_map_find_first_rcu(map); pos != NULL; \
+	     pos = ktf_map_find_next_rcu(pos))
+
+#define ktf_map_for_each_entry_rcu(_pos, _map, _member) \
+	for (_pos = ({ struct ktf_map_elem *_e = ktf_map_find_first_rcu(_map); \
+		       _e ? ktf_map_elem_entry(_e, typeof(*_pos), _member) : NULL; }); \
+	     _pos != NULL; \
+	     _pos = ({ struct ktf_map_elem *_e = \
+			ktf_map_find_next_rcu((struct ktf_map_elem *)&(_pos)->_member); \
+		       _e ? ktf_map_elem_entry(_e, typeof(*_pos), _member) : NULL; }))
+
+#define ktf_map_find_entry_rcu(_map, _key, _type, _member) ({	\
+	struct ktf_map_elem *_entry = ktf_map_find_rcu(_map, _key);	\
+        _entry ? ktf_map_elem_entry(_entry, _type, _member) : NULL; \
 })
 
 #endif
@@ -25,7 +25,7 @@ int ktf_netctx_cb(struct ktf_context *ctx, const void *data, size_t data_sz)
 		return -EINVAL;
 	}
 
-	param_sz = sizeof(*kai) + sizeof(kai->a) * (n - 2);
+	param_sz = sizeof(*kai) + sizeof(kai->a[0]) * (n - 2);
 
 	if (n > nc->max_nodes || n < nc->min_nodes) {
 		terr("Unsupported number of nodes (%d) - must be between %d and %d!",
@@ -6,7 +6,13 @@
  *
  * ktf_nl.c: ktf netlink protocol implementation
  */
+#include <linux/kallsyms.h>
+#include <linux/stacktrace.h>
 #include <linux/version.h>
+#if (KERNEL_VERSION(4, 11, 0) <= LINUX_VERSION_CODE)
+#include <linux/sched/debug.h>
+#include <linux/sched/task.h>
+#endif
 #include <net/netlink.h>
 #include <net/genetlink.h>
 #define NL_INTERNAL 1
@@ -15,6 +21,8 @@
 #include "ktf_nl.h"
 #include "ktf.h"
 #include "ktf_cov.h"
+#include "ktf_pool.h"
+#include "ktf_shm.h"
 #include "ktf_compat.h"
 
 /* Generic netlink support to communicate with user level
@@ -23,8 +31,14 @@
 
 /* Callback functions defined below */
 static int ktf_run(struct sk_buff *skb, struct genl_info *info);
+static int ktf_run_batch(struct sk_buff *skb, struct netlink_callback *cb);
+static int ktf_run_batch_done(struct netlink_callback *cb);
 static int ktf_query(struct sk_buff *skb, struct genl_info *info);
+static int ktf_query_dump(struct sk_buff *skb, struct netlink_callback *cb);
+static int ktf_query_dump_done(struct netlink_callback *cb);
 static int ktf_cov_cmd(struct sk_buff *skb, struct genl_info *info);
+static int ktf_cov_dump(struct sk_buff *skb, struct netlink_callback *cb);
+static int ktf_cov_dump_done(struct netlink_callback *cb);
 static int ktf_ctx_cfg(struct sk_buff *skb, struct genl_info *info);
 static int send_version_only(struct sk_buff *skb, struct genl_info *info);
 
@@ -37,6 +51,8 @@ static struct genl_ops ktf_ops[] = {
 		.policy = ktf_gnl_policy,
 #endif
 		.doit = ktf_query,
+		.dumpit = ktf_query_dump,
+		.done = ktf_query_dump_done,
 	},
 	{
 		.cmd = KTF_C_RUN,
@@ -45,6 +61,8 @@ static struct genl_ops ktf_ops[] = {
 		.policy = ktf_gnl_policy,
 #endif
 		.doit = ktf_run,
+		.dumpit = ktf_run_batch,
+		.done = ktf_run_batch_done,
 	},
 	{
 		.cmd = KTF_C_COV,
@@ -53,6 +71,8 @@ static struct genl_ops ktf_ops[] = {
 		.policy = ktf_gnl_policy,
 #endif
 		.doit = ktf_cov_cmd,
+		.dumpit = ktf_cov_dump,
+		.done = ktf_cov_dump_done,
 	},
 	{
 		.cmd = KTF_C_CTX_CFG,
@@ -64,6 +84,11 @@ static struct genl_ops ktf_ops[] = {
 	}
 };
 
+/* Multicast groups, see ktf_unlproto.h */
+static const struct genl_multicast_group ktf_mcgrps[] = {
+	{ .name = KTF_MCGRP_EVENTS },
+};
+
 /* family definition */
 static struct genl_family ktf_gnl_family = {
 #if (KERNEL_VERSION(4, 10, 0) > LINUX_VERSION_CODE)
@@ -81,9 +106,14 @@ static struct genl_family ktf_gnl_family = {
 #if (KERNEL_VERSION(3, 13, 7) < LINUX_VERSION_CODE)
 	.ops = ktf_ops,
 	.n_ops = ARRAY_SIZE(ktf_ops),
+	.mcgrps = ktf_mcgrps,
+	.n_mcgrps = ARRAY_SIZE(ktf_mcgrps),
 #endif
 };
 
+/* Set while the family is registered, for events */
+static bool ktf_nl_up;
+
 static int check_version(enum ktf_cmd cmd, struct sk_buff *skb, struct genl_info *info)
 {
 	u64 version;
@@ -133,8 +163,31 @@ resp_failure:
 	return retval;
 }
 
+/* Get the shard selection of a QUERY request: shard->count is 0 if none */
+static int ktf_query_shard(struct nlattr *attr, struct ktf_shard *shard)
+{
+	memset(shard, 0, sizeof(*shard));
+	if (!attr)
+		return 0;
+	if (nla_len(attr) != sizeof(*shard))
+		return -EINVAL;
+	nla_memcpy(shard, attr, sizeof(*shard));
+	if (!shard->count || shard->index >= shard->count) {
+		terr("Invalid shard %u of %u", shard->index, shard->count);
+		return -EINVAL;
+	}
+	return 0;
+}
+
+static bool ktf_in_shard(const struct ktf_shard *shard, struct ktf_case *tc, struct ktf_test *t)
+{
+	return !shard->count ||
+		ktf_shard_of(ktf_case_name(tc), t->name, shard->count) == shard->index;
+}
+
 /* Send data about one testcase */
-static int send_test_data(struct sk_buff *resp_skb, struct ktf_case *tc)
+static int send_test_data(struct sk_buff *resp_skb, struct ktf_case *tc,
+			  const struct ktf_shard *shard)
 {
 	struct nlattr *nest_attr;
 	struct ktf_test *t;
@@ -147,6 +200,8 @@ static int send_test_data(struct sk_buff *resp_skb, struct ktf_case *tc)
 
 	nest_attr = nla_nest_start(resp_skb, KTF_A_TEST);
 	ktf_testcase_for_each_test(t, tc) {
+		if (!ktf_in_shard(shard, tc, t))
+			continue;
 		cnt++;
 		/* A test is not valid if the handle requires a context and none is present */
 		if (t->handle->id) {
@@ -217,20 +272,47 @@ static int send_handle_data(struct sk_buff *resp_skb, struct ktf_handle *handle)
 	return 0;
 }
 
+/* Send the list of handles with contexts, followed by the number of test sets */
+static int send_handle_list(struct sk_buff *resp_skb)
+{
+	struct ktf_handle *handle;
+	struct nlattr *nest_attr;
+	int stat;
+
+	if (!list_empty(&context_handles)) {
+		/* Traverse list of handles with contexts */
+		nest_attr = nla_nest_start(resp_skb, KTF_A_HLIST);
+		if (!nest_attr)
+			return -ENOMEM;
+		list_for_each_entry(handle, &context_handles, handle_list) {
+			stat = send_handle_data(resp_skb, handle);
+			if (stat)
+				return stat;
+		}
+		nla_nest_end(resp_skb, nest_attr);
+	}
+
+	/* Send total number of tests */
+	tlog(T_DEBUG, "Total #of test cases: %ld", ktf_case_count());
+	return nla_put_u32(resp_skb, KTF_A_NUM, ktf_case_count());
+}
+
 static int ktf_query(struct sk_buff *skb, struct genl_info *info)
 {
 	struct sk_buff *resp_skb;
 	void *data;
 	int retval = 0;
 	struct nlattr *nest_attr;
-	struct ktf_handle *handle;
+	struct ktf_shard shard;
 	struct ktf_case *tc;
 
 	retval = check_version(KTF_C_QUERY, skb, info);
+	if (retval)
+		return retval;
+	retval = ktf_query_shard(info->attrs[KTF_A_SHARD], &shard);
 	if (retval)
 		return retval;
 
-	/* No options yet, just send a response */
 	resp_skb = nlmsg_new(NLMSG_DEFAULT_SIZE, GFP_KERNEL);
 	if (!resp_skb)
 		return -ENOMEM;
@@ -243,6 +325,7 @@ static int ktf_query(struct sk_buff *skb, struct genl_info *info)
 	}
 
 	nla_put_u64_64bit(resp_skb, KTF_A_VERSION, KTF_VERSION_LATEST, 0);
+	nla_put_u64_64bit(resp_skb, KTF_A_GEN, ktf_registry_generation(), 0);
 
 	/* Add all test sets to the report
 	 *  We send test info as follows:
@@ -250,27 +333,17 @@ static int ktf_query(struct sk_buff *skb, struct genl_info *info)
 	 *                   testset_num [testset1 [name1 name2 ..] testset2 [name1 name2 ..]]
 	 *  Handle IDs without contexts are not present
 	 */
-	if (!list_empty(&context_handles)) {
-		/* Traverse list of handles with contexts */
-		nest_attr = nla_nest_start(resp_skb, KTF_A_HLIST);
-		list_for_each_entry(handle, &context_handles, handle_list) {
-			retval = send_handle_data(resp_skb, handle);
-			if (retval)
-				goto resp_failure;
-		}
-		nla_nest_end(resp_skb, nest_attr);
-	}
+	retval = send_handle_list(resp_skb);
+	if (retval)
+		goto resp_failure;
 
-	/* Send total number of tests */
-	tlog(T_DEBUG, "Total #of test cases: %ld", ktf_case_count());
-	nla_put_u32(resp_skb, KTF_A_NUM, ktf_case_count());
 	nest_attr = nla_nest_start(resp_skb, KTF_A_LIST);
 	if (!nest_attr) {
 		retval = -ENOMEM;
 		goto resp_failure;
 	}
 	ktf_for_each_testcase(tc) {
-		retval = send_test_data(resp_skb, tc);
+		retval = send_test_data(resp_skb, tc, &shard);
 		if (retval) {
 			retval = -ENOMEM;
 			goto resp_failure;
@@ -291,119 +364,1085 @@ resp_failure:
 	return retval;
 }
 
-static int ktf_run_func(struct sk_buff *skb, const char *ctxname,
-			const char *setname, const char *testname,
-			u32 value, void *oob_data, size_t oob_data_sz)
+/* State of a dumped QUERY, kept across invocations of the dump callback.
+ * The cursor is kept by name, to allow sets and tests to come and go while
+ * the dump is in progress:
+ */
+struct ktf_query_state {
+	enum {
+		KTF_QUERY_HEADER,	/* Version, handles and number of sets */
+		KTF_QUERY_SETS,		/* Test sets, as many per message as fit */
+		KTF_QUERY_DONE
+	} phase;
+	bool version_only;		/* Incompatible user space - just send version */
+	bool unchanged;			/* User space has a current copy already */
+	u64 gen;			/* Registry generation at start of the dump */
+	struct ktf_shard shard;		/* Only report the tests of this shard */
+	char set[KTF_MAX_KEY + 1];	/* Current set (or last complete set) */
+	char test[KTF_MAX_KEY + 1];	/* Last test sent of an incomplete set */
+};
+
+static struct ktf_query_state *ktf_query_state_create(struct netlink_callback *cb)
 {
-	struct ktf_case *testset = ktf_case_find(setname);
-	struct ktf_test *t;
-	int tn = 0;
+	struct nlattr *attrs[KTF_A_MAX];
+	struct ktf_query_state *qs;
+	int ret;
 
-	if (!testset) {
-		tlog(T_INFO, "No such testset \"%s\"\n", setname);
-		return -EFAULT;
+	ret = genlmsg_parse_deprecated(cb->nlh, &ktf_gnl_family, attrs, KTF_A_MAX - 1,
+				       ktf_gnl_policy, NULL);
+	if (ret)
+		return ERR_PTR(ret);
+
+	if (!attrs[KTF_A_VERSION]) {
+		terr("received netlink msg with no version!");
+		return ERR_PTR(-EINVAL);
 	}
 
-	/* Execute test functions */
-	ktf_testcase_for_each_test(t, testset) {
-		if (t->fun && strcmp(t->name, testname) == 0) {
-			struct ktf_context *ctx = ktf_find_context(t->handle, ctxname);
+	qs = kzalloc(sizeof(*qs), GFP_KERNEL);
+	if (!qs)
+		return ERR_PTR(-ENOMEM);
+	ret = ktf_query_shard(attrs[KTF_A_SHARD], &qs->shard);
+	if (ret) {
+		kfree(qs);
+		return ERR_PTR(ret);
+	}
+	qs->phase = KTF_QUERY_HEADER;
+	/* Respond with a version only to let user space report the issue: */
+	qs->version_only = ktf_version_check(nla_get_u64(attrs[KTF_A_VERSION])) != 0;
+	/* Any change after this point will make the next query see a new generation */
+	qs->gen = ktf_registry_generation();
+	qs->unchanged = attrs[KTF_A_GEN] && nla_get_u64(attrs[KTF_A_GEN]) == qs->gen;
+	return qs;
+}
+
+static void *ktf_query_dump_put(struct sk_buff *skb, struct netlink_callback *cb)
+{
+	void *data = genlmsg_put(skb, NETLINK_CB(cb->skb).portid, cb->nlh->nlmsg_seq,
+				 &ktf_gnl_family, NLM_F_MULTI, KTF_C_QUERY);
+
+	if (data && nla_put_u64_64bit(skb, KTF_A_VERSION, KTF_VERSION_LATEST, 0)) {
+		genlmsg_cancel(skb, data);
+		return NULL;
+	}
+	return data;
+}
 
-			ktf_run_hook(skb, ctx, t, value, oob_data, oob_data_sz);
-		} else if (!t->fun) {
-			tlog(T_DEBUG, "** no function for test %s.%s **", t->tclass, t->name);
+/* Send a QUERY message with the tests of tc, resuming after qs->test if set.
+ * Returns 0 if the rest of the set was sent, or -EMSGSIZE if the dump buffer
+ * got full, in which case the cursor is updated to allow a later resume:
+ */
+static int ktf_query_dump_set(struct sk_buff *skb, struct netlink_callback *cb,
+			      struct ktf_query_state *qs, struct ktf_case *tc)
+{
+	struct nlattr *list_attr, *test_attr;
+	struct ktf_map_elem *elem;
+	struct ktf_test *t;
+	unsigned char *mark;
+	void *data;
+	int cnt = 0;
+
+	data = ktf_query_dump_put(skb, cb);
+	if (!data)
+		return -EMSGSIZE;
+	list_attr = nla_nest_start(skb, KTF_A_LIST);
+	if (!list_attr || nla_put_string(skb, KTF_A_STR, ktf_case_name(tc)))
+		goto cancel;
+	test_attr = nla_nest_start(skb, KTF_A_TEST);
+	if (!test_attr)
+		goto cancel;
+
+	if (qs->test[0]) {
+		elem = ktf_map_find_after(&tc->tests, qs->test);
+		t = elem ? container_of(elem, struct ktf_test, kmap) : NULL;
+	} else {
+		t = ktf_map_first_entry(&tc->tests, struct ktf_test, kmap);
+	}
+
+	for (; t; t = ktf_map_next_entry(t, kmap)) {
+		if (!ktf_in_shard(&qs->shard, tc, t))
+			continue;
+		mark = skb_tail_pointer(skb);
+		/* A test is not valid if the handle requires a context and none is present */
+		if (t->handle->id) {
+			if (nla_put_u32(skb, KTF_A_HID, t->handle->id))
+				goto full;
+		} else if (t->handle->require_context) {
+			continue;
 		}
-		tn++;
+		if (nla_put_string(skb, KTF_A_STR, t->name))
+			goto full;
+		strlcpy(qs->test, t->kmap.key, sizeof(qs->test));
+		cnt++;
 	}
-	tlog(T_DEBUG, "Set %s contained %d tests", ktf_case_name(testset), tn);
-	ktf_case_put(testset);
+	nla_nest_end(skb, test_attr);
+	nla_nest_end(skb, list_attr);
+	genlmsg_end(skb, data);
+	strlcpy(qs->set, ktf_case_name(tc), sizeof(qs->set));
+	qs->test[0] = '\0';
 	return 0;
+full:
+	ktf_test_put(t);
+	nlmsg_trim(skb, mark);
+	if (!cnt)
+		goto cancel;
+	/* Send what we have of the set, and continue in the next message */
+	nla_nest_end(skb, test_attr);
+	nla_nest_end(skb, list_attr);
+	genlmsg_end(skb, data);
+	strlcpy(qs->set, ktf_case_name(tc), sizeof(qs->set));
+	return -EMSGSIZE;
+cancel:
+	genlmsg_cancel(skb, data);
+	return -EMSGSIZE;
 }
 
-static int ktf_run(struct sk_buff *skb, struct genl_info *info)
+/* Dumped QUERY: Returns the same information as a normal QUERY, but split
+ * into a multipart sequence of QUERY messages: The first carries the handles
+ * and the number of test sets, and the rest the test sets, split between
+ * messages as needed. This way there is no limit to the number of tests
+ * that can be reported, and no need for a large response buffer:
+ */
+static int ktf_query_dump(struct sk_buff *skb, struct netlink_callback *cb)
 {
-	u32 value = 0;
-	struct sk_buff *resp_skb;
+	struct ktf_query_state *qs = (struct ktf_query_state *)cb->args[0];
+	struct ktf_map_elem *elem;
+	struct ktf_case *tc;
 	void *data;
-	int retval = 0;
-	struct nlattr *nest_attr, *data_attr;
+	int ret;
+
+	if (!qs) {
+		qs = ktf_query_state_create(cb);
+		if (IS_ERR(qs))
+			return PTR_ERR(qs);
+		cb->args[0] = (long)qs;
+	}
+
+	switch (qs->phase) {
+	case KTF_QUERY_HEADER:
+		data = ktf_query_dump_put(skb, cb);
+		if (!data)
+			return -EMSGSIZE;
+		if (!qs->version_only &&
+		    nla_put_u64_64bit(skb, KTF_A_GEN, qs->gen, 0)) {
+			genlmsg_cancel(skb, data);
+			return -EMSGSIZE;
+		}
+		if (!qs->version_only && !qs->unchanged) {
+			ret = send_handle_list(skb);
+			if (ret) {
+				twarn("Handle list does not fit in a message (status %d)", ret);
+				genlmsg_cancel(skb, data);
+				return ret;
+			}
+		}
+		genlmsg_end(skb, data);
+		if (qs->version_only || qs->unchanged)
+			qs->phase = KTF_QUERY_DONE;
+		else
+			qs->phase = KTF_QUERY_SETS;
+		return skb->len;
+	case KTF_QUERY_SETS:
+		break;
+	case KTF_QUERY_DONE:
+		return 0;
+	}
+
+	/* Find where to resume: Either within, or after the last set sent */
+	if (!qs->set[0]) {
+		tc = ktf_map_first_entry(&test_cases, struct ktf_case, kmap);
+	} else {
+		tc = qs->test[0] ? ktf_case_find(qs->set) : NULL;
+		if (!tc) {
+			qs->test[0] = '\0';
+			elem = ktf_map_find_after(&test_cases, qs->set);
+			tc = elem ? container_of(elem, struct ktf_case, kmap) : NULL;
+		}
+	}
+
+	for (; tc; tc = ktf_map_next_entry(tc, kmap)) {
+		if (ktf_query_dump_set(skb, cb, qs, tc)) {
+			ktf_case_put(tc);
+			/* Not even a single test fits in an empty message? */
+			return skb->len ? skb->len : -EMSGSIZE;
+		}
+	}
+	qs->phase = KTF_QUERY_DONE;
+	return skb->len;
+}
+
+static int ktf_query_dump_done(struct netlink_callback *cb)
+{
+	kfree((struct ktf_query_state *)cb->args[0]);
+	return 0;
+}
+
+static int ktf_run_func(struct sk_buff *skb, const char *ctxname,
+			const char *setname, const char *testname,
+			u32 value, void *oob_data, size_t oob_data_sz,
+			bool instance, struct ktf_run_result *res)
+{
+	struct ktf_test *t = ktf_test_find(setname, testname);
+	struct ktf_case *testset;
+
+	if (!t) {
+		testset = ktf_case_find(setname);
+		if (!testset) {
+			tlog(T_INFO, "No such testset \"%s\"\n", setname);
+			return -EFAULT;
+		}
+		tlog(T_DEBUG, "No test %s in set %s", testname, setname);
+		ktf_case_put(testset);
+		return 0;
+	}
+
+	/* Execute test function */
+	if (t->fun) {
+		struct ktf_context *ctx = ktf_find_context(t->handle, ctxname);
+
+		if (instance)
+			ktf_run_instance(skb, ctx, t, value, oob_data, oob_data_sz, res);
+		else
+			ktf_run_hook(skb, ctx, t, value, oob_data, oob_data_sz, res);
+	} else {
+		tlog(T_DEBUG, "** no function for test %s.%s **", t->tclass, t->name);
+	}
+	ktf_test_put(t);
+	return 0;
+}
+
+/* Identification of a test to run, as received from user space */
+struct ktf_run_id {
 	char ctxname_store[KTF_MAX_NAME + 1];
-	char *ctxname = ctxname_store;
+	char *ctxname;
 	char setname[KTF_MAX_NAME + 1];
 	char testname[KTF_MAX_NAME + 1];
-	void *oob_data = NULL;
-	size_t oob_data_sz = 0;
-
-	retval = check_version(KTF_C_RUN, skb, info);
-	if (retval)
-		return retval;
+	u32 value;
+	bool cov;	/* Report the functions called by the test */
+	const s32 *points; /* Points requested for a sweep, within the request */
+	u32 nr_points;
+	bool all_ctx;	/* Run in all contexts of the test (KTF_RUN_OPT_ALL_CTX) */
+	bool instance;	/* Run as an instance of the test, see ktf_run_instance() */
+	u32 timeout;	/* Max run time in ms requested, 0 if none */
+};
 
-	if (info->attrs[KTF_A_STR])
-		nla_strlcpy(ctxname, info->attrs[KTF_A_STR], KTF_MAX_NAME);
+static int ktf_parse_run_id(struct nlattr **attrs, struct ktf_run_id *id)
+{
+	id->ctxname = id->ctxname_store;
+	if (attrs[KTF_A_STR])
+		nla_strlcpy(id->ctxname, attrs[KTF_A_STR], KTF_MAX_NAME);
 	else
-		ctxname = NULL;
+		id->ctxname = NULL;
 
-	if (!info->attrs[KTF_A_SNAM])	{
+	if (!attrs[KTF_A_SNAM])	{
 		terr("received KTF_CT_RUN msg without testset name!");
 		return -EINVAL;
 	}
-	nla_strlcpy(setname, info->attrs[KTF_A_SNAM], KTF_MAX_NAME);
+	nla_strlcpy(id->setname, attrs[KTF_A_SNAM], KTF_MAX_NAME);
 
-	if (!info->attrs[KTF_A_TNAM])	{  /* Test name wo/context */
+	if (!attrs[KTF_A_TNAM])	{  /* Test name wo/context */
 		terr("received KTF_CT_RUN msg without test name!");
 		return -EINVAL;
 	}
-	nla_strlcpy(testname, info->attrs[KTF_A_TNAM], KTF_MAX_NAME);
+	nla_strlcpy(id->testname, attrs[KTF_A_TNAM], KTF_MAX_NAME);
 
-	if (info->attrs[KTF_A_NUM])	{
-		/* Using NUM field as optional u32 input parameter to test */
-		value = nla_get_u32(info->attrs[KTF_A_NUM]);
+	/* Using NUM field as optional u32 input parameter to test */
+	id->value = attrs[KTF_A_NUM] ? nla_get_u32(attrs[KTF_A_NUM]) : 0;
+	id->cov = attrs[KTF_A_COVOPT] &&
+		(nla_get_u32(attrs[KTF_A_COVOPT]) & KTF_COV_OPT_DELTA);
+
+	id->all_ctx = attrs[KTF_A_RUNOPT] &&
+		(nla_get_u32(attrs[KTF_A_RUNOPT]) & KTF_RUN_OPT_ALL_CTX);
+	id->instance = false;
+	id->timeout = attrs[KTF_A_TIMEOUT] ? nla_get_u32(attrs[KTF_A_TIMEOUT]) : 0;
+
+	id->points = NULL;
+	id->nr_points = 0;
+	if (attrs[KTF_A_SWEEP]) {
+		int len = nla_len(attrs[KTF_A_SWEEP]);
+
+		if (!len || len % sizeof(s32) || len / sizeof(s32) > KTF_SWEEP_MAX_POINTS) {
+			terr("received KTF_CT_RUN msg with an invalid sweep of %d bytes", len);
+			return -EINVAL;
+		}
+		id->points = nla_data(attrs[KTF_A_SWEEP]);
+		id->nr_points = len / sizeof(s32);
 	}
+	return 0;
+}
+
+/* A COVFN record for a function, with count as the number of calls */
+static int ktf_cov_put_fn(struct sk_buff *skb, struct ktf_cov_entry *entry,
+			  unsigned long count)
+{
+	struct ktf_cov_fn_data fd = {
+		.address = entry->key.address,
+		.size = entry->key.size,
+		.count = count,
+	};
+	struct nlattr *rec = nla_nest_start(skb, KTF_A_COVFN);
 
-	data_attr = info->attrs[KTF_A_DATA];
-	if (data_attr)	{
-		/* User space sends out-of-band data: */
-		oob_data = nla_memdup(data_attr, GFP_KERNEL);
-		oob_data_sz = nla_len(data_attr);
+	if (!rec || nla_put_string(skb, KTF_A_MOD, entry->cov->kmap.key) ||
+	    nla_put_string(skb, KTF_A_STR, entry->name) ||
+	    nla_put(skb, KTF_A_DATA, sizeof(fd), &fd))
+		return -EMSGSIZE;
+	nla_nest_end(skb, rec);
+	return 0;
+}
+
+/* Report the functions called by a test run, as many as there is room for.
+ * NUM is the number of functions called, so that user space can tell
+ * whether the list is complete:
+ */
+static void ktf_run_put_cov(struct sk_buff *skb, struct ktf_cov_snapshot *snap)
+{
+	struct ktf_cov_snapshot_entry *se;
+	unsigned int i, called = 0, sent = 0;
+	struct nlattr *cov_attr;
+	unsigned char *mark = skb_tail_pointer(skb);
+
+	for (i = 0; i < snap->nr_entries; i++)
+		if (snap->entries[i].count)
+			called++;
+
+	cov_attr = nla_nest_start(skb, KTF_A_COVRUN);
+	if (!cov_attr || nla_put_u32(skb, KTF_A_NUM, called)) {
+		nlmsg_trim(skb, mark);
+		return;
 	}
+	for (i = 0; i < snap->nr_entries; i++) {
+		se = &snap->entries[i];
+		if (!se->count)
+			continue;
+		mark = skb_tail_pointer(skb);
+		if (ktf_cov_put_fn(skb, se->entry, se->count)) {
+			nlmsg_trim(skb, mark);
+			twarn("Only room for %u of %u called functions", sent, called);
+			break;
+		}
+		sent++;
+	}
+	nla_nest_end(skb, cov_attr);
+}
 
-	tlog(T_DEBUG, "Request for testset %s, test %s\n", setname, testname);
+/* Run a single test and build a complete RUN response message for it.
+ * The test identification is echoed back to allow user space to
+ * associate the results with the right test in a batched run:
+ */
+static struct sk_buff *ktf_run_msg(u32 portid, u32 seq, int flags, struct ktf_run_id *id,
+				   void *oob_data, size_t oob_data_sz)
+{
+	struct ktf_run_result res = {
+		.want_cov = id->cov,
+		.points = id->points,
+		.nr_points = id->nr_points,
+	};
+	struct sk_buff *resp_skb;
+	struct nlattr *nest_attr;
+	void *data;
+	int stat;
+
+	tlog(T_DEBUG, "Request for testset %s, test %s\n", id->setname, id->testname);
 
-	/* Start building a response */
 	resp_skb = nlmsg_new(NLMSG_DEFAULT_SIZE, GFP_KERNEL);
 	if (!resp_skb)
-		return -ENOMEM;
+		return ERR_PTR(-ENOMEM);
 
-	data = genlmsg_put_reply(resp_skb, info, &ktf_gnl_family,
-				 0, KTF_C_RUN);
-	if (!data) {
-		retval = -ENOMEM;
+	data = genlmsg_put(resp_skb, portid, seq, &ktf_gnl_family, flags, KTF_C_RUN);
+	if (!data)
+		goto put_fail;
+
+	if (nla_put_string(resp_skb, KTF_A_SNAM, id->setname) ||
+	    nla_put_string(resp_skb, KTF_A_TNAM, id->testname) ||
+	    (id->ctxname && nla_put_string(resp_skb, KTF_A_STR, id->ctxname)))
 		goto put_fail;
-	}
 
 	nest_attr = nla_nest_start(resp_skb, KTF_A_LIST);
-	retval = ktf_run_func(resp_skb, ctxname, setname, testname, value, oob_data, oob_data_sz);
+	stat = ktf_run_func(resp_skb, id->ctxname, id->setname, id->testname,
+			    id->value, oob_data, oob_data_sz, id->instance, &res);
 	nla_nest_end(resp_skb, nest_attr);
-	nla_put_u32(resp_skb, KTF_A_STAT, retval);
+	nla_put_u32(resp_skb, KTF_A_STAT, stat);
+	if (res.cov) {
+		ktf_run_put_cov(resp_skb, res.cov);
+		ktf_cov_snapshot_free(res.cov);
+	}
+	if (res.bench)
+		nla_put(resp_skb, KTF_A_BENCH, sizeof(res.bench_data), &res.bench_data);
+	if (res.stats)
+		nla_put(resp_skb, KTF_A_STATS, sizeof(res.stats_data), &res.stats_data);
+	if (res.tgroup)
+		nla_put(resp_skb, KTF_A_TGROUP, sizeof(res.tgroup_data), &res.tgroup_data);
 
 	/* Recompute message header */
 	genlmsg_end(resp_skb, data);
+	return resp_skb;
+put_fail:
+	nlmsg_free(resp_skb);
+	return ERR_PTR(-ENOMEM);
+}
+
+/* Out-of-band data of a request, copied from DATA or referenced
+ * in a shared buffer by SHM:
+ */
+struct ktf_oob {
+	void *data;
+	size_t size;
+	struct ktf_shm *shm;	/* The shared buffer holding data, if any */
+};
+
+static int ktf_oob_get(struct nlattr **attrs, struct ktf_oob *oob)
+{
+	struct ktf_shm_ref ref;
+	void *data;
+
+	memset(oob, 0, sizeof(*oob));
+	if (attrs[KTF_A_SHM]) {
+		if (nla_len(attrs[KTF_A_SHM]) != sizeof(ref))
+			return -EINVAL;
+		nla_memcpy(&ref, attrs[KTF_A_SHM], sizeof(ref));
+		data = ktf_shm_get(ref.id, ref.offset, ref.size, &oob->shm);
+		if (IS_ERR(data))
+			return PTR_ERR(data);
+		oob->data = data;
+		oob->size = ref.size;
+	} else if (attrs[KTF_A_DATA]) {
+		oob->data = nla_memdup(attrs[KTF_A_DATA], GFP_KERNEL);
+		if (!oob->data)
+			return -ENOMEM;
+		oob->size = nla_len(attrs[KTF_A_DATA]);
+	}
+	return 0;
+}
+
+static void ktf_oob_put(struct ktf_oob *oob)
+{
+	if (oob->shm)
+		ktf_shm_put(oob->shm);
+	else
+		kfree(oob->data);
+}
+
+/* A test to run, as part of a batched run or on its own. A test with a
+ * timeout runs in a thread of its own (see ktf_run_watched()), which
+ * outlives the request if the test hangs, so the job is refcounted:
+ */
+struct ktf_run_job {
+	struct ktf_job job;
+	struct list_head list;	  /* Linkage for the list of pending jobs */
+	struct ktf_run_id id;
+	bool parallel;		  /* Test can run concurrently with other parallel tests */
+	u32 portid;
+	u32 seq;
+	int flags;		  /* Netlink flags of the response */
+	struct ktf_oob oob;	  /* Out-of-band data for the test, if any */
+	unsigned int timeout;	  /* Max run time in ms, 0 for no limit */
+	struct kref ref;
+	struct completion run_done; /* The thread running the test has set run_skb */
+	struct sk_buff *run_skb;  /* Response from the thread, if not handed over */
+	s32 *points;		  /* The thread's copy of id.points, see ktf_run_watched() */
+	struct module *owner;	  /* Module of the test, held while the thread runs it */
+	struct ktf_test *test;	  /* The test, to count runs of it that hang */
+	atomic_t state;		  /* KTF_RUN_* state of the thread running the test */
+	struct sk_buff *resp_skb; /* The complete response message (or an ERR_PTR) */
+};
+
+/* States of the thread of a watched run, see ktf_run_watched() */
+enum {
+	KTF_RUN_RUNNING,
+	KTF_RUN_DONE,
+	KTF_RUN_HUNG,
+};
+
+/* Default max run time of a test in ms, see ktf_run_timeout() */
+static unsigned int run_timeout;
+module_param(run_timeout, uint, 0644);
+MODULE_PARM_DESC(run_timeout, "Max run time in ms of tests without a timeout of their own (default 0: no limit)");
+
+static struct ktf_run_job *ktf_run_job_alloc(void)
+{
+	struct ktf_run_job *rj = kzalloc(sizeof(*rj), GFP_KERNEL);
+
+	if (!rj)
+		return NULL;
+	kref_init(&rj->ref);
+	init_completion(&rj->run_done);
+	atomic_set(&rj->state, KTF_RUN_RUNNING);
+	return rj;
+}
+
+static void ktf_run_job_release(struct kref *ref)
+{
+	struct ktf_run_job *rj = container_of(ref, struct ktf_run_job, ref);
+
+	if (!IS_ERR_OR_NULL(rj->run_skb))
+		nlmsg_free(rj->run_skb);
+	kfree(rj->points);
+	if (rj->test)
+		ktf_test_put(rj->test);
+	ktf_oob_put(&rj->oob);
+	kfree(rj);
+}
+
+static void ktf_run_job_put(struct ktf_run_job *rj)
+{
+	kref_put(&rj->ref, ktf_run_job_release);
+}
+
+/* The timeout of a run is the one requested, or else the one of the test,
+ * or else the default:
+ */
+static unsigned int ktf_run_timeout(struct ktf_run_id *id)
+{
+	unsigned int timeout = id->timeout;
+	struct ktf_test *t;
+
+	if (timeout)
+		return timeout;
+	rcu_read_lock();
+	t = ktf_test_find_rcu(id->setname, id->testname);
+	if (t)
+		timeout = READ_ONCE(t->timeout);
+	rcu_read_unlock();
+	return timeout ? timeout : READ_ONCE(run_timeout);
+}
+
+#define KTF_STACK_DEPTH		16
+#define KTF_TIMEOUT_REPORT_SIZE	2048
+
+/* The kernel stack of a task other than current. The function for it
+ * is not exported, so it is looked up, as other kernel internals:
+ */
+static unsigned int ktf_task_stack(struct task_struct *task, unsigned long *entries,
+				   unsigned int size)
+{
+#if (KERNEL_VERSION(5, 2, 0) <= LINUX_VERSION_CODE)
+	unsigned int (*save)(struct task_struct *task, unsigned long *store,
+			     unsigned int size, unsigned int skipnr);
+
+	save = ktf_find_symbol(NULL, "stack_trace_save_tsk");
+	return save ? save(task, entries, size, 0) : 0;
+#else
+	struct stack_trace trace = {
+		.entries = entries,
+		.max_entries = size,
+	};
+	void (*save)(struct task_struct *task, struct stack_trace *trace);
+
+	save = ktf_find_symbol(NULL, "save_stack_trace_tsk");
+	if (save)
+		save(task, &trace);
+	return trace.nr_entries;
+#endif
+}
+
+/* The RUN response for a test that did not complete within its timeout:
+ * A failed assertion with the stack of the thread running the test,
+ * and the timeout that expired:
+ */
+static struct sk_buff *ktf_run_timeout_msg(struct ktf_run_job *rj, struct task_struct *task)
+{
+	unsigned long entries[KTF_STACK_DEPTH];
+	struct sk_buff *resp_skb;
+	struct nlattr *nest_attr;
+	unsigned int i, nr;
+	char *report;
+	size_t len;
+	void *data;
+
+	twarn("Test %s.%s did not complete within %u ms", rj->id.setname,
+	      rj->id.testname, rj->timeout);
+	sched_show_task(task);
 
+	report = kmalloc(KTF_TIMEOUT_REPORT_SIZE, GFP_KERNEL);
+	resp_skb = nlmsg_new(NLMSG_DEFAULT_SIZE, GFP_KERNEL);
+	if (!report || !resp_skb)
+		goto fail;
+
+	nr = ktf_task_stack(task, entries, ARRAY_SIZE(entries));
+	len = scnprintf(report, KTF_TIMEOUT_REPORT_SIZE,
+			"Timeout: No result within %u ms, the test is at:", rj->timeout);
+	for (i = 0; i < nr; i++)
+		len += scnprintf(report + len, KTF_TIMEOUT_REPORT_SIZE - len,
+				 "\n  %pS", (void *)entries[i]);
+	if (!nr)
+		scnprintf(report + len, KTF_TIMEOUT_REPORT_SIZE - len, " (no stack available)");
+
+	data = genlmsg_put(resp_skb, rj->portid, rj->seq, &ktf_gnl_family, rj->flags, KTF_C_RUN);
+	if (!data)
+		goto fail;
+	if (nla_put_string(resp_skb, KTF_A_SNAM, rj->id.setname) ||
+	    nla_put_string(resp_skb, KTF_A_TNAM, rj->id.testname) ||
+	    (rj->id.ctxname && nla_put_string(resp_skb, KTF_A_STR, rj->id.ctxname)))
+		goto fail;
+	nest_attr = nla_nest_start(resp_skb, KTF_A_LIST);
+	if (!nest_attr || nla_put_u32(resp_skb, KTF_A_STAT, 0) ||
+	    nla_put_string(resp_skb, KTF_A_FILE, __FILE__) ||
+	    nla_put_u32(resp_skb, KTF_A_NUM, __LINE__) ||
+	    nla_put_string(resp_skb, KTF_A_STR, report))
+		goto fail;
+	nla_nest_end(resp_skb, nest_attr);
+	if (nla_put_u32(resp_skb, KTF_A_STAT, 0) ||
+	    nla_put_u32(resp_skb, KTF_A_TIMEOUT, rj->timeout))
+		goto fail;
+	genlmsg_end(resp_skb, data);
+	kfree(report);
+	return resp_skb;
+fail:
+	kfree(report);
+	nlmsg_free(resp_skb);
+	return ERR_PTR(-ENOMEM);
+}
+
+static int ktf_run_thread(void *data)
+{
+	struct ktf_run_job *rj = data;
+
+	rj->run_skb = ktf_run_msg(rj->portid, rj->seq, rj->flags, &rj->id,
+				  rj->oob.data, rj->oob.size);
+	module_put(rj->owner);
+	/* The run is no longer in the way of other runs of the test */
+	if (atomic_xchg(&rj->state, KTF_RUN_DONE) == KTF_RUN_HUNG)
+		atomic_dec(&rj->test->hung);
+	complete(&rj->run_done);
+	ktf_run_job_put(rj);
+	return 0;
+}
+
+/* Run the test of rj in a thread of its own, and give up on it if it does
+ * not complete within rj->timeout. The response then reports the timeout
+ * instead, and the thread is left to finish whenever the test does,
+ * holding on to its reference to the job:
+ */
+static void ktf_run_watched(struct ktf_run_job *rj)
+{
+	struct task_struct *task;
+	struct ktf_test *t;
+	bool live = true;
+
+	/* The sweep points are within the request, which the thread may outlive */
+	if (rj->id.nr_points) {
+		rj->points = kmemdup(rj->id.points, rj->id.nr_points * sizeof(s32), GFP_KERNEL);
+		if (!rj->points) {
+			rj->resp_skb = ERR_PTR(-ENOMEM);
+			return;
+		}
+		rj->id.points = rj->points;
+	}
+
+	/* Parking the test does not wait for a thread that timed out, so hold
+	 * on to the module of the test until the thread is done with it, as
+	 * ktf_run_instance() does. A test going away meanwhile is reported as
+	 * not available by ktf_run_msg():
+	 */
+	t = ktf_test_find(rj->id.setname, rj->id.testname);
+	if (t) {
+		/* A thread of a run that hung still holds the run lock of the
+		 * test, so another thread would only hang behind it:
+		 */
+		if (atomic_read(&t->hung) > 0) {
+			twarn("Test %s.%s is still running after a timeout - not running it again",
+			      rj->id.setname, rj->id.testname);
+			ktf_test_put(t);
+			rj->resp_skb = ERR_PTR(-EBUSY);
+			return;
+		}
+		mutex_lock(&t->run_lock);
+		if (t->fun) {
+			rj->owner = t->handle->owner;
+			live = try_module_get(rj->owner);
+		}
+		mutex_unlock(&t->run_lock);
+		rj->test = t;
+	}
+	if (!live) {
+		rj->resp_skb = ktf_run_msg(rj->portid, rj->seq, rj->flags, &rj->id,
+					   rj->oob.data, rj->oob.size);
+		return;
+	}
+
+	task = kthread_create(ktf_run_thread, rj, "ktf_run/%s", rj->id.testname);
+	if (IS_ERR(task)) {
+		twarn("Unable to start a thread for test %s.%s (err %ld) - running it without timeout",
+		      rj->id.setname, rj->id.testname, PTR_ERR(task));
+		rj->resp_skb = ktf_run_msg(rj->portid, rj->seq, rj->flags, &rj->id,
+					   rj->oob.data, rj->oob.size);
+		module_put(rj->owner);
+		return;
+	}
+	get_task_struct(task);
+	kref_get(&rj->ref);
+	wake_up_process(task);
+
+	if (wait_for_completion_timeout(&rj->run_done, msecs_to_jiffies(rj->timeout))) {
+		rj->resp_skb = rj->run_skb;
+		rj->run_skb = NULL;
+	} else {
+		if (rj->test && atomic_cmpxchg(&rj->state, KTF_RUN_RUNNING,
+					       KTF_RUN_HUNG) == KTF_RUN_RUNNING)
+			atomic_inc(&rj->test->hung);
+		rj->resp_skb = ktf_run_timeout_msg(rj, task);
+	}
+	put_task_struct(task);
+}
+
+static void ktf_run_job_fun(struct ktf_job *job)
+{
+	struct ktf_run_job *rj = container_of(job, struct ktf_run_job, job);
+
+	if (rj->timeout)
+		ktf_run_watched(rj);
+	else
+		rj->resp_skb = ktf_run_msg(rj->portid, rj->seq, rj->flags, &rj->id,
+					   rj->oob.data, rj->oob.size);
+}
+
+static int ktf_run(struct sk_buff *skb, struct genl_info *info)
+{
+	struct sk_buff *resp_skb;
+	struct ktf_run_job *rj;
+	int retval = 0;
+
+	retval = check_version(KTF_C_RUN, skb, info);
+	if (retval)
+		return retval;
+
+	rj = ktf_run_job_alloc();
+	if (!rj)
+		return -ENOMEM;
+	retval = ktf_parse_run_id(info->attrs, &rj->id);
+	if (retval)
+		goto out;
+	if (rj->id.all_ctx) {
+		terr("KTF_RUN_OPT_ALL_CTX is only valid in a batched run");
+		retval = -EINVAL;
+		goto out;
+	}
+
+	/* User space may send out-of-band data: */
+	retval = ktf_oob_get(info->attrs, &rj->oob);
+	if (retval)
+		goto out;
+
+	rj->portid = info->snd_portid;
+	rj->seq = info->snd_seq;
+	rj->timeout = ktf_run_timeout(&rj->id);
+	ktf_run_job_fun(&rj->job);
+	resp_skb = rj->resp_skb;
+	if (IS_ERR(resp_skb)) {
+		retval = PTR_ERR(resp_skb);
+		goto out;
+	}
+
+	/* genlmsg_reply consumes the buffer also on failure */
 	retval = genlmsg_reply(resp_skb, info);
 	if (!retval)
-		tlog(T_DEBUG, "Sent reply for test %s.%s\n", setname, testname);
+		tlog(T_DEBUG, "Sent reply for test %s.%s\n", rj->id.setname, rj->id.testname);
 	else
 		twarn("Failed to send reply for test %s.%s - value %d",
-		      setname, testname, retval);
-
-	kfree(oob_data);
-put_fail:
-	/* Free buffer if failure */
-	if (retval)
-		nlmsg_free(resp_skb);
+		      rj->id.setname, rj->id.testname, retval);
+out:
+	ktf_run_job_put(rj);
 	return retval;
 }
 
+/* State of a batched run, kept across invocations of the dump callback */
+struct ktf_batch {
+	struct nlattr *next;	  /* Next test entry in the request */
+	int rem;		  /* Remaining length of the test list */
+	int err;		  /* Set if the test list could not be parsed */
+	struct ktf_run_job *ready; /* Next job, parsed but not yet started */
+	struct list_head pending; /* Started, undelivered jobs in request order */
+	unsigned int nr_pending;
+	unsigned int window;	  /* Max number of pending jobs */
+	bool cov;		  /* Report the functions called by each test */
+	u32 timeout;		  /* Max run time of tests without a timeout in their spec */
+	struct ktf_pool pool;	  /* Workers for parallel tests, if requested */
+	struct ktf_test *ctx_test; /* Test being run in all its contexts, if any */
+	struct ktf_run_id ctx_id; /* ..and the id of its run in the last context */
+};
+
+static bool ktf_test_is_parallel(struct ktf_run_id *id)
+{
+	struct ktf_test *t;
+	bool parallel;
+
+	rcu_read_lock();
+	t = ktf_test_find_rcu(id->setname, id->testname);
+	parallel = t && (t->flags & KTF_TEST_PARALLEL);
+	rcu_read_unlock();
+	return parallel;
+}
+
+static struct ktf_batch *ktf_batch_create(struct netlink_callback *cb)
+{
+	struct nlattr *attrs[KTF_A_MAX];
+	struct ktf_batch *b;
+	u32 jobs = 1;
+	int ret;
+
+	ret = genlmsg_parse_deprecated(cb->nlh, &ktf_gnl_family, attrs, KTF_A_MAX - 1,
+				       ktf_gnl_policy, NULL);
+	if (ret)
+		return ERR_PTR(ret);
+
+	if (!attrs[KTF_A_VERSION] || ktf_version_check(nla_get_u64(attrs[KTF_A_VERSION]))) {
+		terr("received batched KTF_CT_RUN msg with missing or incompatible version!");
+		return ERR_PTR(-EINVAL);
+	}
+
+	if (!attrs[KTF_A_LIST]) {
+		terr("received batched KTF_CT_RUN msg without a test list!");
+		return ERR_PTR(-EINVAL);
+	}
+
+	b = kzalloc(sizeof(*b), GFP_KERNEL);
+	if (!b)
+		return ERR_PTR(-ENOMEM);
+
+	/* The request stays around for the duration of the dump */
+	b->next = nla_data(attrs[KTF_A_LIST]);
+	b->rem = nla_len(attrs[KTF_A_LIST]);
+	INIT_LIST_HEAD(&b->pending);
+	b->window = 1;
+
+	b->cov = attrs[KTF_A_COVOPT] &&
+		(nla_get_u32(attrs[KTF_A_COVOPT]) & KTF_COV_OPT_DELTA);
+	b->timeout = attrs[KTF_A_TIMEOUT] ? nla_get_u32(attrs[KTF_A_TIMEOUT]) : 0;
+
+	if (attrs[KTF_A_JOBS])
+		jobs = nla_get_u32(attrs[KTF_A_JOBS]);
+	if (jobs > 1) {
+		ret = ktf_pool_start(&b->pool, jobs);
+		if (ret)
+			twarn("Unable to start workers (err %d) - running tests serially", ret);
+		else
+			b->window = 2 * b->pool.nr_workers;
+	}
+	return b;
+}
+
+static void ktf_batch_job_init(struct ktf_batch *b, struct ktf_run_job *rj,
+			       struct netlink_callback *cb)
+{
+	rj->id.cov |= b->cov;
+	if (!rj->id.timeout)
+		rj->id.timeout = b->timeout;
+	ktf_job_init(&rj->job, ktf_run_job_fun);
+	rj->portid = NETLINK_CB(cb->skb).portid;
+	rj->seq = cb->nlh->nlmsg_seq;
+	rj->flags = NLM_F_MULTI;
+	rj->timeout = ktf_run_timeout(&rj->id);
+}
+
+/* Set up the runs of the test of @id in each of its contexts, if it has any */
+static bool ktf_batch_expand(struct ktf_batch *b, struct ktf_run_id *id)
+{
+	struct ktf_test *t = ktf_test_find(id->setname, id->testname);
+
+	if (!t)
+		return false;
+	if (!ktf_has_contexts(t->handle)) {
+		ktf_test_put(t);
+		return false;
+	}
+	b->ctx_test = t;
+	b->ctx_id = *id;
+	b->ctx_id.ctxname = NULL;
+	b->ctx_id.instance = true;
+	return true;
+}
+
+/* A job for the run of b->ctx_test in its next context by name, if any.
+ * Contexts are looked up by name, so the runs are not affected by contexts
+ * being added or removed meanwhile, other than in which contexts they run.
+ * The runs are instances of the test (see ktf_run_instance()), and can run
+ * at the same time regardless of whether the test is a parallel test:
+ */
+static struct ktf_run_job *ktf_batch_next_ctx(struct ktf_batch *b, struct netlink_callback *cb)
+{
+	struct ktf_map *ctx_map = &b->ctx_test->handle->ctx_map;
+	struct ktf_map_elem *elem;
+	struct ktf_run_job *rj;
+
+	if (b->ctx_id.ctxname)
+		elem = ktf_map_find_after(ctx_map, b->ctx_id.ctxname);
+	else
+		elem = ktf_map_find_first(ctx_map);
+	if (!elem)
+		goto done;
+	strlcpy(b->ctx_id.ctxname_store, elem->key, sizeof(b->ctx_id.ctxname_store));
+	b->ctx_id.ctxname = b->ctx_id.ctxname_store;
+	ktf_map_elem_put(elem);
+
+	rj = ktf_run_job_alloc();
+	if (!rj) {
+		b->err = -ENOMEM;
+		goto done;
+	}
+	rj->id = b->ctx_id;
+	rj->id.ctxname = rj->id.ctxname_store;
+	ktf_batch_job_init(b, rj, cb);
+	rj->parallel = b->pool.nr_workers > 0;
+	return rj;
+done:
+	ktf_test_put(b->ctx_test);
+	b->ctx_test = NULL;
+	return NULL;
+}
+
+/* Parse the next test entry of the request into a new job. Returns NULL
+ * without setting b->err if the entry is to run in all contexts of the test:
+ */
+static struct ktf_run_job *ktf_batch_parse(struct ktf_batch *b, struct netlink_callback *cb)
+{
+	struct nlattr *attrs[KTF_A_MAX];
+	struct ktf_run_job *rj;
+	int ret;
+
+	if (nla_type(b->next) != KTF_A_TEST) {
+		ret = -EINVAL;
+		goto fail;
+	}
+	ret = nla_parse_nested_deprecated(attrs, KTF_A_MAX - 1, b->next, ktf_gnl_policy, NULL);
+	if (ret)
+		goto fail;
+
+	rj = ktf_run_job_alloc();
+	if (!rj) {
+		ret = -ENOMEM;
+		goto fail;
+	}
+	ret = ktf_parse_run_id(attrs, &rj->id);
+	if (ret) {
+		ktf_run_job_put(rj);
+		goto fail;
+	}
+	b->next = nla_next(b->next, &b->rem);
+	if (rj->id.all_ctx && ktf_batch_expand(b, &rj->id)) {
+		ktf_run_job_put(rj);
+		return NULL;
+	}
+	ktf_batch_job_init(b, rj, cb);
+	rj->parallel = b->pool.nr_workers && ktf_test_is_parallel(&rj->id);
+	return rj;
+fail:
+	b->err = ret;
+	return NULL;
+}
+
+/* The next job of the batch, if any */
+static struct ktf_run_job *ktf_batch_next(struct ktf_batch *b, struct netlink_callback *cb)
+{
+	struct ktf_run_job *rj;
+
+	while (b->ctx_test || (!b->err && nla_ok(b->next, b->rem))) {
+		if (b->ctx_test)
+			rj = ktf_batch_next_ctx(b, cb);
+		else
+			rj = ktf_batch_parse(b, cb);
+		if (rj || b->err)
+			return rj;
+	}
+	return NULL;
+}
+
+/* Move a complete response message into the dump buffer, if there's room */
+static int ktf_run_batch_append(struct sk_buff *skb, struct sk_buff *resp_skb)
+{
+	if (skb_tailroom(skb) < resp_skb->len)
+		return -EMSGSIZE;
+	memcpy(skb_put(skb, resp_skb->len), resp_skb->data, resp_skb->len);
+	nlmsg_free(resp_skb);
+	return 0;
+}
+
+/* Batched RUN: Runs the tests of the TEST entries in the LIST attribute of the
+ * request and returns the results in request order as a multipart dump,
+ * with as many complete per test responses in each message as there is room for.
+ * Tests added as parallel tests, and the runs of a test in all its contexts,
+ * are handed to a pool of per-CPU workers if user space asked for more than
+ * one job, other tests run alone, from here:
+ */
+static int ktf_run_batch(struct sk_buff *skb, struct netlink_callback *cb)
+{
+	struct ktf_batch *b = (struct ktf_batch *)cb->args[0];
+	struct ktf_run_job *rj;
+
+	if (!b) {
+		b = ktf_batch_create(cb);
+		if (IS_ERR(b))
+			return PTR_ERR(b);
+		cb->args[0] = (long)b;
+	}
+
+	for (;;) {
+		/* Start as many tests as the window allows */
+		while (b->nr_pending < b->window) {
+			if (!b->ready && !b->err)
+				b->ready = ktf_batch_next(b, cb);
+			rj = b->ready;
+			if (!rj)
+				break;
+			if (rj->parallel) {
+				ktf_pool_queue(&b->pool, &rj->job);
+			} else if (!b->nr_pending) {
+				rj->job.fun(&rj->job);
+				complete(&rj->job.done);
+			} else {
+				/* Wait for the tests before this one to finish */
+				break;
+			}
+			b->ready = NULL;
+			list_add_tail(&rj->list, &b->pending);
+			b->nr_pending++;
+		}
+
+		rj = list_first_entry_or_null(&b->pending, struct ktf_run_job, list);
+		if (!rj)
+			break;
+		/* Hand what we have to user space before waiting for more */
+		if (!completion_done(&rj->job.done) && skb->len)
+			break;
+		wait_for_completion(&rj->job.done);
+		if (IS_ERR(rj->resp_skb))
+			twarn("No response for test %s.%s (err %ld)", rj->id.setname,
+			      rj->id.testname, PTR_ERR(rj->resp_skb));
+		else if (ktf_run_batch_append(skb, rj->resp_skb))
+			break;
+		list_del(&rj->list);
+		b->nr_pending--;
+		ktf_run_job_put(rj);
+	}
+
+	if (skb->len)
+		return skb->len;
+	return b->err;
+}
+
+static int ktf_run_batch_done(struct netlink_callback *cb)
+{
+	struct ktf_batch *b = (struct ktf_batch *)cb->args[0];
+	struct ktf_run_job *rj, *tmp;
+
+	if (!b)
+		return 0;
+
+	/* The dump may have been aborted with tests still running */
+	list_for_each_entry_safe(rj, tmp, &b->pending, list) {
+		wait_for_completion(&rj->job.done);
+		if (!IS_ERR(rj->resp_skb))
+			nlmsg_free(rj->resp_skb);
+		list_del(&rj->list);
+		ktf_run_job_put(rj);
+	}
+	if (b->ready)
+		ktf_run_job_put(b->ready);
+	if (b->ctx_test)
+		ktf_test_put(b->ctx_test);
+	ktf_pool_stop(&b->pool);
+	kfree(b);
+	return 0;
+}
+
 static int ktf_cov_cmd(struct sk_buff *skb,
 		       struct genl_info *info)
 {
@@ -470,6 +1509,156 @@ put_fail:
 	return retval;
 }
 
+/* Per dump state of a dumped COV request */
+struct ktf_cov_dump_state {
+	enum {
+		KTF_COV_DUMP_FN,	/* Function records */
+		KTF_COV_DUMP_MEM,	/* Outstanding allocation records */
+		KTF_COV_DUMP_DONE
+	} phase;
+	char module[KTF_MAX_KEY + 1];	/* Only functions of this module, if set */
+	unsigned long addr;		/* Address of the last function sent */
+	struct ktf_cov_stack *st;	/* The last stack sent */
+};
+
+static struct ktf_cov_dump_state *ktf_cov_dump_state_create(struct netlink_callback *cb)
+{
+	struct nlattr *attrs[KTF_A_MAX];
+	struct ktf_cov_dump_state *cs;
+	int ret;
+
+	ret = genlmsg_parse_deprecated(cb->nlh, &ktf_gnl_family, attrs, KTF_A_MAX - 1,
+				       ktf_gnl_policy, NULL);
+	if (ret)
+		return ERR_PTR(ret);
+
+	if (!attrs[KTF_A_VERSION]) {
+		terr("received netlink msg with no version!");
+		return ERR_PTR(-EINVAL);
+	}
+	if (ktf_version_check(nla_get_u64(attrs[KTF_A_VERSION])))
+		return ERR_PTR(-EINVAL);
+
+	cs = kzalloc(sizeof(*cs), GFP_KERNEL);
+	if (!cs)
+		return ERR_PTR(-ENOMEM);
+	cs->phase = KTF_COV_DUMP_FN;
+	if (attrs[KTF_A_MOD])
+		nla_strlcpy(cs->module, attrs[KTF_A_MOD], sizeof(cs->module));
+	return cs;
+}
+
+static int ktf_cov_dump_mem(struct sk_buff *skb, struct ktf_cov_stack *st)
+{
+	struct ktf_cov_mem_data md = {
+		.count = atomic_long_read(&st->count),
+		.bytes = atomic_long_read(&st->bytes),
+	};
+	struct nlattr *rec = nla_nest_start(skb, KTF_A_COVMEM);
+	char buf[KSYM_SYMBOL_LEN];
+	int n;
+
+	if (!rec || nla_put(skb, KTF_A_DATA, sizeof(md), &md))
+		return -EMSGSIZE;
+	for (n = 0; n < st->nr_entries; n++) {
+		sprint_symbol(buf, st->entries[n]);
+		if (nla_put_string(skb, KTF_A_STR, buf))
+			return -EMSGSIZE;
+	}
+	nla_nest_end(skb, rec);
+	return 0;
+}
+
+/* Dumped COV: Fill a COV message with as many coverage records as fit,
+ * resuming after the last record sent in the previous message.
+ */
+static int ktf_cov_dump(struct sk_buff *skb, struct netlink_callback *cb)
+{
+	struct ktf_cov_dump_state *cs = (struct ktf_cov_dump_state *)cb->args[0];
+	struct ktf_cov_entry *entry;
+	struct ktf_cov_stack *st;
+	struct nlattr *list_attr;
+	unsigned char *mark;
+	void *data;
+	int cnt = 0;
+
+	if (!cs) {
+		cs = ktf_cov_dump_state_create(cb);
+		if (IS_ERR(cs))
+			return PTR_ERR(cs);
+		cb->args[0] = (long)cs;
+	}
+	if (cs->phase == KTF_COV_DUMP_DONE)
+		return 0;
+
+	data = genlmsg_put(skb, NETLINK_CB(cb->skb).portid, cb->nlh->nlmsg_seq,
+			   &ktf_gnl_family, NLM_F_MULTI, KTF_C_COV);
+	if (!data)
+		return -EMSGSIZE;
+	if (nla_put_u64_64bit(skb, KTF_A_VERSION, KTF_VERSION_LATEST, 0))
+		goto cancel;
+	list_attr = nla_nest_start(skb, KTF_A_LIST);
+	if (!list_attr)
+		goto cancel;
+
+	if (cs->phase == KTF_COV_DUMP_FN) {
+		for (entry = ktf_cov_entry_find_after(cs->addr); entry;
+		     entry = ktf_map_next_entry(entry, kmap)) {
+			if (!entry->cov || (cs->module[0] &&
+			    strcmp(entry->cov->kmap.key, cs->module)))
+				continue;
+			mark = skb_tail_pointer(skb);
+			if (ktf_cov_put_fn(skb, entry, ktf_cov_entry_count(entry))) {
+				ktf_cov_entry_put(entry);
+				nlmsg_trim(skb, mark);
+				goto full;
+			}
+			cs->addr = entry->key.address;
+			cnt++;
+		}
+		cs->phase = KTF_COV_DUMP_MEM;
+	}
+
+	rcu_read_lock();
+	for (st = ktf_cov_stack_next(cs->st); st; st = ktf_cov_stack_next(st)) {
+		if (atomic_long_read(&st->count) <= 0)
+			continue;
+		mark = skb_tail_pointer(skb);
+		if (ktf_cov_dump_mem(skb, st)) {
+			nlmsg_trim(skb, mark);
+			rcu_read_unlock();
+			goto full;
+		}
+		cs->st = st;
+		cnt++;
+	}
+	rcu_read_unlock();
+	cs->phase = KTF_COV_DUMP_DONE;
+	if (!cnt)
+		goto cancel;
+	nla_nest_end(skb, list_attr);
+	genlmsg_end(skb, data);
+	return skb->len;
+full:
+	if (!cnt) {
+		/* Not even a single record fits in an empty message? */
+		genlmsg_cancel(skb, data);
+		return skb->len ? skb->len : -EMSGSIZE;
+	}
+	nla_nest_end(skb, list_attr);
+	genlmsg_end(skb, data);
+	return skb->len;
+cancel:
+	genlmsg_cancel(skb, data);
+	return skb->len;
+}
+
+static int ktf_cov_dump_done(struct netlink_callback *cb)
+{
+	kfree((struct ktf_cov_dump_state *)cb->args[0]);
+	return 0;
+}
+
 /* Process request to configure a configurable context:
  * Expected format:  KTF_C_CTX_CFG hid type_name context_name data
  * placed in A_HID, A_FILE, A_STR and A_DATA respectively.
@@ -478,9 +1667,7 @@ static int ktf_ctx_cfg(struct sk_buff *skb, struct genl_info *info)
 {
 	char ctxname[KTF_MAX_NAME + 1];
 	char type_name[KTF_MAX_NAME + 1];
-	struct nlattr *data_attr;
-	void *ctx_data = NULL;
-	size_t ctx_data_sz = 0;
+	struct ktf_oob oob;
 	int hid;
 	struct ktf_handle *handle;
 	struct ktf_context *ctx;
@@ -492,8 +1679,7 @@ static int ktf_ctx_cfg(struct sk_buff *skb, struct genl_info *info)
 
 	if (!info->attrs[KTF_A_STR] || !info->attrs[KTF_A_HID])
 		return -EINVAL;
-	data_attr = info->attrs[KTF_A_DATA];
-	if (!data_attr)
+	if (!info->attrs[KTF_A_DATA] && !info->attrs[KTF_A_SHM])
 		return -EINVAL;
 	hid = nla_get_u32(info->attrs[KTF_A_HID]);
 	handle = ktf_handle_find(hid);
@@ -512,13 +1698,117 @@ static int ktf_ctx_cfg(struct sk_buff *skb, struct genl_info *info)
 	tlog(T_DEBUG, "Received context configuration for context %s, handle %d",
 	     ctxname, hid);
 
-	ctx_data = nla_memdup(data_attr, GFP_KERNEL);
-	ctx_data_sz = nla_len(data_attr);
-	ret = ktf_context_set_config(ctx, ctx_data, ctx_data_sz);
-	kfree(ctx_data);
+	ret = ktf_oob_get(info->attrs, &oob);
+	if (ret)
+		return ret;
+	ret = ktf_context_set_config(ctx, oob.data, oob.size);
+	ktf_oob_put(&oob);
 	return ret;
 }
 
+/* Start an EVENT message, or return NULL if there is no one to send it to */
+static struct sk_buff *ktf_event_new(enum ktf_event ev, void **data)
+{
+	struct sk_buff *skb;
+
+#if (KERNEL_VERSION(3, 13, 7) < LINUX_VERSION_CODE)
+	if (!ktf_nl_up || !genl_has_listeners(&ktf_gnl_family, &init_net, 0))
+		return NULL;
+#else
+	return NULL;
+#endif
+	skb = genlmsg_new(NLMSG_GOODSIZE, GFP_KERNEL);
+	if (!skb)
+		return NULL;
+	*data = genlmsg_put(skb, 0, 0, &ktf_gnl_family, 0, KTF_C_EVENT);
+	if (!*data ||
+	    nla_put_u64_64bit(skb, KTF_A_VERSION, KTF_VERSION_LATEST, 0) ||
+	    nla_put_u64_64bit(skb, KTF_A_GEN, ktf_registry_generation(), 0) ||
+	    nla_put_u32(skb, KTF_A_EVENT, ev)) {
+		nlmsg_free(skb);
+		return NULL;
+	}
+	return skb;
+}
+
+static void ktf_event_send(struct sk_buff *skb, void *data, int stat)
+{
+	if (stat) {
+		twarn("Failed to build event: %d", stat);
+		nlmsg_free(skb);
+		return;
+	}
+	genlmsg_end(skb, data);
+#if (KERNEL_VERSION(3, 13, 7) < LINUX_VERSION_CODE)
+	/* Fails with -ESRCH if the last listener just left, which is fine */
+	genlmsg_multicast(&ktf_gnl_family, skb, 0, 0, GFP_KERNEL);
+#endif
+}
+
+void ktf_nl_event_set(enum ktf_event ev, struct ktf_case *tc)
+{
+	void *data;
+	struct sk_buff *skb = ktf_event_new(ev, &data);
+
+	if (!skb)
+		return;
+	tlog(T_MCAST, "event %d for set %s", ev, ktf_case_name(tc));
+	ktf_event_send(skb, data, nla_put_string(skb, KTF_A_SNAM, ktf_case_name(tc)));
+}
+
+void ktf_nl_event_test(enum ktf_event ev, struct ktf_test *t)
+{
+	struct sk_buff *skb;
+	void *data;
+	int stat;
+
+	/* As in a query, tests that require a context but have none are not visible */
+	if (!t->handle->id && t->handle->require_context)
+		return;
+	skb = ktf_event_new(ev, &data);
+	if (!skb)
+		return;
+	tlog(T_MCAST, "event %d for test %s.%s", ev, ktf_case_name(t->tc), t->name);
+	stat = nla_put_string(skb, KTF_A_SNAM, ktf_case_name(t->tc));
+	if (!stat)
+		stat = nla_put_string(skb, KTF_A_TNAM, t->name);
+	if (!stat && t->handle->id)
+		stat = nla_put_u32(skb, KTF_A_HID, t->handle->id);
+	ktf_event_send(skb, data, stat);
+}
+
+void ktf_nl_event_ctx(enum ktf_event ev, struct ktf_context *ctx)
+{
+	struct sk_buff *skb;
+	void *data;
+	int stat;
+
+	skb = ktf_event_new(ev, &data);
+	if (!skb)
+		return;
+	tlog(T_MCAST, "event %d for context %s", ev, ctx->name);
+	stat = nla_put_u32(skb, KTF_A_HID, ctx->handle->id);
+	if (!stat)
+		stat = nla_put_string(skb, KTF_A_STR, ctx->name);
+	if (!stat && ctx->config_cb) {
+		stat = nla_put_string(skb, KTF_A_MOD, ctx->type->name);
+		if (!stat)
+			stat = nla_put_u32(skb, KTF_A_STAT, ctx->config_errno);
+	}
+	ktf_event_send(skb, data, stat);
+}
+
+void ktf_nl_event_cov(enum ktf_event ev, const char *module)
+{
+	void *data;
+	struct sk_buff *skb = ktf_event_new(ev, &data);
+
+	if (!skb)
+		return;
+	tlog(T_MCAST, "event %d for coverage of %s", ev, module);
+	ktf_event_send(skb, data, nla_put_string(skb, KTF_A_MOD, module));
+}
+
 int ktf_nl_register(void)
 {
 #if (LINUX_VERSION_CODE < KERNEL_VERSION(3, 13, 7))
@@ -527,10 +1817,12 @@ int ktf_nl_register(void)
 #else
 	int stat = genl_register_family(&ktf_gnl_family);
 #endif
+	ktf_nl_up = !stat;
 	return stat;
 }
 
 void ktf_nl_unregister(void)
 {
+	ktf_nl_up = false;
 	genl_unregister_family(&ktf_gnl_family);
 }
@@ -8,7 +8,21 @@
 #ifndef KTF_NL_H
 #define KTF_NL_H
 
+#include "ktf_unlproto.h"
+
+struct ktf_case;
+struct ktf_test;
+struct ktf_context;
+
 int ktf_nl_register(void);
 void ktf_nl_unregister(void);
 
+/* Notify the members of the KTF_MCGRP_EVENTS group of a change,
+ * if there are any. Called in process context, after the change:
+ */
+void ktf_nl_event_set(enum ktf_event ev, struct ktf_case *tc);
+void ktf_nl_event_test(enum ktf_event ev, struct ktf_test *t);
+void ktf_nl_event_ctx(enum ktf_event ev, struct ktf_context *ctx);
+void ktf_nl_event_cov(enum ktf_event ev, const char *module);
+
 #endif
@@ -5,8 +5,10 @@
  *
  * ktf_override.c: support for overriding function entry.
  */
+#include <linux/ftrace.h>
 #include <linux/kprobes.h>
 #include <linux/ptrace.h>
+#include <linux/string.h>
 #include "ktf.h"
 #include "ktf_override.h"
 
@@ -62,8 +64,88 @@ void ktf_override_function_with_return(struct pt_regs *regs)
 EXPORT_SYMBOL(ktf_override_function_with_return);
 NOKPROBE_SYMBOL(ktf_override_function_with_return);
 
-int ktf_register_override(struct kprobe *kp)
+#ifdef KTF_OVERRIDE_FTRACE
+#if (KERNEL_VERSION(5, 11, 0) > LINUX_VERSION_CODE)
+#define ktf_ftrace_regs pt_regs
+#define ktf_ftrace_get_regs(fregs) (fregs)
+/* Without FTRACE_OPS_FL_RECURSION_SAFE, ftrace protects the handler itself */
+#define ftrace_test_recursion_trylock(ip, parent_ip) 0
+#define ftrace_test_recursion_unlock(bit) do {} while (0)
+#else
+#define ktf_ftrace_regs ftrace_regs
+#define ktf_ftrace_get_regs(fregs) ftrace_get_regs(fregs)
+#endif
+
+/* Runs the override handler as if called from the kprobe.  A handler that
+ * overrides sets the instruction pointer to ktf_just_return_func, which
+ * ftrace returns to instead of the traced function.  Calls of traced
+ * functions from the handler, such as printk, must not recurse into it.
+ */
+static void notrace ktf_override_ftrace_handler(unsigned long ip,
+						unsigned long parent_ip,
+						struct ftrace_ops *ops,
+						struct ktf_ftrace_regs *fregs)
+{
+	struct ktf_override *o = container_of(ops, struct ktf_override, ops);
+	struct pt_regs *regs = ktf_ftrace_get_regs(fregs);
+	int bit;
+
+	bit = ftrace_test_recursion_trylock(ip, parent_ip);
+	if (bit < 0)
+		return;
+	if (regs)
+		(void)o->kp.pre_handler(&o->kp, regs);
+	ftrace_test_recursion_unlock(bit);
+}
+
+static int ktf_register_override_ftrace(struct ktf_override *o)
+{
+	unsigned long addr = (unsigned long)ktf_find_symbol(NULL, o->kp.symbol_name);
+	int ret;
+
+	if (!addr)
+		return -ENOENT;
+
+	memset(&o->ops, 0, sizeof(o->ops));
+	o->ops.func = ktf_override_ftrace_handler;
+	o->ops.flags = FTRACE_OPS_FL_SAVE_REGS | FTRACE_OPS_FL_IPMODIFY;
+	ret = ftrace_set_filter_ip(&o->ops, addr, 0, 0);
+	if (ret)
+		return ret;
+	ret = register_ftrace_function(&o->ops);
+	if (ret) {
+		ftrace_free_filter(&o->ops);
+		return ret;
+	}
+	o->ftrace = true;
+	return 0;
+}
+
+static void ktf_unregister_override_ftrace(struct ktf_override *o)
+{
+	unregister_ftrace_function(&o->ops);
+	ftrace_free_filter(&o->ops);
+	o->ftrace = false;
+}
+#else
+static int ktf_register_override_ftrace(struct ktf_override *o)
 {
+	return -ENOTSUPP;
+}
+
+static void ktf_unregister_override_ftrace(struct ktf_override *o)
+{
+}
+#endif
+
+int ktf_register_override(struct ktf_override *o)
+{
+	int ret = ktf_register_override_ftrace(o);
+
+	if (!ret)
+		return 0;
+	tlog(T_DEBUG, "override of %s via ftrace failed (%d), using kprobe",
+	     o->kp.symbol_name, ret);
 #if (LINUX_VERSION_CODE < KERNEL_VERSION(4, 19, 0))
 	/* We can only support override if we can fix current_kprobe setting in
 	 * ktf_override_function_with_return().  To do that we need access to
@@ -74,6 +156,25 @@ int ktf_register_override(struct kprobe *kp)
 	if (!ktf_find_current_kprobe_sym())
 		return -ENOTSUPP;
 #endif
-	return register_kprobe(kp);
+	return register_kprobe(&o->kp);
 }
 EXPORT_SYMBOL(ktf_register_override);
+
+void ktf_unregister_override(struct ktf_override *o)
+{
+	const char *symbol_name = o->kp.symbol_name;
+	kprobe_pre_handler_t pre_handler = o->kp.pre_handler;
+
+	if (o->ftrace) {
+		ktf_unregister_override_ftrace(o);
+		return;
+	}
+
+	/* Reset the kprobe to allow registering it again */
+	unregister_kprobe(&o->kp);
+	memset(&o->kp, 0, sizeof(o->kp));
+	o->kp.symbol_name = symbol_name;
+	o->kp.pre_handler = pre_handler;
+	o->kp.post_handler = ktf_post_handler;
+}
+EXPORT_SYMBOL(ktf_unregister_override);
@@ -5,10 +5,38 @@
  *
  * ktf_override.h: Function override support interface for KTF.
  */
+#ifndef _KTF_OVERRIDE_H
+#define _KTF_OVERRIDE_H
+
+#include <linux/ftrace.h>
 #include <linux/kprobes.h>
+#include <linux/version.h>
 #include "ktf.h"
 
+/* Overrides are done with an ftrace_ops that modifies the instruction
+ * pointer where the kernel supports it, avoiding the breakpoint trap of a
+ * kprobe per call.  The kprobe is used otherwise, and as a fallback if the
+ * function can not be traced or is already modified by someone else (such
+ * as a live patch).  Before 4.19 the kprobe path has to clean up the
+ * current kprobe state, see ktf_override_function_with_return().
+ */
+#if defined(CONFIG_DYNAMIC_FTRACE_WITH_REGS) && \
+	(LINUX_VERSION_CODE >= KERNEL_VERSION(4, 19, 0))
+#define KTF_OVERRIDE_FTRACE
+#endif
+
+struct ktf_override {
+	struct kprobe kp;	/* symbol_name and handlers are always set */
+#ifdef KTF_OVERRIDE_FTRACE
+	struct ftrace_ops ops;
+#endif
+	bool ftrace;		/* registered with ftrace, not as a kprobe */
+};
+
 void ktf_post_handler(struct kprobe *kp, struct pt_regs *regs,
 		      unsigned long flags);
 void ktf_override_function_with_return(struct pt_regs *regs);
-int ktf_register_override(struct kprobe *kp);
+int ktf_register_override(struct ktf_override *o);
+void ktf_unregister_override(struct ktf_override *o);
+
+#endif
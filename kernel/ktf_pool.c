@@ -0,0 +1,112 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (c) 2019, Oracle and/or its affiliates. All rights reserved.
+ *
+ * ktf_pool.c: A pool of per-CPU worker threads for parallel test execution
+ */
+#include <linux/cpumask.h>
+#include <linux/kthread.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+#include "ktf_pool.h"
+
+void ktf_job_init(struct ktf_job *job, ktf_job_fun fun)
+{
+	INIT_LIST_HEAD(&job->list);
+	job->fun = fun;
+	init_completion(&job->done);
+}
+
+static struct ktf_job *ktf_pool_next(struct ktf_pool *pool)
+{
+	struct ktf_job *job = NULL;
+
+	spin_lock(&pool->lock);
+	if (!list_empty(&pool->queue)) {
+		job = list_first_entry(&pool->queue, struct ktf_job, list);
+		list_del_init(&job->list);
+	}
+	spin_unlock(&pool->lock);
+	return job;
+}
+
+static int ktf_pool_worker(void *data)
+{
+	struct ktf_thread *t = data;
+	struct ktf_pool *pool = container_of(t, struct ktf_worker, thread)->pool;
+	struct ktf_job *job;
+
+	complete(&t->started);
+	while (!kthread_should_stop()) {
+		job = ktf_pool_next(pool);
+		if (!job) {
+			wait_event_interruptible(pool->wq, !list_empty(&pool->queue) ||
+						 kthread_should_stop());
+			continue;
+		}
+		job->fun(job);
+		complete(&job->done);
+	}
+	return 0;
+}
+
+int ktf_pool_start(struct ktf_pool *pool, unsigned int nr_workers)
+{
+	struct ktf_worker *w;
+	struct ktf_thread *t;
+	int cpu;
+
+	INIT_LIST_HEAD(&pool->queue);
+	spin_lock_init(&pool->lock);
+	init_waitqueue_head(&pool->wq);
+	pool->nr_workers = 0;
+
+	nr_workers = min(nr_workers, num_online_cpus());
+	pool->workers = kcalloc(nr_workers, sizeof(*pool->workers), GFP_KERNEL);
+	if (!pool->workers)
+		return -ENOMEM;
+
+	for_each_online_cpu(cpu) {
+		if (pool->nr_workers == nr_workers)
+			break;
+		w = &pool->workers[pool->nr_workers];
+		w->pool = pool;
+		t = &w->thread;
+		t->func = ktf_pool_worker;
+		t->name = "ktf_worker";
+		init_completion(&t->started);
+		init_completion(&t->completed);
+		t->task = kthread_create(t->func, t, "%s/%d", t->name, cpu);
+		if (IS_ERR(t->task)) {
+			int ret = PTR_ERR(t->task);
+
+			t->task = NULL;
+			ktf_pool_stop(pool);
+			return ret;
+		}
+		kthread_bind(t->task, cpu);
+		wake_up_process(t->task);
+		pool->nr_workers++;
+	}
+	tlog(T_DEBUG, "Started %u workers", pool->nr_workers);
+	return 0;
+}
+
+void ktf_pool_queue(struct ktf_pool *pool, struct ktf_job *job)
+{
+	spin_lock(&pool->lock);
+	list_add_tail(&job->list, &pool->queue);
+	spin_unlock(&pool->lock);
+	wake_up(&pool->wq);
+}
+
+void ktf_pool_stop(struct ktf_pool *pool)
+{
+	unsigned int i;
+
+	for (i = 0; i < pool->nr_workers; i++)
+		KTF_THREAD_STOP(&pool->workers[i].thread);
+	kfree(pool->workers);
+	pool->workers = NULL;
+	pool->nr_workers = 0;
+}
@@ -0,0 +1,55 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (c) 2019, Oracle and/or its affiliates. All rights reserved.
+ *
+ * ktf_pool.h: A pool of per-CPU worker threads for parallel test execution
+ */
+#ifndef _KTF_POOL_H
+#define _KTF_POOL_H
+
+#include <linux/completion.h>
+#include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/wait.h>
+#include "ktf.h"
+
+struct ktf_job;
+
+typedef void (*ktf_job_fun)(struct ktf_job *job);
+
+/* A unit of work to be executed by one of the workers in a pool.
+ * Typically embedded in a larger structure with the job specific data:
+ */
+struct ktf_job {
+	struct list_head list;	   /* Linkage for the pool queue */
+	ktf_job_fun fun;	   /* Function to execute */
+	struct completion done;	   /* Signalled when fun has returned */
+};
+
+struct ktf_pool;
+
+struct ktf_worker {
+	struct ktf_thread thread;
+	struct ktf_pool *pool;
+};
+
+struct ktf_pool {
+	struct ktf_worker *workers;  /* One worker thread per CPU used */
+	unsigned int nr_workers;
+	struct list_head queue;	     /* Jobs waiting for a worker */
+	spinlock_t lock;	     /* Protects queue */
+	wait_queue_head_t wq;	     /* Workers wait here for new jobs */
+};
+
+void ktf_job_init(struct ktf_job *job, ktf_job_fun fun);
+
+/* Start a pool of up to nr_workers threads, each bound to a separate online CPU */
+int ktf_pool_start(struct ktf_pool *pool, unsigned int nr_workers);
+
+/* Queue a job for execution by the first available worker */
+void ktf_pool_queue(struct ktf_pool *pool, struct ktf_job *job);
+
+/* Stop all workers - the caller must have waited for all queued jobs to complete */
+void ktf_pool_stop(struct ktf_pool *pool);
+
+#endif
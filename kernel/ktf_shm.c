@@ -0,0 +1,150 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (c) 2019, Oracle and/or its affiliates. All rights reserved.
+ *
+ * ktf_shm.c: Buffers shared between user space and the kernel, for
+ *    passing out-of-band data to tests and contexts without copying it
+ */
+#include <linux/err.h>
+#include <linux/kref.h>
+#include <linux/list.h>
+#include <linux/mm.h>
+#include <linux/mutex.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include "ktf.h"
+#include "ktf_shm.h"
+
+/* Upper limit on the size of a single shared buffer */
+#define KTF_SHM_MAX_SIZE	(1UL << 30)
+
+struct ktf_shm {
+	struct list_head list;	/* Linkage in ktf_shm_list while the file is open */
+	struct kref refcount;	/* Held by the file and each user */
+	u32 id;
+	pid_t tgid;		/* The process that opened the file */
+	void *buf;		/* The buffer, NULL until the file is mapped */
+	size_t size;
+};
+
+static LIST_HEAD(ktf_shm_list);
+static DEFINE_MUTEX(ktf_shm_lock);	/* Protects ktf_shm_list and buf */
+static u32 ktf_shm_next_id;
+
+static void ktf_shm_free(struct kref *ref)
+{
+	struct ktf_shm *shm = container_of(ref, struct ktf_shm, refcount);
+
+	vfree(shm->buf);
+	kfree(shm);
+}
+
+void ktf_shm_put(struct ktf_shm *shm)
+{
+	kref_put(&shm->refcount, ktf_shm_free);
+}
+
+void *ktf_shm_get(u32 id, u64 offset, u64 size, struct ktf_shm **shmp)
+{
+	struct ktf_shm *shm;
+	void *data = ERR_PTR(-ENOENT);
+
+	mutex_lock(&ktf_shm_lock);
+	list_for_each_entry(shm, &ktf_shm_list, list) {
+		if (shm->id != id || shm->tgid != current->tgid || !shm->buf)
+			continue;
+		if (size > shm->size || offset > shm->size - size) {
+			data = ERR_PTR(-EINVAL);
+			break;
+		}
+		kref_get(&shm->refcount);
+		*shmp = shm;
+		data = shm->buf + offset;
+		break;
+	}
+	mutex_unlock(&ktf_shm_lock);
+	return data;
+}
+
+static int ktf_shm_open(struct inode *inode, struct file *file)
+{
+	struct ktf_shm *shm = kzalloc(sizeof(*shm), GFP_KERNEL);
+
+	if (!shm)
+		return -ENOMEM;
+	kref_init(&shm->refcount);
+	shm->tgid = current->tgid;
+
+	mutex_lock(&ktf_shm_lock);
+	shm->id = ++ktf_shm_next_id;
+	list_add(&shm->list, &ktf_shm_list);
+	mutex_unlock(&ktf_shm_lock);
+
+	file->private_data = shm;
+	return 0;
+}
+
+static int ktf_shm_release(struct inode *inode, struct file *file)
+{
+	struct ktf_shm *shm = file->private_data;
+
+	mutex_lock(&ktf_shm_lock);
+	list_del(&shm->list);
+	mutex_unlock(&ktf_shm_lock);
+	ktf_shm_put(shm);
+	return 0;
+}
+
+/* The buffer is allocated by the first mapping, and may only be mapped once.
+ * A mapping holds a reference to the file, so the buffer stays allocated
+ * until the file is both closed and unmapped:
+ */
+static int ktf_shm_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct ktf_shm *shm = file->private_data;
+	size_t size = vma->vm_end - vma->vm_start;
+	void *buf;
+	int ret;
+
+	if (vma->vm_pgoff || size > KTF_SHM_MAX_SIZE)
+		return -EINVAL;
+
+	buf = vmalloc_user(size);
+	if (!buf)
+		return -ENOMEM;
+
+	mutex_lock(&ktf_shm_lock);
+	if (shm->buf) {
+		ret = -EBUSY;
+		goto out;
+	}
+	ret = remap_vmalloc_range(vma, buf, 0);
+	if (ret)
+		goto out;
+	shm->buf = buf;
+	shm->size = size;
+	buf = NULL;
+out:
+	mutex_unlock(&ktf_shm_lock);
+	vfree(buf);
+	return ret;
+}
+
+static ssize_t ktf_shm_read(struct file *file, char __user *ubuf,
+			    size_t count, loff_t *ppos)
+{
+	struct ktf_shm *shm = file->private_data;
+	char id[16];
+	int len = snprintf(id, sizeof(id), "%u\n", shm->id);
+
+	return simple_read_from_buffer(ubuf, count, ppos, id, len);
+}
+
+const struct file_operations ktf_shm_fops = {
+	.owner = THIS_MODULE,
+	.open = ktf_shm_open,
+	.read = ktf_shm_read,
+	.mmap = ktf_shm_mmap,
+	.release = ktf_shm_release,
+};
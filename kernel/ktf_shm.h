@@ -0,0 +1,30 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (c) 2019, Oracle and/or its affiliates. All rights reserved.
+ *
+ * ktf_shm.h: Buffers shared between user space and the kernel, for
+ *    passing out-of-band data to tests and contexts without copying it
+ */
+#ifndef _KTF_SHM_H
+#define _KTF_SHM_H
+
+#include <linux/fs.h>
+#include <linux/types.h>
+
+struct ktf_shm;
+
+/* File operations of the ktf/shm debugfs file: Each open of the file
+ * creates a new buffer, which is allocated by mmap() of the file, with
+ * the size of the mapping. Reading the file returns the id of the buffer.
+ */
+extern const struct file_operations ktf_shm_fops;
+
+/* Find @size bytes at @offset into the buffer @id, which must belong to
+ * the calling process. Returns a pointer to the data, with a reference
+ * to the buffer in *@shm to be released by ktf_shm_put() when the data is
+ * no longer used, or an ERR_PTR():
+ */
+void *ktf_shm_get(u32 id, u64 offset, u64 size, struct ktf_shm **shm);
+void ktf_shm_put(struct ktf_shm *shm);
+
+#endif
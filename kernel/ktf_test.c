@@ -6,7 +6,19 @@
  * ktf_test.c: Kernel side code for tracking and reporting ktf test results
  */
 #include <linux/module.h>
+#include <linux/hashtable.h>
+#include <linux/jhash.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/percpu.h>
+#include <linux/sched.h>
+#include <linux/seq_file.h>
+#include <linux/seqlock.h>
+#include <linux/slab.h>
+#include <linux/sort.h>
 #include <linux/time.h>
+#include <linux/timex.h>
+#include <linux/vmalloc.h>
 #include "ktf_test.h"
 #include <net/netlink.h>
 #include <net/genetlink.h>
@@ -52,12 +64,23 @@ static int ktf_handle_version_check(struct ktf_handle *th)
 	return ktf_version_check(th->version);
 }
 
+/* Tests and test cases are allocated from caches of their own, as
+ * modules may register many thousands of tests:
+ */
+static struct kmem_cache *ktf_test_cache;
+static struct kmem_cache *ktf_case_cache;
+
+static void ktf_case_free_rcu(struct rcu_head *rcu)
+{
+	kmem_cache_free(ktf_case_cache, container_of(rcu, struct ktf_case, kmap.rcu));
+}
+
 /* Function called when global references to test case reach 0. */
 static void ktf_case_free(struct ktf_map_elem *elem)
 {
 	struct ktf_case *tc = container_of(elem, struct ktf_case, kmap);
 
-	kfree(tc);
+	call_rcu(&tc->kmap.rcu, ktf_case_free_rcu);
 }
 
 void ktf_case_get(struct ktf_case *tc)
@@ -71,11 +94,61 @@ void ktf_case_put(struct ktf_case *tc)
 }
 
 /* The global map from name to ktf_case */
-DEFINE_KTF_MAP(test_cases, NULL, ktf_case_free);
+DEFINE_KTF_MAP_RCU(test_cases, NULL, ktf_case_free);
 
 /* a lock to protect this datastructure */
 static DEFINE_MUTEX(tc_lock);
 
+static atomic64_t registry_gen;
+
+int ktf_registry_init(void)
+{
+	atomic64_set(&registry_gen, ktime_get_real_ns());
+
+	ktf_test_cache = kmem_cache_create("ktf_test_cache", sizeof(struct ktf_test),
+					   0, SLAB_HWCACHE_ALIGN, NULL);
+	ktf_case_cache = kmem_cache_create("ktf_case_cache", sizeof(struct ktf_case),
+					   0, SLAB_HWCACHE_ALIGN, NULL);
+	if (!ktf_test_cache || !ktf_case_cache) {
+		ktf_registry_cleanup();
+		return -ENOMEM;
+	}
+	return 0;
+}
+
+void ktf_registry_cleanup(void)
+{
+	/* Wait for deferred frees of tests and test cases */
+	rcu_barrier();
+	if (ktf_test_cache)
+		kmem_cache_destroy(ktf_test_cache);
+	if (ktf_case_cache)
+		kmem_cache_destroy(ktf_case_cache);
+	ktf_test_cache = NULL;
+	ktf_case_cache = NULL;
+}
+
+void ktf_registry_changed(void)
+{
+	atomic64_inc(&registry_gen);
+}
+
+/* Announce the tests of th again, as it got a new handle ID */
+void ktf_registry_handle_changed(struct ktf_handle *th)
+{
+	struct ktf_test *t;
+
+	mutex_lock(&tc_lock);
+	list_for_each_entry(t, &th->test_list, handle_link)
+		ktf_nl_event_test(KTF_EV_TEST_ADD, t);
+	mutex_unlock(&tc_lock);
+}
+
+u64 ktf_registry_generation(void)
+{
+	return atomic64_read(&registry_gen);
+}
+
 /* Current total number of test cases defined */
 size_t ktf_case_count(void)
 {
@@ -92,13 +165,18 @@ static size_t ktf_case_test_count(struct ktf_case *tc)
 	return ktf_map_size(&tc->tests);
 }
 
+static void ktf_test_free_rcu(struct rcu_head *rcu)
+{
+	kmem_cache_free(ktf_test_cache, container_of(rcu, struct ktf_test, kmap.rcu));
+}
+
 /* Called when test refcount reaches 0. */
 static void ktf_test_free(struct ktf_map_elem *elem)
 {
 	struct ktf_test *t = container_of(elem, struct ktf_test, kmap);
 
-	kfree(t->log);
-	kfree(t);
+	free_percpu(t->assert_cnt);
+	call_rcu(&t->kmap.rcu, ktf_test_free_rcu);
 }
 
 void ktf_test_get(struct ktf_test *t)
@@ -113,17 +191,17 @@ void ktf_test_put(struct ktf_test *t)
 
 static struct ktf_case *ktf_case_create(const char *name)
 {
-	struct ktf_case *tc = kmalloc(sizeof(*tc), GFP_KERNEL);
+	struct ktf_case *tc = kmem_cache_alloc(ktf_case_cache, GFP_KERNEL);
 	int ret;
 
 	if (!tc)
 		return tc;
 
 	/* Initialize test case map of tests. */
-	ktf_map_init(&tc->tests, NULL, ktf_test_free);
+	ktf_map_init_rcu(&tc->tests, NULL, ktf_test_free);
 	ret = ktf_map_elem_init(&tc->kmap, name);
 	if (ret) {
-		kfree(tc);
+		kmem_cache_free(ktf_case_cache, tc);
 		return NULL;
 	}
 	ktf_debugfs_create_testset(tc);
@@ -136,6 +214,46 @@ struct ktf_case *ktf_case_find(const char *name)
 	return ktf_map_find_entry(&test_cases, name, struct ktf_case, kmap);
 }
 
+/* Global index of all tests, keyed by "setname.testname", to allow a test to
+ * be looked up directly instead of via the test case. Updated under tc_lock,
+ * lookups are lockless.
+ */
+#define KTF_TEST_INDEX_BITS 10
+static DEFINE_HASHTABLE(test_index, KTF_TEST_INDEX_BITS);
+
+static u32 ktf_test_hash(const char *setname, const char *testname)
+{
+	u32 hash = jhash(setname, strnlen(setname, KTF_MAX_NAME), 0);
+
+	hash = jhash(".", 1, hash);
+	return jhash(testname, strnlen(testname, KTF_MAX_NAME), hash);
+}
+
+struct ktf_test *ktf_test_find_rcu(const char *setname, const char *testname)
+{
+	u32 hash = ktf_test_hash(setname, testname);
+	struct ktf_test *t;
+
+	hash_for_each_possible_rcu(test_index, t, hnode, hash) {
+		if (strncmp(t->kmap.key, testname, KTF_MAX_NAME) == 0 &&
+		    strncmp(t->tclass, setname, KTF_MAX_NAME) == 0)
+			return t;
+	}
+	return NULL;
+}
+
+struct ktf_test *ktf_test_find(const char *setname, const char *testname)
+{
+	struct ktf_test *t;
+
+	rcu_read_lock();
+	t = ktf_test_find_rcu(setname, testname);
+	if (t && !kref_get_unless_zero(&t->kmap.refcount))
+		t = NULL;
+	rcu_read_unlock();
+	return t;
+}
+
 /* Returns with case refcount increased.  Called with tc_lock held. */
 static struct ktf_case *ktf_case_find_create(const char *name)
 {
@@ -148,102 +266,571 @@ static struct ktf_case *ktf_case_find_create(const char *name)
 		if (tc) {
 			ret = ktf_map_insert(&test_cases, &tc->kmap);
 			if (ret) {
-				kfree(tc);
+				kmem_cache_free(ktf_case_cache, tc);
 				tc = NULL;
+			} else {
+				ktf_nl_event_set(KTF_EV_SET_ADD, tc);
 			}
 		}
 	}
 	return tc;
 }
 
-static atomic_t assert_cnt = ATOMIC_INIT(0);
+/* Passed assertions are counted per test in per-CPU counters that
+ * only ever increase, to avoid contention between threads and CPUs
+ * executing the same test. The counters are summed when reported,
+ * and the sum at the last flush is kept to compute the new count:
+ */
+static unsigned long ktf_assert_sum(struct ktf_test *self)
+{
+	unsigned long sum = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		sum += *per_cpu_ptr(self->assert_cnt, cpu);
+	return sum;
+}
 
 void flush_assert_cnt(struct ktf_test *self)
 {
-	if (atomic_read(&assert_cnt)) {
-		tlog(T_DEBUG, "update: %d asserts", atomic_read(&assert_cnt));
+	unsigned long sum = ktf_assert_sum(self);
+	u32 cnt = sum - self->assert_flushed;
+
+	if (cnt) {
+		tlog(T_DEBUG, "update: %u asserts", cnt);
 		if (self->skb)
-			nla_put_u32(self->skb, KTF_A_STAT, atomic_read(&assert_cnt));
-		atomic_set(&assert_cnt, 0);
+			nla_put_u32(self->skb, KTF_A_STAT, cnt);
+		self->assert_flushed = sum;
 	}
 }
 
-u32 ktf_get_assertion_count(void)
+u32 ktf_get_assertion_count(struct ktf_test *self)
 {
-	return atomic_read(&assert_cnt);
+	return ktf_assert_sum(self) - self->assert_flushed;
 }
 EXPORT_SYMBOL(ktf_get_assertion_count);
 
-static DEFINE_SPINLOCK(assert_lock);
+/* Failed assertions are recorded in a shared ring of preallocated records
+ * per CPU, without taking locks or allocating memory, so that assertions
+ * can fail at a high rate and from any context, and memory is only used
+ * for failures that actually happen. The rings are allocated when the first
+ * test runs. Each record identifies the test and the run id of the test
+ * iteration it belongs to. Formatting of the report is deferred until the
+ * records of an iteration are flushed to the netlink response, or the records
+ * of the last run of a test are shown in debugfs. Where available, the
+ * arguments are stored in binary form and formatted with bstr_printf then.
+ * The oldest records of a CPU are overwritten when its ring is full:
+ */
+#define KTF_RESULT_RECORDS	64
+#ifdef CONFIG_BINARY_PRINTF
+#define KTF_ERR_BIN_WORDS	128
+#else
+#define KTF_ERR_TEXT_SIZE	512
+#endif
+
+struct ktf_result_record {
+	seqcount_t seq;		/* Bumped while the record is written */
+	const struct ktf_test *t; /* Test the record belongs to - not referenced */
+	u64 run;		/* Run id of the test iteration */
+	const char *file;
+	const char *fmt;
+	int line;
+	int result;
+#ifdef CONFIG_BINARY_PRINTF
+	u32 bin[KTF_ERR_BIN_WORDS];
+#else
+	char text[KTF_ERR_TEXT_SIZE];
+#endif
+};
+
+struct ktf_result_ring {
+	atomic_t head;	/* Number of records written to the ring */
+	struct ktf_result_record rec[KTF_RESULT_RECORDS];
+};
+
+static struct ktf_result_ring **ktf_results; /* One ring per possible CPU */
+static DEFINE_MUTEX(ktf_results_lock);
+static atomic64_t ktf_run_seq = ATOMIC64_INIT(0);
+
+static void ktf_results_alloc(void)
+{
+	struct ktf_result_ring **rings;
+	int cpu;
+
+	if (smp_load_acquire(&ktf_results))
+		return;
+	mutex_lock(&ktf_results_lock);
+	if (ktf_results)
+		goto out;
+	rings = kcalloc(nr_cpu_ids, sizeof(*rings), GFP_KERNEL);
+	if (!rings)
+		goto out;
+	for_each_possible_cpu(cpu) {
+		rings[cpu] = vzalloc_node(sizeof(**rings), cpu_to_node(cpu));
+		if (!rings[cpu]) {
+			for_each_possible_cpu(cpu)
+				vfree(rings[cpu]);
+			kfree(rings);
+			goto out;
+		}
+	}
+	smp_store_release(&ktf_results, rings);
+out:
+	mutex_unlock(&ktf_results_lock);
+}
+
+static void ktf_results_free(void)
+{
+	int cpu;
+
+	if (!ktf_results)
+		return;
+	for_each_possible_cpu(cpu)
+		vfree(ktf_results[cpu]);
+	kfree(ktf_results);
+	ktf_results = NULL;
+}
+
+static void ktf_err_record(struct ktf_test *self, int result, const char *file,
+			   int line, const char *fmt, va_list ap)
+{
+	struct ktf_result_ring **rings = smp_load_acquire(&ktf_results);
+	struct ktf_result_ring *ring;
+	struct ktf_result_record *rec;
+	unsigned int slot;
+
+	/* Counted even without records, so that the run fails with
+	 * ktf_flush_errors() reporting the failures not recorded:
+	 */
+	atomic_inc(&self->err_pending);
+	if (!rings) {
+		struct va_format vaf = { .fmt = fmt, .va = &ap };
+
+		terr("file %s line %d: result %d: %pV", file, line, result, &vaf);
+		return;
+	}
+
+	ring = rings[get_cpu()];
+	slot = (unsigned int)(atomic_inc_return(&ring->head) - 1) % KTF_RESULT_RECORDS;
+	rec = &ring->rec[slot];
+	raw_write_seqcount_begin(&rec->seq);
+	rec->t = self;
+	rec->run = READ_ONCE(self->run_id);
+	rec->file = file;
+	rec->fmt = fmt;
+	rec->line = line;
+	rec->result = result;
+#ifdef CONFIG_BINARY_PRINTF
+	vbin_printf(rec->bin, KTF_ERR_BIN_WORDS, fmt, ap);
+#else
+	vsnprintf(rec->text, KTF_ERR_TEXT_SIZE, fmt, ap);
+#endif
+	raw_write_seqcount_end(&rec->seq);
+	put_cpu();
+}
+
+/* Copy the record in @slot of @ring to @copy if it belongs to the runs
+ * of test @t from @first to @last. Returns false if it does not, or if it
+ * is being written to:
+ */
+static bool ktf_result_read(struct ktf_result_ring *ring, unsigned int slot, const struct ktf_test *t,
+			    u64 first, u64 last, struct ktf_result_record *copy)
+{
+	struct ktf_result_record *rec = &ring->rec[slot];
+	unsigned int seq = raw_read_seqcount(&rec->seq);
+
+	if (seq & 1)
+		return false;
+	if (READ_ONCE(rec->t) != t || READ_ONCE(rec->run) < first ||
+	    READ_ONCE(rec->run) > last)
+		return false;
+	memcpy(copy, rec, sizeof(*copy));
+	return !read_seqcount_retry(&rec->seq, seq);
+}
+
+/* Call @fn with the formatted report of each failed assertion recorded
+ * for the runs of test @t from @first to @last that is still in the rings.
+ * Returns the number of records found:
+ */
+static unsigned int ktf_results_for_each(const struct ktf_test *t, u64 first, u64 last,
+					 void (*fn)(const struct ktf_result_record *rec,
+						    const char *report, void *arg),
+					 void *arg)
+{
+	struct ktf_result_ring **rings = smp_load_acquire(&ktf_results);
+	struct ktf_result_record *copy;
+	unsigned int found = 0;
+	unsigned int i, n;
+	char *buf;
+	int cpu;
+
+	if (!rings)
+		return 0;
+	copy = kmalloc(sizeof(*copy), GFP_KERNEL);
+	buf = kmalloc(MAX_PRINTF, GFP_KERNEL);
+	if (!copy || !buf)
+		goto out;
+
+	for_each_possible_cpu(cpu) {
+		n = min_t(unsigned int, atomic_read(&rings[cpu]->head), KTF_RESULT_RECORDS);
+		for (i = 0; i < n; i++) {
+			if (!ktf_result_read(rings[cpu], i, t, first, last, copy))
+				continue;
+#ifdef CONFIG_BINARY_PRINTF
+			bstr_printf(buf, MAX_PRINTF, copy->fmt, copy->bin);
+#else
+			strlcpy(buf, copy->text, MAX_PRINTF);
+#endif
+			fn(copy, buf, arg);
+			found++;
+		}
+	}
+out:
+	kfree(buf);
+	kfree(copy);
+	return found;
+}
+
+static void ktf_report_netlink(const struct ktf_result_record *rec,
+			       const char *report, void *arg)
+{
+	struct ktf_test *t = arg;
+
+	if (t->skb) {
+		nla_put_u32(t->skb, KTF_A_STAT, rec->result);
+		nla_put_string(t->skb, KTF_A_FILE, rec->file);
+		nla_put_u32(t->skb, KTF_A_NUM, rec->line);
+		nla_put_string(t->skb, KTF_A_STR, report);
+	}
+	terr("file %s line %d: result %d: %s", rec->file, rec->line,
+	     rec->result, report);
+}
+
+/* Report all failures recorded in the current iteration of a test */
+static void ktf_flush_errors(struct ktf_test *t)
+{
+	unsigned int n = atomic_read(&t->err_pending), found;
+
+	if (!n)
+		return;
+
+	found = ktf_results_for_each(t, t->run_id, t->run_id, ktf_report_netlink, t);
+	if (found < n) {
+		char report[64];
+
+		/* Report them as a failure of their own, so the run fails */
+		snprintf(report, sizeof(report), "%u more failures not recorded", n - found);
+		twarn("%s.%s: %s", t->tclass, t->name, report);
+		if (t->skb) {
+			nla_put_u32(t->skb, KTF_A_STAT, 0);
+			nla_put_string(t->skb, KTF_A_FILE, __FILE__);
+			nla_put_u32(t->skb, KTF_A_NUM, __LINE__);
+			nla_put_string(t->skb, KTF_A_STR, report);
+		}
+	}
+	t->err_cnt += n;
+	atomic_set(&t->err_pending, 0);
+}
+
+static void ktf_report_seq(const struct ktf_result_record *rec,
+			   const char *report, void *arg)
+{
+	seq_printf(arg, "file %s line %d: result %d: %s", rec->file, rec->line,
+		   rec->result, report);
+}
+
+/* The results of a run are copied to t->result when the run is complete,
+ * so that readers get the results of the last completed run even while
+ * the test runs again, without taking run_lock. Runs of a test are serialized
+ * by run_lock, so there is only one writer at a time. The failure records
+ * of the runs are identified by their run ids, and are not affected by runs
+ * in progress either. Called with run_lock held:
+ */
+static void ktf_result_publish(struct ktf_test *t)
+{
+	preempt_disable();
+	write_seqcount_begin(&t->result_seq);
+	t->result.lastrun = t->lastrun;
+	t->result.first_run_id = t->first_run_id;
+	t->result.last_run_id = t->run_id;
+	t->result.err_cnt = t->err_cnt;
+	t->result.stats = t->stats;
+	t->result.bench = t->bench;
+	t->result.tgroup = t->tgroup;
+	write_seqcount_end(&t->result_seq);
+	preempt_enable();
+}
+
+/* Forget the results of earlier runs: Their failure records point to the
+ * file names and formats of the module that ran them, which may be gone.
+ * Called with run_lock held:
+ */
+static void ktf_result_clear(struct ktf_test *t)
+{
+	t->first_run_id = 0;
+	t->err_cnt = 0;
+	preempt_disable();
+	write_seqcount_begin(&t->result_seq);
+	memset(&t->result, 0, sizeof(t->result));
+	write_seqcount_end(&t->result_seq);
+	preempt_enable();
+}
+
+void ktf_test_last_result(struct ktf_test *t, struct ktf_test_result *r)
+{
+	unsigned int seq;
+
+	do {
+		seq = read_seqcount_begin(&t->result_seq);
+		*r = t->result;
+	} while (read_seqcount_retry(&t->result_seq, seq));
+}
+
+void ktf_test_show_errors(struct seq_file *seq, struct ktf_test *t,
+			  const struct ktf_test_result *r)
+{
+	struct timespec now;
+
+	if (r->first_run_id && r->err_cnt) {
+		getnstimeofday(&now);
+		seq_printf(seq, "[%s/%s, %ld seconds ago] ",
+			   t->tclass, t->name, now.tv_sec - r->lastrun.tv_sec);
+		if (ktf_results_for_each(t, r->first_run_id, r->last_run_id,
+					 ktf_report_seq, seq) < r->err_cnt)
+			seq_puts(seq, "(older failures overwritten)");
+		seq_puts(seq, "\n");
+	}
+}
 
 long _ktf_assert(struct ktf_test *self, int result, const char *file,
 		 int line, const char *fmt, ...)
 {
-	int len;
 	va_list ap;
-	char *buf;
-	char bufprefix[256];
-	unsigned long flags;
 
 	if (result) {
-		atomic_inc(&assert_cnt);
+		this_cpu_inc(*self->assert_cnt);
 	} else {
-		flush_assert_cnt(self);
-		buf = kmalloc(MAX_PRINTF, GFP_KERNEL);
-		if (!buf) {
-			terr("file %s line %d: Unable to allocate memory for the error report!",
-			     file, line);
-			goto out;
-		}
 		va_start(ap, fmt);
-		len = vsnprintf(buf, MAX_PRINTF - 1, fmt, ap);
-		buf[len] = 0;
+		ktf_err_record(self, result, file, line, fmt, ap);
 		va_end(ap);
-		if (self->skb) {
-			nla_put_u32(self->skb, KTF_A_STAT, result);
-			nla_put_string(self->skb, KTF_A_FILE, file);
-			nla_put_u32(self->skb, KTF_A_NUM, line);
-			nla_put_string(self->skb, KTF_A_STR, buf);
-		}
-		(void)snprintf(bufprefix, sizeof(bufprefix) - 1,
-				"file %s line %d: result %d: ", file, line,
-				result);
-		terr("%s%s", bufprefix, buf);
-
-		/* Multiple threads may try to update log */
-		spin_lock_irqsave(&assert_lock, flags);
-		(void)strncat(self->log, bufprefix, KTF_MAX_LOG);
-		(void)strncat(self->log, buf, KTF_MAX_LOG);
-		spin_unlock_irqrestore(&assert_lock, flags);
-		kfree(buf);
 	}
-out:
 	return result;
 }
 EXPORT_SYMBOL(_ktf_assert);
 
+/* Registration templates: When a test module is unloaded, the tests it added
+ * via a handle are parked in a template for the handle, keyed by the module
+ * and handle names. Parked tests stay in the registry and in debugfs, but have
+ * no function to run and belong to ktf_parked_handle, which hides them from
+ * queries. When the module is loaded again, each test it adds is rebound to
+ * its parked entry, instead of being allocated and registered anew.
+ * A module with a different srcversion (see MODULE_VERSION()) than the one
+ * that was unloaded starts afresh. Templates are protected by tc_lock:
+ */
+static bool reload_templates = true;
+module_param(reload_templates, bool, 0644);
+MODULE_PARM_DESC(reload_templates, "Keep the tests of unloaded modules for a fast reload (default on)");
+
+#define KTF_BUILD_ID_LEN 32
+
+struct ktf_template {
+	struct list_head list;		/* Linkage for ktf_templates */
+	char module[MODULE_NAME_LEN];
+	char handle[KTF_MAX_KEY];
+	char build_id[KTF_BUILD_ID_LEN];/* srcversion of the module, if any */
+	struct list_head tests;		/* Parked tests, via handle_link */
+};
+
+static LIST_HEAD(ktf_templates);
+
+/* Owner of all parked tests: No id and requiring a context makes them invalid */
+static struct ktf_handle ktf_parked_handle = {
+	.handle_list = LIST_HEAD_INIT(ktf_parked_handle.handle_list),
+	.ctx_type_map = __KTF_MAP_INITIALIZER(ktf_parked_handle, NULL, NULL),
+	.ctx_map = __KTF_MAP_INITIALIZER(ktf_parked_handle, NULL, NULL),
+	.require_context = true,
+	.version = KTF_VERSION_LATEST,
+	.test_list = LIST_HEAD_INIT(ktf_parked_handle.test_list),
+	.name = "ktf_parked_handle",
+};
+
+static const char *ktf_build_id(struct module *mod)
+{
+	return mod->srcversion ? mod->srcversion : "";
+}
+
+/* Remove a test from the registry, called with tc_lock held */
+static void ktf_test_remove(struct ktf_test *t)
+{
+	struct ktf_case *tc = t->tc;
+
+	tlog(T_DEBUG, "ktf: delete test %s.%s", t->tclass, t->name);
+	/* Hold references across the removal, as with iteration */
+	ktf_case_get(tc);
+	ktf_test_get(t);
+	list_del(&t->handle_link);
+	hash_del_rcu(&t->hnode);
+	ktf_registry_changed();
+	ktf_nl_event_test(KTF_EV_TEST_DEL, t);
+	/* removes ref for debugfs */
+	ktf_debugfs_destroy_test(t);
+	/* removes ref for testset map of tests */
+	ktf_map_remove_elem(&tc->tests, &t->kmap);
+	/* This final reference should result in the test being freed */
+	ktf_test_put(t);
+
+	/* If no modules have tests for this test case, we can
+	 * free resources safely.
+	 */
+	if (ktf_case_test_count(tc) == 0) {
+		ktf_debugfs_destroy_testset(tc);
+		ktf_map_remove_elem(&test_cases, &tc->kmap);
+		ktf_nl_event_set(KTF_EV_SET_DEL, tc);
+	}
+	ktf_case_put(tc);
+}
+
+static void ktf_template_free(struct ktf_template *tmpl)
+{
+	struct ktf_test *t, *tmp;
+
+	list_for_each_entry_safe(t, tmp, &tmpl->tests, handle_link)
+		ktf_test_remove(t);
+	list_del(&tmpl->list);
+	kfree(tmpl);
+}
+
+/* Find the template of th, if any. A template from another build of the
+ * module is freed, along with its tests:
+ */
+static struct ktf_template *ktf_template_find(struct ktf_handle *th)
+{
+	struct ktf_template *tmpl;
+
+	if (!th->owner)
+		return NULL;
+	list_for_each_entry(tmpl, &ktf_templates, list) {
+		if (strcmp(tmpl->module, th->owner->name) || strcmp(tmpl->handle, th->name))
+			continue;
+		if (!strcmp(tmpl->build_id, ktf_build_id(th->owner)))
+			return tmpl;
+		tlog(T_INFO, "ktf: %s was rebuilt, dropping its parked tests", tmpl->module);
+		ktf_template_free(tmpl);
+		return NULL;
+	}
+	return NULL;
+}
+
+static struct ktf_template *ktf_template_create(struct ktf_handle *th)
+{
+	struct ktf_template *tmpl = kzalloc(sizeof(*tmpl), GFP_KERNEL);
+
+	if (!tmpl)
+		return NULL;
+	strlcpy(tmpl->module, th->owner->name, sizeof(tmpl->module));
+	strlcpy(tmpl->handle, th->name, sizeof(tmpl->handle));
+	strlcpy(tmpl->build_id, ktf_build_id(th->owner), sizeof(tmpl->build_id));
+	INIT_LIST_HEAD(&tmpl->tests);
+	list_add_tail(&tmpl->list, &ktf_templates);
+	return tmpl;
+}
+
+/* Detach t from the module that added it and park it in tmpl. The names
+ * are switched to ktf's own copies, as the module's go away with it:
+ */
+static void ktf_test_park(struct ktf_test *t, struct ktf_template *tmpl)
+{
+	/* Parked tests are not visible to queries */
+	ktf_registry_changed();
+	ktf_nl_event_test(KTF_EV_TEST_DEL, t);
+	mutex_lock(&t->run_lock);
+	t->fun = NULL;
+	t->handle = &ktf_parked_handle;
+	t->tclass = ktf_case_name(t->tc);
+	t->name = t->kmap.key;
+	ktf_result_clear(t);
+	mutex_unlock(&t->run_lock);
+	t->tmpl = tmpl;
+	list_move_tail(&t->handle_link, &tmpl->tests);
+	tlog(T_DEBUG, "ktf: parked test %s.%s", t->tclass, t->name);
+}
+
+/* Rebind a test parked by an earlier load of the module of th to td.
+ * Called with tc_lock held, returns true if there was such a test:
+ */
+static bool ktf_test_rebind(struct __test_desc *td, struct ktf_handle *th,
+			    int flags, int start, int end)
+{
+	struct ktf_template *tmpl = ktf_template_find(th);
+	struct ktf_test *t;
+
+	if (!tmpl)
+		return false;
+	rcu_read_lock();
+	t = ktf_test_find_rcu(td->tclass, td->name);
+	rcu_read_unlock();
+	if (!t || t->tmpl != tmpl)
+		return false;
+
+	mutex_lock(&t->run_lock);
+	t->tclass = td->tclass;
+	t->name = td->name;
+	t->start = start;
+	t->end = end;
+	t->flags = flags;
+	t->handle = th;
+	t->fun = td->fun;
+	t->timeout = 0;
+	ktf_result_clear(t);
+	mutex_unlock(&t->run_lock);
+	t->tmpl = NULL;
+	list_move_tail(&t->handle_link, &th->test_list);
+	ktf_registry_changed();
+	ktf_nl_event_test(KTF_EV_TEST_ADD, t);
+	if (list_empty(&tmpl->tests))
+		ktf_template_free(tmpl);
+
+	tlog(T_LIST, "Rebound test \"%s.%s\" start = %d, end = %d\n",
+	     td->tclass, td->name, start, end);
+	return true;
+}
+
+/* Remove all parked tests, when ktf itself is unloaded */
+static void ktf_templates_cleanup(void)
+{
+	struct ktf_template *tmpl, *tmp;
+
+	list_for_each_entry_safe(tmpl, tmp, &ktf_templates, list)
+		ktf_template_free(tmpl);
+}
+
 /* Add a test to a testcase:
  * Tests are represented by ktf_test objects that are linked into
  * a per-test case map TCase:tests map.
  */
 void  _ktf_add_test(struct __test_desc td, struct ktf_handle *th,
-		    int _signal, int allowed_exit_value,
+		    int flags, int allowed_exit_value,
 		    int start, int end)
 {
 	struct ktf_case *tc = NULL;
 	struct ktf_test *t;
-	char *log;
 
 	if (ktf_handle_version_check(th))
 		return;
 
-	log = kzalloc(KTF_MAX_LOG, GFP_KERNEL);
-	if (!log)
+	mutex_lock(&tc_lock);
+	if (ktf_test_rebind(&td, th, flags, start, end)) {
+		mutex_unlock(&tc_lock);
 		return;
+	}
+	mutex_unlock(&tc_lock);
 
-	t = kzalloc(sizeof(*t), GFP_KERNEL);
-	if (!t) {
-		kfree(log);
+	t = kmem_cache_zalloc(ktf_test_cache, GFP_KERNEL);
+	if (!t)
+		return;
+	t->assert_cnt = alloc_percpu(unsigned long);
+	if (!t->assert_cnt) {
+		kmem_cache_free(ktf_test_cache, t);
 		return;
 	}
 	t->tclass = td.tclass;
@@ -252,7 +839,10 @@ void  _ktf_add_test(struct __test_desc td, struct ktf_handle *th,
 	t->start = start;
 	t->end = end;
 	t->handle = th;
-	t->log = log;
+	t->flags = flags;
+	mutex_init(&t->run_lock);
+	seqcount_init(&t->result_seq);
+	atomic_set(&t->hung, 0);
 
 	mutex_lock(&tc_lock);
 	tc = ktf_case_find_create(td.tclass);
@@ -263,12 +853,17 @@ void  _ktf_add_test(struct __test_desc td, struct ktf_handle *th,
 		if (tc)
 			ktf_case_put(tc);
 		mutex_unlock(&tc_lock);
-		kfree(log);
-		kfree(t);
+		free_percpu(t->assert_cnt);
+		kmem_cache_free(ktf_test_cache, t);
 		return;
 	}
 
+	t->tc = tc;
+	list_add_tail(&t->handle_link, &th->test_list);
+	hash_add_rcu(test_index, &t->hnode, ktf_test_hash(td.tclass, t->kmap.key));
 	ktf_debugfs_create_test(t);
+	ktf_registry_changed();
+	ktf_nl_event_test(KTF_EV_TEST_ADD, t);
 
 	tlog(T_LIST, "Added test \"%s.%s\" start = %d, end = %d\n",
 	     td.tclass, td.name, start, end);
@@ -284,17 +879,184 @@ void  _ktf_add_test(struct __test_desc td, struct ktf_handle *th,
 }
 EXPORT_SYMBOL(_ktf_add_test);
 
+void _ktf_set_timeout(struct __test_desc td, unsigned int timeout_ms)
+{
+	struct ktf_test *t = ktf_test_find(td.tclass, td.name);
+
+	if (!t) {
+		terr("No test %s.%s to set a timeout for", td.tclass, td.name);
+		return;
+	}
+	WRITE_ONCE(t->timeout, timeout_ms);
+	ktf_test_put(t);
+}
+EXPORT_SYMBOL(_ktf_set_timeout);
+
+static int ktf_u64_cmp(const void *a, const void *b)
+{
+	u64 x = *(const u64 *)a;
+	u64 y = *(const u64 *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Sorts the n samples to find min, median, 99th percentile and max */
+static void ktf_bench_stats(u64 *samples, u32 n, __u64 *min, __u64 *median,
+			    __u64 *p99, __u64 *max)
+{
+	sort(samples, n, sizeof(*samples), ktf_u64_cmp, NULL);
+	*min = samples[0];
+	*median = samples[n / 2];
+	*p99 = samples[min_t(u32, div_u64((u64)n * 99, 100), n - 1)];
+	*max = samples[n - 1];
+}
+
+/* Run the iterations of a benchmark, each timed separately. Assertions
+ * are only flushed after the last iteration, to keep flushing out
+ * of the way of the measurements:
+ */
+static void ktf_run_bench(struct ktf_test *t, struct ktf_context *ctx, u32 value)
+{
+	struct ktf_bench_data *bd = &t->bench;
+	u32 i, n = t->end - t->start;
+	unsigned long flags = 0;
+	u64 *ns, *cycles;
+	cycles_t c0;
+	u64 t0;
+
+	if (!n)
+		return;
+	ns = vmalloc(n * sizeof(*ns));
+	cycles = vmalloc(n * sizeof(*cycles));
+	if (!ns || !cycles) {
+		terr("Unable to allocate samples for %u iterations of benchmark %s.%s",
+		     n, t->tclass, t->name);
+		goto out;
+	}
+
+	for (i = 0; i < n; i++) {
+		if (t->flags & KTF_TEST_NOIRQ)
+			local_irq_save(flags);
+		else if (t->flags & KTF_TEST_NOPREEMPT)
+			preempt_disable();
+		c0 = get_cycles();
+		t0 = ktime_get_ns();
+		t->fun(t, ctx, t->start + i, value);
+		ns[i] = ktime_get_ns() - t0;
+		cycles[i] = get_cycles() - c0;
+		if (t->flags & KTF_TEST_NOIRQ)
+			local_irq_restore(flags);
+		else if (t->flags & KTF_TEST_NOPREEMPT)
+			preempt_enable();
+	}
+
+	bd->iterations = n;
+	ktf_bench_stats(ns, n, &bd->min_ns, &bd->median_ns, &bd->p99_ns, &bd->max_ns);
+	ktf_bench_stats(cycles, n, &bd->min_cycles, &bd->median_cycles,
+			&bd->p99_cycles, &bd->max_cycles);
+out:
+	vfree(cycles);
+	vfree(ns);
+}
+
+/* Resource usage at the start of a run, see ktf_stats_end() */
+struct ktf_stats_start {
+	u64 ns;
+	unsigned long nvcsw;
+	unsigned long nivcsw;
+	unsigned long mem_alloc;
+	unsigned long mem_freed;
+	bool mem;
+};
+
+static void ktf_stats_start(struct ktf_test_stats *st, struct ktf_stats_start *s)
+{
+	memset(st, 0, sizeof(*st));
+	st->cpu = raw_smp_processor_id();
+	s->nvcsw = current->nvcsw;
+	s->nivcsw = current->nivcsw;
+	s->mem = ktf_cov_mem_bytes(&s->mem_alloc, &s->mem_freed);
+	s->ns = ktime_get_ns();
+}
+
+static void ktf_stats_end(struct ktf_test_stats *st, struct ktf_stats_start *s)
+{
+	unsigned long alloc, freed;
+
+	st->duration_ns = ktime_get_ns() - s->ns;
+	if (raw_smp_processor_id() != st->cpu)
+		st->flags |= KTF_STATS_MIGRATED;
+	st->nvcsw = current->nvcsw - s->nvcsw;
+	st->nivcsw = current->nivcsw - s->nivcsw;
+	if (s->mem && ktf_cov_mem_bytes(&alloc, &freed)) {
+		st->flags |= KTF_STATS_MEM;
+		st->mem_alloc = alloc - s->mem_alloc;
+		st->mem_freed = freed - s->mem_freed;
+	}
+}
+
+/* Report the result of a point of a sweep after its assertions and failures */
+static void ktf_sweep_point_put(struct ktf_test *t, int point, u64 ns,
+				u32 assertions, u32 failures)
+{
+	struct ktf_sweep_point sp = {
+		.point = point,
+		.assertions = assertions,
+		.failures = failures,
+		.duration_ns = ns,
+	};
+
+	if (t->skb)
+		nla_put(t->skb, KTF_A_POINT, sizeof(sp), &sp);
+	tlog(T_DEBUG, "%s.%s point %d: %u assertions, %u failed, %llu ns",
+	     t->tclass, t->name, point, assertions, failures, ns);
+}
+
 void ktf_run_hook(struct sk_buff *skb, struct ktf_context *ctx,
 		  struct ktf_test *t, u32 value,
-		void *oob_data, size_t oob_data_sz)
+		void *oob_data, size_t oob_data_sz,
+		struct ktf_run_result *res)
 {
+	const s32 *points = NULL;
+	struct ktf_stats_start ss;
+	unsigned long a0 = 0;
+	unsigned int e0 = 0;
+	u32 k, n;
+	u64 t0 = 0;
 	int i;
 
-	t->log[0] = '\0';
+	/* A sweep may run the points requested by user space instead of its range */
+	n = t->end > t->start ? t->end - t->start : 0;
+	if ((t->flags & KTF_TEST_SWEEP) && res && res->nr_points) {
+		points = res->points;
+		n = res->nr_points;
+	}
+
+	/* The per test state below is shared by all runs of the test */
+	ktf_results_alloc();
+	mutex_lock(&t->run_lock);
+	/* A parked test (see ktf_test_park()) has nothing to run */
+	if (!t->fun) {
+		mutex_unlock(&t->run_lock);
+		return;
+	}
+	/* Runs in the same context are serialized too, runs in different
+	 * contexts are not. The context lock nests inside run_lock:
+	 */
+	if (ctx)
+		mutex_lock(&ctx->run_lock);
+	t->first_run_id = 0;
+	t->err_cnt = 0;
 	t->skb = skb;
 	t->data = oob_data;
 	t->data_sz = oob_data_sz;
-	for (i = t->start; i < t->end; i++) {
+	memset(&t->bench, 0, sizeof(t->bench));
+	memset(&t->tgroup, 0, sizeof(t->tgroup));
+	if (res && res->want_cov)
+		res->cov = ktf_cov_snapshot_take();
+	ktf_stats_start(&t->stats, &ss);
+	for (k = 0; k < n; k++) {
+		i = points ? points[k] : t->start + k;
 		if (!ctx && t->handle->require_context) {
 			terr("Test %s.%s requires a context, but none configured!",
 			     t->tclass, t->name);
@@ -312,62 +1074,127 @@ void ktf_run_hook(struct sk_buff *skb, struct ktf_context *ctx,
 			printk("[%d:%d]\n", t->start, t->end);
 		);
 		getnstimeofday(&t->lastrun);
-		t->fun(t, ctx, i, value);
+		t->run_id = atomic64_inc_return(&ktf_run_seq);
+		if (!t->first_run_id)
+			t->first_run_id = t->run_id;
+		if (t->flags & KTF_TEST_BENCH) {
+			/* All iterations in one go */
+			ktf_run_bench(t, ctx, value);
+			k = n;
+		} else if (t->flags & KTF_TEST_SWEEP) {
+			a0 = t->assert_flushed;
+			e0 = t->err_cnt;
+			t0 = ktime_get_ns();
+			t->fun(t, ctx, i, value);
+			t0 = ktime_get_ns() - t0;
+		} else {
+			t->fun(t, ctx, i, value);
+		}
 		flush_assert_cnt(t);
+		ktf_flush_errors(t);
+		if (t->flags & KTF_TEST_SWEEP)
+			ktf_sweep_point_put(t, i, t0, t->assert_flushed - a0, t->err_cnt - e0);
+	}
+	ktf_stats_end(&t->stats, &ss);
+	if (res) {
+		res->stats = true;
+		res->stats_data = t->stats;
+	}
+	if (res && (t->flags & KTF_TEST_BENCH) && t->bench.iterations) {
+		res->bench = true;
+		res->bench_data = t->bench;
 	}
+	if (res && t->tgroup.threads) {
+		res->tgroup = true;
+		res->tgroup_data = t->tgroup;
+	}
+	if (res && res->cov)
+		ktf_cov_snapshot_delta(res->cov);
+	ktf_result_publish(t);
 	t->handle->current_test = NULL;
+	t->skb = NULL;
+	if (ctx)
+		mutex_unlock(&ctx->run_lock);
+	mutex_unlock(&t->run_lock);
+}
+
+/* All runs of a test share its run state, so to run a test in several
+ * contexts at the same time, each run gets an instance of its own: A copy of
+ * the test with fresh run state, which is not in the registry and is freed
+ * when the run is done. The failure records of an instance are identified
+ * by the instance and the run ids, so they don't mix with those of the test.
+ * The results are reported via @skb and @res only, not published as the last
+ * results of @t:
+ */
+void ktf_run_instance(struct sk_buff *skb, struct ktf_context *ctx,
+		      struct ktf_test *t, u32 value,
+		      void *oob_data, size_t oob_data_sz,
+		      struct ktf_run_result *res)
+{
+	struct ktf_test *it = kmem_cache_alloc(ktf_test_cache, GFP_KERNEL);
+	unsigned long __percpu *assert_cnt = alloc_percpu(unsigned long);
+
+	if (!it || !assert_cnt) {
+		terr("Unable to allocate an instance of test %s.%s", t->tclass, t->name);
+		free_percpu(assert_cnt);
+		if (it)
+			kmem_cache_free(ktf_test_cache, it);
+		return;
+	}
+
+	/* Parking a test waits for its runs via run_lock (see ktf_test_park()),
+	 * which the instance does not hold, so hold on to the module instead:
+	 */
+	mutex_lock(&t->run_lock);
+	memcpy(it, t, sizeof(*it));
+	if (it->fun && !try_module_get(it->handle->owner))
+		it->fun = NULL;
+	mutex_unlock(&t->run_lock);
+	if (!it->fun)
+		goto out;
+
+	INIT_HLIST_NODE(&it->hnode);
+	INIT_LIST_HEAD(&it->handle_link);
+	memset(&it->debugfs, 0, sizeof(it->debugfs));
+	mutex_init(&it->run_lock);
+	it->assert_cnt = assert_cnt;
+	it->assert_flushed = 0;
+	atomic_set(&it->err_pending, 0);
+	it->tmpl = NULL;
+	seqcount_init(&it->result_seq);
+
+	ktf_run_hook(skb, ctx, it, value, oob_data, oob_data_sz, res);
+	module_put(it->handle->owner);
+out:
+	free_percpu(assert_cnt);
+	kmem_cache_free(ktf_test_cache, it);
 }
 
 /* Clean up all tests associated with a ktf_handle */
 
 void ktf_test_cleanup(struct ktf_handle *th)
 {
-	struct ktf_test *t;
-	struct ktf_case *tc;
+	struct ktf_template *tmpl = NULL;
+	struct ktf_test *t, *tmp;
 
 	/* Clean up tests which are associated with this handle.
 	 * It's possible multiple modules contribute tests to a test case,
-	 * so we can't just do this on a per-testcase basis.
+	 * so we can't just do this on a per-testcase basis, but each handle
+	 * keeps a list of the tests it added, so we only visit those.
 	 */
 	mutex_lock(&tc_lock);
-
-	tc = ktf_map_first_entry(&test_cases, struct ktf_case, kmap);
-	while (tc) {
-		/* FIXME - this is inefficient. */
-		t = ktf_map_first_entry(&tc->tests, struct ktf_test, kmap);
-		while (t) {
-			if (t->handle == th) {
-				tlog(T_DEBUG, "ktf: delete test %s.%s",
-				     t->tclass, t->name);
-				/* removes ref for debugfs */
-				ktf_debugfs_destroy_test(t);
-				/* removes ref for testset map of tests */
-				ktf_map_remove_elem(&tc->tests, &t->kmap);
-				/* now remove our reference which we get
-				 * from ktf_map_[first|next]_entry().
-				 * This final reference should result in
-				 * the test being freed.
-				 */
-				ktf_test_put(t);
-				/* Need to reset to root */
-				t = ktf_map_first_entry(&tc->tests,
-							struct ktf_test, kmap);
-			} else {
-				t = ktf_map_next_entry(t, kmap);
-			}
-		}
-		/* If no modules have tests for this test case, we can
-		 * free resources safely.
-		 */
-		if (ktf_case_test_count(tc) == 0) {
-			ktf_debugfs_destroy_testset(tc);
-			ktf_map_remove_elem(&test_cases, &tc->kmap);
-			ktf_case_put(tc);
-			tc = ktf_map_first_entry(&test_cases, struct ktf_case,
-						 kmap);
-		} else {
-			tc = ktf_map_next_entry(tc, kmap);
-		}
+	if (reload_templates && th->owner && !list_empty(&th->test_list)) {
+		/* Tests parked by the previous load and not added again are gone */
+		tmpl = ktf_template_find(th);
+		if (tmpl)
+			ktf_template_free(tmpl);
+		tmpl = ktf_template_create(th);
+	}
+	list_for_each_entry_safe(t, tmp, &th->test_list, handle_link) {
+		if (tmpl)
+			ktf_test_park(t, tmpl);
+		else
+			ktf_test_remove(t);
 	}
 	mutex_unlock(&tc_lock);
 }
@@ -382,6 +1209,7 @@ int ktf_cleanup(void)
 
 	/* Unloading of dependencies means we should have no testcases/tests. */
 	mutex_lock(&tc_lock);
+	ktf_templates_cleanup();
 	ktf_for_each_testcase(tc) {
 		twarn("(memory leak) test set %s still active at unload!", ktf_case_name(tc));
 		ktf_testcase_for_each_test(t, tc) {
@@ -392,5 +1220,7 @@ int ktf_cleanup(void)
 	}
 	ktf_debugfs_cleanup();
 	mutex_unlock(&tc_lock);
+	ktf_results_free();
+	ktf_registry_cleanup();
 	return 0;
 }
@@ -11,6 +11,10 @@
 #define KTF_TEST_H
 
 #include <net/netlink.h>
+#include <linux/module.h>
+#include <linux/mutex.h>
+#include <linux/seqlock.h>
+#include <linux/list.h>
 #include <linux/version.h>
 #include "ktf_map.h"
 #include "ktf_unlproto.h"
@@ -22,6 +26,8 @@
 struct ktf_context;
 
 struct ktf_test;
+struct ktf_template;
+struct seq_file;
 
 typedef void (*ktf_test_fun) (struct ktf_test *, struct ktf_context* tdev, int, u32);
 
@@ -32,22 +38,58 @@ struct ktf_debugfs {
         struct dentry *debugfs_run_test;
 };
 
+/* The results of the last completed run of a test, see ktf_test_last_result() */
+struct ktf_test_result {
+	struct timespec lastrun; /* Start of the last iteration */
+	u64 first_run_id; /* Ids of the first and last iteration, 0 if never run */
+	u64 last_run_id;
+	unsigned int err_cnt; /* Failed assertions */
+	struct ktf_test_stats stats;
+	struct ktf_bench_data bench;
+	struct ktf_tgroup_data tgroup;
+};
+
 struct ktf_test {
 	struct ktf_map_elem kmap; /* linkage for test case list */
+	struct hlist_node hnode; /* linkage for the global "set.test" index */
+	struct list_head handle_link; /* linkage for the test_list of the owning handle */
+	struct ktf_case *tc; /* test case this test belongs to */
 	const char* tclass; /* test class name */
 	const char* name; /* Name of the test */
 	ktf_test_fun fun;
 	int start; /* Start and end value to argument to fun */
 	int end;   /* Defines number of iterations */
 	struct sk_buff *skb; /* sk_buff for recording assertion results */
-	char *log; /* per-test log */
 	void *data; /* Test specific out-of-band data */
 	size_t data_sz; /* Size of the data element, if set */
 	struct timespec lastrun; /* last time test was run */
 	struct ktf_debugfs debugfs; /* debugfs info for test */
 	struct ktf_handle *handle; /* Handler for owning module */
+	u32 flags; /* KTF_TEST_* flags given when the test was added */
+	struct mutex run_lock; /* Serializes runs of this test */
+	unsigned long __percpu *assert_cnt; /* Passed assertions */
+	unsigned long assert_flushed; /* Sum of assert_cnt when last reported */
+	u64 run_id; /* Id of the current or last iteration run */
+	u64 first_run_id; /* Id of the first iteration of the current or last run */
+	atomic_t err_pending; /* Failed assertions not yet reported */
+	unsigned int err_cnt; /* Failed assertions reported in the last run */
+	struct ktf_bench_data bench; /* Results of the last run, if a benchmark */
+	struct ktf_test_stats stats; /* Resources used by the last run */
+	struct ktf_tgroup_data tgroup; /* Last thread group run by the test, if any */
+	struct ktf_template *tmpl; /* Template the test is parked in, if unloaded */
+	seqcount_t result_seq; /* Bumped while result is updated */
+	struct ktf_test_result result; /* Published at the end of each run */
+	unsigned int timeout; /* Max run time in ms from user space, 0 for the default */
+	atomic_t hung;	      /* Runs that timed out and are still running, see ktf_run_watched() */
 };
 
+/* Test flags */
+#define KTF_TEST_PARALLEL	0x1 /* Safe to run concurrently with other parallel tests */
+#define KTF_TEST_BENCH		0x2 /* Benchmark: time each iteration */
+#define KTF_TEST_NOPREEMPT	0x4 /* Benchmark iterations run with preemption disabled */
+#define KTF_TEST_NOIRQ		0x8 /* Benchmark iterations run with interrupts disabled */
+#define KTF_TEST_SWEEP		0x10 /* Each iteration is reported as a separate point */
+
 struct ktf_case {
 	struct ktf_map_elem kmap; /* Linkage for ktf_map */
 	struct ktf_map tests; /* List of tests to run */
@@ -76,16 +118,58 @@ void ktf_case_put(struct ktf_case *);
 
 int ktf_version_check(u64 version);
 
+struct ktf_cov_snapshot;
+
+/* Results of a test run in addition to the assertions, for the RUN response */
+struct ktf_run_result {
+	bool want_cov;			/* Collect the functions called */
+	const s32 *points;		/* Points to run a sweep test for, if nr_points */
+	u32 nr_points;
+	struct ktf_cov_snapshot *cov;	/* Functions called, if want_cov and available */
+	bool bench;			/* Set if bench holds benchmark results */
+	struct ktf_bench_data bench_data;
+	bool stats;			/* Set if the test was run */
+	struct ktf_test_stats stats_data;
+	bool tgroup;			/* Set if the test ran a thread group */
+	struct ktf_tgroup_data tgroup_data;
+};
+
+/* Run test t, and fill in res if set */
 void ktf_run_hook(struct sk_buff *skb, struct ktf_context *ctx,
 		struct ktf_test *t, u32 value,
-		void *oob_data, size_t oob_data_sz);
+		void *oob_data, size_t oob_data_sz,
+		struct ktf_run_result *res);
+/* Run test t as a separate instance, which may run concurrently with other
+ * runs of t, see ktf_run_hook()
+ */
+void ktf_run_instance(struct sk_buff *skb, struct ktf_context *ctx,
+		      struct ktf_test *t, u32 value,
+		      void *oob_data, size_t oob_data_sz,
+		      struct ktf_run_result *res);
 void flush_assert_cnt(struct ktf_test *self);
 
+/* Get a consistent copy of the results of the last completed run of t,
+ * without waiting for a run in progress:
+ */
+void ktf_test_last_result(struct ktf_test *t, struct ktf_test_result *r);
+
+/* Show the failures of the run of t with results r that are still recorded */
+void ktf_test_show_errors(struct seq_file *seq, struct ktf_test *t,
+			  const struct ktf_test_result *r);
+
 /* Representation of a test case (a group of tests) */
 struct ktf_case;
 
 struct ktf_case *ktf_case_find(const char *name);
 
+/* Direct lookup of test "setname.testname" via the global test index.
+ * ktf_test_find returns the test with refcount increased, the _rcu version
+ * must be called under rcu_read_lock() and returns the test without a
+ * reference.
+ */
+struct ktf_test *ktf_test_find(const char *setname, const char *testname);
+struct ktf_test *ktf_test_find_rcu(const char *setname, const char *testname);
+
 /* Each module client of the test framework is required to
  * declare at least one ktf_handle via the macro
  * DECLARE_KTF_HANDLE (below)
@@ -100,6 +184,22 @@ struct ktf_handle *ktf_handle_find(int hid);
 /* Called upon ktf unload to clean up test cases */
 int ktf_cleanup(void);
 
+/* The registry generation changes whenever tests or contexts come or go,
+ * or the configuration state of a context changes, to allow user space to
+ * tell whether a cached copy of the QUERY response is still valid.
+ * The generation starts from a load specific value, so that generations
+ * from different loads of ktf do not compare equal.
+ * ktf_registry_init() also sets up the caches tests and test cases are
+ * allocated from, which ktf_registry_cleanup() destroys.
+ */
+int ktf_registry_init(void);
+void ktf_registry_cleanup(void);
+void ktf_registry_changed(void);
+u64 ktf_registry_generation(void);
+
+/* Notify event listeners of the tests of a handle that got a new handle ID */
+void ktf_registry_handle_changed(struct ktf_handle *th);
+
 /* The list of handles that have contexts associated with them */
 extern struct list_head context_handles;
 
@@ -132,11 +232,15 @@ void ktf_test_put(struct ktf_test *t);
 #define ktf_add_loop_test(td,s,e)				\
 	_ktf_add_test(td##_setup, &__test_handle, 0,0,(s),(e))
 
+/* Add a test function with KTF_TEST_* flags to a test case (macro version) */
+#define ktf_add_loop_test_flags(td,s,e,f)			\
+	_ktf_add_test(td##_setup, &__test_handle, (f),0,(s),(e))
+
 /* Add a test function to a test case
   (function version -- use this when the macro won't work
 */
 void _ktf_add_test(struct __test_desc td, struct ktf_handle *th,
-		int _signal, int allowed_exit_value, int start, int end);
+		int flags, int allowed_exit_value, int start, int end);
 
 /* Internal function to mark the start of a test function */
 void ktf_fn_start (const char *fname, const char *file, int line);
@@ -151,6 +255,48 @@ void ktf_fn_start (const char *fname, const char *file, int line);
 #define ADD_LOOP_TEST(__testname, from, to)			\
 	ktf_add_loop_test(__testname, from, to)
 
+/* Add a test that is safe to run concurrently with other such tests.
+ * Parallel tests may be distributed across CPUs when
+ * user space asks for more than one job:
+ */
+#define ADD_PARALLEL_TEST(__testname)\
+	ktf_add_loop_test_flags(__testname, 0, 1, KTF_TEST_PARALLEL)
+
+#define ADD_PARALLEL_LOOP_TEST(__testname, from, to)		\
+	ktf_add_loop_test_flags(__testname, from, to, KTF_TEST_PARALLEL)
+
+/* Add a benchmark created with BENCH(): The body is run the given number of
+ * times, each iteration timed on it's own, and the min, median, 99th percentile
+ * and max iteration times are reported. With the _NOPREEMPT and _NOIRQ versions
+ * each iteration runs with preemption or interrupts disabled, and must not sleep:
+ */
+#define ADD_BENCH(__testname, iterations)		\
+	ktf_add_loop_test_flags(__testname, 0, iterations, KTF_TEST_BENCH)
+
+#define ADD_BENCH_NOPREEMPT(__testname, iterations)		\
+	ktf_add_loop_test_flags(__testname, 0, iterations,	\
+				KTF_TEST_BENCH | KTF_TEST_NOPREEMPT)
+
+#define ADD_BENCH_NOIRQ(__testname, iterations)		\
+	ktf_add_loop_test_flags(__testname, 0, iterations,	\
+				KTF_TEST_BENCH | KTF_TEST_NOIRQ)
+
+/* Add a sweep over the values of _i in [from, to): Like a loop test, but the
+ * assertion counts, failures and run time of each point are reported
+ * separately. User space may pass a list of points to run instead:
+ */
+#define ADD_SWEEP_TEST(__testname, from, to)			\
+	ktf_add_loop_test_flags(__testname, from, to, KTF_TEST_SWEEP)
+
+/* Set the max time in ms a run of a test added with one of the ADD_ macros
+ * above may take when run from user space, before it is reported as timed out.
+ * A timeout given by the RUN request takes precedence:
+ */
+#define SET_TEST_TIMEOUT(__testname, ms)		\
+	_ktf_set_timeout(__testname##_setup, ms)
+
+void _ktf_set_timeout(struct __test_desc td, unsigned int timeout_ms);
+
 /* Remove a test previously added with ADD_TEST */
 #define DEL_TEST(__testname)\
 	ktf_del_test(__testname)
@@ -183,8 +329,18 @@ struct ktf_handle {
 	bool require_context;	      /* If set, tests are only valid if a context is provided */
 	u64 version;		      /* version assoc. with handle */
 	struct ktf_test *current_test;/* Current test running */
+	struct list_head test_list;   /* Tests added via this handle (protected by tc_lock) */
+	const char *name;	      /* Name of the handle variable, and */
+	struct module *owner;	      /* ..the module declaring it, to find its template */
 };
 
+/* Remove the tests added via th. If th belongs to a module, its tests are
+ * parked instead, in a registration template for the handle, and are hidden
+ * and cannot run until the module adds them again. This keeps reloading the
+ * same test module cheap, as the tests keep their registry and debugfs
+ * entries. Tests the module does not add again are removed when it is
+ * unloaded the next time, or if it is loaded with a different srcversion:
+ */
 void ktf_test_cleanup(struct ktf_handle *th);
 void ktf_handle_cleanup_check(struct ktf_handle *handle);
 void ktf_cleanup_check(void);
@@ -197,6 +353,9 @@ void ktf_cleanup_check(void);
 		.id = 0, \
 		.require_context = __need_ctx, \
 		.version = __version, \
+		.test_list = LIST_HEAD_INIT(__test_handle.test_list), \
+		.name = #__test_handle, \
+		.owner = THIS_MODULE, \
 	};
 
 #define	KTF_HANDLE_INIT(__test_handle)	\
@@ -229,6 +388,11 @@ void ktf_cleanup_check(void);
 	static void __testname(struct ktf_test *self, struct ktf_context* ctx, \
 			int _i, u32 _value)
 
+/* Start a benchmark with BENCH(suite_name,unit_name): The body is
+ * a single iteration, with the iteration number available as _i.
+ */
+#define BENCH(__testsuite, __testname) TEST(__testsuite, __testname)
+
 /* Start a unit test using a fixture
  * NB! Note the intentionally missing start parenthesis on DECLARE_F!
  *
@@ -0,0 +1,147 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (c) 2019, Oracle and/or its affiliates. All rights reserved.
+ *
+ * ktf_tgroup.c: Groups of CPU bound test threads released together,
+ *   for measuring the scalability of the code under test
+ */
+#include <linux/delay.h>
+#include <linux/kthread.h>
+#include <linux/math64.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+#include "ktf.h"
+
+static void ktf_tgroup_put(struct ktf_tgroup *tg)
+{
+	if (atomic_dec_and_test(&tg->running))
+		complete(&tg->done);
+}
+
+static int ktf_tgroup_thread(void *data)
+{
+	struct ktf_tgroup_thread *th = data;
+	struct ktf_tgroup *tg = th->tg;
+	struct ktf_test_state *s = &tg->state;
+	int go;
+	u64 t0;
+
+	/* Threads may share a CPU, so let the others get to the barrier too */
+	atomic_inc(&tg->ready);
+	while (!(go = smp_load_acquire(&tg->go))) {
+		cpu_relax();
+		cond_resched();
+	}
+
+	if (go > 0) {
+		t0 = ktime_get_ns();
+		tg->func(th, s->self, s->ctx, s->iter, s->value);
+		th->end_ns = ktime_get_ns();
+		th->duration_ns = th->end_ns - t0;
+	}
+	ktf_tgroup_put(tg);
+	return 0;
+}
+
+/* Aggregate the per thread results of a completed run into tg->result */
+static void ktf_tgroup_result(struct ktf_tgroup *tg, unsigned int ncpus)
+{
+	struct ktf_tgroup_data *r = &tg->result;
+	struct ktf_tgroup_thread *th;
+	u64 end_ns = tg->start_ns;
+	unsigned int i;
+
+	memset(r, 0, sizeof(*r));
+	r->threads = tg->nr_threads;
+	r->cpus = ncpus;
+	r->min_ns = r->min_ops = U64_MAX;
+	for (i = 0; i < tg->nr_threads; i++) {
+		th = &tg->threads[i];
+		r->ops += th->ops;
+		end_ns = max(end_ns, th->end_ns);
+		r->min_ns = min(r->min_ns, th->duration_ns);
+		r->max_ns = max(r->max_ns, th->duration_ns);
+		r->min_ops = min(r->min_ops, th->ops);
+		r->max_ops = max(r->max_ops, th->ops);
+	}
+	r->duration_ns = end_ns - tg->start_ns;
+	if (!r->duration_ns)
+		return;
+	if (r->ops <= U64_MAX / NSEC_PER_SEC)
+		r->ops_per_sec = div64_u64(r->ops * NSEC_PER_SEC, r->duration_ns);
+	else
+		r->ops_per_sec = div64_u64(r->ops, max_t(u64, 1, div64_u64(r->duration_ns,
+									  NSEC_PER_MSEC))) * MSEC_PER_SEC;
+}
+
+int ktf_tgroup_run(struct ktf_tgroup *tg, const struct cpumask *cpus)
+{
+	struct ktf_tgroup_thread *th;
+	struct task_struct *task;
+	unsigned int i, created = 0, ncpus = 0;
+	int cpu = -1, ret = 0;
+
+	if (!cpus)
+		cpus = cpu_online_mask;
+	if (!tg->nr_threads || !cpumask_intersects(cpus, cpu_online_mask))
+		return -EINVAL;
+
+	ktf_tgroup_cleanup(tg);
+	tg->threads = kcalloc(tg->nr_threads, sizeof(*tg->threads), GFP_KERNEL);
+	if (!tg->threads)
+		return -ENOMEM;
+	atomic_set(&tg->ready, 0);
+	atomic_set(&tg->running, 1);
+	init_completion(&tg->done);
+	tg->go = 0;
+
+	for (i = 0; i < tg->nr_threads; i++) {
+		cpu = cpumask_next_and(cpu, cpus, cpu_online_mask);
+		if (cpu >= nr_cpu_ids)
+			cpu = cpumask_next_and(-1, cpus, cpu_online_mask);
+		else if (ncpus == i)
+			ncpus++;
+		th = &tg->threads[i];
+		th->tg = tg;
+		th->index = i;
+		th->cpu = cpu;
+		task = kthread_create(ktf_tgroup_thread, th, "%s/%u", tg->name, i);
+		if (IS_ERR(task)) {
+			ret = PTR_ERR(task);
+			break;
+		}
+		kthread_bind(task, cpu);
+		atomic_inc(&tg->running);
+		wake_up_process(task);
+		created++;
+	}
+
+	if (ret) {
+		terr("Failed to create thread %u of group %s: %d", created, tg->name, ret);
+		smp_store_release(&tg->go, -1);
+	} else {
+		while (atomic_read(&tg->ready) < created)
+			usleep_range(10, 100);
+		tg->start_ns = ktime_get_ns();
+		smp_store_release(&tg->go, 1);
+	}
+	ktf_tgroup_put(tg);
+	wait_for_completion(&tg->done);
+	if (ret)
+		return ret;
+
+	ktf_tgroup_result(tg, ncpus);
+	if (tg->state.self)
+		tg->state.self->tgroup = tg->result;
+	tlog(T_DEBUG, "Group %s: %u threads, %llu ops in %llu ns", tg->name,
+	     tg->result.threads, tg->result.ops, tg->result.duration_ns);
+	return 0;
+}
+EXPORT_SYMBOL(ktf_tgroup_run);
+
+void ktf_tgroup_cleanup(struct ktf_tgroup *tg)
+{
+	kfree(tg->threads);
+	tg->threads = NULL;
+}
+EXPORT_SYMBOL(ktf_tgroup_cleanup);
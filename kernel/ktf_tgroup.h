@@ -0,0 +1,58 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (c) 2019, Oracle and/or its affiliates. All rights reserved.
+ *
+ * ktf_tgroup.h: Groups of CPU bound test threads released together,
+ *   for measuring the scalability of the code under test
+ */
+#ifndef _KTF_TGROUP_H
+#define _KTF_TGROUP_H
+
+#include <linux/atomic.h>
+#include <linux/completion.h>
+#include <linux/cpumask.h>
+#include "ktf_test.h"
+
+struct ktf_tgroup;
+struct ktf_tgroup_thread;
+
+typedef void (*ktf_tgroup_fun)(struct ktf_tgroup_thread *thread, struct ktf_test *self,
+			       struct ktf_context *ctx, int _i, u32 _value);
+
+struct ktf_tgroup_thread {
+	struct ktf_tgroup *tg;	   /* Owning group */
+	unsigned int index;	   /* Index of the thread within the group */
+	int cpu;		   /* CPU the thread is bound to */
+	u64 ops;		   /* Operations counted by the thread function */
+	u64 end_ns;		   /* Time the thread function returned */
+	u64 duration_ns;	   /* Run time of the thread function */
+};
+
+struct ktf_tgroup {
+	ktf_tgroup_fun func;	   /* Function run by each thread */
+	const char *name;
+	struct ktf_test_state state;
+	void *arg;		   /* Available to the threads as _thread->tg->arg */
+	unsigned int nr_threads;
+	struct ktf_tgroup_thread *threads; /* Per thread results of the last run */
+	atomic_t ready;		   /* Threads spinning in the start barrier */
+	int go;			   /* Releases the barrier: > 0 to run, < 0 to abort */
+	u64 start_ns;		   /* Time of release */
+	atomic_t running;	   /* Threads not yet done, + 1 for the caller */
+	struct completion done;	   /* Signalled when the last thread is done */
+	struct ktf_tgroup_data result; /* Aggregate measurements of the last run */
+};
+
+/* Run nr_threads instances of func, round robin on the online CPUs in
+ * cpus, or on all online CPUs if cpus is NULL. The threads are created and
+ * bound first and then wait in a spin barrier until all of them are ready,
+ * so that the measured part of the threads run concurrently. Returns when
+ * all threads are done, and passes tg->result to user space as the thread
+ * group result of the calling test. Returns 0 upon success or -errno.
+ */
+int ktf_tgroup_run(struct ktf_tgroup *tg, const struct cpumask *cpus);
+
+/* Free the per thread results of the last run */
+void ktf_tgroup_cleanup(struct ktf_tgroup *tg);
+
+#endif
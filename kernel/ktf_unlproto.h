@@ -8,6 +8,7 @@
  */
 #ifndef _KTF_UNLPROTO_H
 #define _KTF_UNLPROTO_H
+#include <linux/types.h>
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -19,6 +20,7 @@ enum ktf_cmd {
 	KTF_C_RUN,	/* Run a test */
 	KTF_C_COV,	/* Enable/disable coverage support */
 	KTF_C_CTX_CFG,	/* Configure a context */
+	KTF_C_EVENT,	/* Notification of a change, see KTF_MCGRP_EVENTS */
 	KTF_C_MAX,
 };
 
@@ -43,9 +45,9 @@ enum ktf_cmd {
  *     list of TEST lists, each representing a test suite and corresponding tests and associated
  *     test handle:
  *
- * <QUERY_request>   ::= VERSION
+ * <QUERY_request>   ::= VERSION [ GEN ][ SHARD ]
  *
- * <QUERY_response>  ::= VERSION [ <handle_list> ] NUM [ <testset_list> ]
+ * <QUERY_response>  ::= VERSION GEN [ <handle_list> ] NUM [ <testset_list> ]
  * <handle_list>     ::= HLIST <handle_data>+
  * <handle_data>     ::= HID [ <context_list> ]
  * <context_list>    ::= LIST <context_type>+ <context_data>+
@@ -55,26 +57,103 @@ enum ktf_cmd {
  * <testset_data>    ::= STR TEST <test_data>+
  * <test_data>       ::= HID STR
  *
+ * The QUERY can also be sent as a dump request (NLM_F_DUMP), in which case the
+ * kernel responds with a multipart sequence of QUERY responses, terminated by
+ * NLMSG_DONE. The first response carries the handle list and the number of test sets,
+ * and each of the rest a single test set. A test set with too many tests to fit
+ * in one response is split between responses, with the set name (STR) repeated:
+ *
+ * <QUERY_dump_response> ::= <QUERY_header> <QUERY_sets>*
+ * <QUERY_header>        ::= VERSION GEN [ <handle_list> ] NUM
+ * <QUERY_sets>          ::= VERSION <testset_list>
+ *
+ * GEN is the generation of the set of tests and contexts, which changes
+ * whenever the response would change. If a dumped QUERY request carries the
+ * GEN of a previous response which is still current, the response is just
+ * a header without handle list and NUM, and no test sets follow:
+ *
+ * <QUERY_unchanged>     ::= VERSION GEN
+ *
+ * A SHARD attribute (struct ktf_shard) in the request, normal or dumped, limits
+ * the test sets reported to the tests of one shard of the inventory, as given by
+ * ktf_shard_of(). All contexts of a test belong to the same shard.
+ * Test sets without tests in the shard are still reported, but empty:
+ *
  *
  * RUN:
  * ----
- * A RUN request currently specifies a run of a single named test. A test is identified
+ * A RUN request specifies a run of a single named test. A test is identified
  * by a test SNAME (set/suite name) a TNAM (test name) and an optional context (STR attribute)
  * to run it in. In addition tests can be arbitrarily parameterized, so tests optionally
- * allow out-of-band data via a DATA binary attribute.
- * The kernel response is a global status (in STAT) pluss an optional set of test results
- * eg. it supports running multiple tests, but this is not currently used.
+ * allow out-of-band data via a DATA binary attribute, or by reference to a buffer
+ * shared with the kernel via an SHM attribute (see struct ktf_shm_ref).
+ * The kernel response is a global status (in STAT) pluss an optional set of test results.
+ * The response echoes the test identification (SNAM, TNAM and STR) of the test.
  *
  * Each test result contains an optional list of individual error reports and
  * which each contains file name (FILE), line number (NUM) and a formatted error report string.
  * In addition each test result reports the number of assertions that were executed in the STAT
  * attribute:
  *
- * <RUN_request>     ::= VERSION SNAM TNAM [ STR ][ DATA ]
- * <RUN_response>    ::= STAT LIST <test_result>
- * <test_run_result> ::= STAT [ LIST <error_report>+ ]
+ * If the COVOPT of a RUN request has KTF_COV_OPT_DELTA set, the response also
+ * reports the functions with coverage enabled that were called while the test ran,
+ * each as a COVFN record with the number of calls made by the test in DATA.
+ * NUM is the number of functions called, which may be more than there was
+ * room for in the response. Calls made concurrently by other tests are counted
+ * too, so the report is only exact for tests that run alone:
+ *
+ * The response to the run of a benchmark test also holds a BENCH attribute
+ * with the distribution of the iteration times as a struct ktf_bench_data.
+ * If the test was found, the response has a STATS attribute with the time
+ * and resources used by the run as a struct ktf_test_stats. A test that ran
+ * a thread group (see ktf_tgroup_run()) has a TGROUP attribute with the
+ * measurements of the last group it ran as a struct ktf_tgroup_data.
+ *
+ * In the results of a sweep test (see ADD_SWEEP_TEST()), the assertion counts
+ * and error reports of each point are followed by a POINT attribute with a
+ * struct ktf_sweep_point. A SWEEP attribute in the request, an array of
+ * __s32, gives the points to run instead of the range the test was added with.
+ * It is ignored for other tests:
+ *
+ * A test may be given a max run time in milliseconds, either by TIMEOUT in the
+ * request or when it was added (see SET_TEST_TIMEOUT()), or else by the run_timeout
+ * parameter of the ktf module. A test with a timeout runs in a thread of its own.
+ * If it has not completed in time, the response reports the timeout and
+ * the stack of the thread as a failed assertion, and has TIMEOUT set.
+ * The thread keeps running until the test completes, and until then other runs
+ * of the test wait for it, and its module cannot be unloaded:
+ *
+ * <RUN_request>     ::= VERSION SNAM TNAM [ STR ][ NUM ][ DATA | SHM ][ COVOPT ][ SWEEP ]
+ *                       [ TIMEOUT ]
+ * <RUN_response>    ::= <test_id> LIST <test_result> STAT [ <cov_run> ][ BENCH ][ STATS ]
+ *                       [ TGROUP ][ TIMEOUT ]
+ * <cov_run>         ::= COVRUN NUM COVFN*
+ * <test_id>         ::= SNAM TNAM [ STR ]
+ * <test_run_result> ::= STAT [ LIST <error_report>+ ][ POINT ]
  * <error_report>    ::= STAT FILE NUM STR
  *
+ * Several tests can be run with a single batched RUN request by sending it as a
+ * dump request (NLM_F_DUMP) with a LIST of TEST entries, each identifying a test
+ * to run. The kernel then responds with a multipart sequence of RUN responses,
+ * one per test in request order, terminated by NLMSG_DONE:
+ *
+ * If JOBS is given and > 1, tests added as parallel tests may be run concurrently
+ * on up to JOBS CPUs. Responses are still returned in request order:
+ *
+ * If the RUNOPT of a test spec has KTF_RUN_OPT_ALL_CTX set, the test is run in
+ * each of its contexts instead of the one in STR, and there is one RUN response
+ * per context, with the context name in STR, in context name order. Each context
+ * is locked for the duration of the run in it, and given JOBS > 1, the runs
+ * in the different contexts proceed concurrently, whether the test was added
+ * as a parallel test or not. A test without contexts just runs once:
+ *
+ * A TIMEOUT in a batched request applies to the tests that don't have one in
+ * their test spec:
+ *
+ * <RUN_batch_request>  ::= VERSION [ JOBS ][ COVOPT ][ TIMEOUT ] LIST <test_spec>+
+ * <test_spec>          ::= TEST <test_id> [ NUM ][ SWEEP ][ RUNOPT ][ TIMEOUT ]
+ * <RUN_batch_response> ::= <RUN_response>*
+ *
  * COV:
  * ----
  * A COV request is currently used to either enable or disable (NUM = 1/0)
@@ -84,21 +163,67 @@ enum ktf_cmd {
  * <COV_request>     ::= VERSION MOD NUM [ COVOPT ]
  * <COV_response>    ::= NUM STAT
  *
+ * A COV request sent as a dump request (NLM_F_DUMP) instead retrieves the
+ * coverage data collected so far, as a multipart sequence of COV messages with
+ * as many records as fit in each. If MOD is given, only functions of that
+ * module are reported. A function record holds the module, function name and a
+ * struct ktf_cov_fn_data, and an allocation record holds a
+ * struct ktf_cov_mem_data for the outstanding allocations with a particular
+ * allocation stack, followed by the symbolic stack frames, innermost first:
+ *
+ * <COV_dump_request>  ::= VERSION [ MOD ]
+ * <COV_dump_response> ::= ( VERSION LIST <cov_record>+ )*
+ * <cov_record>        ::= COVFN MOD STR DATA | COVMEM DATA STR+
+ *
  * CTX_CFG:
  * --------
  * A context configuration (CTX_CFG) request is used to configure the kernel side
  * of a context with the necessary parameters (context type specific data) provided
- * in a DATA attribute. The optional context type parameter (FILE attribute)
+ * in a DATA attribute, or in a shared buffer referenced by an SHM attribute.
+ * The optional context type parameter (FILE attribute)
  * can be used to reference a context type, to dynamically create a new context
  * if the name given as STR does not exist.
  * The kernel currently does not send any response data to the user,
  * but tests will obviously subsequently fail if the context is not properly
  * configured:
  *
- * <CTX_CFG_request> ::= VERSION STR HID DATA [ FILE ]
+ * <CTX_CFG_request> ::= VERSION STR HID ( DATA | SHM ) [ FILE ]
+ *
+ * EVENT:
+ * ------
+ * EVENT messages are not requested, but multicast by the kernel to the members
+ * of the KTF_MCGRP_EVENTS group of the ktf family whenever the tests, contexts or
+ * coverage settings change. EVENT holds the kind of change (enum ktf_event) and
+ * GEN the generation of the set of tests and contexts after it, as in QUERY.
+ * Test events are only sent for tests that a QUERY would report, and a test
+ * handle that gets a new handle ID has its tests announced again with it.
+ * Events are lost if the receive buffer of a member overflows, which is
+ * reported to the member as ENOBUFS, and it then has to QUERY the tests again:
+ *
+ * <EVENT>           ::= VERSION GEN EVENT <event_data>
+ * <event_data>      ::= SNAM                    (KTF_EV_SET_*)
+ *                     | SNAM TNAM [ HID ]       (KTF_EV_TEST_*)
+ *                     | HID STR [ MOD STAT ]    (KTF_EV_CTX_*)
+ *                     | MOD                     (KTF_EV_COV_*)
  *
  */
 
+#define KTF_MCGRP_EVENTS	"events"
+
+/* Kinds of changes notified by EVENT messages */
+enum ktf_event {
+	KTF_EV_UNSPEC,
+	KTF_EV_SET_ADD,	/* A test set was added */
+	KTF_EV_SET_DEL,	/* The last test of a test set was removed */
+	KTF_EV_TEST_ADD,	/* A test was added, or got a new handle ID */
+	KTF_EV_TEST_DEL,
+	KTF_EV_CTX_ADD,
+	KTF_EV_CTX_DEL,
+	KTF_EV_CTX_CFG,	/* A context was configured, with the result in STAT */
+	KTF_EV_COV_ON,	/* Coverage was enabled for a module */
+	KTF_EV_COV_OFF,
+};
+
 /* supported attributes */
 enum ktf_attr {
 	KTF_A_UNSPEC,
@@ -116,6 +241,21 @@ enum ktf_attr {
 	KTF_A_MOD,    /* module for coverage analysis, also used for context type */
 	KTF_A_COVOPT, /* options for coverage analysis */
 	KTF_A_DATA,   /* Binary data used by a.o. hybrid tests */
+	KTF_A_JOBS,   /* Max number of tests to run in parallel in a batched run */
+	KTF_A_GEN,    /* Generation of the set of tests and contexts */
+	KTF_A_COVFN,  /* Coverage record for a function */
+	KTF_A_COVMEM, /* Coverage record for outstanding allocations */
+	KTF_A_COVRUN, /* Functions called during a test run */
+	KTF_A_BENCH,  /* Benchmark results (struct ktf_bench_data) */
+	KTF_A_STATS,  /* Resource usage of a test run (struct ktf_test_stats) */
+	KTF_A_SHM,    /* Data in a shared buffer (struct ktf_shm_ref) */
+	KTF_A_TGROUP, /* Thread group measurements (struct ktf_tgroup_data) */
+	KTF_A_SWEEP,  /* Points to run a sweep test for (array of __s32) */
+	KTF_A_POINT,  /* Result of a point of a sweep (struct ktf_sweep_point) */
+	KTF_A_SHARD,  /* Shard of the tests to query (struct ktf_shard) */
+	KTF_A_EVENT,  /* Kind of change notified by an EVENT (enum ktf_event) */
+	KTF_A_RUNOPT, /* Options for a test in a batched run (KTF_RUN_OPT_*) */
+	KTF_A_TIMEOUT, /* Max run time of a test in ms */
 	KTF_A_MAX
 };
 
@@ -136,6 +276,21 @@ static struct nla_policy ktf_gnl_policy[KTF_A_MAX] = {
 	[KTF_A_MOD]   = { .type = NLA_STRING },
 	[KTF_A_COVOPT] = { .type = NLA_U32 },
 	[KTF_A_DATA] = { .type = NLA_BINARY },
+	[KTF_A_JOBS] = { .type = NLA_U32 },
+	[KTF_A_GEN] = { .type = NLA_U64 },
+	[KTF_A_COVFN] = { .type = NLA_NESTED },
+	[KTF_A_COVMEM] = { .type = NLA_NESTED },
+	[KTF_A_COVRUN] = { .type = NLA_NESTED },
+	[KTF_A_BENCH] = { .type = NLA_BINARY },
+	[KTF_A_STATS] = { .type = NLA_BINARY },
+	[KTF_A_SHM] = { .type = NLA_BINARY },
+	[KTF_A_TGROUP] = { .type = NLA_BINARY },
+	[KTF_A_SWEEP] = { .type = NLA_BINARY },
+	[KTF_A_POINT] = { .type = NLA_BINARY },
+	[KTF_A_SHARD] = { .type = NLA_BINARY },
+	[KTF_A_EVENT] = { .type = NLA_U32 },
+	[KTF_A_RUNOPT] = { .type = NLA_U32 },
+	[KTF_A_TIMEOUT] = { .type = NLA_U32 },
 };
 #endif
 
@@ -154,10 +309,123 @@ enum ktf_vshift {
 	((__v & 0xffffULL) << KTF_VSHIFT_##__field)
 
 #define	KTF_VERSION_LATEST	\
-	(KTF_VERSION_SET(MAJOR, 0ULL) | KTF_VERSION_SET(MINOR, 2ULL) | KTF_VERSION_SET(MICRO, 1ULL))
+	(KTF_VERSION_SET(MAJOR, 0ULL) | KTF_VERSION_SET(MINOR, 3ULL) | KTF_VERSION_SET(MICRO, 0ULL))
 
 /* Coverage options */
 #define	KTF_COV_OPT_MEM		0x1
+#define	KTF_COV_OPT_FTRACE	0x2	/* count calls via ftrace, not kprobes */
+#define	KTF_COV_OPT_DELTA	0x4	/* RUN: report the functions called */
+
+/* Options for a test in a batched run */
+#define	KTF_RUN_OPT_ALL_CTX	0x1	/* Run in all contexts of the test */
+
+/* DATA of the records of a dumped COV response, in host byte order: */
+struct ktf_cov_fn_data {
+	__u64 address;	/* Address of the function */
+	__u64 size;	/* Size of the function */
+	__u64 count;	/* Number of calls seen */
+};
+
+struct ktf_cov_mem_data {
+	__u64 count;	/* Number of outstanding allocations with this stack */
+	__u64 bytes;	/* Their total size */
+};
+
+/* DATA of a BENCH attribute: Times of the iterations of a benchmark,
+ * in nanoseconds and in cycles as counted by get_cycles() (0 if not supported):
+ */
+struct ktf_bench_data {
+	__u64 iterations;
+	__u64 min_ns;
+	__u64 median_ns;
+	__u64 p99_ns;
+	__u64 max_ns;
+	__u64 min_cycles;
+	__u64 median_cycles;
+	__u64 p99_cycles;
+	__u64 max_cycles;
+};
+
+/* DATA of a STATS attribute: Time and resources used by a test run.
+ * Context switches are those of the task running the test. Memory is
+ * only accounted when memory tracking is enabled (KTF_STATS_MEM), and
+ * counts all tracked allocations made or freed while the test ran:
+ */
+struct ktf_test_stats {
+	__u64 duration_ns;	/* Wall time of the run */
+	__u32 cpu;		/* CPU the run started on */
+	__u32 flags;		/* KTF_STATS_* */
+	__u64 nvcsw;		/* Voluntary context switches */
+	__u64 nivcsw;		/* Involuntary context switches */
+	__u64 mem_alloc;	/* Bytes of tracked memory allocated */
+	__u64 mem_freed;	/* Bytes of tracked memory freed */
+};
+
+#define	KTF_STATS_MEM		0x1	/* mem_alloc and mem_freed are valid */
+#define	KTF_STATS_MIGRATED	0x2	/* The run ended on another CPU */
+
+/* DATA of a TGROUP attribute: Measurements of a group of threads released
+ * together, each counting the operations it did. The duration is from the
+ * release until the last thread finished:
+ */
+struct ktf_tgroup_data {
+	__u32 threads;		/* Number of threads in the group */
+	__u32 cpus;		/* Number of distinct CPUs they were bound to */
+	__u64 ops;		/* Total operations */
+	__u64 duration_ns;
+	__u64 ops_per_sec;	/* Aggregate throughput, ops / duration */
+	__u64 min_ns;		/* Shortest and longest run time of a thread */
+	__u64 max_ns;
+	__u64 min_ops;		/* Fewest and most operations by a thread */
+	__u64 max_ops;
+};
+
+/* Max number of points in a SWEEP attribute */
+#define	KTF_SWEEP_MAX_POINTS	4096
+
+/* DATA of a POINT attribute: The outcome of one point (value of _i) of a sweep */
+struct ktf_sweep_point {
+	__s32 point;
+	__u32 assertions;	/* Passed assertions */
+	__u32 failures;		/* Failed assertions */
+	__u32 pad;
+	__u64 duration_ns;	/* Run time of the test function for the point */
+};
+
+/* DATA of a SHARD attribute: Select shard @index of @count, @index < @count */
+struct ktf_shard {
+	__u32 index;
+	__u32 count;
+};
+
+/* The shard of @count that the test @set.@test belongs to: An FNV-1a hash
+ * of "<set>.<test>", so that every host computes the same partitioning
+ * regardless of the order in which tests were loaded:
+ */
+static inline __u32 ktf_shard_of(const char *set, const char *test, __u32 count)
+{
+	__u32 h = 2166136261U;
+	const char *p;
+
+	for (p = set; *p; p++)
+		h = (h ^ (unsigned char)*p) * 16777619U;
+	h = (h ^ '.') * 16777619U;
+	for (p = test; *p; p++)
+		h = (h ^ (unsigned char)*p) * 16777619U;
+	return count ? h % count : 0;
+}
+
+/* DATA of an SHM attribute: @size bytes at @offset into the shared
+ * buffer @id, as read from the file descriptor of the mapped
+ * ktf/shm debugfs file. The buffer must belong to the process
+ * sending the request:
+ */
+struct ktf_shm_ref {
+	__u32 id;
+	__u32 pad;
+	__u64 offset;
+	__u64 size;
+};
 
 struct nla_policy *ktf_get_gnl_policy(void);
 
@@ -20,13 +20,147 @@ namespace ktf
   class KernelTest;
 
   /* Invoke the kernel test - to be called directly from user mode
-   * hybrid tests:
+   * hybrid tests. This and the other requests below may be issued from
+   * multiple threads concurrently, each thread uses its own netlink socket:
    */
   void run(KernelTest* kt, std::string ctx = "");
 
   /* Function for enabling/disabling coverage for module */
   int set_coverage(std::string module, unsigned int opts, bool enabled);
 
+  /* Asynchronous requests: run_async() and set_coverage_async() queue a
+   * request to be sent to the kernel while the caller continues, and return
+   * a tag identifying it, or -errno. Requests are executed in the order they
+   * were queued, and any out-of-band data is copied when queued.
+   * Responses are handled, and test results reported, only from wait() and
+   * wait_all(), which also call the async_callback of each request waited
+   * for with its tag, status (0 or -errno) and @arg:
+   */
+  typedef void (*async_callback)(int tag, int status, void* arg);
+
+  int run_async(KernelTest* kt, std::string ctx = "",
+		async_callback cb = NULL, void* arg = NULL);
+  int set_coverage_async(std::string module, unsigned int opts, bool enabled,
+			 async_callback cb = NULL, void* arg = NULL);
+
+  /* Wait for the request @tag, returns it's status */
+  int wait(int tag);
+
+  /* Wait for all outstanding asynchronous requests */
+  void wait_all();
+
+  /* Coverage data as exported by the kernel: */
+  struct cov_function
+  {
+    std::string module;
+    std::string name;
+    uint64_t address;
+    uint64_t size;
+    uint64_t count;	/* Number of calls seen */
+  };
+
+  struct cov_allocation
+  {
+    uint64_t count;	/* Number of outstanding allocations with this stack */
+    uint64_t bytes;	/* Their total size */
+    std::vector<std::string> stack; /* Symbolic frames, innermost first */
+  };
+
+  /* Retrieve the coverage data collected so far, for all modules with
+   * coverage enabled, or only for 'module' if nonempty:
+   */
+  int get_coverage(std::string module, std::vector<cov_function>& functions,
+		   std::vector<cov_allocation>& allocations);
+
+  /* Record the functions with coverage enabled that each kernel test calls,
+   * as lines of "<test> <module> <function> <calls>" appended to the file @path.
+   * Calls made by concurrently running tests are included, so this is only
+   * exact when tests run one at a time:
+   */
+  int set_test_coverage(std::string path);
+
+  /* Compare the results of kernel benchmarks against the baseline in the
+   * file @path, and fail benchmarks whose median or 99th percentile iteration
+   * time is more than @threshold percent above the baseline:
+   */
+  int set_bench_baseline(std::string path, double threshold);
+
+  /* Save the results of the kernel benchmarks that run as a new baseline in
+   * the file @path. Baselines of benchmarks that did not run are kept:
+   */
+  int set_bench_baseline_output(std::string path);
+
+  /* Write a JSON object to the file @path ("-" for stdout) for each kernel
+   * test result as soon as it is received, with the test identification,
+   * status, assertion counts, run time and failed assertions:
+   */
+  int set_jsonl_output(std::string path);
+
+  /* Append the run time of each kernel test to the file @path as a line of
+   * "<set>.<test>[/<context>] <duration_ns>", as input for balancing shards
+   * by run time with $KTF_SHARD_TIMES:
+   */
+  int set_test_times_output(std::string path);
+
+  /* Run kernel sweep tests for the points in @spec instead of their own range.
+   * @spec is a comma separated list of values or FROM:TO[:STEP] ranges, with
+   * TO not included, as in "1,2,4:64:4". Returns 0 or -EINVAL:
+   */
+  int set_sweep_points(std::string spec);
+
+  /* Allocate @size bytes of memory shared with the kernel, or return NULL.
+   * Out-of-band data for a kernel test (see KTF_USERDATA_SHARED) or context
+   * configuration data within such memory is passed to the kernel by
+   * reference instead of being copied into the request, and is not limited
+   * by the size of a netlink message. Note that such data is not
+   * copied when an asynchronous request is queued either:
+   */
+  void* shared_alloc(size_t size);
+  void shared_free(void* p);
+
+  /* Allow up to @jobs kernel tests added as parallel tests to run concurrently */
+  void set_jobs(unsigned int jobs);
+
+  /* Give up on kernel tests that don't complete within @ms milliseconds,
+   * 0 for the kernel's default. A test that times out fails with the
+   * kernel stack of the test:
+   */
+  void set_timeout(unsigned int ms);
+
+  /* A change to the kernel tests, contexts or coverage, as notified by the
+   * kernel. @type is one of KTF_EV_* in kernel/ktf_unlproto.h, and @gen the
+   * generation of the tests and contexts after the change. @name is the name
+   * of the test or context, and @module the module of a coverage change or
+   * the type of a configurable context:
+   */
+  struct registry_event
+  {
+    unsigned int type;
+    uint64_t gen;
+    std::string setname;
+    std::string name;
+    std::string module;
+    unsigned int handle_id;
+    int cfg_stat;	/* Configuration status of a configurable context */
+  };
+
+  typedef void (*event_handler)(const registry_event& ev);
+
+  /* Subscribe to notifications of changes from the kernel, to keep the
+   * tests and contexts known to ktf up to date without querying the kernel
+   * again. Returns a file descriptor to poll for input, which is then
+   * handled with process_events(), or -errno:
+   */
+  int subscribe_events(event_handler eh = NULL);
+
+  /* Apply the changes notified since the last call, and call the event_handler,
+   * if any, for each. Does not block. Returns the number of events handled, or
+   * -ENOBUFS if events were lost, in which case the tests have to be queried again:
+   */
+  int process_events();
+
+  void unsubscribe_events();
+
   typedef void (*configurator)(void);
 
   // Initialize KTF:
@@ -63,6 +197,15 @@ namespace ktf
   ASSERT_TRUE(__priv_data); \
   ASSERT_EQ(get_priv_sz(__kt_ptr), sizeof(struct __priv_datatype))
 
+/* Same as KTF_USERDATA, but with the data in memory shared with the kernel,
+ * so that the kernel side of the test accesses it directly:
+ */
+#define KTF_USERDATA_SHARED(__kt_ptr, __priv_datatype, __priv_data) \
+  struct __priv_datatype *__priv_data =	\
+    (struct __priv_datatype *)get_shared_priv(__kt_ptr, sizeof(struct __priv_datatype)); \
+  ASSERT_TRUE(__priv_data); \
+  ASSERT_EQ(get_priv_sz(__kt_ptr), sizeof(struct __priv_datatype))
+
 /* KTF support for configurable contexts:
  * Send a configuation data structure to the given context name.
  */
@@ -101,6 +244,9 @@ namespace ktf {
   /* get a priv pointer of the given size, allocate if necessary */
   void* get_priv(KernelTest* kt, size_t priv_sz);
 
+  /* get a priv pointer to memory shared with the kernel, allocate if necessary */
+  void* get_shared_priv(KernelTest* kt, size_t priv_sz);
+
   /* Get the size of the existing priv data */
   size_t get_priv_sz(KernelTest *kt);
 
@@ -14,6 +14,12 @@
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <algorithm>
+#include <deque>
 #include <map>
 #include <set>
 #include <string>
@@ -33,11 +39,179 @@ int devcnt = 0;
 namespace ktf
 {
 
-struct nl_sock* sock = NULL;
 int family = -1;
 
 int printed_header = 0;
 
+static int parse_cb(struct nl_msg *msg, void *arg);
+static int debug_cb(struct nl_msg *msg, void *arg);
+static int error_cb(struct nl_msg *msg, void *arg);
+
+/* Open a new netlink socket connected to generic netlink, with the
+ * generic callback functions for messages, or return NULL:
+ */
+static struct nl_sock* nl_open(void)
+{
+  /* Allocate a new netlink socket */
+  struct nl_sock* sk = nl_socket_alloc();
+  if (sk == NULL){
+    fprintf(stderr, "Failed to allocate a nl socket\n");
+    return NULL;
+  }
+
+  /* Connect to generic netlink socket on kernel side */
+  int stat = genl_connect(sk);
+  if (stat) {
+    fprintf(stderr, "Failed to open generic netlink connection\n");
+    nl_socket_free(sk);
+    return NULL;
+  }
+
+  /* Specify the generic callback functions for messages */
+  nl_socket_modify_cb(sk, NL_CB_VALID, NL_CB_CUSTOM, parse_cb, NULL);
+  nl_socket_modify_cb(sk, NL_CB_INVALID, NL_CB_CUSTOM, error_cb, NULL);
+  return sk;
+}
+
+class AsyncClient;
+
+/* Netlink state of a user thread: Each thread that talks to the kernel
+ * uses sockets of its own, so that requests from different threads can be
+ * in flight concurrently without seeing each other's responses:
+ */
+struct thread_state
+{
+  thread_state() : sock(NULL), async(NULL)
+  { }
+
+  ~thread_state();
+
+  struct nl_sock* sock; /* For synchronous requests */
+  AsyncClient* async;   /* For asynchronous requests, if used */
+};
+
+static pthread_key_t thread_key;
+static pthread_once_t thread_key_once = PTHREAD_ONCE_INIT;
+
+static void thread_state_free(void* ts)
+{
+  delete (thread_state*)ts;
+}
+
+static void thread_key_init(void)
+{
+  pthread_key_create(&thread_key, thread_state_free);
+}
+
+static thread_state& tstate()
+{
+  pthread_once(&thread_key_once, thread_key_init);
+  thread_state* ts = (thread_state*)pthread_getspecific(thread_key);
+  if (!ts) {
+    ts = new thread_state();
+    pthread_setspecific(thread_key, ts);
+  }
+  return *ts;
+}
+
+/* The socket of the calling thread, connected on first use */
+static struct nl_sock* thread_sock()
+{
+  thread_state& ts = tstate();
+  if (!ts.sock)
+    ts.sock = nl_open();
+  return ts.sock;
+}
+
+/* Buffers shared with the kernel, by start address */
+#define KTF_SHM_PATH "/sys/kernel/debug/ktf/shm"
+
+struct shm_region
+{
+  int fd;
+  unsigned int id;
+  size_t size;
+};
+
+typedef std::map<char*, shm_region> shm_map;
+static shm_map shm_regions;
+static pthread_mutex_t shm_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void* shared_alloc(size_t size)
+{
+  long pgsz = sysconf(_SC_PAGESIZE);
+  char idbuf[16];
+  shm_region r;
+  void* p;
+  ssize_t n;
+
+  r.size = (size + pgsz - 1) & ~(pgsz - 1);
+  r.fd = open(KTF_SHM_PATH, O_RDWR);
+  if (r.fd < 0) {
+    fprintf(stderr, "Unable to open %s: %s\n", KTF_SHM_PATH, strerror(errno));
+    return NULL;
+  }
+  p = mmap(NULL, r.size, PROT_READ | PROT_WRITE, MAP_SHARED, r.fd, 0);
+  if (p == MAP_FAILED) {
+    fprintf(stderr, "Unable to map %lu bytes of %s: %s\n", r.size, KTF_SHM_PATH, strerror(errno));
+    close(r.fd);
+    return NULL;
+  }
+  n = read(r.fd, idbuf, sizeof(idbuf) - 1);
+  if (n <= 0) {
+    fprintf(stderr, "Unable to read the id of the shared buffer\n");
+    munmap(p, r.size);
+    close(r.fd);
+    return NULL;
+  }
+  idbuf[n] = '\0';
+  r.id = strtoul(idbuf, NULL, 10);
+
+  pthread_mutex_lock(&shm_lock);
+  shm_regions[(char*)p] = r;
+  pthread_mutex_unlock(&shm_lock);
+  return p;
+}
+
+void shared_free(void* p)
+{
+  pthread_mutex_lock(&shm_lock);
+  shm_map::iterator it = shm_regions.find((char*)p);
+  if (it != shm_regions.end()) {
+    munmap(p, it->second.size);
+    close(it->second.fd);
+    shm_regions.erase(it);
+  }
+  pthread_mutex_unlock(&shm_lock);
+}
+
+/* Put out-of-band data in @msg, by reference if it is within a shared buffer */
+static void put_data(struct nl_msg* msg, void* data, size_t data_sz)
+{
+  char* p = (char*)data;
+  struct ktf_shm_ref ref;
+  bool shared = false;
+
+  pthread_mutex_lock(&shm_lock);
+  shm_map::iterator it = shm_regions.upper_bound(p);
+  if (it != shm_regions.begin()) {
+    --it;
+    if (p + data_sz <= it->first + it->second.size) {
+      memset(&ref, 0, sizeof(ref));
+      ref.id = it->second.id;
+      ref.offset = p - it->first;
+      ref.size = data_sz;
+      shared = true;
+    }
+  }
+  pthread_mutex_unlock(&shm_lock);
+
+  if (shared)
+    nla_put(msg, KTF_A_SHM, sizeof(ref), &ref);
+  else
+    nla_put(msg, KTF_A_DATA, data_sz, data);
+}
+
 typedef std::map<std::string, KernelTest*> testmap;
 typedef std::map<std::string, test_cb*> wrappermap;
 
@@ -118,12 +292,18 @@ public:
 
 /* Wrap globals in an object to control init order and
  * memory cleanup:
+ * The tests and contexts are registered by the thread calling setup(),
+ * before any tests run. After that, test lookups may happen concurrently
+ * from multiple threads, and only take the lock for reading, while
+ * context configuration may update the contexts under the write lock.
  */
 class KernelTestMgr
 {
 public:
   KernelTestMgr() : next_set(0), cur(NULL)
-  { }
+  {
+    pthread_rwlock_init(&lock, NULL);
+  }
 
   ~KernelTestMgr();
 
@@ -134,6 +314,7 @@ public:
   void add_wrapper(const std::string setname, const std::string testname, test_cb* tcb);
 
   stringvec& get_set_names() { return set_names; }
+  bool has_set(const std::string& setname);
   stringvec get_test_names();
 
   stringvec get_testsets()
@@ -151,6 +332,8 @@ public:
     return handle_to_ctxvec[id];
   }
 
+  size_t context_count(unsigned int id);
+
   void add_cset(unsigned int hid, stringvec& ctxs);
   void add_ctype(unsigned int hid, const std::string& type_name);
   std::vector<ConfigurableContext*> add_configurable_context(const std::string& ctx,
@@ -165,8 +348,19 @@ public:
 							 const std::string& type_name);
 
   /* Update the list of contexts returned from the kernel with a newly created one */
-  void add_context(unsigned int hid, const std::string& ctx);
+  void add_context(ConfigurableContext* c);
+
+  /* Apply a change notified by the kernel, see subscribe_events() */
+  void apply_event(const registry_event& ev);
 private:
+  KernelTest* lookup(const std::string& setname, const std::string& testname);
+  ConfigurableContext* find_context(const std::string& ctx, unsigned int hid);
+  void add_test_context(unsigned int hid, const std::string& ctx);
+  void remove_test_context(unsigned int hid, const std::string& ctx);
+  void remove_test(const std::string& setname, const std::string& testname);
+  void remove_set(const std::string& setname);
+
+  pthread_rwlock_t lock;
   setmap sets;
   stringvec test_names;
   stringvec set_names;
@@ -176,6 +370,9 @@ private:
 
   // Context types that allows dynamically created contexts:
   std::map<std::string, std::vector<ContextType*> > ctx_types;
+
+  /* Tests removed by the kernel, which other threads may still refer to */
+  std::vector<KernelTest*> removed_tests;
   int next_set;
   name_iter* cur;
 };
@@ -197,16 +394,25 @@ KernelTestMgr::~KernelTestMgr()
     for (ttit = tit->second.begin(); ttit != tit->second.end(); ++ttit)
       delete *ttit;
   }
+
+  for (std::vector<KernelTest*>::iterator kit = removed_tests.begin();
+       kit != removed_tests.end(); ++kit)
+    delete *kit;
 }
 
 context_vector KernelTestMgr::find_contexts(const std::string& ctx, const std::string& type_name)
 {
   std::map<std::string,context_vector>::iterator it;
+  context_vector ct;
+
+  pthread_rwlock_wrlock(&lock);
   it = cfg_contexts.find(ctx);
   if (it == cfg_contexts.end())
-    return maybe_create_context(ctx, type_name);
+    ct = maybe_create_context(ctx, type_name);
   else
-    return it->second;
+    ct = it->second;
+  pthread_rwlock_unlock(&lock);
+  return ct;
 }
 
 context_vector KernelTestMgr::maybe_create_context(const std::string& ctx, const std::string& type_name)
@@ -219,9 +425,37 @@ context_vector KernelTestMgr::maybe_create_context(const std::string& ctx, const
     return add_configurable_contexts(ctx, it->second);
 }
 
-void KernelTestMgr::add_context(unsigned int hid, const std::string& ctx)
+void KernelTestMgr::add_context(ConfigurableContext* c)
+{
+  pthread_rwlock_wrlock(&lock);
+  if (c->cfg_stat == ENODEV) {
+    stringvec& ctxv = handle_to_ctxvec[c->handle_id];
+    /* The kernel's notification of the new context may have come first */
+    if (std::find(ctxv.begin(), ctxv.end(), c->name) == ctxv.end())
+      ctxv.push_back(c->name);
+    c->cfg_stat = 0;
+  }
+  pthread_rwlock_unlock(&lock);
+}
+
+size_t KernelTestMgr::context_count(unsigned int id)
+{
+  size_t n = 0;
+
+  pthread_rwlock_rdlock(&lock);
+  std::map<unsigned int, stringvec>::iterator it = handle_to_ctxvec.find(id);
+  if (it != handle_to_ctxvec.end())
+    n = it->second.size();
+  pthread_rwlock_unlock(&lock);
+  return n;
+}
+
+bool KernelTestMgr::has_set(const std::string& setname)
 {
-  handle_to_ctxvec[hid].push_back(ctx);
+  pthread_rwlock_rdlock(&lock);
+  bool found = kernelsets.count(setname) > 0;
+  pthread_rwlock_unlock(&lock);
+  return found;
 }
 
 
@@ -276,6 +510,16 @@ void KernelTestMgr::add_test(const std::string& setname, const char* tname,
 }
 
 
+/* Look up a test without modifying the maps, called with the lock held */
+KernelTest* KernelTestMgr::lookup(const std::string& setname, const std::string& testname)
+{
+  setmap::iterator sit = sets.find(setname);
+  if (sit == sets.end())
+    return NULL;
+  testmap::iterator tit = sit->second.tests.find(testname);
+  return tit == sit->second.tests.end() ? NULL : tit->second;
+}
+
 /* Here we might get called with test names expanded with context names */
 KernelTest* KernelTestMgr::find_test(const std::string&setname,
 				     const std::string& testname,
@@ -284,29 +528,33 @@ KernelTest* KernelTestMgr::find_test(const std::string&setname,
   off_t pos;
   log(KTF_DEBUG, "find test %s.%s\n", setname.c_str(), testname.c_str());
 
+  pthread_rwlock_rdlock(&lock);
+
   /* Try direct lookup first: */
-  KernelTest* kt = sets[setname].tests[testname];
+  KernelTest* kt = lookup(setname, testname);
   if (kt) {
     *pctx = std::string();
-    return kt;
+    goto out;
   }
 
   /* If we don't have any contexts set, no need to parse name: */
   if (handle_to_ctxvec.empty())
-    return NULL;
+    goto out;
 
   pos = testname.find_last_of('_');
   while (pos >= 0) {
     std::string tname = testname.substr(0,pos);
     std::string ctx = testname.substr(pos + 1, testname.npos);
     *pctx = ctx;
-    kt = sets[setname].tests[tname];
+    kt = lookup(setname, tname);
     if (kt)
-      return kt;
+      goto out;
     /* context name might contain an '_' , iterate on: */
     pos = tname.find_last_of('_');
   }
-  return NULL;
+out:
+  pthread_rwlock_unlock(&lock);
+  return kt;
 }
 
 
@@ -428,9 +676,14 @@ std::string ConfigurableContext::str_state()
 
 int ConfigurableContext::Configure(void *data, size_t data_sz)
 {
-  struct nl_msg *msg = nlmsg_alloc();
+  struct nl_sock* sock = thread_sock();
+  struct nl_msg *msg;
   int err;
 
+  if (!sock)
+    return -ENOTCONN;
+  msg = nlmsg_alloc();
+
   log(KTF_INFO, "%s, data_sz %lu\n", name.c_str(), data_sz);
   genlmsg_put(msg, NL_AUTO_PID, NL_AUTO_SEQ, family, 0, NLM_F_REQUEST,
               KTF_C_CTX_CFG, 1);
@@ -438,7 +691,7 @@ int ConfigurableContext::Configure(void *data, size_t data_sz)
   nla_put_string(msg, KTF_A_STR, name.c_str());
   nla_put_u32(msg, KTF_A_HID, handle_id);
   nla_put_string(msg, KTF_A_FILE, type_name.c_str());
-  nla_put(msg, KTF_A_DATA, data_sz, data);
+  put_data(msg, data, data_sz);
 
   // Send message over netlink socket
   nl_send_auto_complete(sock, msg);
@@ -455,11 +708,10 @@ int ConfigurableContext::Configure(void *data, size_t data_sz)
   //
   err = nl_wait_for_ack(sock);
 
-  if (!err && cfg_stat == ENODEV) {
-    // Successfully added a new context, update it's state and
-    // tell kmgr() about it:
-    kmgr().add_context(handle_id, name);
-    cfg_stat = 0;
+  if (!err) {
+    // If this successfully added a new context, update it's state
+    // and tell kmgr() about it:
+    kmgr().add_context(this);
   }
   return err;
 }
@@ -469,23 +721,38 @@ void *get_priv(KernelTest *kt, size_t sz)
   return kt->get_priv(sz);
 }
 
+void *get_shared_priv(KernelTest *kt, size_t sz)
+{
+  return kt->get_shared_priv(sz);
+}
+
 size_t get_priv_sz(KernelTest *kt)
 {
   return kt->user_priv_sz;
 }
 
-int set_coverage(std::string module, unsigned int opts, bool enabled)
+static struct nl_msg* cov_msg(std::string& module, unsigned int opts, bool enabled)
 {
-  struct nl_msg *msg;
-  int err;
+  struct nl_msg *msg = nlmsg_alloc();
 
-  msg = nlmsg_alloc();
   genlmsg_put(msg, NL_AUTO_PID, NL_AUTO_SEQ, family, 0, NLM_F_REQUEST,
 	      KTF_C_COV, 1);
   nla_put_u32(msg, KTF_A_COVOPT, opts);
   nla_put_u32(msg, KTF_A_NUM, enabled ? 1 : 0);
   nla_put_u64(msg, KTF_A_VERSION, KTF_VERSION_LATEST);
   nla_put_string(msg, KTF_A_MOD, module.c_str());
+  return msg;
+}
+
+int set_coverage(std::string module, unsigned int opts, bool enabled)
+{
+  struct nl_sock* sock = thread_sock();
+  struct nl_msg *msg;
+  int err;
+
+  if (!sock)
+    return -ENOTCONN;
+  msg = cov_msg(module, opts, enabled);
 
   // Send message over netlink socket
   nl_send_auto_complete(sock, msg);
@@ -508,10 +775,12 @@ int set_coverage(std::string module, unsigned int opts, bool enabled)
   KernelTest::KernelTest(const std::string& sn, const char* tn, unsigned int handle_id)
   : setname(sn),
     testname(tn),
+    handle_id(handle_id),
     setnum(0),
     testnum(0),
     user_priv(NULL),
     user_priv_sz(0),
+    user_priv_shared(false),
     user_test(NULL),
     file(NULL),
     line(-1)
@@ -549,7 +818,9 @@ int set_coverage(std::string module, unsigned int opts, bool enabled)
 
 KernelTest::~KernelTest()
 {
-  if (user_priv)
+  if (user_priv_shared)
+    shared_free(user_priv);
+  else if (user_priv)
     free(user_priv);
 }
 
@@ -563,25 +834,23 @@ void* KernelTest::get_priv(size_t p_sz)
   return user_priv;
 }
 
-static int parse_cb(struct nl_msg *msg, void *arg);
-static int debug_cb(struct nl_msg *msg, void *arg);
-static int error_cb(struct nl_msg *msg, void *arg);
-
-int nl_connect(void)
+void* KernelTest::get_shared_priv(size_t p_sz)
 {
-  /* Allocate a new netlink socket */
-  sock = nl_socket_alloc();
-  if (sock == NULL){
-    fprintf(stderr, "Failed to allocate a nl socket");
-    exit(1);
+  if (!user_priv) {
+    user_priv = shared_alloc(p_sz);
+    if (user_priv) {
+      user_priv_sz = p_sz;
+      user_priv_shared = true;
+    }
   }
+  return user_priv;
+}
 
-  /* Connect to generic netlink socket on kernel side */
-  int stat = genl_connect(sock);
-  if (stat) {
-    fprintf(stderr, "Failed to open generic netlink connection");
+int nl_connect(void)
+{
+  struct nl_sock* sock = thread_sock();
+  if (!sock)
     exit(1);
-  }
 
   /* Ask kernel to resolve family name to family id */
   family = genl_ctrl_resolve(sock, "ktf");
@@ -589,10 +858,6 @@ int nl_connect(void)
     fprintf(stderr, "Netlink protocol family for ktf not found - is the ktf module loaded?\n");
     exit(1);
   }
-
-  /* Specify the generic callback functions for messages */
-  nl_socket_modify_cb(sock, NL_CB_VALID, NL_CB_CUSTOM, parse_cb, NULL);
-  nl_socket_modify_cb(sock, NL_CB_INVALID, NL_CB_CUSTOM, error_cb, NULL);
   return 0;
 }
 
@@ -607,6 +872,30 @@ void default_test_handler(int result,  const char* file, int line, const char* r
 }
 
 test_handler handle_test = default_test_handler;
+bench_handler handle_bench = NULL;
+stats_handler handle_stats = NULL;
+tgroup_handler handle_tgroup = NULL;
+point_handler handle_point = NULL;
+
+void set_bench_handler(bench_handler bh)
+{
+  handle_bench = bh;
+}
+
+void set_stats_handler(stats_handler sh)
+{
+  handle_stats = sh;
+}
+
+void set_tgroup_handler(tgroup_handler th)
+{
+  handle_tgroup = th;
+}
+
+void set_point_handler(point_handler ph)
+{
+  handle_point = ph;
+}
 
 bool setup(test_handler ht)
 {
@@ -623,22 +912,382 @@ void set_configurator(configurator c)
   do_context_configure = c;
 }
 
-/* Query kernel for available tests in index order */
-stringvec& query_testsets()
+/* A test reported by a dumped query, before it is added to kmgr() */
+struct query_test
+{
+  query_test(const std::string& sn, const char* tn, unsigned int hid)
+    : setname(sn), testname(tn), handle_id(hid) {}
+  std::string setname;
+  std::string testname;
+  unsigned int handle_id;
+};
+
+/* State of a dumped query while it is being received:
+ * Contexts cannot be configured while the dump is in progress, and tests with
+ * contexts can only be added after that, since configuration may add contexts.
+ * Balancing shards by run time also needs all the tests before adding any:
+ */
+static struct
+{
+  bool defer;		  /* Tests are added when the dump is complete */
+  std::vector<query_test> tests;
+  uint64_t gen;		  /* Generation reported by the kernel, if any */
+  bool unchanged;	  /* Kernel reported that our cached copy is current */
+  bool replay;		  /* Parsing messages from the cache */
+  std::vector<char> raw;  /* The messages received, for the cache */
+} qdump;
+
+/* The KTF version of the kernel, as reported by the last query */
+static uint64_t kernel_ktf_version;
+
+/* Kernel support for running a test in all its contexts (KTF_RUN_OPT_ALL_CTX),
+ * which all kernels of the current minor version have:
+ */
+static bool kernel_has_run_all_ctx()
+{
+  return KTF_VERSION(MAJOR, kernel_ktf_version) == KTF_VERSION(MAJOR, KTF_VERSION_LATEST) &&
+    KTF_VERSION(MINOR, kernel_ktf_version) == KTF_VERSION(MINOR, KTF_VERSION_LATEST);
+}
+
+/* Selection of a shard of the tests, to spread a test suite across hosts.
+ * $KTF_TOTAL_SHARDS and $KTF_SHARD_INDEX select shard index of count.
+ * By default the kernel only reports the tests of the shard, as given by
+ * ktf_shard_of(). If $KTF_SHARD_TIMES names a file with previous run times
+ * (see set_test_times_output()), all tests are queried instead and assigned
+ * to shards to make the total run time of the shards as equal as possible:
+ */
+typedef std::map<std::string, unsigned long long> time_map;
+
+static struct
+{
+  unsigned int index;
+  unsigned int count;	  /* 0 if not sharding */
+  time_map times;	  /* Run time of each test, if balancing */
+} shard;
+
+static int read_test_times(const std::string& path, time_map& m)
+{
+  FILE* f = fopen(path.c_str(), "r");
+  unsigned long long ns;
+  char line[1024], name[512];
+
+  if (!f)
+    return -errno;
+  while (fgets(line, sizeof(line), f)) {
+    if (line[0] == '#')
+      continue;
+    if (sscanf(line, "%511s %llu", name, &ns) == 2)
+      m[name] = ns;
+  }
+  fclose(f);
+  return 0;
+}
+
+static void read_shard_config()
+{
+  const char* total = getenv("KTF_TOTAL_SHARDS");
+  const char* index = getenv("KTF_SHARD_INDEX");
+  const char* times = getenv("KTF_SHARD_TIMES");
+  time_map last;
+  char* end;
+  int ret;
+
+  if (!total && !index)
+    return;
+  if (!total || !index) {
+    fprintf(stderr, "Both KTF_TOTAL_SHARDS and KTF_SHARD_INDEX must be set - not sharding\n");
+    return;
+  }
+  shard.count = strtoul(total, &end, 10);
+  if (*end)
+    shard.count = 0;
+  shard.index = strtoul(index, &end, 10);
+  if (*end || shard.index >= shard.count) {
+    fprintf(stderr, "Invalid shard %s of %s - not sharding\n", index, total);
+    shard.count = 0;
+    return;
+  }
+  if (!times || !*times)
+    return;
+
+  ret = read_test_times(times, last);
+  if (ret) {
+    fprintf(stderr, "Unable to read test times %s: %s - sharding by name\n", times,
+	    strerror(-ret));
+    return;
+  }
+  /* Contexts of a test run in the same shard, so add up their times */
+  for (time_map::iterator it = last.begin(); it != last.end(); ++it)
+    shard.times[it->first.substr(0, it->first.find('/'))] += it->second;
+  log(KTF_DEBUG, "Shard %u of %u, balanced by the run times of %zu tests\n", shard.index,
+      shard.count, shard.times.size());
+}
+
+/* Tests are also filtered here, in case the kernel does not know about shards */
+static bool in_hash_shard(const std::string& setname, const char* testname)
+{
+  return !shard.count || ktf_shard_of(setname.c_str(), testname, shard.count) == shard.index;
+}
+
+struct shard_weight
+{
+  shard_weight(unsigned long long w, const std::string& n, size_t i)
+    : ns(w), name(n), index(i) {}
+
+  /* Longest first */
+  bool operator<(const shard_weight& o) const
+  {
+    return ns != o.ns ? ns > o.ns : name < o.name;
+  }
+
+  unsigned long long ns;
+  std::string name;
+  size_t index;
+};
+
+/* Assign tests to shards by their run time, longest first, each to the shard
+ * with the least total time so far (ties to the lowest shard), and keep the
+ * tests of our own shard. Tests without a known run time are assumed to take
+ * the average time. Ties between tests are broken by name, so all hosts make
+ * the same assignment from the same times:
+ */
+static void select_shard(std::vector<query_test>& tests)
+{
+  std::vector<unsigned long long> load(shard.count, 0);
+  std::vector<shard_weight> order;
+  std::vector<query_test> mine;
+  unsigned long long total = 0, avg;
+  size_t known = 0;
+
+  for (size_t i = 0; i < tests.size(); i++) {
+    time_map::iterator it = shard.times.find(tests[i].setname + "." + tests[i].testname);
+    if (it != shard.times.end()) {
+      total += it->second;
+      known++;
+    }
+  }
+  avg = known ? std::max(total / known, 1ULL) : 1;
+  for (size_t i = 0; i < tests.size(); i++) {
+    std::string name = tests[i].setname + "." + tests[i].testname;
+    time_map::iterator it = shard.times.find(name);
+    order.push_back(shard_weight(it != shard.times.end() ? it->second : avg, name, i));
+  }
+  std::sort(order.begin(), order.end());
+
+  for (size_t i = 0; i < order.size(); i++) {
+    unsigned int s = std::min_element(load.begin(), load.end()) - load.begin();
+    load[s] += order[i].ns;
+    if (s == shard.index)
+      mine.push_back(tests[order[i].index]);
+  }
+  log(KTF_INFO, "Shard %u of %u: %zu of %zu tests, estimated %llu of %llu ns\n",
+      shard.index, shard.count, mine.size(), tests.size(), load[shard.index],
+      total + (tests.size() - known) * avg);
+  tests.swap(mine);
+}
+
+/* The response to a dumped query is saved in a cache file, together with the
+ * registry generation of the kernel at the time. Later queries provide
+ * that generation to the kernel, and if nothing has changed, the kernel does
+ * not resend the response, and the cached messages are parsed instead.
+ * The cache file is $KTF_QUERY_CACHE, or if that is not set, a per user
+ * file in /tmp. Setting KTF_QUERY_CACHE to an empty string disables caching.
+ * The kernel response to a query for a shard of the tests is cached
+ * separately from the full inventory:
+ */
+class QueryCache
 {
+public:
+  QueryCache();
+  bool load();
+  void save(uint64_t gen, const std::vector<char>& raw);
+  void replay();
+  uint64_t gen;
+private:
+  struct header
+  {
+    char magic[4];
+    uint32_t size;
+    uint64_t version;
+    uint64_t gen;
+  };
+  std::string path;
+  std::vector<char> raw;
+};
+
+QueryCache& qcache()
+{
+  static QueryCache qcache_;
+  return qcache_;
+}
+
+QueryCache::QueryCache()
+  : gen(0)
+{
+  const char* p = getenv("KTF_QUERY_CACHE");
+  if (p) {
+    path = p;
+  } else {
+    char tmp[64];
+    snprintf(tmp, sizeof(tmp), "/tmp/ktf_query_%u.cache", (unsigned int)getuid());
+    path = tmp;
+  }
+  if (shard.count && shard.times.empty() && !path.empty()) {
+    char sfx[32];
+    snprintf(sfx, sizeof(sfx), ".%uof%u", shard.index, shard.count);
+    path += sfx;
+  }
+}
+
+bool QueryCache::load()
+{
+  struct header h;
+  struct stat st;
+  ssize_t sz;
+  int fd;
+
+  if (path.empty())
+    return false;
+  fd = open(path.c_str(), O_RDONLY | O_NOFOLLOW);
+  if (fd < 0)
+    return false;
+
+  /* Only trust a regular file of our own */
+  if (fstat(fd, &st) || !S_ISREG(st.st_mode) || st.st_uid != getuid() ||
+      read(fd, &h, sizeof(h)) != sizeof(h))
+    goto fail;
+  if (memcmp(h.magic, "KTFQ", 4) || h.version != KTF_VERSION_LATEST ||
+      h.size != st.st_size - sizeof(h))
+    goto fail;
+
+  raw.resize(h.size);
+  sz = read(fd, raw.data(), h.size);
+  if (sz < 0 || (size_t)sz != h.size)
+    goto fail;
+  close(fd);
+  gen = h.gen;
+  log(KTF_DEBUG, "Loaded query cache %s (generation %llu, %u bytes)\n", path.c_str(),
+      (unsigned long long)gen, h.size);
+  return true;
+fail:
+  close(fd);
+  raw.clear();
+  return false;
+}
+
+void QueryCache::save(uint64_t g, const std::vector<char>& r)
+{
+  struct header h;
+  std::string tmp;
+  char pid[32];
+  int fd;
+  bool ok;
+
+  if (path.empty())
+    return;
+
+  /* Write a private copy and rename it in place, to never expose a partial cache */
+  snprintf(pid, sizeof(pid), ".%d", (int)getpid());
+  tmp = path + pid;
+  fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW, 0600);
+  if (fd < 0)
+    return;
+  memcpy(h.magic, "KTFQ", 4);
+  h.size = r.size();
+  h.version = KTF_VERSION_LATEST;
+  h.gen = g;
+  ok = write(fd, &h, sizeof(h)) == sizeof(h) &&
+    write(fd, r.data(), r.size()) == (ssize_t)r.size();
+  close(fd);
+  if (!ok || rename(tmp.c_str(), path.c_str()))
+    unlink(tmp.c_str());
+}
+
+void QueryCache::replay()
+{
+  size_t off = 0;
+
+  qdump.replay = true;
+  while (off + sizeof(struct nlmsghdr) <= raw.size()) {
+    struct nlmsghdr *nlh = (struct nlmsghdr *)&raw[off];
+    struct nl_msg *msg;
+
+    if (nlh->nlmsg_len < sizeof(*nlh) || off + nlh->nlmsg_len > raw.size())
+      break;
+    msg = nlmsg_convert(nlh);
+    if (!msg)
+      break;
+    parse_cb(msg, NULL);
+    nlmsg_free(msg);
+    off += NLMSG_ALIGN(nlh->nlmsg_len);
+  }
+  qdump.replay = false;
+  raw.clear();
+}
+
+static void send_query(int flags, uint64_t gen = 0)
+{
+  struct nl_sock* sock = thread_sock();
   struct nl_msg *msg;
-  int err;
 
   msg = nlmsg_alloc();
-  genlmsg_put(msg, NL_AUTO_PID, NL_AUTO_SEQ, family, 0, NLM_F_REQUEST,
+  genlmsg_put(msg, NL_AUTO_PID, NL_AUTO_SEQ, family, 0, NLM_F_REQUEST | flags,
 	      KTF_C_QUERY, 1);
   nla_put_u64(msg, KTF_A_VERSION, KTF_VERSION_LATEST);
+  if (gen)
+    nla_put_u64(msg, KTF_A_GEN, gen);
+  if (shard.count && shard.times.empty()) {
+    struct ktf_shard ks = { shard.index, shard.count };
+    nla_put(msg, KTF_A_SHARD, sizeof(ks), &ks);
+  }
 
   // Send message over netlink socket
   nl_send_auto_complete(sock, msg);
 
   // Free message
   nlmsg_free(msg);
+}
+
+/* Query kernel for available tests in index order */
+stringvec& query_testsets()
+{
+  struct nl_sock* sock = thread_sock();
+  int err;
+
+  // Ask for the tests as a multipart message first, to keep
+  // each message small regardless of the number of tests.
+  // Dump requests are never acked, so an error here means that
+  // the kernel did not accept the request, typically because
+  // it is too old to support dumped queries:
+  //
+  read_shard_config();
+  qdump.gen = 0;
+  qdump.unchanged = false;
+  send_query(NLM_F_DUMP, qcache().load() ? qcache().gen : 0);
+  err = nl_recvmsgs_default(sock);
+  if (err >= 0) {
+    if (qdump.unchanged)
+      qcache().replay();
+    else if (qdump.gen)
+      qcache().save(qdump.gen, qdump.raw);
+    qdump.raw.clear();
+    if (qdump.defer) {
+      if (do_context_configure)
+	do_context_configure();
+      if (!shard.times.empty())
+	select_shard(qdump.tests);
+      for (std::vector<query_test>::iterator it = qdump.tests.begin();
+	   it != qdump.tests.end(); ++it)
+	if (!shard.times.empty() || in_hash_shard(it->setname, it->testname.c_str()))
+	  kmgr().add_test(it->setname, it->testname.c_str(), it->handle_id);
+      qdump.tests.clear();
+      qdump.defer = false;
+    }
+    return kmgr().get_set_names();
+  }
+  log(KTF_INFO, "Dumped query not supported by kernel (err %d) - using a single query\n", err);
+
+  send_query(0);
 
   // Wait for acknowledgement:
   // This function also returns error status if the message
@@ -655,6 +1304,55 @@ stringvec& query_testsets()
   return kmgr().get_set_names();
 }
 
+/* Count the tests and contexts in a part of a dumped query, for time_query() */
+static int count_query_cb(struct nl_msg *msg, void *arg)
+{
+  size_t* entries = (size_t*)arg;
+  struct nlattr *attrs[KTF_A_MAX+1];
+  struct nlattr *nla, *nla2, *nla3;
+  int rem, rem2, rem3;
+
+  if (genlmsg_parse(nlmsg_hdr(msg), 0, attrs, KTF_A_MAX, ktf_get_gnl_policy()) < 0)
+    return NL_SKIP;
+  if (attrs[KTF_A_HLIST])
+    nla_for_each_nested(nla, attrs[KTF_A_HLIST], rem)
+      if (nla_type(nla) == KTF_A_LIST)
+	nla_for_each_nested(nla2, nla, rem2)
+	  if (nla_type(nla2) == KTF_A_STR)
+	    (*entries)++;
+  if (attrs[KTF_A_LIST])
+    nla_for_each_nested(nla, attrs[KTF_A_LIST], rem)
+      if (nla_type(nla) == KTF_A_TEST)
+	nla_for_each_nested(nla3, nla, rem3)
+	  if (nla_type(nla3) == KTF_A_STR)
+	    (*entries)++;
+  return NL_OK;
+}
+
+long long time_query(size_t* entries)
+{
+  struct nl_sock* sock = thread_sock();
+  struct timespec t0, t1;
+  struct nl_cb *cb;
+  int err;
+
+  if (!sock)
+    return -ENOTCONN;
+  cb = nl_cb_clone(nl_socket_get_cb(sock));
+  if (!cb)
+    return -ENOMEM;
+  nl_cb_set(cb, NL_CB_VALID, NL_CB_CUSTOM, count_query_cb, entries);
+  *entries = 0;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  send_query(NLM_F_DUMP);
+  err = nl_recvmsgs(sock, cb);
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  nl_cb_put(cb);
+  if (err < 0)
+    return -EIO;
+  return (t1.tv_sec - t0.tv_sec) * 1000000000LL + t1.tv_nsec - t0.tv_nsec;
+}
+
 stringvec get_test_names()
 {
   return kmgr().get_test_names();
@@ -675,23 +1373,85 @@ void add_wrapper(const std::string setname, const std::string testname, test_cb*
   kmgr().add_wrapper(setname, testname, tcb);
 }
 
-void run_test(KernelTest* kt, std::string& ctx)
+/* Where to record the functions called by each test, if requested */
+static FILE* test_cov = NULL;
+
+int set_test_coverage(std::string path)
 {
-  if (kt->user_test)
-    kt->user_test->fun(kt);
-  else
-    run(kt, ctx);
-}
+  FILE* f = fopen(path.c_str(), "a");
 
-/* Run the kernel test */
-void run(KernelTest* kt, std::string context)
+  if (!f) {
+    fprintf(stderr, "Unable to open %s: %s\n", path.c_str(), strerror(errno));
+    return -errno;
+  }
+  if (test_cov)
+    fclose(test_cov);
+  test_cov = f;
+  return 0;
+}
+
+/* Points to pass to sweep tests instead of their own range, if any */
+static std::vector<int32_t> sweep_points;
+
+int set_sweep_points(std::string spec)
 {
-  struct nl_msg *msg;
+  std::vector<int32_t> points;
+  const char* s = spec.c_str();
+
+  while (*s) {
+    long from, to, step = 1;
+    char* end;
+    int n = 0;
+
+    from = strtol(s, &end, 0);
+    if (end == s)
+      return -EINVAL;
+    s = end;
+    to = from + 1;
+    if (*s == ':') {
+      to = strtol(s + 1, &end, 0);
+      if (end == s + 1)
+	return -EINVAL;
+      s = end;
+      if (*s == ':') {
+	step = strtol(s + 1, &end, 0);
+	if (end == s + 1 || step <= 0)
+	  return -EINVAL;
+	s = end;
+      }
+    }
+    for (long v = from; v < to; v += step, n++) {
+      if (points.size() == KTF_SWEEP_MAX_POINTS)
+	return -EINVAL;
+      points.push_back(v);
+    }
+    if (!n || (*s && *s++ != ','))
+      return -EINVAL;
+  }
+  if (points.empty())
+    return -EINVAL;
+  sweep_points = points;
+  return 0;
+}
 
-  log(KTF_DEBUG_V, "START kernel test (%ld,%ld): %s\n", kt->setnum,
-		kt->testnum, kt->name.c_str());
+static void put_sweep(struct nl_msg* msg)
+{
+  if (!sweep_points.empty())
+    nla_put(msg, KTF_A_SWEEP, sweep_points.size() * sizeof(int32_t), &sweep_points[0]);
+}
+
+/* Max run time in ms for the kernel tests, 0 for the kernel's default */
+static unsigned int run_timeout;
+
+void set_timeout(unsigned int ms)
+{
+  run_timeout = ms;
+}
+
+static struct nl_msg* run_msg(KernelTest* kt, std::string& context)
+{
+  struct nl_msg *msg = nlmsg_alloc();
 
-  msg = nlmsg_alloc();
   genlmsg_put(msg, NL_AUTO_PID, NL_AUTO_SEQ, family, 0, NLM_F_REQUEST,
 	      KTF_C_RUN, 1);
   nla_put_u64(msg, KTF_A_VERSION, KTF_VERSION_LATEST);
@@ -703,7 +1463,31 @@ void run(KernelTest* kt, std::string context)
 
   /* Send any test specific out-of-band data */
   if (kt->user_priv)
-    nla_put(msg, KTF_A_DATA, kt->user_priv_sz, kt->user_priv);
+    put_data(msg, kt->user_priv, kt->user_priv_sz);
+
+  if (test_cov)
+    nla_put_u32(msg, KTF_A_COVOPT, KTF_COV_OPT_DELTA);
+  if (run_timeout)
+    nla_put_u32(msg, KTF_A_TIMEOUT, run_timeout);
+  put_sweep(msg);
+  return msg;
+}
+
+/* Run the kernel test */
+void run(KernelTest* kt, std::string context)
+{
+  struct nl_sock* sock = thread_sock();
+  struct nl_msg *msg;
+
+  log(KTF_DEBUG_V, "START kernel test (%ld,%ld): %s\n", kt->setnum,
+		kt->testnum, kt->name.c_str());
+
+  if (!sock) {
+    errno = ENOTCONN;
+    return;
+  }
+
+  msg = run_msg(kt, context);
 
   // Send message over netlink socket
   nl_send_auto_complete(sock, msg);
@@ -725,6 +1509,608 @@ void run(KernelTest* kt, std::string context)
   log(KTF_DEBUG_V, "END   ktf::run_kernel_test %s\n", kt->name.c_str());
 }
 
+/* Asynchronous requests:
+ * Requests are queued by the caller and sent in order by a sender thread
+ * on a netlink socket of their own, one per calling thread, each tagged with its own netlink
+ * sequence number. The kernel handles a request in the context of the
+ * sending thread, so the caller is free to do other work meanwhile.
+ * Responses and acks queue up on the socket until the caller waits for
+ * a request, and are then parsed and matched to their requests by sequence
+ * number in the calling thread, so that results are reported in the context
+ * of the calling test. At most KTF_ASYNC_WINDOW requests are sent ahead of
+ * the responses received, to avoid overrunning the socket receive buffer.
+ */
+#define KTF_ASYNC_WINDOW 16
+
+class AsyncClient
+{
+public:
+  AsyncClient();
+  ~AsyncClient();
+  int submit(struct nl_msg* msg, async_callback cb, void* arg);
+  int wait(int tag);
+  void wait_all();
+private:
+  struct request
+  {
+    request() : cb(NULL), arg(NULL), done(false), status(0)
+    { }
+
+    async_callback cb;
+    void* arg;
+    bool done;
+    int status;
+  };
+  typedef std::map<int, request> requestmap;
+
+  bool connect();
+  bool receive();
+  void complete(int tag, int status);
+
+  static void* sender(void* arg);
+  static int ack_cb(struct nl_msg *msg, void *arg);
+  static int err_cb(struct sockaddr_nl *nla, struct nlmsgerr *err, void *arg);
+  static int seq_cb(struct nl_msg *msg, void *arg);
+
+  struct nl_sock* sk;
+  struct nl_cb* cb;
+  pthread_t thread;
+  bool stopping;	   /* Sender thread to exit when done */
+  pthread_mutex_t lock;
+  pthread_cond_t cond;         /* Signalled when a request is sent or completed */
+  std::deque<struct nl_msg*> queue;  /* Requests not yet sent */
+  requestmap pending;      /* Requests not yet waited for */
+  int in_flight;	   /* Requests sent but not yet completed */
+  int next_tag;
+};
+
+AsyncClient::AsyncClient()
+  : sk(NULL),
+    cb(NULL),
+    stopping(false),
+    in_flight(0),
+    next_tag(0)
+{
+  pthread_mutex_init(&lock, NULL);
+  pthread_cond_init(&cond, NULL);
+}
+
+/* Requests still outstanding when the calling thread exits are waited for */
+AsyncClient::~AsyncClient()
+{
+  if (sk) {
+    wait_all();
+    pthread_mutex_lock(&lock);
+    stopping = true;
+    pthread_cond_broadcast(&cond);
+    pthread_mutex_unlock(&lock);
+    pthread_join(thread, NULL);
+    nl_cb_put(cb);
+    nl_socket_free(sk);
+  }
+  pthread_cond_destroy(&cond);
+  pthread_mutex_destroy(&lock);
+}
+
+bool AsyncClient::connect()
+{
+  sk = nl_open();
+  if (!sk)
+    return false;
+
+  /* Responses are matched to requests by sequence number here,
+   * any number of requests may be outstanding:
+   */
+  cb = nl_cb_alloc(NL_CB_DEFAULT);
+  if (!cb)
+    goto fail;
+  nl_cb_set(cb, NL_CB_VALID, NL_CB_CUSTOM, parse_cb, NULL);
+  nl_cb_set(cb, NL_CB_INVALID, NL_CB_CUSTOM, error_cb, NULL);
+  nl_cb_set(cb, NL_CB_ACK, NL_CB_CUSTOM, ack_cb, this);
+  nl_cb_set(cb, NL_CB_SEQ_CHECK, NL_CB_CUSTOM, seq_cb, NULL);
+  nl_cb_err(cb, NL_CB_CUSTOM, err_cb, this);
+
+  if (pthread_create(&thread, NULL, sender, this)) {
+    fprintf(stderr, "Failed to start the asynchronous request thread\n");
+    goto fail;
+  }
+  return true;
+fail:
+  if (cb)
+    nl_cb_put(cb);
+  cb = NULL;
+  nl_socket_free(sk);
+  sk = NULL;
+  return false;
+}
+
+/* Takes ownership of @msg. Returns the tag of the request, or -errno */
+int AsyncClient::submit(struct nl_msg* msg, async_callback rcb, void* arg)
+{
+  int tag;
+
+  if (!sk && !connect()) {
+    nlmsg_free(msg);
+    return -ENOTCONN;
+  }
+
+  pthread_mutex_lock(&lock);
+  /* Tags are sequence numbers, and 0 (NL_AUTO_SEQ) is reserved */
+  if (++next_tag <= 0)
+    next_tag = 1;
+  tag = next_tag;
+  nlmsg_hdr(msg)->nlmsg_seq = tag;
+
+  request& r = pending[tag];
+  r.cb = rcb;
+  r.arg = arg;
+  queue.push_back(msg);
+  pthread_cond_broadcast(&cond);
+  pthread_mutex_unlock(&lock);
+  return tag;
+}
+
+void* AsyncClient::sender(void* arg)
+{
+  AsyncClient* ac = (AsyncClient*)arg;
+
+  pthread_mutex_lock(&ac->lock);
+  for (;;) {
+    while ((ac->queue.empty() && !ac->stopping) || ac->in_flight >= KTF_ASYNC_WINDOW)
+      pthread_cond_wait(&ac->cond, &ac->lock);
+    if (ac->queue.empty())
+      break;
+
+    struct nl_msg* msg = ac->queue.front();
+    int tag = nlmsg_hdr(msg)->nlmsg_seq;
+    ac->queue.pop_front();
+    pthread_mutex_unlock(&ac->lock);
+
+    /* The kernel executes the request before this returns: */
+    int err = nl_send_auto_complete(ac->sk, msg);
+    nlmsg_free(msg);
+
+    pthread_mutex_lock(&ac->lock);
+    if (err < 0) {
+      fprintf(stderr, "Failed to send asynchronous request %d: %s\n", tag, nl_geterror(err));
+      ac->pending[tag].done = true;
+      ac->pending[tag].status = -EIO;
+    } else {
+      /* The ack may already have been received, if so in_flight
+       * was decremented by complete() and is back to where it was:
+       */
+      ac->in_flight++;
+    }
+    pthread_cond_broadcast(&ac->cond);
+  }
+  pthread_mutex_unlock(&ac->lock);
+  return NULL;
+}
+
+void AsyncClient::complete(int tag, int status)
+{
+  pthread_mutex_lock(&lock);
+  requestmap::iterator it = pending.find(tag);
+  if (it != pending.end() && !it->second.done) {
+    it->second.done = true;
+    it->second.status = status;
+    in_flight--;
+    pthread_cond_broadcast(&cond);
+  } else
+    fprintf(stderr, "Received netlink ack for unknown request %d\n", tag);
+  pthread_mutex_unlock(&lock);
+}
+
+/* Called with the lock held - receive any responses to sent requests
+ * or wait for requests to be sent. Returns with the lock held.
+ */
+bool AsyncClient::receive()
+{
+  int err = 0;
+
+  if (in_flight <= 0) {
+    pthread_cond_wait(&cond, &lock);
+    return true;
+  }
+  pthread_mutex_unlock(&lock);
+  err = nl_recvmsgs(sk, cb);
+  pthread_mutex_lock(&lock);
+  if (err < 0) {
+    fprintf(stderr, "Failed to receive asynchronous responses: %s\n", nl_geterror(err));
+    return false;
+  }
+  return true;
+}
+
+/* Wait for the request @tag to complete, handling the responses to
+ * this and any requests sent before it, and call its callback.
+ * Returns the status of the request.
+ */
+int AsyncClient::wait(int tag)
+{
+  pthread_mutex_lock(&lock);
+  requestmap::iterator it = pending.find(tag);
+  if (it == pending.end()) {
+    pthread_mutex_unlock(&lock);
+    return -ENOENT;
+  }
+  while (!it->second.done)
+    if (!receive()) {
+      pthread_mutex_unlock(&lock);
+      return -EIO;
+    }
+
+  request r = it->second;
+  pending.erase(it);
+  pthread_mutex_unlock(&lock);
+
+  if (r.cb)
+    r.cb(tag, r.status, r.arg);
+  return r.status;
+}
+
+void AsyncClient::wait_all()
+{
+  pthread_mutex_lock(&lock);
+  while (!pending.empty()) {
+    int tag = pending.begin()->first;
+    pthread_mutex_unlock(&lock);
+    wait(tag);
+    pthread_mutex_lock(&lock);
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+int AsyncClient::ack_cb(struct nl_msg *msg, void *arg)
+{
+  AsyncClient* ac = (AsyncClient*)arg;
+
+  ac->complete(nlmsg_hdr(msg)->nlmsg_seq, 0);
+  return NL_OK;
+}
+
+int AsyncClient::err_cb(struct sockaddr_nl *nla, struct nlmsgerr *err, void *arg)
+{
+  AsyncClient* ac = (AsyncClient*)arg;
+
+  ac->complete(err->msg.nlmsg_seq, err->error);
+  return NL_SKIP;
+}
+
+int AsyncClient::seq_cb(struct nl_msg *msg, void *arg)
+{
+  return NL_OK;
+}
+
+thread_state::~thread_state()
+{
+  delete async;
+  if (sock)
+    nl_socket_free(sock);
+}
+
+static AsyncClient& async_client()
+{
+  thread_state& ts = tstate();
+  if (!ts.async)
+    ts.async = new AsyncClient();
+  return *ts.async;
+}
+
+int run_async(KernelTest* kt, std::string context, async_callback cb, void* arg)
+{
+  log(KTF_DEBUG_V, "QUEUE kernel test (%ld,%ld): %s\n", kt->setnum,
+		kt->testnum, kt->name.c_str());
+  return async_client().submit(run_msg(kt, context), cb, arg);
+}
+
+int set_coverage_async(std::string module, unsigned int opts, bool enabled,
+		       async_callback cb, void* arg)
+{
+  return async_client().submit(cov_msg(module, opts, enabled), cb, arg);
+}
+
+int wait(int tag)
+{
+  return async_client().wait(tag);
+}
+
+void wait_all()
+{
+  async_client().wait_all();
+}
+
+
+/* Batched execution of kernel tests:
+ * The test framework queues all the tests selected to run up front,
+ * and the first time one of the queued kernel tests is about to run,
+ * it is sent to the kernel along with as many of the immediately following
+ * kernel tests as fits within one batched RUN request. Results are kept
+ * per test until the test framework gets to the test, and then replayed.
+ * A user level test (or hybrid test) acts as a barrier to preserve
+ * the order of execution as seen from the kernel.
+ */
+struct test_report
+{
+  test_report(int r, const char* f, int l, const char* rep)
+    : result(r), file(f), line(l), report(rep)
+  { }
+
+  int result;
+  std::string file;
+  int line;
+  std::string report;
+};
+
+typedef std::vector<test_report> report_vec;
+
+/* Sweep points, each with the number of reports preceding it */
+typedef std::vector<std::pair<size_t, struct ktf_sweep_point> > point_vec;
+
+/* What the kernel returned for a test in a batched run */
+struct test_result
+{
+  test_result() : has_bench(false), has_stats(false), has_tgroup(false)
+  { }
+
+  report_vec reports;
+  bool has_bench;
+  struct ktf_bench_data bench;
+  bool has_stats;
+  struct ktf_test_stats stats;
+  bool has_tgroup;
+  struct ktf_tgroup_data tgroup;
+  point_vec points;
+};
+
+class TestBatch
+{
+public:
+  TestBatch() : kernel_tests(0), jobs(1), disabled(false)
+  { }
+
+  void reset();
+  void set_jobs(unsigned int j) { jobs = j; }
+  void add(KernelTest* kt, const std::string& ctx);
+  bool run_test(KernelTest* kt, const std::string& ctx);
+
+  /* Called for each result message to get where to store the results: */
+  test_result* find_result(const char* setname, const char* testname, const char* ctx);
+private:
+  enum batch_state { B_QUEUED, B_SENT, B_DONE };
+
+  struct entry
+  {
+    entry(KernelTest* t, const std::string& c) : kt(t), ctx(c), state(B_QUEUED)
+    { }
+
+    KernelTest* kt;  /* NULL for a barrier */
+    std::string ctx;
+    batch_state state;
+    test_result result;
+  };
+
+  static std::string key(const std::string& setname, const std::string& testname,
+			 const std::string& ctx)
+  {
+    return setname + "." + testname + "/" + ctx;
+  }
+
+  size_t all_contexts(size_t first);
+  void run_chunk(size_t first);
+
+  std::vector<entry> entries;
+  std::map<std::string, size_t> index;
+  size_t kernel_tests;
+  unsigned int jobs;
+  bool disabled;
+};
+
+/* Don't bother batching unless at least this many kernel tests are selected: */
+#define KTF_BATCH_MIN 4
+
+/* Max number of tests to run per batched request, and the request buffer size
+ * needed to hold that many test specs with max length names:
+ */
+#define KTF_BATCH_MAX 64
+#define KTF_BATCH_MSG_SIZE (KTF_BATCH_MAX * 256 + 1024)
+
+TestBatch& batch()
+{
+  static TestBatch batch_;
+  return batch_;
+}
+
+void TestBatch::reset()
+{
+  entries.clear();
+  index.clear();
+  kernel_tests = 0;
+}
+
+void TestBatch::add(KernelTest* kt, const std::string& ctx)
+{
+  if (kt) {
+    index[key(kt->setname, kt->testname, ctx)] = entries.size();
+    kernel_tests++;
+  }
+  entries.push_back(entry(kt, ctx));
+}
+
+test_result* TestBatch::find_result(const char* setname, const char* testname, const char* ctx)
+{
+  std::map<std::string, size_t>::iterator it = index.find(key(setname, testname, ctx ? ctx : ""));
+  if (it == index.end() || entries[it->second].state != B_SENT)
+    return NULL;
+  entries[it->second].state = B_DONE;
+  return &entries[it->second].result;
+}
+
+/* Returns true if results for the test was obtained via a batched run */
+bool TestBatch::run_test(KernelTest* kt, const std::string& ctx)
+{
+  if (disabled || kernel_tests < KTF_BATCH_MIN)
+    return false;
+
+  std::map<std::string, size_t>::iterator it = index.find(key(kt->setname, kt->testname, ctx));
+  if (it == index.end())
+    return false;
+
+  entry& e = entries[it->second];
+  if (e.state == B_QUEUED)
+    run_chunk(it->second);
+  if (e.state != B_DONE) {
+    /* No response for this test, let it run on it's own */
+    log(KTF_INFO, "No batched result for %s - running it separately\n", kt->name.c_str());
+    return false;
+  }
+
+  report_vec& reports = e.result.reports;
+  point_vec& points = e.result.points;
+  size_t p = 0;
+  for (size_t i = 0; i <= reports.size(); i++) {
+    /* Deliver the points in order with the reports of each point */
+    for (; p < points.size() && points[p].first == i; p++)
+      if (handle_point)
+	handle_point(&points[p].second);
+    if (i < reports.size())
+      handle_test(reports[i].result, reports[i].file.c_str(), reports[i].line,
+		  reports[i].report.c_str());
+  }
+  reports.clear();
+  points.clear();
+  if (e.result.has_bench && handle_bench)
+    handle_bench(&e.result.bench);
+  if (e.result.has_stats && handle_stats)
+    handle_stats(&e.result.stats);
+  if (e.result.has_tgroup && handle_tgroup)
+    handle_tgroup(&e.result.tgroup);
+  e.result.has_bench = false;
+  e.result.has_stats = false;
+  e.result.has_tgroup = false;
+  return true;
+}
+
+/* With more than one job, the runs of a test in all its contexts can be
+ * sent as one test spec, for the kernel to run in parallel. Returns the number
+ * of entries from @first on that are the queued runs of the same test in each
+ * of its contexts, or 0 if they cannot be sent as one:
+ */
+size_t TestBatch::all_contexts(size_t first)
+{
+  KernelTest* kt = entries[first].kt;
+  size_t i, n;
+
+  if (jobs <= 1 || entries[first].ctx.empty() || !kernel_has_run_all_ctx())
+    return 0;
+  n = kmgr().context_count(kt->handle_id);
+  for (i = first; i < entries.size() && i - first < n; i++)
+    if (entries[i].kt != kt || entries[i].state != B_QUEUED)
+      return 0;
+  return n > 1 && i - first == n ? n : 0;
+}
+
+void TestBatch::run_chunk(size_t first)
+{
+  struct nl_sock* sock = thread_sock();
+  struct nl_msg *msg;
+  struct nlattr *list, *spec;
+  size_t i, j, n, cnt = 0;
+  int err;
+
+  msg = nlmsg_alloc_size(KTF_BATCH_MSG_SIZE +
+			 KTF_BATCH_MAX * NLA_ALIGN(sweep_points.size() * sizeof(int32_t) + NLA_HDRLEN));
+  genlmsg_put(msg, NL_AUTO_PID, NL_AUTO_SEQ, family, 0, NLM_F_REQUEST | NLM_F_DUMP,
+	      KTF_C_RUN, 1);
+  nla_put_u64(msg, KTF_A_VERSION, KTF_VERSION_LATEST);
+  if (jobs > 1)
+    nla_put_u32(msg, KTF_A_JOBS, jobs);
+  if (test_cov)
+    nla_put_u32(msg, KTF_A_COVOPT, KTF_COV_OPT_DELTA);
+  if (run_timeout)
+    nla_put_u32(msg, KTF_A_TIMEOUT, run_timeout);
+
+  list = nla_nest_start(msg, KTF_A_LIST);
+  for (i = first; i < entries.size() && cnt < KTF_BATCH_MAX; i++) {
+    entry& e = entries[i];
+    if (!e.kt)
+      break;
+    if (e.state != B_QUEUED)
+      continue;
+    n = all_contexts(i);
+    spec = nla_nest_start(msg, KTF_A_TEST);
+    nla_put_string(msg, KTF_A_SNAM, e.kt->setname.c_str());
+    nla_put_string(msg, KTF_A_TNAM, e.kt->testname.c_str());
+    if (n)
+      nla_put_u32(msg, KTF_A_RUNOPT, KTF_RUN_OPT_ALL_CTX);
+    else if (!e.ctx.empty())
+      nla_put_string(msg, KTF_A_STR, e.ctx.c_str());
+    put_sweep(msg);
+    nla_nest_end(msg, spec);
+    /* The results of each context are returned with the context name */
+    for (j = 0; j < std::max(n, (size_t)1); j++)
+      entries[i + j].state = B_SENT;
+    if (n)
+      i += n - 1;
+    cnt++;
+  }
+  nla_nest_end(msg, list);
+
+  log(KTF_DEBUG, "START batch of %lu kernel tests from %s\n", cnt,
+      entries[first].kt->name.c_str());
+
+  // Send message over netlink socket
+  nl_send_auto_complete(sock, msg);
+
+  // Free message
+  nlmsg_free(msg);
+
+  // The results are returned as a multipart message, which
+  // libnl receives in full, up to and including the final NLMSG_DONE.
+  // Dump requests are never acked, so an error here means that
+  // the kernel did not accept the request at all, typically
+  // because it is too old to support batched runs:
+  //
+  err = nl_recvmsgs_default(sock);
+  if (err < 0) {
+    log(KTF_INFO, "Batched run not supported by kernel (err %d) - running tests separately\n",
+	err);
+    disabled = true;
+  }
+  log(KTF_DEBUG, "END   batch\n");
+}
+
+void run_test(KernelTest* kt, std::string& ctx)
+{
+  if (kt->user_test)
+    kt->user_test->fun(kt);
+  else if (!batch().run_test(kt, ctx))
+    run(kt, ctx);
+}
+
+void set_jobs(unsigned int jobs)
+{
+  batch().set_jobs(jobs);
+}
+
+void batch_reset()
+{
+  batch().reset();
+}
+
+void batch_add(KernelTest* kt, const std::string& ctx)
+{
+  if (kt && !kt->user_test)
+    batch().add(kt, ctx);
+  else
+    batch().add(NULL, ctx);
+}
+
+bool is_kernel_set(const std::string& setname)
+{
+  return kmgr().has_set(setname);
+}
+
 
 void configure_context(const std::string context, const std::string type_name, void *data, size_t data_sz)
 {
@@ -755,7 +2141,7 @@ void configure_context_for_test(const std::string& setname, const std::string& t
 
 
 static nl_cb_action parse_one_set(std::string& setname,
-				  std::string& testname, struct nlattr* attr)
+				  std::string& testname, struct nlattr* attr, bool defer)
 {
   int rem = 0;
   struct nlattr *nla;
@@ -769,7 +2155,10 @@ static nl_cb_action parse_one_set(std::string& setname,
       break;
     case KTF_A_STR:
       msg = nla_get_string(nla);
-      kmgr().add_test(setname, msg, handle_id);
+      if (defer)
+	qdump.tests.push_back(query_test(setname, msg, handle_id));
+      else if (in_hash_shard(setname, msg))
+	kmgr().add_test(setname, msg, handle_id);
       handle_id = 0;
       break;
     default:
@@ -787,12 +2176,15 @@ static int parse_query(struct nl_msg *msg, struct nlattr** attrs)
   int alloc = 0, rem = 0, rem2 = 0, cfg_stat;
   nl_cb_action stat;
   std::string setname,testname,ctx;
+  struct nlmsghdr *nlh = nlmsg_hdr(msg);
+  bool multi = nlh->nlmsg_flags & NLM_F_MULTI;
 
   /* Version 0.1.0.0 did not report version back from the kernel */
   uint64_t kernel_version = (KTF_VERSION_SET(MAJOR, 0ULL) | KTF_VERSION_SET(MINOR, 1ULL));
 
   if (attrs[KTF_A_VERSION])
     kernel_version = nla_get_u64(attrs[KTF_A_VERSION]);
+  kernel_ktf_version = kernel_version;
 
   /* We only got here if we were compatible enough, log that we had differences */
   if (kernel_version != KTF_VERSION_LATEST)
@@ -804,21 +2196,36 @@ static int parse_query(struct nl_msg *msg, struct nlattr** attrs)
     if (!is_compatible)
       note = "Error";
 
-    fprintf(stderr,
-	    "%s: KTF version difference - user lib %llu.%llu.%llu.%llu, kernel has %llu.%llu.%llu.%llu\n",
-	    note,
-	    KTF_VERSION(MAJOR, KTF_VERSION_LATEST),
-	    KTF_VERSION(MINOR, KTF_VERSION_LATEST),
-	    KTF_VERSION(MICRO, KTF_VERSION_LATEST),
-	    KTF_VERSION(BUILD, KTF_VERSION_LATEST),
-	    KTF_VERSION(MAJOR, kernel_version),
-	    KTF_VERSION(MINOR, kernel_version),
-	    KTF_VERSION(MICRO, kernel_version),
-	    KTF_VERSION(BUILD, kernel_version));
+    /* Every part of a dumped query carries the version, just note it once */
+    if (!multi || !attrs[KTF_A_LIST])
+      fprintf(stderr,
+	      "%s: KTF version difference - user lib %llu.%llu.%llu.%llu, kernel has %llu.%llu.%llu.%llu\n",
+	      note,
+	      KTF_VERSION(MAJOR, KTF_VERSION_LATEST),
+	      KTF_VERSION(MINOR, KTF_VERSION_LATEST),
+	      KTF_VERSION(MICRO, KTF_VERSION_LATEST),
+	      KTF_VERSION(BUILD, KTF_VERSION_LATEST),
+	      KTF_VERSION(MAJOR, kernel_version),
+	      KTF_VERSION(MINOR, kernel_version),
+	      KTF_VERSION(MICRO, kernel_version),
+	      KTF_VERSION(BUILD, kernel_version));
     if (!is_compatible)
       return NL_SKIP;
   }
 
+  if (multi && attrs[KTF_A_GEN] && !attrs[KTF_A_NUM]) {
+    log(KTF_DEBUG, "Test inventory unchanged - using cached copy\n");
+    qdump.unchanged = true;
+    return NL_OK;
+  }
+  if (attrs[KTF_A_GEN])
+    qdump.gen = nla_get_u64(attrs[KTF_A_GEN]);
+  if (multi && !qdump.replay) {
+    size_t off = qdump.raw.size();
+    qdump.raw.resize(off + NLMSG_ALIGN(nlh->nlmsg_len));
+    memcpy(&qdump.raw[off], nlh, nlh->nlmsg_len);
+  }
+
   if (attrs[KTF_A_HLIST]) {
     struct nlattr *nla, *nla2;
     stringvec contexts;
@@ -869,15 +2276,20 @@ static int parse_query(struct nl_msg *msg, struct nlattr** attrs)
   // Now we know enough about contexts and type_ids to actually configure
   // any contexts that needs to be configured, and this must be
   // done before the list of tests gets spanned out because addition
-  // of new contexts can lead to more tests being "generated":
+  // of new contexts can lead to more tests being "generated".
+  // With a dumped query both have to wait until the dump is complete:
   //
-  if (do_context_configure)
-    do_context_configure();
+  if (attrs[KTF_A_NUM]) {
+    if (multi && (do_context_configure || !shard.times.empty()))
+      qdump.defer = true;
+    else if (do_context_configure)
+      do_context_configure();
+  }
 
   if (attrs[KTF_A_NUM]) {
     alloc = nla_get_u32(attrs[KTF_A_NUM]);
     log(KTF_DEBUG, "Kernel offers %d test sets:\n", alloc);
-  } else {
+  } else if (!multi) {
     fprintf(stderr,"No test set count in kernel response??\n");
     return -1;
   }
@@ -892,7 +2304,7 @@ static int parse_query(struct nl_msg *msg, struct nlattr** attrs)
 	setname = nla_get_string(nla);
 	break;
       case KTF_A_TEST:
-	stat = parse_one_set(setname, testname, nla);
+	stat = parse_one_set(setname, testname, nla, qdump.defer);
 	if (stat != NL_OK)
 	  return stat;
 	break;
@@ -908,11 +2320,230 @@ static int parse_query(struct nl_msg *msg, struct nlattr** attrs)
 }
 
 
+/* Parse a COVFN record */
+static cov_function parse_cov_fn(struct nlattr* rec)
+{
+  cov_function f = cov_function();
+  struct nlattr *a;
+  int rem;
+
+  nla_for_each_nested(a, rec, rem) {
+    switch (nla_type(a)) {
+    case KTF_A_MOD:
+      f.module = nla_get_string(a);
+      break;
+    case KTF_A_STR:
+      f.name = nla_get_string(a);
+      break;
+    case KTF_A_DATA:
+      if (nla_len(a) >= (int)sizeof(struct ktf_cov_fn_data)) {
+	struct ktf_cov_fn_data d;
+	memcpy(&d, nla_data(a), sizeof(d));
+	f.address = d.address;
+	f.size = d.size;
+	f.count = d.count;
+      }
+      break;
+    }
+  }
+  return f;
+}
+
+/* Record the functions called by a test, as reported in the RUN response */
+static void parse_test_cov(struct nlattr** attrs)
+{
+  std::string name;
+  struct nlattr *nla;
+  unsigned int called = 0, cnt = 0;
+  int rem;
+
+  if (!test_cov || !attrs[KTF_A_SNAM] || !attrs[KTF_A_TNAM])
+    return;
+  name = std::string(nla_get_string(attrs[KTF_A_SNAM])) + "." + nla_get_string(attrs[KTF_A_TNAM]);
+  if (attrs[KTF_A_STR])
+    name += std::string("_") + nla_get_string(attrs[KTF_A_STR]);
+
+  /* Keep the lines of a test together if tests run from multiple threads */
+  flockfile(test_cov);
+  nla_for_each_nested(nla, attrs[KTF_A_COVRUN], rem) {
+    switch (nla_type(nla)) {
+    case KTF_A_NUM:
+      called = nla_get_u32(nla);
+      break;
+    case KTF_A_COVFN: {
+      cov_function f = parse_cov_fn(nla);
+      fprintf(test_cov, "%s %s %s %llu\n", name.c_str(), f.module.c_str(),
+	      f.name.c_str(), (unsigned long long)f.count);
+      cnt++;
+      break;
+    }
+    }
+  }
+  funlockfile(test_cov);
+  if (cnt < called)
+    fprintf(stderr, "Coverage of %s incomplete: %u of %u called functions reported\n",
+	    name.c_str(), cnt, called);
+  fflush(test_cov);
+}
+
+/* Streamed results, one JSON object per line for each test result received */
+static FILE* jsonl_out = NULL;
+
+int set_jsonl_output(std::string path)
+{
+  FILE* f = (path.empty() || path == "-") ? stdout : fopen(path.c_str(), "w");
+
+  if (!f) {
+    fprintf(stderr, "Unable to open %s: %s\n", path.c_str(), strerror(errno));
+    return -errno;
+  }
+  if (jsonl_out && jsonl_out != stdout)
+    fclose(jsonl_out);
+  jsonl_out = f;
+  return 0;
+}
+
+/* Run times of kernel tests, appended as they are received, for balancing shards */
+static FILE* times_out = NULL;
+
+int set_test_times_output(std::string path)
+{
+  FILE* f = fopen(path.c_str(), "a");
+
+  if (!f) {
+    fprintf(stderr, "Unable to open %s: %s\n", path.c_str(), strerror(errno));
+    return -errno;
+  }
+  if (times_out)
+    fclose(times_out);
+  times_out = f;
+  return 0;
+}
+
+static void write_test_time(struct nlattr** attrs, const struct ktf_test_stats* stats)
+{
+  if (!stats || !attrs[KTF_A_SNAM] || !attrs[KTF_A_TNAM])
+    return;
+  flockfile(times_out);
+  fprintf(times_out, "%s.%s", nla_get_string(attrs[KTF_A_SNAM]), nla_get_string(attrs[KTF_A_TNAM]));
+  if (attrs[KTF_A_STR])
+    fprintf(times_out, "/%s", nla_get_string(attrs[KTF_A_STR]));
+  fprintf(times_out, " %llu\n", (unsigned long long)stats->duration_ns);
+  fflush(times_out);
+  funlockfile(times_out);
+}
+
+static std::string json_str(const char* s)
+{
+  std::string out("\"");
+  char buf[8];
+
+  for (; *s; s++) {
+    switch (*s) {
+    case '"':
+      out += "\\\"";
+      break;
+    case '\\':
+      out += "\\\\";
+      break;
+    case '\n':
+      out += "\\n";
+      break;
+    case '\t':
+      out += "\\t";
+      break;
+    default:
+      if ((unsigned char)*s < 0x20) {
+	snprintf(buf, sizeof(buf), "\\u%04x", *s);
+	out += buf;
+      } else {
+	out += *s;
+      }
+    }
+  }
+  return out + "\"";
+}
+
+static void write_jsonl(struct nlattr** attrs, int stat, int assert_cnt, int fail_cnt,
+			const struct ktf_test_stats* stats, report_vec& failures,
+			point_vec& points)
+{
+  const char* status = stat ? "error" : (fail_cnt ? "failed" : "passed");
+
+  flockfile(jsonl_out);
+  fprintf(jsonl_out, "{\"set\":%s,\"test\":%s",
+	  json_str(attrs[KTF_A_SNAM] ? nla_get_string(attrs[KTF_A_SNAM]) : "").c_str(),
+	  json_str(attrs[KTF_A_TNAM] ? nla_get_string(attrs[KTF_A_TNAM]) : "").c_str());
+  if (attrs[KTF_A_STR])
+    fprintf(jsonl_out, ",\"context\":%s", json_str(nla_get_string(attrs[KTF_A_STR])).c_str());
+  fprintf(jsonl_out, ",\"status\":\"%s\",\"assertions\":%d,\"failures\":%d",
+	  status, assert_cnt, fail_cnt);
+  if (stat)
+    fprintf(jsonl_out, ",\"error\":%d", stat);
+  if (stats)
+    fprintf(jsonl_out, ",\"duration_ns\":%llu", (unsigned long long)stats->duration_ns);
+  fprintf(jsonl_out, ",\"errors\":[");
+  for (size_t i = 0; i < failures.size(); i++)
+    fprintf(jsonl_out, "%s{\"file\":%s,\"line\":%d,\"message\":%s}", i ? "," : "",
+	    json_str(failures[i].file.c_str()).c_str(), failures[i].line,
+	    json_str(failures[i].report.c_str()).c_str());
+  fprintf(jsonl_out, "]");
+  if (!points.empty()) {
+    fprintf(jsonl_out, ",\"points\":[");
+    for (size_t i = 0; i < points.size(); i++) {
+      const struct ktf_sweep_point& sp = points[i].second;
+
+      fprintf(jsonl_out, "%s{\"point\":%d,\"assertions\":%u,\"failures\":%u,"
+	      "\"duration_ns\":%llu}", i ? "," : "", sp.point, sp.assertions,
+	      sp.failures, (unsigned long long)sp.duration_ns);
+    }
+    fprintf(jsonl_out, "]");
+  }
+  fprintf(jsonl_out, "}\n");
+  fflush(jsonl_out);
+  funlockfile(jsonl_out);
+}
+
+/* Deliver a test result to the test framework, or store it
+ * for later replay if it is part of a batched run:
+ */
+static void report_test(test_result* res, report_vec* failures, int result,
+			const char* file, int line, const char* report)
+{
+  if (!result)
+    failures->push_back(test_report(result, file, line, report));
+  if (res)
+    res->reports.push_back(test_report(result, file, line, report));
+  else
+    handle_test(result, file, line, report);
+}
+
 static enum nl_cb_action parse_result(struct nl_msg *msg, struct nlattr** attrs)
 {
   int assert_cnt = 0, fail_cnt = 0;
-  int rem = 0, stat;
+  int rem = 0, stat = 0;
   const char *file = "no_file",*report = "no_report";
+  test_result* res = NULL;
+  report_vec failures;
+  point_vec points;
+  struct ktf_test_stats st;
+  bool has_stats = false;
+
+  if (nlmsg_hdr(msg)->nlmsg_flags & NLM_F_MULTI) {
+    /* Part of the response to a batched run: */
+    if (!attrs[KTF_A_SNAM] || !attrs[KTF_A_TNAM]) {
+      fprintf(stderr, "parse_result: Batched result without test identification\n");
+      return NL_SKIP;
+    }
+    res = batch().find_result(nla_get_string(attrs[KTF_A_SNAM]),
+				   nla_get_string(attrs[KTF_A_TNAM]),
+				   attrs[KTF_A_STR] ? nla_get_string(attrs[KTF_A_STR]) : NULL);
+    if (!res) {
+      fprintf(stderr, "parse_result: Unexpected batched result for %s.%s\n",
+	      nla_get_string(attrs[KTF_A_SNAM]), nla_get_string(attrs[KTF_A_TNAM]));
+      return NL_SKIP;
+    }
+  }
 
   if (attrs[KTF_A_STAT]) {
     stat = nla_get_u32(attrs[KTF_A_STAT]);
@@ -929,7 +2560,7 @@ static enum nl_cb_action parse_result(struct nl_msg *msg, struct nlattr** attrs)
       switch (nla_type(nla)) {
       case KTF_A_STAT:
 	/* Flush previous test, if any */
-	handle_test(result,file,line,report);
+	report_test(res,&failures,result,file,line,report);
 	result = nla_get_u32(nla);
 	/* Our own count and report since check does such a lousy
 	 * job in counting individual checks */
@@ -953,15 +2584,155 @@ static enum nl_cb_action parse_result(struct nl_msg *msg, struct nlattr** attrs)
 	if (!report)
 	  report = "no_report";
 	break;
+      case KTF_A_POINT:
+	/* End of the results of a point of a sweep */
+	if (nla_len(nla) >= (int)sizeof(struct ktf_sweep_point)) {
+	  struct ktf_sweep_point sp;
+
+	  report_test(res,&failures,result,file,line,report);
+	  result = -1;
+	  memcpy(&sp, nla_data(nla), sizeof(sp));
+	  points.push_back(std::make_pair(res ? res->reports.size() : 0, sp));
+	  if (res)
+	    res->points.push_back(points.back());
+	  else if (handle_point)
+	    handle_point(&sp);
+	}
+	break;
       default:
 	fprintf(stderr,"parse_result: Unexpected attribute type %d\n", nla_type(nla));
 	return NL_SKIP;
       }
     }
     /* Handle last test */
-    handle_test(result,file,line,report);
+    report_test(res,&failures,result,file,line,report);
+  }
+
+  if (attrs[KTF_A_BENCH] && nla_len(attrs[KTF_A_BENCH]) >= (int)sizeof(struct ktf_bench_data)) {
+    struct ktf_bench_data bd;
+
+    memcpy(&bd, nla_data(attrs[KTF_A_BENCH]), sizeof(bd));
+    if (res) {
+      res->bench = bd;
+      res->has_bench = true;
+    } else if (handle_bench) {
+      handle_bench(&bd);
+    }
   }
 
+  if (attrs[KTF_A_STATS] && nla_len(attrs[KTF_A_STATS]) >= (int)sizeof(struct ktf_test_stats)) {
+    memcpy(&st, nla_data(attrs[KTF_A_STATS]), sizeof(st));
+    has_stats = true;
+    if (res) {
+      res->stats = st;
+      res->has_stats = true;
+    } else if (handle_stats) {
+      handle_stats(&st);
+    }
+  }
+
+  if (attrs[KTF_A_TGROUP] && nla_len(attrs[KTF_A_TGROUP]) >= (int)sizeof(struct ktf_tgroup_data)) {
+    struct ktf_tgroup_data tg;
+
+    memcpy(&tg, nla_data(attrs[KTF_A_TGROUP]), sizeof(tg));
+    if (res) {
+      res->tgroup = tg;
+      res->has_tgroup = true;
+    } else if (handle_tgroup) {
+      handle_tgroup(&tg);
+    }
+  }
+
+  if (attrs[KTF_A_COVRUN])
+    parse_test_cov(attrs);
+  if (times_out)
+    write_test_time(attrs, has_stats ? &st : NULL);
+  if (jsonl_out)
+    write_jsonl(attrs, stat, assert_cnt, fail_cnt, has_stats ? &st : NULL, failures, points);
+  return NL_OK;
+}
+
+/* Destination of a coverage dump while it is being received by this thread */
+static __thread struct
+{
+  std::vector<cov_function>* functions;
+  std::vector<cov_allocation>* allocations;
+} cdump;
+
+int get_coverage(std::string module, std::vector<cov_function>& functions,
+		 std::vector<cov_allocation>& allocations)
+{
+  struct nl_sock* sock = thread_sock();
+  struct nl_msg *msg;
+  int err;
+
+  if (!sock)
+    return -ENOTCONN;
+
+  msg = nlmsg_alloc();
+  genlmsg_put(msg, NL_AUTO_PID, NL_AUTO_SEQ, family, 0, NLM_F_REQUEST | NLM_F_DUMP,
+	      KTF_C_COV, 1);
+  nla_put_u64(msg, KTF_A_VERSION, KTF_VERSION_LATEST);
+  if (module.size())
+    nla_put_string(msg, KTF_A_MOD, module.c_str());
+
+  // Send message over netlink socket
+  nl_send_auto_complete(sock, msg);
+
+  // Free message
+  nlmsg_free(msg);
+
+  // A dump is not acked, the records arrive as a multipart
+  // sequence of COV messages terminated by NLMSG_DONE:
+  cdump.functions = &functions;
+  cdump.allocations = &allocations;
+  err = nl_recvmsgs_default(sock);
+  cdump.functions = NULL;
+  cdump.allocations = NULL;
+  return err < 0 ? err : 0;
+}
+
+static enum nl_cb_action parse_cov_dump(struct nl_msg *msg, struct nlattr** attrs)
+{
+  struct nlattr *nla, *a;
+  int rem, arem;
+
+  if (!cdump.functions) {
+    fprintf(stderr, "parse_cov_dump: Unexpected coverage dump\n");
+    return NL_SKIP;
+  }
+
+  nla_for_each_nested(nla, attrs[KTF_A_LIST], rem) {
+    switch (nla_type(nla)) {
+    case KTF_A_COVFN:
+      cdump.functions->push_back(parse_cov_fn(nla));
+      break;
+    case KTF_A_COVMEM: {
+      cov_allocation m = cov_allocation();
+
+      nla_for_each_nested(a, nla, arem) {
+	switch (nla_type(a)) {
+	case KTF_A_DATA:
+	  if (nla_len(a) >= (int)sizeof(struct ktf_cov_mem_data)) {
+	    struct ktf_cov_mem_data d;
+	    memcpy(&d, nla_data(a), sizeof(d));
+	    m.count = d.count;
+	    m.bytes = d.bytes;
+	  }
+	  break;
+	case KTF_A_STR:
+	  m.stack.push_back(nla_get_string(a));
+	  break;
+	}
+      }
+      cdump.allocations->push_back(m);
+      break;
+    }
+    default:
+      fprintf(stderr,"parse_cov_dump[LIST]: Unexpected attribute type %d\n", nla_type(nla));
+      return NL_SKIP;
+    }
+  }
   return NL_OK;
 }
 
@@ -976,6 +2747,246 @@ static enum nl_cb_action parse_cov_endis(struct nl_msg *msg, struct nlattr** att
   return NL_OK;
 }
 
+/* Subscription to the kernel's notifications of changes */
+static struct
+{
+  struct nl_sock* sock;
+  event_handler handler;
+  int count;		  /* Events handled by the current process_events() */
+} events;
+
+static void erase_name(stringvec& v, const std::string& name)
+{
+  stringvec::iterator it = std::find(v.begin(), v.end(), name);
+  if (it != v.end())
+    v.erase(it);
+}
+
+/* The functions below are called with the lock held for writing */
+ConfigurableContext* KernelTestMgr::find_context(const std::string& ctx, unsigned int hid)
+{
+  std::map<std::string, context_vector>::iterator it = cfg_contexts.find(ctx);
+  if (it == cfg_contexts.end())
+    return NULL;
+  for (context_vector::iterator cit = it->second.begin(); cit != it->second.end(); ++cit)
+    if ((unsigned int)(*cit)->handle_id == hid)
+      return *cit;
+  return NULL;
+}
+
+/* Add or remove the names of the tests of handle hid in context ctx */
+void KernelTestMgr::add_test_context(unsigned int hid, const std::string& ctx)
+{
+  for (setmap::iterator sit = sets.begin(); sit != sets.end(); ++sit)
+    for (testmap::iterator tit = sit->second.tests.begin(); tit != sit->second.tests.end(); ++tit)
+      if (tit->second->handle_id == hid)
+	sit->second.test_names.push_back(tit->first + "_" + ctx);
+}
+
+void KernelTestMgr::remove_test_context(unsigned int hid, const std::string& ctx)
+{
+  for (setmap::iterator sit = sets.begin(); sit != sets.end(); ++sit)
+    for (testmap::iterator tit = sit->second.tests.begin(); tit != sit->second.tests.end(); ++tit)
+      if (tit->second->handle_id == hid)
+	erase_name(sit->second.test_names, tit->first + "_" + ctx);
+}
+
+void KernelTestMgr::remove_test(const std::string& setname, const std::string& testname)
+{
+  setmap::iterator sit = sets.find(setname);
+  if (sit == sets.end())
+    return;
+  testset& ts = sit->second;
+  testmap::iterator tit = ts.tests.find(testname);
+  if (tit == ts.tests.end())
+    return;
+
+  KernelTest* kt = tit->second;
+  if (!kt->handle_id)
+    erase_name(ts.test_names, testname);
+  else {
+    stringvec& ctxv = handle_to_ctxvec[kt->handle_id];
+    for (stringvec::iterator it = ctxv.begin(); it != ctxv.end(); ++it)
+      erase_name(ts.test_names, testname + "_" + *it);
+  }
+  erase_name(test_names, testname);
+
+  /* Keep any user part of the test for when the kernel test comes back */
+  if (kt->user_test)
+    ts.wrapper[testname] = kt->user_test;
+  ts.tests.erase(tit);
+
+  /* Lookups, batches and the gtest objects of the test keep pointers to
+   * it beyond the lock, so it is only deleted with the manager. Runs of it
+   * meanwhile get the kernel's answer for a test that is gone:
+   */
+  removed_tests.push_back(kt);
+}
+
+void KernelTestMgr::remove_set(const std::string& setname)
+{
+  if (!kernelsets.erase(setname))
+    return;
+  erase_name(set_names, setname);
+  setmap::iterator sit = sets.find(setname);
+  if (sit != sets.end() && sit->second.tests.empty() && sit->second.wrapper.empty())
+    sets.erase(sit);
+}
+
+void KernelTestMgr::apply_event(const registry_event& ev)
+{
+  std::string setname(ev.setname);
+  ConfigurableContext* c;
+  KernelTest* kt;
+
+  pthread_rwlock_wrlock(&lock);
+  switch (ev.type) {
+  case KTF_EV_SET_ADD:
+    find_add_set(setname);
+    break;
+  case KTF_EV_SET_DEL:
+    remove_set(setname);
+    break;
+  case KTF_EV_TEST_ADD:
+    /* A test is announced again if its handle got a new ID */
+    kt = lookup(setname, ev.name);
+    if (kt && kt->handle_id != ev.handle_id) {
+      remove_test(setname, ev.name);
+      kt = NULL;
+    }
+    if (!kt && in_hash_shard(setname, ev.name.c_str()))
+      add_test(setname, ev.name.c_str(), ev.handle_id);
+    break;
+  case KTF_EV_TEST_DEL:
+    remove_test(setname, ev.name);
+    break;
+  case KTF_EV_CTX_ADD:
+    {
+      stringvec& ctxv = handle_to_ctxvec[ev.handle_id];
+      if (std::find(ctxv.begin(), ctxv.end(), ev.name) == ctxv.end()) {
+	ctxv.push_back(ev.name);
+	add_test_context(ev.handle_id, ev.name);
+      }
+    }
+    if (ev.module.empty())
+      break;
+    c = find_context(ev.name, ev.handle_id);
+    if (c)
+      c->cfg_stat = ev.cfg_stat;
+    else
+      cfg_contexts[ev.name].push_back(new ConfigurableContext(ev.name, ev.module,
+							      ev.handle_id, ev.cfg_stat));
+    break;
+  case KTF_EV_CTX_DEL:
+    remove_test_context(ev.handle_id, ev.name);
+    erase_name(handle_to_ctxvec[ev.handle_id], ev.name);
+    /* Other threads may still refer to the context, and configuring it
+     * again creates a new one if its type allows that:
+     */
+    c = find_context(ev.name, ev.handle_id);
+    if (c)
+      c->cfg_stat = ENODEV;
+    break;
+  case KTF_EV_CTX_CFG:
+    c = find_context(ev.name, ev.handle_id);
+    if (c)
+      c->cfg_stat = ev.cfg_stat;
+    break;
+  }
+  pthread_rwlock_unlock(&lock);
+}
+
+static int parse_event(struct nl_msg *msg, struct nlattr** attrs)
+{
+  registry_event ev = registry_event();
+
+  if (!attrs[KTF_A_VERSION] || !attrs[KTF_A_EVENT] ||
+      KTF_VERSION(MAJOR, nla_get_u64(attrs[KTF_A_VERSION])) != KTF_VERSION(MAJOR, KTF_VERSION_LATEST) ||
+      KTF_VERSION(MINOR, nla_get_u64(attrs[KTF_A_VERSION])) != KTF_VERSION(MINOR, KTF_VERSION_LATEST))
+    return NL_SKIP;
+
+  ev.type = nla_get_u32(attrs[KTF_A_EVENT]);
+  if (attrs[KTF_A_GEN])
+    ev.gen = nla_get_u64(attrs[KTF_A_GEN]);
+  if (attrs[KTF_A_SNAM])
+    ev.setname = nla_get_string(attrs[KTF_A_SNAM]);
+  if (attrs[KTF_A_TNAM])
+    ev.name = nla_get_string(attrs[KTF_A_TNAM]);
+  else if (attrs[KTF_A_STR])
+    ev.name = nla_get_string(attrs[KTF_A_STR]);
+  if (attrs[KTF_A_MOD])
+    ev.module = nla_get_string(attrs[KTF_A_MOD]);
+  if (attrs[KTF_A_HID])
+    ev.handle_id = nla_get_u32(attrs[KTF_A_HID]);
+  if (attrs[KTF_A_STAT])
+    ev.cfg_stat = nla_get_u32(attrs[KTF_A_STAT]);
+  log(KTF_DEBUG, "event %u: %s %s %s (hid %u) gen %llu\n", ev.type, ev.setname.c_str(),
+      ev.name.c_str(), ev.module.c_str(), ev.handle_id, (unsigned long long)ev.gen);
+
+  kmgr().apply_event(ev);
+  if (events.handler)
+    events.handler(ev);
+  events.count++;
+  return NL_OK;
+}
+
+int subscribe_events(event_handler eh)
+{
+  struct nl_sock* sock;
+  int grp, err;
+
+  if (events.sock)
+    return -EBUSY;
+  sock = nl_open();
+  if (!sock)
+    return -ENOTCONN;
+
+  grp = genl_ctrl_resolve_grp(sock, "ktf", KTF_MCGRP_EVENTS);
+  if (grp < 0) {
+    fprintf(stderr, "No event group in the ktf netlink family - is the ktf module too old?\n");
+    nl_socket_free(sock);
+    return -ENOENT;
+  }
+  err = nl_socket_add_membership(sock, grp);
+  if (err) {
+    nl_socket_free(sock);
+    return -EINVAL;
+  }
+  /* Events are not responses to requests from this socket */
+  nl_socket_disable_seq_check(sock);
+  nl_socket_set_nonblocking(sock);
+  events.sock = sock;
+  events.handler = eh;
+  return nl_socket_get_fd(sock);
+}
+
+int process_events()
+{
+  int err;
+
+  if (!events.sock)
+    return -ENOTCONN;
+  events.count = 0;
+  do {
+    err = nl_recvmsgs_default(events.sock);
+  } while (err >= 0);
+
+  /* libnl reports an overflow of the receive buffer (ENOBUFS) as NLE_NOMEM */
+  if (err == -NLE_NOMEM)
+    return -ENOBUFS;
+  if (err != -NLE_AGAIN)
+    log(KTF_INFO, "Failed to receive events: %s\n", nl_geterror(err));
+  return events.count;
+}
+
+void unsubscribe_events()
+{
+  if (events.sock)
+    nl_socket_free(events.sock);
+  events.sock = NULL;
+  events.handler = NULL;
+}
+
 static int parse_cb(struct nl_msg *msg, void *arg)
 {
   ktf_cmd cmd;
@@ -995,7 +3006,11 @@ static int parse_cb(struct nl_msg *msg, void *arg)
   case KTF_C_RUN:
     return parse_result(msg, attrs);
   case KTF_C_COV:
+    if (attrs[KTF_A_LIST])
+      return parse_cov_dump(msg, attrs);
     return parse_cov_endis(msg, attrs);
+  case KTF_C_EVENT:
+    return parse_event(msg, attrs);
   default:
     debug_cb(msg, attrs);
   }
@@ -19,18 +19,40 @@
 
 typedef std::vector<std::string> stringvec;
 
+struct ktf_bench_data;
+struct ktf_test_stats;
+struct ktf_tgroup_data;
+struct ktf_sweep_point;
+
 namespace ktf
 {
 
   /* A callback handler to be called for each assertion result */
   typedef void (*test_handler)(int result,  const char* file, int line, const char* report);
 
+  /* A callback handler to be called with the results of a kernel benchmark */
+  typedef void (*bench_handler)(const struct ktf_bench_data* bd);
+  void set_bench_handler(bench_handler bh);
+
+  /* A callback handler to be called with the resources used by a kernel test run */
+  typedef void (*stats_handler)(const struct ktf_test_stats* st);
+  void set_stats_handler(stats_handler sh);
+
+  /* A callback handler to be called with the measurements of a kernel thread group */
+  typedef void (*tgroup_handler)(const struct ktf_tgroup_data* tg);
+  void set_tgroup_handler(tgroup_handler th);
+
+  /* A callback handler to be called with the outcome of each point of a kernel sweep */
+  typedef void (*point_handler)(const struct ktf_sweep_point* sp);
+  void set_point_handler(point_handler ph);
+
   class KernelTest
   {
   public:
     KernelTest(const std::string& setname, const char* testname, unsigned int handle_id);
     ~KernelTest();
     void* get_priv(size_t priv_sz);
+    void* get_shared_priv(size_t priv_sz);
     size_t get_priv_sz(KernelTest *kt);
     std::string setname;
     std::string testname;
@@ -40,6 +62,7 @@ namespace ktf
     size_t testnum; /* This test's index (test number) in the kernel */
     void* user_priv;  /* Optional private data for the test */
     size_t user_priv_sz; /* Size of the user_priv data if used */
+    bool user_priv_shared; /* user_priv is a buffer shared with the kernel */
     test_cb* user_test;  /* Optional user level wrapper function for the kernel test */
     char* file;
     int line;
@@ -59,12 +82,26 @@ namespace ktf
   /* Query kernel for available tests in index order */
   stringvec& query_testsets();
 
+  /* Time a complete dumped query of the tests, as for query_testsets(), but
+   * without the query cache and without registering the tests. Returns the
+   * time in nanoseconds, or -errno, with the number of tests and contexts
+   * reported in @entries:
+   */
+  long long time_query(size_t* entries);
+
   stringvec get_testsets();
   std::string get_current_setname();
   stringvec get_test_names();
 
   /* "private" - only run from gtest framework */
   void run_test(KernelTest* test, std::string& ctx);
+
+  /* Batched execution: Queue up the tests selected to run, in the order they will run.
+   * A NULL test (or a hybrid test) is queued as a barrier for batching:
+   */
+  void batch_reset();
+  void batch_add(KernelTest* test, const std::string& ctx);
+  bool is_kernel_set(const std::string& setname);
 } // end namespace ktf
 
 
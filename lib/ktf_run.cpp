@@ -12,7 +12,12 @@
 #include "ktf_int.h"
 #include <assert.h>
 #include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <map>
 #include "ktf_debug.h"
+#include "kernel/ktf_unlproto.h"
 
 namespace ktf
 {
@@ -96,9 +101,39 @@ public:
   }
 };
 
+/* Queue up the kernel tests selected by the gtest filter for batched execution */
+class KernelBatchListener : public ::testing::EmptyTestEventListener
+{
+public:
+  virtual void OnTestIterationStart(const ::testing::UnitTest& unit_test, int iteration)
+  {
+    ktf::batch_reset();
+    for (int i = 0; i < unit_test.total_test_case_count(); i++) {
+      const ::testing::TestCase* tc = unit_test.GetTestCase(i);
+      std::string setname(tc->name());
+      bool kernel_set = is_kernel_set(setname);
+
+      for (int j = 0; j < tc->total_test_count(); j++) {
+	const ::testing::TestInfo* ti = tc->GetTestInfo(j);
+	std::string ctx;
+	if (!ti->should_run())
+	  continue;
+	if (kernel_set)
+	  ktf::batch_add(ktf::find_test(setname, ti->name(), &ctx), ctx);
+	else
+	  ktf::batch_add(NULL, ctx);
+      }
+    }
+  }
+};
+
 testing::internal::ParamGenerator<Kernel::ParamType> gtest_query_tests(void);
 std::string gtest_name_from_info(const testing::TestParamInfo<Kernel::ParamType>&);
 void gtest_handle_test(int result,  const char* file, int line, const char* report);
+void gtest_handle_bench(const struct ktf_bench_data* bd);
+void gtest_handle_stats(const struct ktf_test_stats* st);
+void gtest_handle_tgroup(const struct ktf_tgroup_data* tg);
+void gtest_handle_point(const struct ktf_sweep_point* sp);
 
 #ifndef INSTANTIATE_TEST_SUITE_P
 /* This rename happens in Googletest commit 3a460a26b7.
@@ -110,6 +145,10 @@ void gtest_handle_test(int result,  const char* file, int line, const char* repo
 int Kernel::AddToRegistry()
 {
   if (!ktf::setup(ktf::gtest_handle_test)) return 1;
+  ktf::set_bench_handler(ktf::gtest_handle_bench);
+  ktf::set_stats_handler(ktf::gtest_handle_stats);
+  ktf::set_tgroup_handler(ktf::gtest_handle_tgroup);
+  ktf::set_point_handler(ktf::gtest_handle_point);
 
   /* Run query against kernel to figure out which tests that exists: */
   stringvec& t = ktf::query_testsets();
@@ -125,6 +164,8 @@ int Kernel::AddToRegistry()
   }
 
   tci->AddTestSuiteInstantiation("", &gtest_query_tests, &gtest_name_from_info, NULL, 0);
+
+  ::testing::UnitTest::GetInstance()->listeners().Append(new KernelBatchListener());
   return 0;
 }
 
@@ -163,6 +204,204 @@ void gtest_handle_test(int result,  const char* file, int line, const char* repo
   }
 }
 
+static void record_u64(const char* key, unsigned long long value)
+{
+  char buf[32];
+
+  snprintf(buf, sizeof(buf), "%llu", value);
+  ::testing::Test::RecordProperty(key, buf);
+}
+
+/* Benchmark baselines, as lines of "<test> <median_ns> <p99_ns>" in a file */
+struct bench_baseline
+{
+  bench_baseline(unsigned long long m = 0, unsigned long long p = 0)
+    : median_ns(m), p99_ns(p)
+  { }
+
+  unsigned long long median_ns;
+  unsigned long long p99_ns;
+};
+
+typedef std::map<std::string, bench_baseline> baseline_map;
+
+static baseline_map baseline;	    /* The baseline to compare against */
+static double baseline_threshold;   /* Allowed regression in percent */
+static baseline_map new_baseline;   /* The baseline to write, if requested */
+static pthread_mutex_t new_baseline_lock = PTHREAD_MUTEX_INITIALIZER;
+static std::string new_baseline_path;
+
+static int read_baseline(const std::string& path, baseline_map& m)
+{
+  FILE* f = fopen(path.c_str(), "r");
+  unsigned long long median, p99;
+  char line[1024], name[512];
+
+  if (!f)
+    return -errno;
+  while (fgets(line, sizeof(line), f)) {
+    if (line[0] == '#')
+      continue;
+    if (sscanf(line, "%511s %llu %llu", name, &median, &p99) == 3)
+      m[name] = bench_baseline(median, p99);
+  }
+  fclose(f);
+  return 0;
+}
+
+static int write_baseline(const std::string& path, baseline_map& m)
+{
+  FILE* f = fopen(path.c_str(), "w");
+
+  if (!f)
+    return -errno;
+  fprintf(f, "# test median_ns p99_ns\n");
+  for (baseline_map::iterator it = m.begin(); it != m.end(); ++it)
+    fprintf(f, "%s %llu %llu\n", it->first.c_str(), it->second.median_ns, it->second.p99_ns);
+  fclose(f);
+  return 0;
+}
+
+/* Write the new baseline when all tests have run */
+class BaselineListener : public ::testing::EmptyTestEventListener
+{
+public:
+  virtual void OnTestIterationEnd(const ::testing::UnitTest& unit_test, int iteration)
+  {
+    int ret = write_baseline(new_baseline_path, new_baseline);
+
+    if (ret)
+      fprintf(stderr, "Unable to write baseline %s: %s\n", new_baseline_path.c_str(),
+	      strerror(-ret));
+  }
+};
+
+int set_bench_baseline(std::string path, double threshold)
+{
+  int ret = read_baseline(path, baseline);
+
+  if (ret)
+    fprintf(stderr, "Unable to read baseline %s: %s\n", path.c_str(), strerror(-ret));
+  baseline_threshold = threshold;
+  return ret;
+}
+
+int set_bench_baseline_output(std::string path)
+{
+  int ret = read_baseline(path, new_baseline);
+
+  if (ret && ret != -ENOENT) {
+    fprintf(stderr, "Unable to read baseline %s: %s\n", path.c_str(), strerror(-ret));
+    return ret;
+  }
+  if (new_baseline_path.empty())
+    ::testing::UnitTest::GetInstance()->listeners().Append(new BaselineListener());
+  new_baseline_path = path;
+  return 0;
+}
+
+static void check_bench_value(const std::string& name, const char* what,
+			      unsigned long long value, unsigned long long base)
+{
+  if (base && value > base * (1.0 + baseline_threshold / 100.0))
+    ADD_FAILURE() << name << ": " << what << " iteration time " << value
+		  << " ns is more than " << baseline_threshold
+		  << "% above the baseline of " << base << " ns";
+}
+
+static void check_bench_baseline(const struct ktf_bench_data* bd)
+{
+  const ::testing::TestInfo* ti = ::testing::UnitTest::GetInstance()->current_test_info();
+  std::string name;
+  baseline_map::iterator it;
+
+  if (!ti)
+    return;
+  name = std::string(ti->test_case_name()) + "." + ti->name();
+  if (!new_baseline_path.empty()) {
+    pthread_mutex_lock(&new_baseline_lock);
+    new_baseline[name] = bench_baseline(bd->median_ns, bd->p99_ns);
+    pthread_mutex_unlock(&new_baseline_lock);
+  }
+
+  it = baseline.find(name);
+  if (it == baseline.end())
+    return;
+  check_bench_value(name, "median", bd->median_ns, it->second.median_ns);
+  check_bench_value(name, "p99", bd->p99_ns, it->second.p99_ns);
+}
+
+/* Benchmark results are shown with the test, and recorded as properties
+ * of the test to have them in the XML/JSON output of gtest:
+ */
+void gtest_handle_bench(const struct ktf_bench_data* bd)
+{
+  printf("[  BENCH   ] %llu iterations: min/median/p99/max %llu/%llu/%llu/%llu ns"
+	 " (%llu/%llu/%llu/%llu cycles)\n",
+	 (unsigned long long)bd->iterations,
+	 (unsigned long long)bd->min_ns, (unsigned long long)bd->median_ns,
+	 (unsigned long long)bd->p99_ns, (unsigned long long)bd->max_ns,
+	 (unsigned long long)bd->min_cycles, (unsigned long long)bd->median_cycles,
+	 (unsigned long long)bd->p99_cycles, (unsigned long long)bd->max_cycles);
+  record_u64("iterations", bd->iterations);
+  record_u64("min_ns", bd->min_ns);
+  record_u64("median_ns", bd->median_ns);
+  record_u64("p99_ns", bd->p99_ns);
+  record_u64("max_ns", bd->max_ns);
+  record_u64("min_cycles", bd->min_cycles);
+  record_u64("median_cycles", bd->median_cycles);
+  record_u64("p99_cycles", bd->p99_cycles);
+  record_u64("max_cycles", bd->max_cycles);
+  check_bench_baseline(bd);
+}
+
+/* Resource usage of kernel tests is only recorded as test properties */
+void gtest_handle_stats(const struct ktf_test_stats* st)
+{
+  record_u64("kernel_ns", st->duration_ns);
+  record_u64("cpu", st->cpu);
+  record_u64("nvcsw", st->nvcsw);
+  record_u64("nivcsw", st->nivcsw);
+  if (st->flags & KTF_STATS_MEM) {
+    record_u64("mem_alloc", st->mem_alloc);
+    record_u64("mem_freed", st->mem_freed);
+  }
+}
+
+/* Thread group measurements are shown and recorded like benchmark results */
+void gtest_handle_tgroup(const struct ktf_tgroup_data* tg)
+{
+  printf("[  TGROUP  ] %u threads on %u cpus: %llu ops in %llu ns, %llu ops/s"
+	 " (per thread %llu-%llu ops, %llu-%llu ns)\n",
+	 tg->threads, tg->cpus, (unsigned long long)tg->ops,
+	 (unsigned long long)tg->duration_ns, (unsigned long long)tg->ops_per_sec,
+	 (unsigned long long)tg->min_ops, (unsigned long long)tg->max_ops,
+	 (unsigned long long)tg->min_ns, (unsigned long long)tg->max_ns);
+  record_u64("threads", tg->threads);
+  record_u64("thread_cpus", tg->cpus);
+  record_u64("ops", tg->ops);
+  record_u64("group_ns", tg->duration_ns);
+  record_u64("ops_per_sec", tg->ops_per_sec);
+  record_u64("thread_min_ns", tg->min_ns);
+  record_u64("thread_max_ns", tg->max_ns);
+  record_u64("thread_min_ops", tg->min_ops);
+  record_u64("thread_max_ops", tg->max_ops);
+}
+
+/* Each point of a sweep is shown after its failures, if any, and its run
+ * time is recorded as the property "point_<point>_ns" of the test:
+ */
+void gtest_handle_point(const struct ktf_sweep_point* sp)
+{
+  char key[32];
+
+  printf("[  POINT   ] %d: %s, %u assertions, %u failed, %llu ns\n", sp->point,
+	 sp->failures ? "FAILED" : "OK", sp->assertions + sp->failures, sp->failures,
+	 (unsigned long long)sp->duration_ns);
+  snprintf(key, sizeof(key), "point_%d_ns", sp->point);
+  record_u64(key, sp->duration_ns);
+}
+
 testing::internal::ParamGenerator<Kernel::ParamType> gtest_query_tests()
 {
   return testing::ValuesIn(ktf::get_test_names());
@@ -3,7 +3,7 @@ ktf_syms = $(ktf_symfile:%.txt=%.h)
 
 ifneq ($(ktf_symfile),)
 
-$(obj)/self.o: $(obj)/$(ktf_syms)
+$(obj)/self.o $(obj)/ktfbench.o: $(obj)/$(ktf_syms)
 
 ktf_scripts = $(srctree)/$(src)/../scripts
 
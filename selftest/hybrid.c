@@ -12,22 +12,48 @@
  * "out-of-band" data from user space:
  */
 
-TEST(selftest, msg)
+/* Accept data of type 'struct hybrid_self_params' (defined in hybrid_self.h)
+ * from user mode. This functionality is to allow user mode to test something,
+ * for instance that a certain parameter is handled in a specific way in the kernel.
+ * The user then has the option to provide data to the kernel out-of-band to
+ * tell the kernel side what to expect.
+ * In these tests, just verify that data has been transmitted correctly:
+ */
+static void hybrid_check_msg(struct ktf_test *self)
 {
-	/* Accept data of type 'struct hybrid_self_params' (defined in hybrid_self.h)
-	 * from user mode. This functionality is to allow user mode to test something,
-	 * for instance that a certain parameter is handled in a specific way in the kernel.
-	 * The user then has the option to provide data to the kernel out-of-band to
-	 * tell the kernel side what to expect.
-	 * In this test, just verify that data has been transmitted correctly:
-	 */
 	KTF_USERDATA(self, hybrid_self_params, data);
 
 	EXPECT_STREQ(data->text_val, HYBRID_MSG);
 	EXPECT_LONG_EQ(data->val, HYBRID_MSG_VAL);
 }
 
+TEST(selftest, msg)
+{
+	hybrid_check_msg(self);
+}
+
+/* Same as msg, but queued multiple times from user mode with ktf::run_async() */
+TEST(selftest, msg_async)
+{
+	hybrid_check_msg(self);
+}
+
+/* Same as msg, but run concurrently from multiple user threads */
+TEST(selftest, msg_threads)
+{
+	hybrid_check_msg(self);
+}
+
+/* Same as msg, but with the data in memory shared with user mode */
+TEST(selftest, msg_shared)
+{
+	hybrid_check_msg(self);
+}
+
 void add_hybrid_tests(void)
 {
 	ADD_TEST(msg);
+	ADD_TEST(msg_async);
+	ADD_TEST(msg_threads);
+	ADD_TEST(msg_shared);
 }
@@ -0,0 +1,249 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (c) 2019, Oracle and/or its affiliates. All rights reserved.
+ *
+ * ktfbench.c: Benchmarks of KTF's own overhead, run by user/ktfbench.cpp:
+ *   The cost of assertions, of an iteration of a benchmark and of a
+ *   function call with coverage enabled, ktf_map operations against the
+ *   size of the map, and assertions and map lookups against the number of
+ *   concurrent threads. The registry can be grown with contexts configured
+ *   from user space, to measure queries and runs against its size.
+ */
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+
+#include "ktf.h"
+#include "ktf_map.h"
+#include "ktf_syms.h"
+
+#include "ktfbench.h"
+
+MODULE_LICENSE("GPL");
+
+KTF_INIT();
+
+/* The contexts added from user space to grow the registry */
+static KTF_HANDLE_INIT(reg_handle);
+
+/* Nothing to do: A run of this measures the round trip to the kernel */
+TEST(ktfbench, empty)
+{
+}
+
+/* The same for each context added from user space */
+TEST(ktfbench, reg)
+{
+	ASSERT_ADDR_NE(ctx, NULL);
+}
+
+/* The overhead of an iteration of a benchmark */
+BENCH(ktfbench, iteration)
+{
+}
+
+BENCH(ktfbench, assert)
+{
+	int i;
+
+	for (i = 0; i < KTFBENCH_ASSERTS; i++)
+		EXPECT_TRUE(i >= 0);
+}
+
+static noinline int ktfbench_called(int i)
+{
+	return i + 1;
+}
+
+/* The cost of a call of a function in this module, which the driver runs
+ * with and without coverage enabled for the module:
+ */
+BENCH(ktfbench, call)
+{
+	int i, sum = 0;
+
+	for (i = 0; i < KTFBENCH_CALLS; i++)
+		sum += ktfbench_called(i);
+	EXPECT_INT_EQ(sum, KTFBENCH_CALLS * (KTFBENCH_CALLS + 1) / 2);
+}
+
+/* A map of n elements with string keys, as the maps of the registry */
+struct ktfbench_map {
+	struct ktf_map map;
+	struct ktf_map_elem *elems;
+	unsigned int n;
+};
+
+static void ktfbench_key(char *key, unsigned int i)
+{
+	snprintf(key, KTF_MAX_KEY, "ktfbench_elem_%08u", i);
+}
+
+static int ktfbench_map_fill(struct ktfbench_map *m, unsigned int n)
+{
+	unsigned int i;
+	char key[KTF_MAX_KEY];
+	int ret;
+
+	ktf_map_init(&m->map, NULL, NULL);
+	m->elems = vzalloc(n * sizeof(*m->elems));
+	if (!m->elems)
+		return -ENOMEM;
+	m->n = n;
+	for (i = 0; i < n; i++) {
+		/* Spread the keys across the tree in a pseudo random order */
+		ktfbench_key(key, (i * 2654435761U) % n);
+		ret = ktf_map_elem_init(&m->elems[i], key);
+		if (!ret)
+			ret = ktf_map_insert(&m->map, &m->elems[i]);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+static void ktfbench_map_free(struct ktfbench_map *m)
+{
+	ktf_map_delete_all(&m->map);
+	vfree(m->elems);
+	m->elems = NULL;
+}
+
+static unsigned int ktfbench_map_find(struct ktfbench_map *m, unsigned int i)
+{
+	char key[KTF_MAX_KEY];
+	struct ktf_map_elem *elem;
+
+	ktfbench_key(key, i % m->n);
+	elem = ktf_map_find(&m->map, key);
+	if (!elem)
+		return 0;
+	ktf_map_elem_put(elem);
+	return 1;
+}
+
+/* Sweeps over map sizes: Building and removing a map of 1 << _i elements,
+ * and the same with KTFBENCH_FIND_ROUNDS lookups of each element. The
+ * driver takes the difference between the two as the time of the lookups:
+ */
+TEST(ktfbench, map_insert)
+{
+	struct ktfbench_map m;
+
+	EXPECT_INT_EQ(ktfbench_map_fill(&m, 1U << _i), 0);
+	ktfbench_map_free(&m);
+}
+
+TEST(ktfbench, map_find)
+{
+	unsigned int i, found = 0, n = 1U << _i;
+	struct ktfbench_map m;
+
+	ASSERT_INT_EQ_GOTO(ktfbench_map_fill(&m, n), 0, done);
+	for (i = 0; i < n * KTFBENCH_FIND_ROUNDS; i++)
+		found += ktfbench_map_find(&m, i);
+	EXPECT_INT_EQ(found, n * KTFBENCH_FIND_ROUNDS);
+done:
+	ktfbench_map_free(&m);
+}
+
+/* Sweeps over the number of threads, one per CPU as far as there are CPUs,
+ * each doing KTFBENCH_MT_OPS assertions or lookups in a map shared by all:
+ */
+KTF_TGROUP_THREAD(assert_thread)
+{
+	int i;
+
+	for (i = 0; i < KTFBENCH_MT_OPS; i++)
+		EXPECT_TRUE(i >= 0);
+	_thread->ops = KTFBENCH_MT_OPS;
+}
+
+KTF_TGROUP_THREAD(map_thread)
+{
+	struct ktfbench_map *m = _thread->tg->arg;
+	unsigned int i, found = 0;
+
+	for (i = 0; i < KTFBENCH_MT_OPS; i++)
+		found += ktfbench_map_find(m, i + _thread->index);
+	EXPECT_INT_EQ(found, KTFBENCH_MT_OPS);
+	_thread->ops = KTFBENCH_MT_OPS;
+}
+
+static struct ktf_tgroup assert_tgroup;
+static struct ktf_tgroup map_tgroup;
+
+TEST(ktfbench, assert_mt)
+{
+	KTF_TGROUP_INIT(assert_thread, &assert_tgroup, _i, NULL);
+	EXPECT_INT_EQ(ktf_tgroup_run(&assert_tgroup, NULL), 0);
+	ktf_tgroup_cleanup(&assert_tgroup);
+}
+
+TEST(ktfbench, map_mt)
+{
+	struct ktfbench_map m;
+
+	ASSERT_INT_EQ_GOTO(ktfbench_map_fill(&m, 1U << KTFBENCH_MT_MAP_ORDER), 0, done);
+	KTF_TGROUP_INIT(map_thread, &map_tgroup, _i, &m);
+	EXPECT_INT_EQ(ktf_tgroup_run(&map_tgroup, NULL), 0);
+	ktf_tgroup_cleanup(&map_tgroup);
+done:
+	ktfbench_map_free(&m);
+}
+
+/* Contexts of type KTFBENCH_REG_TYPE, created when configured from user space */
+static int reg_ctx_cb(struct ktf_context *ctx, const void *data, size_t data_sz)
+{
+	return data_sz == sizeof(struct ktfbench_reg_cfg) ? 0 : -EINVAL;
+}
+
+static struct ktf_context *reg_ctx_alloc(struct ktf_context_type *ct)
+{
+	return kzalloc(sizeof(struct ktf_context), GFP_KERNEL);
+}
+
+static void reg_ctx_cleanup(struct ktf_context *ctx)
+{
+	kfree(ctx);
+}
+
+static struct ktf_context_type reg_type = {
+	.alloc = reg_ctx_alloc,
+	.config_cb = reg_ctx_cb,
+	.cleanup = reg_ctx_cleanup,
+	.name = KTFBENCH_REG_TYPE,
+};
+
+static int __init ktfbench_init(void)
+{
+	int ret = ktf_resolve_symbols();
+
+	if (ret)
+		return ret;
+	ret = ktf_handle_add_ctx_type(&reg_handle, &reg_type);
+	if (ret)
+		return ret;
+
+	ADD_TEST(empty);
+	ADD_TEST_TO(reg_handle, reg);
+	ADD_BENCH_NOPREEMPT(iteration, 10000);
+	ADD_BENCH(assert, 1000);
+	ADD_BENCH(call, 1000);
+	ADD_SWEEP_TEST(map_insert, KTFBENCH_MAP_MIN_ORDER, KTFBENCH_MAP_MAX_ORDER + 1);
+	ADD_SWEEP_TEST(map_find, KTFBENCH_MAP_MIN_ORDER, KTFBENCH_MAP_MAX_ORDER + 1);
+	ADD_SWEEP_TEST(assert_mt, 1, num_online_cpus() + 1);
+	ADD_SWEEP_TEST(map_mt, 1, num_online_cpus() + 1);
+	tlog(T_INFO, "ktfbench: loaded");
+	return 0;
+}
+
+static void __exit ktfbench_exit(void)
+{
+	KTF_HANDLE_CLEANUP(reg_handle);
+	KTF_CLEANUP();
+	tlog(T_INFO, "ktfbench: unloaded");
+}
+
+module_init(ktfbench_init);
+module_exit(ktfbench_exit);
@@ -0,0 +1,41 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (c) 2019, Oracle and/or its affiliates. All rights reserved.
+ *
+ * ktfbench.h: Parameters of the benchmarks of KTF's own overhead in the
+ *  ktfbench module, shared with the ktfbench driver which derives the
+ *  per operation costs from them. Included both from user space and kernel.
+ */
+
+#ifndef KTF_KTFBENCH_H
+#define KTF_KTFBENCH_H
+
+/* Passed assertions per iteration of ktfbench.assert */
+#define KTFBENCH_ASSERTS	100
+
+/* Calls of a function per iteration of ktfbench.call */
+#define KTFBENCH_CALLS		100
+
+/* The map sweeps run for maps of 1 << point elements */
+#define KTFBENCH_MAP_MIN_ORDER	4
+#define KTFBENCH_MAP_MAX_ORDER	15
+
+/* Lookups of each element per point of ktfbench.map_find */
+#define KTFBENCH_FIND_ROUNDS	4
+
+/* Operations per thread in each point of the *_mt sweeps, which run
+ * as many threads as the point, and the size of the map used by map_mt:
+ */
+#define KTFBENCH_MT_OPS		100000
+#define KTFBENCH_MT_MAP_ORDER	10
+
+/* Context type for growing the registry from user space: Each context
+ * configured with this type adds a context to the ktfbench.reg test.
+ */
+#define KTFBENCH_REG_TYPE	"ktfbench_reg"
+
+struct ktfbench_reg_cfg {
+	unsigned int index;
+};
+
+#endif
@@ -36,6 +36,7 @@ static KTF_HANDLE_INIT(dual_handle);
 static KTF_HANDLE_INIT(single_handle);
 static KTF_HANDLE_INIT(no_handle);
 static KTF_HANDLE_INIT_VERSION(wrongversion_handle, 0, false);
+static KTF_HANDLE_INIT(reload_handle);
 
 static struct map_test_ctx *to_mctx(struct ktf_context *ctx)
 {
@@ -130,6 +131,65 @@ TEST(selftest, mapref)
 	EXPECT_LONG_EQ(0, ktf_map_size(&tm));
 }
 
+/* --- RCU read side test --- */
+
+TEST(selftest, maprcu)
+{
+	int i;
+	const int nelems = 3;
+	struct myelem e[nelems], *ep;
+	struct ktf_map tm;
+	struct ktf_map_elem *elem;
+
+	/* myelem_free does not release memory, so no need to defer it */
+	ktf_map_init_rcu(&tm, NULL, myelem_free);
+	EXPECT_INT_EQ(0, ktf_map_elem_init(&e[0].foo, "foo"));
+	EXPECT_INT_EQ(0, ktf_map_elem_init(&e[1].foo, "bar"));
+	EXPECT_INT_EQ(0, ktf_map_elem_init(&e[2].foo, "zax"));
+
+	for (i = 0; i < nelems; i++) {
+		e[i].freed = 0;
+		EXPECT_INT_EQ(0, ktf_map_insert(&tm, &e[i].foo));
+		ktf_map_elem_put(&e[i].foo);
+	}
+
+	rcu_read_lock();
+	for (i = 0; i < nelems; i++)
+		EXPECT_ADDR_EQ(&e[i].foo, ktf_map_find_rcu(&tm, e[i].foo.key));
+	EXPECT_ADDR_EQ(NULL, ktf_map_find_rcu(&tm, "nosuchkey"));
+
+	/* Should be visited in sorted order: bar, foo, zax */
+	i = 0;
+	ktf_map_for_each_entry_rcu(ep, &tm, foo) {
+		EXPECT_ADDR_EQ(&e[(i + 1) % nelems], ep);
+		i++;
+	}
+	EXPECT_INT_EQ(nelems, i);
+	rcu_read_unlock();
+
+	/* The refcounted interface must work as with locked maps */
+	i = 0;
+	ktf_map_for_each_entry(ep, &tm, foo)
+		i++;
+	EXPECT_INT_EQ(nelems, i);
+	elem = ktf_map_find(&tm, "foo");
+	EXPECT_ADDR_EQ(&e[0].foo, elem);
+	if (elem)
+		ktf_map_elem_put(elem);
+
+	for (i = 0; i < nelems; i++) {
+		elem = ktf_map_remove(&tm, e[i].foo.key);
+		EXPECT_ADDR_EQ(&e[i].foo, elem);
+		rcu_read_lock();
+		EXPECT_ADDR_EQ(NULL, ktf_map_find_rcu(&tm, e[i].foo.key));
+		rcu_read_unlock();
+		EXPECT_INT_EQ(0, e[i].freed);
+		ktf_map_elem_put(elem);
+		EXPECT_INT_EQ(1, e[i].freed);
+	}
+	EXPECT_LONG_EQ(0, ktf_map_size(&tm));
+}
+
 /* --- Test that the expect macros work as if-then-else single statement */
 TEST(selftest, statements)
 {
@@ -285,6 +345,60 @@ done:
 	ktf_map_delete_all(&cm);
 }
 
+/* --- Verify compact elements with fixed size binary keys --- */
+
+struct myfixedelem {
+	struct ktf_map_elem_fixed foo;
+	int order;
+};
+
+static DEFINE_KTF_MAP_FIXED_RCU(fixed_map, ktf_ulong_compare, NULL);
+
+TEST(selftest, map_fixedkey)
+{
+	const int nelems = 3;
+	struct myfixedelem elems[nelems], *fe;
+	struct ktf_map_elem strelem;
+	unsigned long key;
+	int i;
+
+	EXPECT_TRUE(sizeof(struct ktf_map_elem_fixed) < sizeof(struct ktf_map_elem));
+	EXPECT_INT_EQ(-EINVAL, ktf_map_elem_init_fixed(&elems[0].foo, &key,
+						       KTF_MAP_KEY_FIXED + 1));
+
+	/* Insert in reverse order to check that the typed compare is used */
+	for (i = 0; i < nelems; i++) {
+		key = (nelems - i) << 12;
+		elems[i].order = nelems - i - 1;
+		ASSERT_INT_EQ_GOTO(ktf_map_elem_init_fixed(&elems[i].foo, &key,
+							   sizeof(key)),
+				   0, done);
+		ASSERT_INT_EQ_GOTO(ktf_map_insert(&fixed_map,
+						  ktf_map_fixed_elem(&elems[i].foo)),
+				   0, done);
+	}
+	EXPECT_INT_EQ(-EEXIST, ktf_map_insert(&fixed_map,
+					      ktf_map_fixed_elem(&elems[0].foo)));
+
+	/* String key elements do not fit here */
+	EXPECT_INT_EQ(0, ktf_map_elem_init(&strelem, "foo"));
+	EXPECT_INT_EQ(-EINVAL, ktf_map_insert(&fixed_map, &strelem));
+
+	i = 0;
+	ktf_map_for_each_entry(fe, &fixed_map, foo)
+		EXPECT_INT_EQ(i++, fe->order);
+	EXPECT_INT_EQ(nelems, i);
+
+	key = 2 << 12;
+	EXPECT_ADDR_EQ(&elems[1], ktf_map_find_entry(&fixed_map, (char *)&key,
+						     struct myfixedelem, foo));
+	ktf_map_elem_put(ktf_map_fixed_elem(&elems[1].foo));
+	key = 5;
+	EXPECT_FALSE(ktf_map_find(&fixed_map, (char *)&key));
+done:
+	ktf_map_delete_all(&fixed_map);
+}
+
 TEST(selftest, dummy)
 {
 	/* The default handle does not have any contexts in this test set */
@@ -303,9 +417,11 @@ static void add_map_tests(void)
 	ADD_LOOP_TEST(statements, 0, 2);
 	ADD_TEST_TO(dual_handle, simplemap);
 	ADD_TEST_TO(dual_handle, mapref);
+	ADD_TEST(maprcu);
 	ADD_TEST_TO(dual_handle, mapcmpfunc);
 	ADD_TEST(map_keyoverflow);
 	ADD_TEST(map_customkey);
+	ADD_TEST(map_fixedkey);
 
 	terr("-- version check test: --");
 	/* This should fail */
@@ -386,6 +502,25 @@ done:
 	KTF_UNREGISTER_OVERRIDE(myfunc, myfunc_override);
 }
 
+/* --- Verify that an override can be removed and registered again --- */
+
+TEST(selftest, override_reregister)
+{
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		override_failed = 0;
+		ASSERT_INT_EQ(KTF_REGISTER_OVERRIDE(myfunc, myfunc_override), 0);
+		EXPECT_INT_EQ(myfunc(100), 0);
+		EXPECT_INT_EQ(override_failed, 0);
+		KTF_UNREGISTER_OVERRIDE(myfunc, myfunc_override);
+
+		/* The original function runs again */
+		EXPECT_INT_EQ(myfunc(100), 100);
+		EXPECT_INT_EQ(override_failed, 1);
+	}
+}
+
 noinline int probesum(int a, int b)
 {
 	tlog(T_INFO, "Adding %d + %d", a, b);
@@ -434,6 +569,7 @@ static void add_probe_tests(void)
 	ADD_TEST(probeentry);
 	ADD_TEST(probereturn);
 	ADD_TEST(override);
+	ADD_TEST(override_reregister);
 }
 
 noinline void cov_counted(void)
@@ -462,9 +598,10 @@ TEST(selftest, cov)
 	int foundp1 = 0, foundp2 = 0, foundp3 = 0, foundp4 = 0;
 	struct ktf_cov_entry *e;
 	struct ktf_cov_mem *m;
+	int bkt;
 	char *p1 = NULL, *p2 = NULL, *p3 = NULL, *p4 = NULL;
 	struct kmem_cache *c = NULL;
-	int oldcount;
+	unsigned long oldcount;
 
 	c = kmem_cache_create("selftest_cov_cache",
 			      32, 0,
@@ -477,13 +614,13 @@ TEST(selftest, cov)
 
 	e = ktf_cov_entry_find((unsigned long)cov_counted, 0);
 	ASSERT_ADDR_NE_GOTO(e, NULL, done);
-	oldcount = e->count;
+	oldcount = ktf_cov_entry_count(e);
 	ktf_cov_entry_put(e);
 	cov_counted();
 	e = ktf_cov_entry_find((unsigned long)cov_counted, 0);
 	ASSERT_ADDR_NE_GOTO(e, NULL, done);
 	if (e) {
-		ASSERT_INT_EQ(e->count, oldcount + 1);
+		ASSERT_LONG_EQ(ktf_cov_entry_count(e), oldcount + 1);
 		ktf_cov_entry_put(e);
 	}
 
@@ -501,7 +638,8 @@ TEST(selftest, cov)
 	p4 = doalloc(c, 0);
 	ASSERT_ADDR_NE_GOTO(p4, NULL, done);
 
-	ktf_for_each_cov_mem(m) {
+	rcu_read_lock();
+	ktf_for_each_cov_mem(bkt, m) {
 		if (m->key.address == (unsigned long)p1)
 			foundp1 = 1;
 		if (m->key.address == (unsigned long)p2 && m->key.size == 16)
@@ -511,6 +649,7 @@ TEST(selftest, cov)
 		if (m->key.address == (unsigned long)p4)
 			foundp4 = 1;
 	}
+	rcu_read_unlock();
 	ASSERT_INT_EQ_GOTO(foundp1, 1, done);
 	ASSERT_INT_EQ_GOTO(foundp2, 1, done);
 	ASSERT_INT_EQ_GOTO(foundp3, 1, done);
@@ -522,7 +661,8 @@ TEST(selftest, cov)
 	foundp2 = 0;
 	foundp3 = 0;
 	foundp4 = 0;
-	ktf_for_each_cov_mem(m) {
+	rcu_read_lock();
+	ktf_for_each_cov_mem(bkt, m) {
 		if (m->key.address == (unsigned long)p1)
 			foundp1 = 1;
 		if (m->key.address == (unsigned long)p2)
@@ -532,6 +672,7 @@ TEST(selftest, cov)
 		if (m->key.address == (unsigned long)p4)
 			foundp4 = 1;
 	}
+	rcu_read_unlock();
 	ASSERT_INT_EQ_GOTO(foundp2, 1, done);
 	ASSERT_INT_EQ_GOTO(foundp3, 1, done);
 	ASSERT_INT_EQ_GOTO(foundp1, 0, done);
@@ -544,9 +685,31 @@ done:
 	kmem_cache_destroy(c);
 }
 
+TEST(selftest, cov_delta)
+{
+	struct ktf_cov_snapshot *snap;
+	unsigned long calls = 0;
+	unsigned int i;
+
+	ASSERT_INT_EQ(0, ktf_cov_enable((THIS_MODULE)->name, 0));
+	snap = ktf_cov_snapshot_take();
+	ASSERT_ADDR_NE_GOTO(snap, NULL, done);
+	cov_counted();
+	cov_counted();
+	ktf_cov_snapshot_delta(snap);
+	for (i = 0; i < snap->nr_entries; i++)
+		if (snap->entries[i].entry->key.address == (unsigned long)cov_counted)
+			calls = snap->entries[i].count;
+	EXPECT_LONG_EQ(calls, 2);
+	ktf_cov_snapshot_free(snap);
+done:
+	ktf_cov_disable((THIS_MODULE)->name);
+}
+
 static void add_cov_tests(void)
 {
 	ADD_TEST(acov);
+	ADD_TEST(cov_delta);
 	/* We still seem to have some subtle issues with the memory coverage test feature,
 	 * as sometimes allocations made by the coverage framework itself,
 	 * for this particular test survives the cleanup function.
@@ -577,15 +740,120 @@ TEST(selftest, thread)
 	for (i = 0; i < NUM_TEST_THREADS; i++)
 		KTF_THREAD_WAIT_COMPLETED(&test_threads[i]);
 
-	assertions = (int)ktf_get_assertion_count();
+	assertions = (int)ktf_get_assertion_count(self);
 
 	/* Verify assertion in thread */
 	ASSERT_INT_EQ(assertions, NUM_TEST_THREADS);
 }
 
+/* Runs on one of the pool workers if the batch is run with more than one job.
+ * Runs in parallel with other tests, but the iterations of a run of the test
+ * still go one at a time, in order:
+ */
+static atomic_t parallel_running = ATOMIC_INIT(0);
+static int parallel_prev;
+
+TEST(selftest, parallel)
+{
+	EXPECT_TRUE(self->flags & KTF_TEST_PARALLEL);
+	EXPECT_INT_EQ(atomic_inc_return(&parallel_running), 1);
+	if (self->run_id == self->first_run_id)
+		EXPECT_INT_EQ(_i, self->start);
+	else
+		EXPECT_INT_EQ(_i, parallel_prev + 1);
+	EXPECT_TRUE(_i < self->end);
+	parallel_prev = _i;
+	atomic_dec(&parallel_running);
+}
+
+#define TGROUP_THREAD_OPS 1000
+
+KTF_TGROUP_THREAD(tgroup_thread)
+{
+	atomic_t *count = _thread->tg->arg;
+	int i;
+
+	for (i = 0; i < TGROUP_THREAD_OPS; i++)
+		atomic_inc(count);
+	_thread->ops = TGROUP_THREAD_OPS;
+	EXPECT_INT_EQ(_thread->cpu, raw_smp_processor_id());
+}
+
+static struct ktf_tgroup test_tgroup;
+
+TEST(selftest, tgroup)
+{
+	unsigned int nr = 2 * num_online_cpus();
+	atomic_t count = ATOMIC_INIT(0);
+	struct ktf_tgroup_data *r = &test_tgroup.result;
+
+	KTF_TGROUP_INIT(tgroup_thread, &test_tgroup, nr, &count);
+	ASSERT_INT_EQ(ktf_tgroup_run(&test_tgroup, NULL), 0);
+	EXPECT_INT_EQ(atomic_read(&count), nr * TGROUP_THREAD_OPS);
+	EXPECT_INT_EQ(r->threads, nr);
+	EXPECT_INT_EQ(r->cpus, num_online_cpus());
+	EXPECT_LONG_EQ(r->ops, nr * TGROUP_THREAD_OPS);
+	EXPECT_LONG_EQ(r->min_ops, TGROUP_THREAD_OPS);
+	EXPECT_LONG_EQ(r->max_ops, TGROUP_THREAD_OPS);
+	EXPECT_TRUE(r->max_ns <= r->duration_ns);
+	/* The result is passed on to user space with the test result */
+	EXPECT_INT_EQ(self->tgroup.threads, nr);
+	ktf_tgroup_cleanup(&test_tgroup);
+}
+
+/* Each value of _i is reported as a point of the sweep, and each point is
+ * run once per run of the sweep:
+ */
+static u64 sweep_run;		 /* first_run_id of the run seen last */
+static unsigned long sweep_seen; /* Points seen in that run */
+
+TEST(selftest, sweep)
+{
+	EXPECT_TRUE(self->flags & KTF_TEST_SWEEP);
+	ASSERT_TRUE(_i >= 0 && _i < BITS_PER_LONG);
+	if (self->first_run_id != sweep_run) {
+		sweep_run = self->first_run_id;
+		sweep_seen = 0;
+	}
+	EXPECT_FALSE(__test_and_set_bit(_i, &sweep_seen));
+}
+
+/* A test with a timeout runs in a thread of its own when run from user space,
+ * which holds on to the module of the test. Other ways of running the test,
+ * such as via debugfs, have no watchdog and nothing to check here:
+ */
+TEST(selftest, watched)
+{
+	if (strncmp(current->comm, "ktf_run/", 8))
+		return;
+	EXPECT_STREQ(current->comm, "ktf_run/watched");
+	EXPECT_TRUE(current->flags & PF_KTHREAD);
+	EXPECT_TRUE(module_refcount(THIS_MODULE) > 0);
+}
+
 static void add_thread_tests(void)
 {
 	ADD_TEST(thread);
+	ADD_TEST(tgroup);
+	ADD_PARALLEL_LOOP_TEST(parallel, 0, 4);
+	ADD_SWEEP_TEST(sweep, 0, 4);
+	ADD_TEST(watched);
+	SET_TEST_TIMEOUT(watched, 60000);
+}
+
+/* Each iteration runs with preemption disabled and is timed separately */
+BENCH(selftest, bench)
+{
+	void *p = kmalloc(64, GFP_ATOMIC);
+
+	EXPECT_ADDR_NE(p, NULL);
+	EXPECT_TRUE(self->flags & KTF_TEST_BENCH);
+	kfree(p);
+}
+
+static void add_bench_tests(void)
+{
+	ADD_BENCH_NOPREEMPT(bench, 1000);
 }
 
 static int selftest_module_var;
@@ -614,6 +882,87 @@ static void add_symbol_tests(void)
 	ADD_TEST(symbol);
 }
 
+/* A test runs with its context locked */
+TEST(selftest, ctx_locked)
+{
+	ASSERT_ADDR_NE(ctx, NULL);
+	EXPECT_TRUE(mutex_is_locked(&ctx->run_lock));
+}
+
+/* An instance of a test, as used for runs in all contexts of a test, runs
+ * separately from the test, and does not change its published results:
+ */
+TEST(selftest, instance)
+{
+	struct ktf_run_result res = {};
+	struct ktf_test_result r0, r1;
+	struct ktf_context *ictx;
+	struct ktf_test *t;
+
+	ictx = ktf_find_context(&dual_handle, "map1");
+	ASSERT_ADDR_NE(ictx, NULL);
+	t = ktf_test_find("selftest", "ctx_locked");
+	ASSERT_ADDR_NE(t, NULL);
+
+	ktf_test_last_result(t, &r0);
+	ktf_run_instance(NULL, ictx, t, 0, NULL, 0, &res);
+	EXPECT_TRUE(res.stats);
+	EXPECT_FALSE(mutex_is_locked(&ictx->run_lock));
+	ktf_test_last_result(t, &r1);
+	EXPECT_LONG_EQ(r0.last_run_id, r1.last_run_id);
+	EXPECT_INT_EQ(r0.err_cnt, r1.err_cnt);
+	ktf_map_elem_put(&ictx->elem);
+	ktf_test_put(t);
+}
+
+static void add_instance_tests(void)
+{
+	ADD_TEST_TO(dual_handle, ctx_locked);
+	ADD_TEST(instance);
+}
+
+TEST(selftest, reload_target)
+{
+	EXPECT_TRUE(true);
+}
+
+/* Cleaning up a handle, as on module unload, parks its tests, and adding
+ * them again, as on reload, rebinds them to the same registry entries:
+ */
+TEST(selftest, reload)
+{
+	struct ktf_test *t, *t2;
+
+	t = ktf_test_find("selftest", "reload_target");
+	ASSERT_ADDR_NE(t, NULL);
+
+	ktf_test_cleanup(&reload_handle);
+	t2 = ktf_test_find("selftest", "reload_target");
+	EXPECT_ADDR_EQ(t2, t);
+	if (t2) {
+		EXPECT_ADDR_EQ(t2->fun, NULL);
+		EXPECT_FALSE(t2->handle == &reload_handle);
+		EXPECT_ADDR_EQ(t2->name, t2->kmap.key);
+		ktf_test_put(t2);
+	}
+
+	ADD_TEST_TO(reload_handle, reload_target);
+	t2 = ktf_test_find("selftest", "reload_target");
+	EXPECT_ADDR_EQ(t2, t);
+	if (t2) {
+		EXPECT_ADDR_EQ(t2->fun, reload_target);
+		EXPECT_TRUE(t2->handle == &reload_handle);
+		ktf_test_put(t2);
+	}
+	ktf_test_put(t);
+}
+
+static void add_reload_tests(void)
+{
+	ADD_TEST_TO(reload_handle, reload_target);
+	ADD_TEST(reload);
+}
+
 static int __init selftest_init(void)
 {
 	int ret = KTF_CONTEXT_ADD_TO(dual_handle, &s_mctx[1].k, "map1");
@@ -636,9 +985,12 @@ static int __init selftest_init(void)
 	add_probe_tests();
 	add_cov_tests();
 	add_thread_tests();
+	add_bench_tests();
 	add_hybrid_tests();
 	add_context_tests();
 	add_symbol_tests();
+	add_instance_tests();
+	add_reload_tests();
 	tlog(T_INFO, "selftest: loaded");
 	return 0;
 fail:
@@ -652,6 +1004,7 @@ static void __exit selftest_exit(void)
 	KTF_HANDLE_CLEANUP(single_handle);
 	KTF_HANDLE_CLEANUP(dual_handle);
 	KTF_HANDLE_CLEANUP(no_handle);
+	KTF_HANDLE_CLEANUP(reload_handle);
 	KTF_CLEANUP();
 	tlog(T_INFO, "selftest: unloaded");
 }
@@ -9,6 +9,8 @@
 
 #include "ktf.h"
 #include <string.h>
+#include <errno.h>
+#include <pthread.h>
 
 extern "C" {
 #include "../selftest/hybrid_self.h"
@@ -37,3 +39,77 @@ HTEST(selftest, msg)
   /* and here.. */
   EXPECT_TRUE(true);
 }
+
+/* Keep several runs of a kernel test in flight at the same time.
+ * The out-of-band data is copied when a run is queued, so changing it
+ * afterwards does not affect the runs already queued:
+ */
+
+static void msg_async_done(int tag, int status, void* arg)
+{
+  (*(int*)arg)++;
+}
+
+HTEST(selftest, msg_async)
+{
+  KTF_USERDATA(self, hybrid_self_params, data);
+  int tags[4];
+  int completed = 0;
+
+  strcpy(data->text_val, HYBRID_MSG);
+  data->val = HYBRID_MSG_VAL;
+
+  for (int i = 0; i < 4; i++) {
+    tags[i] = ktf::run_async(self, "", msg_async_done, &completed);
+    ASSERT_GT(tags[i], 0);
+  }
+  data->val = 0;
+
+  EXPECT_EQ(0, ktf::wait(tags[3]));
+  ktf::wait_all();
+  EXPECT_EQ(4, completed);
+  EXPECT_EQ(-ENOENT, ktf::wait(tags[0]));
+}
+
+/* Run a kernel test from several threads at the same time - each
+ * thread gets its own netlink socket, and the results of each run are
+ * reported as part of this test:
+ */
+
+#define MSG_THREADS 4
+#define MSG_THREAD_RUNS 16
+
+static void* msg_thread(void* arg)
+{
+  for (int i = 0; i < MSG_THREAD_RUNS; i++)
+    ktf::run((ktf::KernelTest*)arg);
+  return NULL;
+}
+
+HTEST(selftest, msg_threads)
+{
+  KTF_USERDATA(self, hybrid_self_params, data);
+  pthread_t threads[MSG_THREADS];
+
+  strcpy(data->text_val, HYBRID_MSG);
+  data->val = HYBRID_MSG_VAL;
+
+  for (int i = 0; i < MSG_THREADS; i++)
+    ASSERT_EQ(0, pthread_create(&threads[i], NULL, msg_thread, self));
+  for (int i = 0; i < MSG_THREADS; i++)
+    EXPECT_EQ(0, pthread_join(threads[i], NULL));
+}
+
+/* Pass the out-of-band data in memory shared with the kernel instead
+ * of in the netlink request:
+ */
+
+HTEST(selftest, msg_shared)
+{
+  KTF_USERDATA_SHARED(self, hybrid_self_params, data);
+
+  strcpy(data->text_val, HYBRID_MSG);
+  data->val = HYBRID_MSG_VAL;
+
+  ktf::run(self);
+}
@@ -0,0 +1,288 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (c) 2019, Oracle and/or its affiliates. All rights reserved.
+ *
+ * ktfbench.cpp: Driver for the benchmarks of KTF's own overhead in the
+ *   ktfbench module (see selftest/ktfbench.c). Runs the benchmarks, times
+ *   queries and test runs from user space for registries of the given sizes,
+ *   and writes a JSON object per measurement, with the cost per operation
+ *   in nanoseconds:
+ *
+ *   # insmod ktfbench.ko
+ *   # ktfbench --registry=0,1000,10000 --output=ktfbench.jsonl
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include "ktf_int.h"
+#include "../kernel/ktf_unlproto.h"
+#include "../selftest/ktfbench.h"
+
+static struct option ktfbench_options[] = {
+  { "runs", required_argument, NULL, 'r' },
+  { "registry", required_argument, NULL, 'R' },
+  { "output", required_argument, NULL, 'o' },
+  { NULL, 0, NULL, 0 }
+};
+
+void usage(char *progname)
+{
+  fprintf(stderr, "Usage: %s [-r|--runs N] [-R|--registry SIZE,SIZE...] [-o|--output FILE]\n",
+	  progname);
+}
+
+static FILE* out;
+static int failures;
+
+/* The results of the last run */
+static struct ktf_bench_data bench;
+static std::vector<struct ktf_sweep_point> points;
+
+static void handle_result(int result, const char* file, int line, const char* report)
+{
+  if (!result) {
+    fprintf(stderr, "Failed at %s:%d: %s\n", file, line, report);
+    failures++;
+  }
+}
+
+static void handle_bench(const struct ktf_bench_data* bd)
+{
+  bench = *bd;
+}
+
+static void handle_point(const struct ktf_sweep_point* sp)
+{
+  points.push_back(*sp);
+}
+
+static long long now_ns()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static ktf::KernelTest* find(const char* testname)
+{
+  std::string ctx;
+  ktf::KernelTest* kt = KTF_FIND("ktfbench", testname, &ctx);
+
+  if (!kt)
+    fprintf(stderr, "No test ktfbench.%s - is the ktfbench module loaded?\n", testname);
+  return kt;
+}
+
+static bool run(const char* testname)
+{
+  ktf::KernelTest* kt = find(testname);
+  int failed = failures;
+
+  if (!kt)
+    return false;
+  memset(&bench, 0, sizeof(bench));
+  points.clear();
+  ktf::run(kt);
+  return failures == failed;
+}
+
+/* Min, median, 99th percentile and max of the samples, in ns */
+static void put_times(const char* metric, const char* param, long long value,
+		      std::vector<long long>& t)
+{
+  std::sort(t.begin(), t.end());
+  fprintf(out, "{\"metric\":\"%s\",\"%s\":%lld,\"samples\":%zu,\"min_ns\":%lld,"
+	  "\"median_ns\":%lld,\"p99_ns\":%lld,\"max_ns\":%lld}\n",
+	  metric, param, value, t.size(), t[0], t[t.size() / 2],
+	  t[t.size() * 99 / 100], t[t.size() - 1]);
+}
+
+/* The median and 99th percentile of a benchmark, per operation */
+static void put_bench(const char* metric, double ops, double base_median = 0,
+		      double base_p99 = 0)
+{
+  fprintf(out, "{\"metric\":\"%s\",\"iterations\":%llu,\"median_ns\":%.2f,\"p99_ns\":%.2f}\n",
+	  metric, (unsigned long long)bench.iterations,
+	  (bench.median_ns - base_median) / ops, (bench.p99_ns - base_p99) / ops);
+}
+
+static void put_point(const char* metric, const char* param, long long value, double ns)
+{
+  fprintf(out, "{\"metric\":\"%s\",\"%s\":%lld,\"ns_per_op\":%.2f}\n", metric, param, value, ns);
+}
+
+/* Per operation costs within the kernel */
+static int run_benchmarks()
+{
+  std::vector<struct ktf_sweep_point> inserts;
+
+  if (!run("iteration"))
+    return -1;
+  put_bench("bench_iteration", 1);
+  double iter_median = bench.median_ns, iter_p99 = bench.p99_ns;
+
+  if (!run("assert"))
+    return -1;
+  put_bench("assert", KTFBENCH_ASSERTS, iter_median, iter_p99);
+
+  /* Coverage probes: The same calls with and without coverage of the module */
+  if (!run("call"))
+    return -1;
+  double call_median = bench.median_ns, call_p99 = bench.p99_ns;
+  if (ktf::set_coverage("ktfbench", 0, true)) {
+    fprintf(stderr, "Unable to enable coverage for ktfbench\n");
+    return -1;
+  }
+  bool ok = run("call");
+  ktf::set_coverage("ktfbench", 0, false);
+  if (!ok)
+    return -1;
+  put_bench("cov_call", KTFBENCH_CALLS, call_median, call_p99);
+
+  if (!run("map_insert"))
+    return -1;
+  inserts = points;
+  for (size_t i = 0; i < inserts.size(); i++) {
+    long long n = 1LL << inserts[i].point;
+    put_point("map_insert", "size", n, (double)inserts[i].duration_ns / n);
+  }
+  if (!run("map_find"))
+    return -1;
+  for (size_t i = 0; i < points.size() && i < inserts.size(); i++) {
+    long long n = 1LL << points[i].point;
+    double find_ns = (double)points[i].duration_ns - inserts[i].duration_ns;
+    put_point("map_find", "size", n, std::max(find_ns, 0.0) / (n * KTFBENCH_FIND_ROUNDS));
+  }
+
+  /* Time per operation of each thread, ideally constant */
+  if (!run("assert_mt"))
+    return -1;
+  for (size_t i = 0; i < points.size(); i++)
+    put_point("assert_mt", "threads", points[i].point,
+	      (double)points[i].duration_ns / KTFBENCH_MT_OPS);
+  if (!run("map_mt"))
+    return -1;
+  for (size_t i = 0; i < points.size(); i++)
+    put_point("map_mt", "threads", points[i].point,
+	      (double)points[i].duration_ns / KTFBENCH_MT_OPS);
+  return 0;
+}
+
+/* Grow the registry to @size contexts of the ktfbench.reg test */
+static void grow_registry(size_t& contexts, size_t size)
+{
+  struct ktfbench_reg_cfg cfg;
+  char name[32];
+
+  for (; contexts < size; contexts++) {
+    cfg.index = contexts;
+    snprintf(name, sizeof(name), "reg%zu", contexts);
+    ktf::configure_context(name, KTFBENCH_REG_TYPE, &cfg, sizeof(cfg));
+  }
+}
+
+/* Queries and round trips of runs from user space for a registry size */
+static int run_registry(long long size, int runs)
+{
+  ktf::KernelTest* kt = find("empty");
+  std::vector<long long> t;
+  size_t entries = 0;
+
+  if (!kt)
+    return -1;
+  for (int i = 0; i < std::max(runs / 10, 1); i++) {
+    long long ns = ktf::time_query(&entries);
+    if (ns < 0) {
+      fprintf(stderr, "Query failed: %s\n", strerror(-ns));
+      return -1;
+    }
+    t.push_back(ns);
+  }
+  put_times("query", "registry", size, t);
+  fprintf(out, "{\"metric\":\"query_entries\",\"registry\":%lld,\"entries\":%zu}\n",
+	  size, entries);
+
+  t.clear();
+  for (int i = 0; i < runs; i++) {
+    long long t0 = now_ns();
+    ktf::run(kt);
+    t.push_back(now_ns() - t0);
+  }
+  put_times("run_rtt", "registry", size, t);
+  return 0;
+}
+
+int main (int argc, char** argv)
+{
+  std::vector<long long> sizes;
+  const char* registry = "0,100,1000";
+  const char* output = NULL;
+  size_t contexts = 0;
+  int opt, runs = 1000;
+  long long t0;
+
+  while ((opt = getopt_long(argc, argv, "r:R:o:", ktfbench_options, NULL)) != -1) {
+    switch (opt) {
+    case 'r':
+      runs = atoi(optarg);
+      if (runs < 1) {
+	usage(argv[0]);
+	return -1;
+      }
+      break;
+    case 'R':
+      registry = optarg;
+      break;
+    case 'o':
+      output = optarg;
+      break;
+    default:
+      usage(argv[0]);
+      return -1;
+    }
+  }
+
+  for (const char* p = registry; *p; ) {
+    char* end;
+    long long size = strtoll(p, &end, 10);
+    if (end == p || size < 0 || (*end && *end != ',')) {
+      fprintf(stderr, "Invalid registry sizes: %s\n", registry);
+      return -1;
+    }
+    sizes.push_back(size);
+    p = *end ? end + 1 : end;
+  }
+  /* Contexts can only be added, so grow the registry in steps */
+  std::sort(sizes.begin(), sizes.end());
+
+  out = output ? fopen(output, "w") : stdout;
+  if (!out) {
+    perror(output);
+    return -1;
+  }
+
+  if (!ktf::setup(handle_result))
+    return -1;
+  ktf::set_bench_handler(handle_bench);
+  ktf::set_point_handler(handle_point);
+  t0 = now_ns();
+  ktf::query_testsets();
+  fprintf(out, "{\"metric\":\"setup_query\",\"ns\":%lld}\n", now_ns() - t0);
+
+  if (run_benchmarks())
+    return -1;
+  for (size_t i = 0; i < sizes.size(); i++) {
+    grow_registry(contexts, sizes[i]);
+    if (run_registry(sizes[i], runs))
+      return -1;
+  }
+  if (out != stdout)
+    fclose(out);
+  return failures ? 1 : 0;
+}
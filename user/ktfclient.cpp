@@ -0,0 +1,99 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (c) 2019, Oracle and/or its affiliates. All rights reserved.
+ *
+ * ktfclient.cpp: Thin client for running kernel tests with a ktfrun daemon
+ *   (started with ktfrun --daemon SOCKET), which has the tests registered
+ *   already. The options are passed on to the daemon, and the output of the
+ *   run is shown as it arrives:
+ *
+ *   # ktfrun --daemon /run/ktfrun.sock &
+ *   # ktfclient /run/ktfrun.sock --gtest_filter='selftest.*'
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <string>
+
+void usage(char *progname)
+{
+  fprintf(stderr, "Usage: %s SOCKET [--gtest_filter=PATTERN] [--gtest_repeat=N]\n"
+	  "\t[--gtest_also_run_disabled_tests] [--gtest_shuffle] [--gtest_random_seed=N]\n"
+	  "\t[--gtest_list_tests] [--jobs=N] [--timeout=SECONDS]\n",
+	  progname);
+}
+
+static int write_all(int fd, const char* p, size_t left)
+{
+  while (left) {
+    ssize_t n = write(fd, p, left);
+    if (n < 0) {
+      if (errno == EINTR)
+	continue;
+      return -1;
+    }
+    p += n;
+    left -= n;
+  }
+  return 0;
+}
+
+int main (int argc, char** argv)
+{
+  struct sockaddr_un sa;
+  std::string status;
+  bool done = false;
+  char buf[4096];
+  ssize_t n;
+  int fd;
+
+  if (argc < 2 || strlen(argv[1]) >= sizeof(sa.sun_path)) {
+    usage(argv[0]);
+    return 2;
+  }
+  memset(&sa, 0, sizeof(sa));
+  sa.sun_family = AF_UNIX;
+  strcpy(sa.sun_path, argv[1]);
+  fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0 || connect(fd, (struct sockaddr*)&sa, sizeof(sa))) {
+    fprintf(stderr, "Unable to connect to ktfrun daemon at %s: %s\n", argv[1], strerror(errno));
+    return 2;
+  }
+
+  /* Each argument is sent with its terminating NUL */
+  for (int i = 2; i < argc; i++)
+    if (write_all(fd, argv[i], strlen(argv[i]) + 1))
+      goto lost;
+  shutdown(fd, SHUT_WR);
+
+  /* The output of the run is followed by a NUL and the exit status */
+  while ((n = read(fd, buf, sizeof(buf))) != 0) {
+    if (n < 0) {
+      if (errno == EINTR)
+	continue;
+      goto lost;
+    }
+    if (done) {
+      status.append(buf, n);
+      continue;
+    }
+    char* end = (char*)memchr(buf, '\0', n);
+    size_t len = end ? end - buf : n;
+    if (write_all(STDOUT_FILENO, buf, len))
+      return 2;
+    if (end) {
+      done = true;
+      status.append(end + 1, n - len - 1);
+    }
+  }
+  close(fd);
+  if (done && !status.empty())
+    return atoi(status.c_str());
+lost:
+  fprintf(stderr, "Lost the connection to the ktfrun daemon\n");
+  return 2;
+}
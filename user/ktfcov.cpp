@@ -4,12 +4,15 @@
  *    Author: Alan Maguire <alan.maguire@oracle.com>
  *
  * ktfcov.cpp:
- *   User level application to enable/disable coverage of kernel modules.
+ *   User level application to enable/disable coverage of kernel modules,
+ *   and to export the collected coverage data.
  */
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <getopt.h>
+#include <map>
 #include "ktf.h"
 #include "../kernel/ktf_unlproto.h"
 
@@ -18,7 +21,48 @@ using namespace std;
 void
 usage(char *progname)
 {
-	cerr << "Usage: " << progname << " [-e module[-m]] [-d module]\n";
+	cerr << "Usage: " << progname << " [-e module [-m] [-f]] [-d module]"
+	     << " [--dump [-m] [module]]\n";
+}
+
+/* Write the function counts in lcov tracefile format, one record per module */
+static void dump_functions(std::vector<ktf::cov_function>& functions)
+{
+  std::map<std::string, std::vector<ktf::cov_function*> > modules;
+  std::map<std::string, std::vector<ktf::cov_function*> >::iterator it;
+
+  for (size_t i = 0; i < functions.size(); i++)
+	modules[functions[i].module].push_back(&functions[i]);
+
+  for (it = modules.begin(); it != modules.end(); ++it) {
+	std::vector<ktf::cov_function*>& fv = it->second;
+	size_t hit = 0;
+
+	printf("TN:\nSF:%s\n", it->first.c_str());
+	for (size_t i = 0; i < fv.size(); i++)
+		printf("FN:0,%s\n", fv[i]->name.c_str());
+	for (size_t i = 0; i < fv.size(); i++) {
+		printf("FNDA:%llu,%s\n", (unsigned long long)fv[i]->count,
+		       fv[i]->name.c_str());
+		if (fv[i]->count)
+			hit++;
+	}
+	printf("FNF:%zu\nFNH:%zu\nend_of_record\n", fv.size(), hit);
+  }
+}
+
+/* Write the outstanding allocations, one record per allocation stack */
+static void dump_allocations(std::vector<ktf::cov_allocation>& allocations)
+{
+  for (size_t i = 0; i < allocations.size(); i++) {
+	ktf::cov_allocation& m = allocations[i];
+
+	printf("MEM:%llu,%llu\n", (unsigned long long)m.count,
+	       (unsigned long long)m.bytes);
+	for (size_t j = 0; j < m.stack.size(); j++)
+		printf("STACK:%s\n", m.stack[j].c_str());
+	printf("end_of_record\n");
+  }
 }
 
 int main (int argc, char** argv)
@@ -27,16 +71,21 @@ int main (int argc, char** argv)
   unsigned int cov_opts = 0;
   std::string modname = std::string();
   bool enable = false;
+  bool dump = false;
+  static struct option long_options[] = {
+	{ "dump", no_argument, NULL, 'D' },
+	{ NULL, 0, NULL, 0 }
+  };
 
   ktf::setup();
   testing::InitGoogleTest(&argc,argv);
 
-  if (argc < 3) {
+  if (argc < 2) {
 	usage(argv[0]);
 	return -1;
   }
 
-  while ((opt = getopt(argc, argv, "e:d:m")) != -1) {
+  while ((opt = getopt_long(argc, argv, "e:d:mf", long_options, NULL)) != -1) {
 	switch (opt) {
 	case 'e':
 		nopts++;
@@ -51,13 +100,41 @@ int main (int argc, char** argv)
 	case 'm':
 		cov_opts |= KTF_COV_OPT_MEM;
 		break;
+	case 'f':
+		cov_opts |= KTF_COV_OPT_FTRACE;
+		break;
+	case 'D':
+		dump = true;
+		break;
 	default:
 		cerr << "Unknown option '" << char(optopt) << "'";
 		return -1;
 	}
   }
-  /* Either enable or disable must be specified, and -m is only valid
-   * for enable.
+  if (dump) {
+	std::vector<ktf::cov_function> functions;
+	std::vector<ktf::cov_allocation> allocations;
+	int ret;
+
+	/* -m selects the allocation records instead of the function counts */
+	if (nopts || (cov_opts & ~KTF_COV_OPT_MEM) || argc - optind > 1) {
+		usage(argv[0]);
+		return -1;
+	}
+	if (optind < argc)
+		modname = argv[optind];
+	ret = ktf::get_coverage(modname, functions, allocations);
+	if (ret)
+		return ret;
+	if (cov_opts & KTF_COV_OPT_MEM)
+		dump_allocations(allocations);
+	else
+		dump_functions(functions);
+	return 0;
+  }
+
+  /* Either enable or disable must be specified, and -m and -f are only
+   * valid for enable.
    */
   if (modname.size() == 0 || nopts != 1 || (cov_opts && !enable)) {
 	usage(argv[0]);
@@ -0,0 +1,380 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (c) 2019, Oracle and/or its affiliates. All rights reserved.
+ *
+ * ktfnet.cpp: Coordinator for multinode network tests using a netctx
+ *   context (see kernel/ktf_netctx.h).
+ *
+ * One instance runs on each node, with the same list of node
+ * addresses and the rank of the local node in it.  Each instance
+ * configures the local netctx context with the addresses, and the
+ * instances then wait for each other in a barrier before they start the
+ * selected kernel tests at the same time.  The instance with rank 0
+ * is the coordinator: the others connect to it on its address in the list,
+ * and it collects and reports the results of all ranks when done:
+ *
+ *   node0# ktfnet -r 0 -c net --gtest_filter='net.*' 10.0.0.1@eth1 10.0.0.2@eth1
+ *   node1# ktfnet -r 1 -c net --gtest_filter='net.*' 10.0.0.1@eth1 10.0.0.2@eth1
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <ktf.h>
+#include "../kernel/ktf_netctx.h"
+
+#define KTFNET_DEFAULT_PORT	"7173"
+#define KTFNET_DEFAULT_TIMEOUT	60	/* seconds to wait for all ranks */
+
+static struct option ktfnet_options[] = {
+  { "rank", required_argument, NULL, 'r' },
+  { "context", required_argument, NULL, 'c' },
+  { "port", required_argument, NULL, 'p' },
+  { "timeout", required_argument, NULL, 'T' },
+  { NULL, 0, NULL, 0 }
+};
+
+static std::string context;
+static struct ktf_addrinfo* ai;
+static size_t ai_sz;
+
+void usage(char *progname)
+{
+  fprintf(stderr, "Usage: %s [gtest options] -r|--rank RANK -c|--context NAME\n"
+	  "\t[-p|--port PORT] [-T|--timeout SECONDS] ADDRESS[@IFNAME] ADDRESS[@IFNAME]...\n",
+	  progname);
+}
+
+/* Results of the tests run locally, in a form for sending to rank 0 */
+class ResultCollector : public ::testing::EmptyTestEventListener
+{
+public:
+  ResultCollector() : failed(0) {}
+
+  virtual void OnTestEnd(const ::testing::TestInfo& ti)
+  {
+    char line[512];
+
+    snprintf(line, sizeof(line), "RESULT %d %lld %s.%s\n",
+	     ti.result()->Passed() ? 1 : 0,
+	     (long long)ti.result()->elapsed_time(),
+	     ti.test_case_name(), ti.name());
+    results.push_back(line);
+    if (!ti.result()->Passed())
+      failed++;
+  }
+
+  std::vector<std::string> results;
+  int failed;
+};
+
+static int parse_node(const char* spec, struct ktf_peer_address* pa)
+{
+  std::string addr(spec);
+  size_t at = addr.find('@');
+  struct addrinfo hints, *res;
+  int ret;
+
+  if (at != std::string::npos) {
+    std::string ifname = addr.substr(at + 1);
+    if (ifname.size() >= IFNAMSZ) {
+      fprintf(stderr, "Interface name too long: %s\n", ifname.c_str());
+      return -1;
+    }
+    strcpy(pa->ifname, ifname.c_str());
+    addr.resize(at);
+  }
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_flags = AI_NUMERICHOST;
+  ret = getaddrinfo(addr.c_str(), NULL, &hints, &res);
+  if (ret) {
+    fprintf(stderr, "Invalid address %s: %s\n", addr.c_str(), gai_strerror(ret));
+    return -1;
+  }
+  memcpy(&pa->addr, res->ai_addr, res->ai_addrlen);
+  freeaddrinfo(res);
+  return 0;
+}
+
+static socklen_t addr_len(const struct sockaddr_storage* ss)
+{
+  return ss->ss_family == AF_INET6 ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+}
+
+static void set_port(struct sockaddr_storage* ss, unsigned short port)
+{
+  if (ss->ss_family == AF_INET6)
+    ((struct sockaddr_in6*)ss)->sin6_port = htons(port);
+  else
+    ((struct sockaddr_in*)ss)->sin_port = htons(port);
+}
+
+static long long now_ms()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+static int send_line(int fd, const std::string& line)
+{
+  const char* p = line.c_str();
+  size_t left = line.size();
+
+  while (left) {
+    ssize_t n = write(fd, p, left);
+    if (n < 0) {
+      if (errno == EINTR)
+	continue;
+      return -1;
+    }
+    p += n;
+    left -= n;
+  }
+  return 0;
+}
+
+/* Read a line, without the newline, from fd within the deadline */
+static int recv_line(int fd, std::string& line, long long deadline)
+{
+  struct pollfd pfd = { fd, POLLIN, 0 };
+  char c;
+
+  line.clear();
+  for (;;) {
+    long long left = deadline - now_ms();
+    if (left <= 0 || poll(&pfd, 1, left) != 1)
+      return -1;
+    if (read(fd, &c, 1) != 1)
+      return -1;
+    if (c == '\n')
+      return 0;
+    line += c;
+  }
+}
+
+/* Configure the netctx context, called by ktf::setup() once the
+ * contexts provided by the kernel are known:
+ */
+static void configure()
+{
+  ktf::configure_context(context, "netctx", ai, ai_sz);
+}
+
+/* Rank 0: Wait for all other ranks to report ready, then let all go */
+static int coordinator_barrier(std::vector<int>& fds, const struct sockaddr_storage* addr,
+			       unsigned short port, long long deadline)
+{
+  struct sockaddr_storage la = *addr;
+  int n = fds.size();
+  int one = 1;
+  int lfd, ready = 1;
+
+  lfd = socket(la.ss_family, SOCK_STREAM, 0);
+  if (lfd < 0) {
+    perror("socket");
+    return -1;
+  }
+  set_port(&la, port);
+  setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  if (bind(lfd, (struct sockaddr*)&la, addr_len(&la)) || listen(lfd, n)) {
+    perror("bind/listen");
+    close(lfd);
+    return -1;
+  }
+
+  while (ready < n) {
+    struct pollfd pfd = { lfd, POLLIN, 0 };
+    long long left = deadline - now_ms();
+    std::string line;
+    int fd, rank;
+
+    if (left <= 0 || poll(&pfd, 1, left) != 1)
+      break;
+    fd = accept(lfd, NULL, NULL);
+    if (fd < 0)
+      continue;
+    if (recv_line(fd, line, deadline) || sscanf(line.c_str(), "READY %d", &rank) != 1 ||
+	rank <= 0 || rank >= n || fds[rank] >= 0) {
+      fprintf(stderr, "Unexpected peer message \"%s\"\n", line.c_str());
+      close(fd);
+      continue;
+    }
+    fds[rank] = fd;
+    ready++;
+  }
+  close(lfd);
+  if (ready < n) {
+    fprintf(stderr, "Only %d of %d ranks ready within the timeout\n", ready, n);
+    return -1;
+  }
+
+  for (int i = 1; i < n; i++)
+    if (send_line(fds[i], "GO\n"))
+      return -1;
+  return 0;
+}
+
+/* Other ranks: Connect to rank 0, report ready and wait for the go */
+static int peer_barrier(int& fd, short rank, const struct sockaddr_storage* addr,
+			unsigned short port, long long deadline)
+{
+  struct sockaddr_storage ca = *addr;
+  std::string line;
+  char msg[32];
+
+  set_port(&ca, port);
+  for (;;) {
+    fd = socket(ca.ss_family, SOCK_STREAM, 0);
+    if (fd < 0) {
+      perror("socket");
+      return -1;
+    }
+    if (connect(fd, (struct sockaddr*)&ca, addr_len(&ca)) == 0)
+      break;
+    close(fd);
+    fd = -1;
+    /* rank 0 may not be listening yet */
+    if (now_ms() + 100 >= deadline) {
+      fprintf(stderr, "Could not connect to rank 0 within the timeout\n");
+      return -1;
+    }
+    usleep(100000);
+  }
+
+  snprintf(msg, sizeof(msg), "READY %d\n", rank);
+  if (send_line(fd, msg) || recv_line(fd, line, deadline) || line != "GO") {
+    fprintf(stderr, "No go from rank 0\n");
+    return -1;
+  }
+  return 0;
+}
+
+static void report(int rank, const std::string& result)
+{
+  int passed;
+  long long ms;
+  char name[400];
+
+  if (sscanf(result.c_str(), "RESULT %d %lld %399s", &passed, &ms, name) == 3)
+    printf("[rank %d] %-8s %s (%lld ms)\n", rank, passed ? "PASSED" : "FAILED",
+	   name, ms);
+}
+
+int main (int argc, char** argv)
+{
+  const char* port_arg = KTFNET_DEFAULT_PORT;
+  int opt, timeout = KTFNET_DEFAULT_TIMEOUT;
+  int rank = -1, n, ret, failed;
+  long long deadline;
+  unsigned short port;
+
+  /* The context must be configured by ktf::setup(), which has to be called
+   * before gtest parses its options, so skip the gtest options here:
+   */
+  opterr = 0;
+  while ((opt = getopt_long(argc, argv, "r:c:p:T:", ktfnet_options, NULL)) != -1) {
+    switch (opt) {
+    case 'r':
+      rank = atoi(optarg);
+      break;
+    case 'c':
+      context = optarg;
+      break;
+    case 'p':
+      port_arg = optarg;
+      break;
+    case 'T':
+      timeout = atoi(optarg);
+      break;
+    default:
+      if (strncmp(argv[optind - 1], "--gtest_", 8) == 0)
+	break;
+      usage(argv[0]);
+      return -1;
+    }
+  }
+
+  n = argc - optind;
+  port = atoi(port_arg);
+  if (n < 2 || rank < 0 || rank >= n || context.empty() || !port || timeout <= 0) {
+    usage(argv[0]);
+    return -1;
+  }
+
+  /* struct ktf_addrinfo has room for two peers */
+  ai_sz = sizeof(*ai) + sizeof(ai->a[0]) * (n - 2);
+  ai = (struct ktf_addrinfo*)calloc(1, ai_sz);
+  if (!ai)
+    return -1;
+  ai->n = n;
+  ai->rank = rank;
+  for (int i = 0; i < n; i++)
+    if (parse_node(argv[optind + i], &ai->a[i]))
+      return -1;
+
+  ktf::setup(configure);
+  testing::InitGoogleTest(&argc,argv);
+
+  ResultCollector* rc = new ResultCollector;
+  testing::UnitTest::GetInstance()->listeners().Append(rc);
+
+  std::vector<int> fds(n, -1);
+
+  deadline = now_ms() + timeout * 1000LL;
+  if (rank == 0)
+    ret = coordinator_barrier(fds, &ai->a[0].addr, port, deadline);
+  else
+    ret = peer_barrier(fds[0], rank, &ai->a[0].addr, port, deadline);
+  if (ret)
+    return -1;
+
+  ret = RUN_ALL_TESTS();
+  failed = rc->failed;
+
+  if (rank != 0) {
+    char end[32];
+
+    for (size_t i = 0; i < rc->results.size(); i++)
+      if (send_line(fds[0], rc->results[i]))
+	return -1;
+    snprintf(end, sizeof(end), "END %d\n", failed);
+    if (send_line(fds[0], end))
+      return -1;
+    close(fds[0]);
+    return ret;
+  }
+
+  /* Gather the results of all ranks, the tests may take a while */
+  for (size_t i = 0; i < rc->results.size(); i++)
+    report(0, rc->results[i].substr(0, rc->results[i].size() - 1));
+  for (int i = 1; i < n; i++) {
+    std::string line;
+    int rfailed;
+
+    for (;;) {
+      if (recv_line(fds[i], line, now_ms() + timeout * 1000LL)) {
+	fprintf(stderr, "Lost contact with rank %d\n", i);
+	failed++;
+	break;
+      }
+      if (sscanf(line.c_str(), "END %d", &rfailed) == 1) {
+	failed += rfailed;
+	break;
+      }
+      report(i, line);
+    }
+    close(fds[i]);
+  }
+  printf("%d ranks, %d failed tests\n", n, failed);
+  return failed || ret ? 1 : 0;
+}
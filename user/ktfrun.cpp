@@ -5,15 +5,345 @@
  *
  * ktfrun.cpp: Generic user level application to run kernel tests
  *   provided by modules subscribing to ktf services.
+ *
+ * With --daemon, ktfrun instead stays around with the tests registered, and
+ * runs the tests selected by each ktfclient that connects to its socket.
  */
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <ktf.h>
+#include "../kernel/ktf_unlproto.h"
+
+static struct option ktfrun_options[] = {
+  { "jobs", required_argument, NULL, 'j' },
+  { "test-coverage", required_argument, NULL, 'c' },
+  { "baseline", required_argument, NULL, 'b' },
+  { "threshold", required_argument, NULL, 't' },
+  { "write-baseline", required_argument, NULL, 'w' },
+  { "format", required_argument, NULL, 'f' },
+  { "output", required_argument, NULL, 'o' },
+  { "sweep", required_argument, NULL, 's' },
+  { "write-times", required_argument, NULL, 'T' },
+  { "daemon", required_argument, NULL, 'd' },
+  { "timeout", required_argument, NULL, 'W' },
+  { NULL, 0, NULL, 0 }
+};
+
+/* A listening socket inherited from the daemon that started this one */
+#define KTFRUN_LISTEN_FD "KTFRUN_LISTEN_FD"
+
+void usage(char *progname)
+{
+  fprintf(stderr, "Usage: %s [gtest options] [-j|--jobs N] [-c|--test-coverage FILE]\n"
+	  "\t[-b|--baseline FILE [-t|--threshold PERCENT]] [-w|--write-baseline FILE]\n"
+	  "\t[-f|--format jsonl [-o|--output FILE]] [-s|--sweep POINTS]\n"
+	  "\t[-T|--write-times FILE] [-d|--daemon SOCKET] [-W|--timeout SECONDS]\n",
+	  progname);
+}
+
+static unsigned int daemon_jobs = 1;
+static unsigned int daemon_timeout;
+static bool daemon_stale;
+
+/* Tests that are added or removed, or get new names from contexts, need a
+ * new gtest registry, which the daemon gets by starting over:
+ */
+static void daemon_event(const ktf::registry_event& ev)
+{
+  if (ev.type != KTF_EV_CTX_CFG && ev.type != KTF_EV_COV_ON && ev.type != KTF_EV_COV_OFF)
+    daemon_stale = true;
+}
+
+static int daemon_listen(const char* path)
+{
+  struct sockaddr_un sa;
+  const char* inherited = getenv(KTFRUN_LISTEN_FD);
+  int fd;
+
+  if (inherited) {
+    unsetenv(KTFRUN_LISTEN_FD);
+    return atoi(inherited);
+  }
+  if (strlen(path) >= sizeof(sa.sun_path)) {
+    fprintf(stderr, "Socket path too long: %s\n", path);
+    return -1;
+  }
+  memset(&sa, 0, sizeof(sa));
+  sa.sun_family = AF_UNIX;
+  strcpy(sa.sun_path, path);
+  fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) {
+    perror("socket");
+    return -1;
+  }
+  unlink(path);
+  if (bind(fd, (struct sockaddr*)&sa, sizeof(sa)) || listen(fd, 16)) {
+    perror("bind/listen");
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+/* Read the arguments of a request, each terminated by a NUL, until the
+ * client shuts down its side of the connection:
+ */
+static int read_request(int fd, std::vector<std::string>& args)
+{
+  std::string arg;
+  char buf[512];
+  ssize_t n;
+
+  while ((n = read(fd, buf, sizeof(buf))) != 0) {
+    if (n < 0) {
+      if (errno == EINTR)
+	continue;
+      return -1;
+    }
+    for (ssize_t i = 0; i < n; i++) {
+      if (buf[i]) {
+	arg += buf[i];
+      } else {
+	args.push_back(arg);
+	arg.clear();
+      }
+    }
+  }
+  return 0;
+}
+
+/* Apply the options of a request, on top of the defaults */
+static int request_options(const std::vector<std::string>& args, std::string& err)
+{
+  testing::GTEST_FLAG(filter) = "*";
+  testing::GTEST_FLAG(repeat) = 1;
+  testing::GTEST_FLAG(also_run_disabled_tests) = false;
+  testing::GTEST_FLAG(shuffle) = false;
+  testing::GTEST_FLAG(random_seed) = 0;
+  testing::GTEST_FLAG(list_tests) = false;
+  ktf::set_jobs(daemon_jobs);
+  ktf::set_timeout(daemon_timeout);
+
+  for (size_t i = 0; i < args.size(); i++) {
+    const std::string& a = args[i];
+    if (a.compare(0, 15, "--gtest_filter=") == 0)
+      testing::GTEST_FLAG(filter) = a.substr(15);
+    else if (a.compare(0, 15, "--gtest_repeat=") == 0)
+      testing::GTEST_FLAG(repeat) = atoi(a.c_str() + 15);
+    else if (a == "--gtest_also_run_disabled_tests")
+      testing::GTEST_FLAG(also_run_disabled_tests) = true;
+    else if (a == "--gtest_shuffle")
+      testing::GTEST_FLAG(shuffle) = true;
+    else if (a.compare(0, 20, "--gtest_random_seed=") == 0)
+      testing::GTEST_FLAG(random_seed) = atoi(a.c_str() + 20);
+    else if (a == "--gtest_list_tests")
+      testing::GTEST_FLAG(list_tests) = true;
+    else if (a.compare(0, 7, "--jobs=") == 0 && atoi(a.c_str() + 7) > 0)
+      ktf::set_jobs(atoi(a.c_str() + 7));
+    else if (a.compare(0, 10, "--timeout=") == 0 && atoi(a.c_str() + 10) >= 0)
+      ktf::set_timeout(atoi(a.c_str() + 10) * 1000);
+    else {
+      err = "Unsupported option for a daemon run: " + a + "\n";
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/* Run the tests of a request with the output of the run going to the
+ * client, followed by a NUL and the exit status of the run:
+ */
+static void serve_request(int cfd)
+{
+  std::vector<std::string> args;
+  std::string err;
+  char status[16];
+  int ret = 2;
+
+  if (read_request(cfd, args)) {
+    close(cfd);
+    return;
+  }
+  if (request_options(args, err) == 0) {
+    int out = dup(STDOUT_FILENO), errfd = dup(STDERR_FILENO);
+
+    fflush(stdout);
+    fflush(stderr);
+    dup2(cfd, STDOUT_FILENO);
+    dup2(cfd, STDERR_FILENO);
+    ret = RUN_ALL_TESTS();
+    fflush(stdout);
+    fflush(stderr);
+    dup2(out, STDOUT_FILENO);
+    dup2(errfd, STDERR_FILENO);
+    close(out);
+    close(errfd);
+  } else if (write(cfd, err.c_str(), err.size()) < 0) {
+    close(cfd);
+    return;
+  }
+  snprintf(status, sizeof(status), "%d", ret);
+  if (write(cfd, "", 1) == 1 && write(cfd, status, strlen(status)) < 0)
+    fprintf(stderr, "Lost the client before the end of the run\n");
+  close(cfd);
+}
+
+/* Serve requests until killed. When the kernel's tests change, start over
+ * as a new ktfrun with the same arguments and the same listening socket:
+ */
+static int serve(const char* path, char** argv)
+{
+  struct pollfd pfd[2];
+  char fdbuf[16];
+  int lfd, efd;
+
+  lfd = daemon_listen(path);
+  if (lfd < 0)
+    return -1;
+  efd = ktf::subscribe_events(daemon_event);
+  if (efd < 0)
+    fprintf(stderr, "Not notified of changes to the kernel tests: %s\n", strerror(-efd));
+  signal(SIGPIPE, SIG_IGN);
+
+  pfd[0].fd = lfd;
+  pfd[0].events = POLLIN;
+  pfd[1].fd = efd;
+  pfd[1].events = POLLIN;
+  for (;;) {
+    if (poll(pfd, efd < 0 ? 1 : 2, -1) < 0) {
+      if (errno == EINTR)
+	continue;
+      perror("poll");
+      return -1;
+    }
+    /* Pending changes apply to the next request, so handle them first */
+    if (efd >= 0 && (pfd[1].revents & POLLIN) && ktf::process_events() == -ENOBUFS)
+      daemon_stale = true;
+    if (daemon_stale) {
+      fprintf(stderr, "Kernel tests changed - restarting\n");
+      ktf::unsubscribe_events();
+      snprintf(fdbuf, sizeof(fdbuf), "%d", lfd);
+      setenv(KTFRUN_LISTEN_FD, fdbuf, 1);
+      execv("/proc/self/exe", argv);
+      perror("execv");
+      return -1;
+    }
+    if (pfd[0].revents & POLLIN) {
+      int cfd = accept(lfd, NULL, NULL);
+      if (cfd >= 0)
+	serve_request(cfd);
+    }
+  }
+}
 
 int main (int argc, char** argv)
 {
+  int opt, jobs, timeout;
+  const char* baseline = NULL;
+  double threshold = 10.0;
+  const char* output = NULL;
+  const char* daemon_path = NULL;
+  bool jsonl = false;
+  /* A restarted daemon needs the arguments gtest takes out of argv */
+  std::vector<char*> args(argv, argv + argc + 1);
+
   ktf::setup();
   testing::InitGoogleTest(&argc,argv);
 
+  /* gtest has removed its own options, parse the rest: */
+  while ((opt = getopt_long(argc, argv, "j:c:b:t:w:f:o:s:T:d:W:", ktfrun_options, NULL)) != -1) {
+    switch (opt) {
+    case 'j':
+      jobs = atoi(optarg);
+      if (jobs < 1) {
+	usage(argv[0]);
+	return -1;
+      }
+      ktf::set_jobs(jobs);
+      daemon_jobs = jobs;
+      break;
+    case 'c':
+      if (ktf::set_test_coverage(optarg))
+	return -1;
+      break;
+    case 'b':
+      baseline = optarg;
+      break;
+    case 't':
+      threshold = atof(optarg);
+      if (threshold < 0) {
+	usage(argv[0]);
+	return -1;
+      }
+      break;
+    case 'w':
+      if (ktf::set_bench_baseline_output(optarg))
+	return -1;
+      break;
+    case 'f':
+      if (strcmp(optarg, "jsonl") != 0) {
+	usage(argv[0]);
+	return -1;
+      }
+      jsonl = true;
+      break;
+    case 'o':
+      output = optarg;
+      break;
+    case 's':
+      if (ktf::set_sweep_points(optarg)) {
+	fprintf(stderr, "Invalid sweep points: %s\n", optarg);
+	return -1;
+      }
+      break;
+    case 'T':
+      if (ktf::set_test_times_output(optarg))
+	return -1;
+      break;
+    case 'd':
+      daemon_path = optarg;
+      break;
+    case 'W':
+      timeout = atoi(optarg);
+      if (timeout < 0) {
+	usage(argv[0]);
+	return -1;
+      }
+      ktf::set_timeout(timeout * 1000);
+      daemon_timeout = timeout * 1000;
+      break;
+    default:
+      usage(argv[0]);
+      return -1;
+    }
+  }
+
+  if (baseline && ktf::set_bench_baseline(baseline, threshold))
+    return -1;
+
+  if (output && !jsonl) {
+    usage(argv[0]);
+    return -1;
+  }
+  if (jsonl) {
+    if (ktf::set_jsonl_output(output ? output : "-"))
+      return -1;
+    /* The records replace the normal console output on stdout */
+    if (!output) {
+      testing::TestEventListeners& listeners = testing::UnitTest::GetInstance()->listeners();
+      delete listeners.Release(listeners.default_result_printer());
+    }
+  }
+
+  if (daemon_path)
+    return serve(daemon_path, &args[0]);
   return RUN_ALL_TESTS();
 }